@@ -6,9 +6,11 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/rtnetlink.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/wait.h>
 
 #include "internal.h"
 
@@ -16,6 +18,41 @@ static void crypto_remove_final(struct list_head *list);
 
 static LIST_HEAD(crypto_template_list);
 
+/*
+ * With async_tests set (and outside FIPS mode) crypto_register_alg()
+ * returns as soon as the self-test has been started instead of waiting
+ * for it, so registrations no longer serialize on their tests.  Until the
+ * test completes the algorithm is only reachable through its test larval,
+ * which makes users block on the result just as before.  The larval is
+ * then retired by crypto_alg_tested() rather than by the registrant.
+ */
+static int crypto_async_tests = 1;
+module_param_named(async_tests, crypto_async_tests, int, 0644);
+MODULE_PARM_DESC(async_tests, "Do not wait for self-tests in "
+		 "crypto_register_alg (ignored in FIPS mode)");
+
+static DECLARE_WAIT_QUEUE_HEAD(crypto_tests_wait);
+
+/* Whether @alg still has a test larval, which holds a reference on it */
+static int crypto_test_pending(struct crypto_alg *alg)
+{
+	struct crypto_alg *q;
+	int pending = 0;
+
+	down_read(&crypto_alg_sem);
+	list_for_each_entry(q, &crypto_alg_list, cra_list) {
+		if (crypto_is_larval(q) &&
+		    ((struct crypto_larval *)q)->test_async &&
+		    ((struct crypto_larval *)q)->adult == alg) {
+			pending = 1;
+			break;
+		}
+	}
+	up_read(&crypto_alg_sem);
+
+	return pending;
+}
+
 void crypto_larval_error(const char *name, u32 type, u32 mask)
 {
 	struct crypto_alg *alg;
@@ -220,6 +257,7 @@ static struct crypto_larval *__crypto_register_alg(struct crypto_alg *alg)
 
 	list_add(&alg->cra_list, &crypto_alg_list);
 	list_add(&larval->alg.cra_list, &crypto_alg_list);
+	crypto_alg_cache_flush();
 
 out:
 	return larval;
@@ -236,6 +274,7 @@ void crypto_alg_tested(const char *name, int err)
 	struct crypto_larval *test;
 	struct crypto_alg *alg;
 	struct crypto_alg *q;
+	int retire = 0;
 	LIST_HEAD(list);
 
 	down_write(&crypto_alg_sem);
@@ -259,6 +298,7 @@ found:
 		goto complete;
 
 	alg->cra_flags |= CRYPTO_ALG_TESTED;
+	crypto_alg_cache_flush();
 
 	list_for_each_entry(q, &crypto_alg_list, cra_list) {
 		if (q == alg)
@@ -304,9 +344,23 @@ found:
 complete:
 	complete_all(&test->completion);
 
+	/*
+	 * Drop the list's reference while still holding the lock, so that
+	 * once the larval is gone from the list it no longer pins the
+	 * algorithm for crypto_unregister_alg().
+	 */
+	if (test->test_async) {
+		list_del_init(&test->alg.cra_list);
+		crypto_alg_put(&test->alg);
+		retire = 1;
+	}
+
 unlock:
 	up_write(&crypto_alg_sem);
 
+	if (retire)
+		wake_up_all(&crypto_tests_wait);
+
 	crypto_remove_final(&list);
 }
 EXPORT_SYMBOL_GPL(crypto_alg_tested);
@@ -340,6 +394,28 @@ out:
 	crypto_larval_kill(&larval->alg);
 }
 
+static void crypto_start_test(struct crypto_larval *larval)
+{
+	int err;
+
+	err = crypto_probing_notify(CRYPTO_MSG_ALG_REGISTER, larval->adult);
+	if (err == NOTIFY_STOP)
+		return;
+
+	if (!WARN_ON(err != NOTIFY_DONE)) {
+		crypto_alg_tested(larval->alg.cra_driver_name, 0);
+		return;
+	}
+
+	/* No test will ever report back, retire the larval ourselves */
+	down_write(&crypto_alg_sem);
+	list_del_init(&larval->alg.cra_list);
+	complete_all(&larval->completion);
+	crypto_alg_put(&larval->alg);
+	up_write(&crypto_alg_sem);
+	wake_up_all(&crypto_tests_wait);
+}
+
 int crypto_register_alg(struct crypto_alg *alg)
 {
 	struct crypto_larval *larval;
@@ -351,12 +427,17 @@ int crypto_register_alg(struct crypto_alg *alg)
 
 	down_write(&crypto_alg_sem);
 	larval = __crypto_register_alg(alg);
+	if (!IS_ERR(larval) && crypto_async_tests && !fips_enabled)
+		larval->test_async = 1;
 	up_write(&crypto_alg_sem);
 
 	if (IS_ERR(larval))
 		return PTR_ERR(larval);
 
-	crypto_wait_for_test(larval);
+	if (larval->test_async)
+		crypto_start_test(larval);
+	else
+		crypto_wait_for_test(larval);
 	return 0;
 }
 EXPORT_SYMBOL_GPL(crypto_register_alg);
@@ -367,6 +448,7 @@ static int crypto_remove_alg(struct crypto_alg *alg, struct list_head *list)
 		return -ENOENT;
 
 	alg->cra_flags |= CRYPTO_ALG_DEAD;
+	crypto_alg_cache_flush();
 
 	crypto_notify(CRYPTO_MSG_ALG_UNREGISTER, alg);
 	list_del_init(&alg->cra_list);
@@ -387,6 +469,13 @@ int crypto_unregister_alg(struct crypto_alg *alg)
 	if (ret)
 		return ret;
 
+	/*
+	 * A test of this algorithm may still be running.  It fails quickly
+	 * now that the algorithm is dead, and then lets go of it.
+	 */
+	wait_event(crypto_tests_wait, !crypto_test_pending(alg));
+	crypto_alg_cache_reap();
+
 	BUG_ON(atomic_read(&alg->cra_refcnt) != 1);
 	if (alg->cra_destroy)
 		alg->cra_destroy(alg);
@@ -409,6 +498,7 @@ int crypto_register_template(struct crypto_template *tmpl)
 	}
 
 	list_add(&tmpl->list, &crypto_template_list);
+	crypto_alg_cache_flush();
 	crypto_notify(CRYPTO_MSG_TMPL_REGISTER, tmpl);
 	err = 0;
 out:
@@ -428,6 +518,7 @@ void crypto_unregister_template(struct crypto_template *tmpl)
 
 	BUG_ON(list_empty(&tmpl->list));
 	list_del_init(&tmpl->list);
+	crypto_alg_cache_flush();
 
 	list = &tmpl->instances;
 	hlist_for_each_entry(inst, p, list, list) {
@@ -439,6 +530,8 @@ void crypto_unregister_template(struct crypto_template *tmpl)
 
 	up_write(&crypto_alg_sem);
 
+	crypto_alg_cache_reap();
+
 	hlist_for_each_entry_safe(inst, p, n, list, list) {
 		BUG_ON(atomic_read(&inst->alg.cra_refcnt) != 1);
 		tmpl->free(inst);
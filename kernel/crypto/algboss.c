@@ -5,6 +5,7 @@
 #include <linux/err.h>
 #include <linux/init.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/notifier.h>
 #include <linux/rtnetlink.h>
@@ -197,16 +198,90 @@ err:
 }
 
 #ifdef CONFIG_CRYPTO_MANAGER_TESTS
+/*
+ * Each self-test runs in its own thread, so with asynchronous
+ * registration they spread over all CPUs.  Keep enough bookkeeping to
+ * tell at the end of boot how long the tests took in total and how much
+ * of that was hidden by running them in parallel.
+ */
+static DEFINE_SPINLOCK(cryptomgr_stats_lock);
+static unsigned int cryptomgr_tests_running;
+static unsigned int cryptomgr_tests_done;
+static s64 cryptomgr_test_ns;
+static ktime_t cryptomgr_first_start;
+static ktime_t cryptomgr_last_end;
+static int cryptomgr_report_armed;
+
+static void cryptomgr_report(void)
+{
+	printk(KERN_INFO "cryptomgr: %u self-tests finished %lld ms after "
+	       "the first one started (%lld ms of test time)\n",
+	       cryptomgr_tests_done,
+	       ktime_to_ms(ktime_sub(cryptomgr_last_end,
+				     cryptomgr_first_start)),
+	       cryptomgr_test_ns / NSEC_PER_MSEC);
+}
+
+static ktime_t cryptomgr_test_start(void)
+{
+	ktime_t now = ktime_get();
+
+	spin_lock(&cryptomgr_stats_lock);
+	if (!cryptomgr_tests_done && !cryptomgr_tests_running)
+		cryptomgr_first_start = now;
+	cryptomgr_tests_running++;
+	spin_unlock(&cryptomgr_stats_lock);
+
+	return now;
+}
+
+static void cryptomgr_test_end(ktime_t start)
+{
+	ktime_t now = ktime_get();
+	int report;
+
+	spin_lock(&cryptomgr_stats_lock);
+	cryptomgr_tests_running--;
+	cryptomgr_tests_done++;
+	cryptomgr_test_ns += ktime_to_ns(ktime_sub(now, start));
+	cryptomgr_last_end = now;
+	report = cryptomgr_report_armed && !cryptomgr_tests_running;
+	if (report)
+		cryptomgr_report_armed = 0;
+	spin_unlock(&cryptomgr_stats_lock);
+
+	if (report)
+		cryptomgr_report();
+}
+
+static int __init cryptomgr_boot_report(void)
+{
+	int report;
+
+	spin_lock(&cryptomgr_stats_lock);
+	report = !cryptomgr_tests_running && cryptomgr_tests_done;
+	cryptomgr_report_armed = !!cryptomgr_tests_running;
+	spin_unlock(&cryptomgr_stats_lock);
+
+	if (report)
+		cryptomgr_report();
+	return 0;
+}
+late_initcall(cryptomgr_boot_report);
+
 static int cryptomgr_test(void *data)
 {
 	struct crypto_test_param *param = data;
 	u32 type = param->type;
+	ktime_t start;
 	int err = 0;
 
 	if (type & CRYPTO_ALG_TESTED)
 		goto skiptest;
 
+	start = cryptomgr_test_start();
 	err = alg_test(param->driver, param->alg, type, CRYPTO_ALG_TESTED);
+	cryptomgr_test_end(start);
 
 skiptest:
 	crypto_alg_tested(param->driver, err);
@@ -2,13 +2,17 @@
 
 #include <linux/err.h>
 #include <linux/errno.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
 #include <linux/kmod.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/param.h>
+#include <linux/rculist.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/workqueue.h>
 #include "internal.h"
 
 LIST_HEAD(crypto_alg_list);
@@ -232,17 +236,205 @@ int crypto_probing_notify(unsigned long val, void *v)
 }
 EXPORT_SYMBOL_GPL(crypto_probing_notify);
 
-struct crypto_alg *crypto_alg_mod_lookup(const char *name, u32 type, u32 mask)
+/*
+ * Lookup cache sitting in front of crypto_alg_list.  Entries are keyed by
+ * the requested name, type and mask and are searched under RCU only, so
+ * repeated tfm allocations never touch crypto_alg_sem.  A positive entry
+ * holds a reference on the algorithm; a negative entry (alg == NULL)
+ * remembers a failed lookup, including a failed template instantiation,
+ * for CRYPTO_ALG_CACHE_NEG_TIMEOUT.  Any change to the algorithm or
+ * template lists flushes the whole cache.
+ */
+#define CRYPTO_ALG_CACHE_BITS		6
+#define CRYPTO_ALG_CACHE_SIZE		(1 << CRYPTO_ALG_CACHE_BITS)
+#define CRYPTO_ALG_CACHE_MAX		256
+#define CRYPTO_ALG_CACHE_NEG_TIMEOUT	(5 * HZ)
+
+struct crypto_alg_cache_entry {
+	struct hlist_node hlist;
+	union {
+		struct list_head reap;
+		struct rcu_head rcu;
+	};
+	struct crypto_alg *alg;
+	unsigned long expires;
+	u32 type;
+	u32 mask;
+	char name[CRYPTO_MAX_ALG_NAME];
+};
+
+static struct hlist_head crypto_alg_cache[CRYPTO_ALG_CACHE_SIZE];
+static DEFINE_SPINLOCK(crypto_alg_cache_lock);
+static DEFINE_MUTEX(crypto_alg_cache_reap_mutex);
+static LIST_HEAD(crypto_alg_cache_graveyard);
+static unsigned int crypto_alg_cache_count;
+static unsigned int crypto_alg_cache_gen;
+
+static void crypto_alg_cache_reap_work_fn(struct work_struct *work)
+{
+	crypto_alg_cache_reap();
+}
+
+static DECLARE_WORK(crypto_alg_cache_reap_work, crypto_alg_cache_reap_work_fn);
+
+static struct hlist_head *crypto_alg_cache_bucket(const char *name, u32 type,
+						  u32 mask)
+{
+	u32 hash = jhash(name, strlen(name), type) ^ mask;
+
+	return &crypto_alg_cache[hash & (CRYPTO_ALG_CACHE_SIZE - 1)];
+}
+
+static void crypto_alg_cache_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct crypto_alg_cache_entry, rcu));
+}
+
+static void crypto_alg_cache_unhash(struct crypto_alg_cache_entry *e)
+{
+	hlist_del_rcu(&e->hlist);
+	crypto_alg_cache_count--;
+
+	if (e->alg)
+		list_add_tail(&e->reap, &crypto_alg_cache_graveyard);
+	else
+		call_rcu(&e->rcu, crypto_alg_cache_free_rcu);
+}
+
+static struct crypto_alg *crypto_alg_cache_lookup(const char *name, u32 type,
+						  u32 mask)
+{
+	struct crypto_alg_cache_entry *e;
+	struct hlist_node *p;
+	struct crypto_alg *alg = NULL;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(e, p, crypto_alg_cache_bucket(name, type, mask),
+				 hlist) {
+		if (e->type != type || e->mask != mask || strcmp(e->name, name))
+			continue;
+
+		if (!e->alg) {
+			if (time_before(jiffies, e->expires))
+				alg = ERR_PTR(-ENOENT);
+		} else if (!crypto_is_moribund(e->alg))
+			alg = crypto_mod_get(e->alg);
+		break;
+	}
+	rcu_read_unlock();
+
+	return alg;
+}
+
+static void crypto_alg_cache_insert(const char *name, u32 type, u32 mask,
+				    struct crypto_alg *alg, unsigned int gen)
+{
+	struct crypto_alg_cache_entry *e, *old = NULL;
+	struct hlist_head *bucket;
+	struct hlist_node *p;
+
+	if (alg && (crypto_is_larval(alg) || crypto_is_moribund(alg)))
+		return;
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if (!e)
+		return;
+
+	strlcpy(e->name, name, CRYPTO_MAX_ALG_NAME);
+	e->type = type;
+	e->mask = mask;
+	e->expires = jiffies + CRYPTO_ALG_CACHE_NEG_TIMEOUT;
+	bucket = crypto_alg_cache_bucket(name, type, mask);
+
+	spin_lock(&crypto_alg_cache_lock);
+	if (gen != crypto_alg_cache_gen)
+		goto out_free;
+
+	hlist_for_each_entry(old, p, bucket, hlist) {
+		if (old->type == type && old->mask == mask &&
+		    !strcmp(old->name, name))
+			break;
+	}
+
+	if (p && old->alg)
+		goto out_free;
+	if (!p && crypto_alg_cache_count >= CRYPTO_ALG_CACHE_MAX)
+		goto out_free;
+
+	if (alg)
+		e->alg = crypto_alg_get(alg);
+
+	if (p) {
+		hlist_replace_rcu(&old->hlist, &e->hlist);
+		call_rcu(&old->rcu, crypto_alg_cache_free_rcu);
+	} else {
+		hlist_add_head_rcu(&e->hlist, bucket);
+		crypto_alg_cache_count++;
+	}
+	spin_unlock(&crypto_alg_cache_lock);
+	return;
+
+out_free:
+	spin_unlock(&crypto_alg_cache_lock);
+	kfree(e);
+}
+
+void crypto_alg_cache_flush(void)
+{
+	struct crypto_alg_cache_entry *e;
+	struct hlist_node *p, *n;
+	int reap;
+	int i;
+
+	spin_lock(&crypto_alg_cache_lock);
+	crypto_alg_cache_gen++;
+	for (i = 0; i < CRYPTO_ALG_CACHE_SIZE; i++)
+		hlist_for_each_entry_safe(e, p, n, &crypto_alg_cache[i], hlist)
+			crypto_alg_cache_unhash(e);
+	reap = !list_empty(&crypto_alg_cache_graveyard);
+	spin_unlock(&crypto_alg_cache_lock);
+
+	if (reap)
+		schedule_work(&crypto_alg_cache_reap_work);
+}
+EXPORT_SYMBOL_GPL(crypto_alg_cache_flush);
+
+/*
+ * Drop the references held by flushed entries once no reader can see them
+ * any more.  Must not be called with crypto_alg_sem held since the final
+ * put may destroy an instance.
+ */
+void crypto_alg_cache_reap(void)
+{
+	struct crypto_alg_cache_entry *e, *n;
+	LIST_HEAD(list);
+
+	mutex_lock(&crypto_alg_cache_reap_mutex);
+
+	spin_lock(&crypto_alg_cache_lock);
+	list_splice_init(&crypto_alg_cache_graveyard, &list);
+	spin_unlock(&crypto_alg_cache_lock);
+
+	if (!list_empty(&list)) {
+		synchronize_rcu();
+
+		list_for_each_entry_safe(e, n, &list, reap) {
+			crypto_alg_put(e->alg);
+			kfree(e);
+		}
+	}
+
+	mutex_unlock(&crypto_alg_cache_reap_mutex);
+}
+EXPORT_SYMBOL_GPL(crypto_alg_cache_reap);
+
+static struct crypto_alg *__crypto_alg_mod_lookup(const char *name, u32 type,
+						  u32 mask)
 {
 	struct crypto_alg *alg;
 	struct crypto_alg *larval;
 	int ok;
 
-	if (!((type | mask) & CRYPTO_ALG_TESTED)) {
-		type |= CRYPTO_ALG_TESTED;
-		mask |= CRYPTO_ALG_TESTED;
-	}
-
 	larval = crypto_larval_lookup(name, type, mask);
 	if (IS_ERR(larval) || !crypto_is_larval(larval))
 		return larval;
@@ -258,6 +450,35 @@ struct crypto_alg *crypto_alg_mod_lookup(const char *name, u32 type, u32 mask)
 	crypto_larval_kill(larval);
 	return alg;
 }
+
+struct crypto_alg *crypto_alg_mod_lookup(const char *name, u32 type, u32 mask)
+{
+	struct crypto_alg *alg;
+	unsigned int gen;
+
+	if (!((type | mask) & CRYPTO_ALG_TESTED)) {
+		type |= CRYPTO_ALG_TESTED;
+		mask |= CRYPTO_ALG_TESTED;
+	}
+
+	if (!name)
+		return ERR_PTR(-ENOENT);
+
+	alg = crypto_alg_cache_lookup(name, type, mask);
+	if (alg)
+		return alg;
+
+	gen = ACCESS_ONCE(crypto_alg_cache_gen);
+	smp_rmb();
+
+	alg = __crypto_alg_mod_lookup(name, type, mask);
+	if (!IS_ERR(alg))
+		crypto_alg_cache_insert(name, type, mask, alg, gen);
+	else if (PTR_ERR(alg) == -ENOENT)
+		crypto_alg_cache_insert(name, type, mask, NULL, gen);
+
+	return alg;
+}
 EXPORT_SYMBOL_GPL(crypto_alg_mod_lookup);
 
 static int crypto_init_ops(struct crypto_tfm *tfm, u32 type, u32 mask)
@@ -335,6 +556,7 @@ void crypto_shoot_alg(struct crypto_alg *alg)
 {
 	down_write(&crypto_alg_sem);
 	alg->cra_flags |= CRYPTO_ALG_DYING;
+	crypto_alg_cache_flush();
 	up_write(&crypto_alg_sem);
 }
 EXPORT_SYMBOL_GPL(crypto_shoot_alg);
@@ -6,7 +6,9 @@
 #include <linux/vmalloc.h>
 #include <linux/interrupt.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
 #include <linux/net.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
 
 #define DEFLATE_DEF_LEVEL		Z_DEFAULT_COMPRESSION
@@ -18,6 +20,25 @@ struct deflate_ctx {
 	struct z_stream_s decomp_stream;
 };
 
+/*
+ * Every (de)compression resets its stream first, so the streams and their
+ * workspaces carry no state between calls.  Keep them per CPU, shared by
+ * all tfms, instead of a quarter megabyte of workspace per tfm.
+ *
+ * IPComp calls in from softirq or with bottom halves off, and then nothing
+ * else can use this CPU's ->bh pair until it returns.  Everybody else
+ * takes ->mutex for the ->task pair and stays preemptible throughout.
+ */
+struct deflate_pcpu {
+	struct mutex mutex;
+	struct deflate_ctx task;
+	struct deflate_ctx bh;
+};
+
+static struct deflate_pcpu __percpu *deflate_pcpu;
+static unsigned int deflate_pcpu_users;
+static DEFINE_MUTEX(deflate_pcpu_mutex);
+
 static int deflate_comp_init(struct deflate_ctx *ctx)
 {
 	int ret = 0;
@@ -40,6 +61,7 @@ out:
 	return ret;
 out_free:
 	vfree(stream->workspace);
+	stream->workspace = NULL;
 	goto out;
 }
 
@@ -62,6 +84,7 @@ out:
 	return ret;
 out_free:
 	kfree(stream->workspace);
+	stream->workspace = NULL;
 	goto out;
 }
 
@@ -77,35 +100,118 @@ static void deflate_decomp_exit(struct deflate_ctx *ctx)
 	kfree(ctx->decomp_stream.workspace);
 }
 
-static int deflate_init(struct crypto_tfm *tfm)
+static int deflate_ctx_init(struct deflate_ctx *ctx)
 {
-	struct deflate_ctx *ctx = crypto_tfm_ctx(tfm);
 	int ret;
 
 	ret = deflate_comp_init(ctx);
 	if (ret)
-		goto out;
-	ret = deflate_decomp_init(ctx);
-	if (ret)
+		return ret;
+	return deflate_decomp_init(ctx);
+}
+
+static void deflate_ctx_exit(struct deflate_ctx *ctx)
+{
+	if (ctx->comp_stream.workspace)
 		deflate_comp_exit(ctx);
+	if (ctx->decomp_stream.workspace)
+		deflate_decomp_exit(ctx);
+}
+
+static void deflate_free_pcpu(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct deflate_pcpu *pcpu = per_cpu_ptr(deflate_pcpu, cpu);
+
+		deflate_ctx_exit(&pcpu->task);
+		deflate_ctx_exit(&pcpu->bh);
+	}
+	free_percpu(deflate_pcpu);
+	deflate_pcpu = NULL;
+}
+
+static int deflate_alloc_pcpu(void)
+{
+	int cpu;
+	int ret;
+
+	deflate_pcpu = alloc_percpu(struct deflate_pcpu);
+	if (!deflate_pcpu)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct deflate_pcpu *pcpu = per_cpu_ptr(deflate_pcpu, cpu);
+
+		mutex_init(&pcpu->mutex);
+		ret = deflate_ctx_init(&pcpu->task);
+		if (ret)
+			goto out_free;
+		ret = deflate_ctx_init(&pcpu->bh);
+		if (ret)
+			goto out_free;
+	}
+
+	return 0;
+
+out_free:
+	deflate_free_pcpu();
+	return ret;
+}
+
+static int deflate_init(struct crypto_tfm *tfm)
+{
+	int ret = 0;
+
+	mutex_lock(&deflate_pcpu_mutex);
+	if (!deflate_pcpu_users) {
+		ret = deflate_alloc_pcpu();
+		if (ret)
+			goto out;
+	}
+	deflate_pcpu_users++;
 out:
+	mutex_unlock(&deflate_pcpu_mutex);
 	return ret;
 }
 
 static void deflate_exit(struct crypto_tfm *tfm)
 {
-	struct deflate_ctx *ctx = crypto_tfm_ctx(tfm);
+	mutex_lock(&deflate_pcpu_mutex);
+	if (!--deflate_pcpu_users)
+		deflate_free_pcpu();
+	mutex_unlock(&deflate_pcpu_mutex);
+}
+
+static struct deflate_ctx *deflate_get_ctx(void)
+{
+	struct deflate_pcpu *pcpu;
+
+	if (in_interrupt())
+		return &this_cpu_ptr(deflate_pcpu)->bh;
 
-	deflate_comp_exit(ctx);
-	deflate_decomp_exit(ctx);
+	pcpu = per_cpu_ptr(deflate_pcpu, raw_smp_processor_id());
+	mutex_lock(&pcpu->mutex);
+	return &pcpu->task;
+}
+
+static void deflate_put_ctx(struct deflate_ctx *dctx)
+{
+	if (!in_interrupt())
+		mutex_unlock(&container_of(dctx, struct deflate_pcpu,
+					   task)->mutex);
 }
 
 static int deflate_compress(struct crypto_tfm *tfm, const u8 *src,
 			    unsigned int slen, u8 *dst, unsigned int *dlen)
 {
 	int ret = 0;
-	struct deflate_ctx *dctx = crypto_tfm_ctx(tfm);
-	struct z_stream_s *stream = &dctx->comp_stream;
+	struct deflate_ctx *dctx;
+	struct z_stream_s *stream;
+
+	dctx = deflate_get_ctx();
+	stream = &dctx->comp_stream;
 
 	ret = zlib_deflateReset(stream);
 	if (ret != Z_OK) {
@@ -126,6 +232,7 @@ static int deflate_compress(struct crypto_tfm *tfm, const u8 *src,
 	ret = 0;
 	*dlen = stream->total_out;
 out:
+	deflate_put_ctx(dctx);
 	return ret;
 }
 
@@ -134,8 +241,11 @@ static int deflate_decompress(struct crypto_tfm *tfm, const u8 *src,
 {
 
 	int ret = 0;
-	struct deflate_ctx *dctx = crypto_tfm_ctx(tfm);
-	struct z_stream_s *stream = &dctx->decomp_stream;
+	struct deflate_ctx *dctx;
+	struct z_stream_s *stream;
+
+	dctx = deflate_get_ctx();
+	stream = &dctx->decomp_stream;
 
 	ret = zlib_inflateReset(stream);
 	if (ret != Z_OK) {
@@ -167,13 +277,14 @@ static int deflate_decompress(struct crypto_tfm *tfm, const u8 *src,
 	ret = 0;
 	*dlen = stream->total_out;
 out:
+	deflate_put_ctx(dctx);
 	return ret;
 }
 
 static struct crypto_alg alg = {
 	.cra_name		= "deflate",
 	.cra_flags		= CRYPTO_ALG_TYPE_COMPRESS,
-	.cra_ctxsize		= sizeof(struct deflate_ctx),
+	.cra_ctxsize		= 0,
 	.cra_module		= THIS_MODULE,
 	.cra_list		= LIST_HEAD_INIT(alg.cra_list),
 	.cra_init		= deflate_init,
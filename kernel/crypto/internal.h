@@ -33,6 +33,7 @@ struct crypto_larval {
 	struct crypto_alg *adult;
 	struct completion completion;
 	u32 mask;
+	int test_async;
 };
 
 extern struct list_head crypto_alg_list;
@@ -62,6 +63,8 @@ static inline unsigned int crypto_compress_ctxsize(struct crypto_alg *alg)
 struct crypto_alg *crypto_mod_get(struct crypto_alg *alg);
 struct crypto_alg *crypto_alg_lookup(const char *name, u32 type, u32 mask);
 struct crypto_alg *crypto_alg_mod_lookup(const char *name, u32 type, u32 mask);
+void crypto_alg_cache_flush(void);
+void crypto_alg_cache_reap(void);
 
 int crypto_init_cipher_ops(struct crypto_tfm *tfm);
 int crypto_init_compress_ops(struct crypto_tfm *tfm);
@@ -86,6 +89,15 @@ struct crypto_alg *crypto_find_alg(const char *alg_name,
 void *crypto_alloc_tfm(const char *alg_name,
 		       const struct crypto_type *frontend, u32 type, u32 mask);
 
+struct crypto_pcomp;
+struct scatterlist;
+int crypto_pcomp_compress_sg(struct crypto_pcomp *tfm,
+			     struct scatterlist *src, unsigned int slen,
+			     struct scatterlist *dst, unsigned int *dlen);
+int crypto_pcomp_decompress_sg(struct crypto_pcomp *tfm,
+			       struct scatterlist *src, unsigned int slen,
+			       struct scatterlist *dst, unsigned int *dlen);
+
 int crypto_register_notifier(struct notifier_block *nb);
 int crypto_unregister_notifier(struct notifier_block *nb);
 int crypto_probing_notify(unsigned long val, void *v);
@@ -3,39 +3,125 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/crypto.h>
+#include <linux/interrupt.h>
 #include <linux/vmalloc.h>
 #include <linux/lzo.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/string.h>
 
-struct lzo_ctx {
-	void *lzo_comp_mem;
+#include <crypto/internal/compress.h>
+
+/*
+ * The compression workspace is only needed for the duration of a single
+ * lzo1x_1_compress() call, so rather than giving every tfm its own 64K
+ * (128K on 64-bit) buffer, keep them per CPU and share them between all
+ * tfms while any of them exist.  ->bh serves IPComp, which compresses with
+ * bottom halves off; other callers sleep on ->mutex for ->task instead of
+ * running the compression with preemption disabled.
+ */
+struct lzo_wrkmem {
+	struct mutex mutex;
+	void *task;
+	void *bh;
 };
 
-static int lzo_init(struct crypto_tfm *tfm)
+static struct lzo_wrkmem __percpu *lzo_wrkmem;
+static unsigned int lzo_wrkmem_users;
+static DEFINE_MUTEX(lzo_wrkmem_mutex);
+
+static void lzo_free_wrkmem(void)
 {
-	struct lzo_ctx *ctx = crypto_tfm_ctx(tfm);
+	int cpu;
 
-	ctx->lzo_comp_mem = vmalloc(LZO1X_MEM_COMPRESS);
-	if (!ctx->lzo_comp_mem)
-		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct lzo_wrkmem *wm = per_cpu_ptr(lzo_wrkmem, cpu);
 
-	return 0;
+		vfree(wm->task);
+		vfree(wm->bh);
+	}
+	free_percpu(lzo_wrkmem);
+	lzo_wrkmem = NULL;
+}
+
+static int lzo_get_wrkmem(void)
+{
+	int cpu;
+	int err = 0;
+
+	mutex_lock(&lzo_wrkmem_mutex);
+	if (lzo_wrkmem_users++)
+		goto out;
+
+	lzo_wrkmem = alloc_percpu(struct lzo_wrkmem);
+	if (!lzo_wrkmem)
+		goto nomem;
+
+	for_each_possible_cpu(cpu) {
+		struct lzo_wrkmem *wm = per_cpu_ptr(lzo_wrkmem, cpu);
+
+		mutex_init(&wm->mutex);
+		wm->task = vmalloc(LZO1X_MEM_COMPRESS);
+		wm->bh = vmalloc(LZO1X_MEM_COMPRESS);
+		if (!wm->task || !wm->bh) {
+			lzo_free_wrkmem();
+			goto nomem;
+		}
+	}
+
+out:
+	mutex_unlock(&lzo_wrkmem_mutex);
+	return err;
+
+nomem:
+	lzo_wrkmem_users--;
+	err = -ENOMEM;
+	goto out;
+}
+
+static void lzo_put_wrkmem(void)
+{
+	mutex_lock(&lzo_wrkmem_mutex);
+	if (!--lzo_wrkmem_users)
+		lzo_free_wrkmem();
+	mutex_unlock(&lzo_wrkmem_mutex);
+}
+
+static int lzo_init(struct crypto_tfm *tfm)
+{
+	return lzo_get_wrkmem();
 }
 
 static void lzo_exit(struct crypto_tfm *tfm)
 {
-	struct lzo_ctx *ctx = crypto_tfm_ctx(tfm);
+	lzo_put_wrkmem();
+}
 
-	vfree(ctx->lzo_comp_mem);
+static int __lzo_compress(const u8 *src, unsigned int slen, u8 *dst,
+			  size_t *dlen)
+{
+	struct lzo_wrkmem *wm;
+	int err;
+
+	if (in_interrupt())
+		return lzo1x_1_compress(src, slen, dst, dlen,
+					this_cpu_ptr(lzo_wrkmem)->bh);
+
+	wm = per_cpu_ptr(lzo_wrkmem, raw_smp_processor_id());
+	mutex_lock(&wm->mutex);
+	err = lzo1x_1_compress(src, slen, dst, dlen, wm->task);
+	mutex_unlock(&wm->mutex);
+
+	return err;
 }
 
 static int lzo_compress(struct crypto_tfm *tfm, const u8 *src,
 			    unsigned int slen, u8 *dst, unsigned int *dlen)
 {
-	struct lzo_ctx *ctx = crypto_tfm_ctx(tfm);
 	size_t tmp_len = *dlen; /* size_t(ulong) <-> uint on 64 bit */
 	int err;
 
-	err = lzo1x_1_compress(src, slen, dst, &tmp_len, ctx->lzo_comp_mem);
+	err = __lzo_compress(src, slen, dst, &tmp_len);
 
 	if (err != LZO_E_OK)
 		return -EINVAL;
@@ -63,7 +149,7 @@ static int lzo_decompress(struct crypto_tfm *tfm, const u8 *src,
 static struct crypto_alg alg = {
 	.cra_name		= "lzo",
 	.cra_flags		= CRYPTO_ALG_TYPE_COMPRESS,
-	.cra_ctxsize		= sizeof(struct lzo_ctx),
+	.cra_ctxsize		= 0,
 	.cra_module		= THIS_MODULE,
 	.cra_list		= LIST_HEAD_INIT(alg.cra_list),
 	.cra_init		= lzo_init,
@@ -73,13 +159,188 @@ static struct crypto_alg alg = {
 	.coa_decompress  	= lzo_decompress } }
 };
 
+/*
+ * LZO has no streaming format, so the partial (de)compression interface
+ * stages the input until final() and then hands the result out in as
+ * many final() calls as the caller needs to drain it.
+ */
+#define LZO_PCOMP_MAX_LEN	(128 * 1024)
+
+struct lzo_pcomp_ctx {
+	u8 *in;
+	u8 *out;
+	unsigned int in_len;
+	unsigned int out_len;
+	unsigned int out_pos;
+	int done;
+};
+
+static int lzo_pcomp_init_tfm(struct crypto_tfm *tfm)
+{
+	struct lzo_pcomp_ctx *ctx = crypto_tfm_ctx(tfm);
+	int err;
+
+	err = lzo_get_wrkmem();
+	if (err)
+		return err;
+
+	ctx->in = vmalloc(LZO_PCOMP_MAX_LEN);
+	ctx->out = vmalloc(lzo1x_worst_compress(LZO_PCOMP_MAX_LEN));
+	if (!ctx->in || !ctx->out) {
+		vfree(ctx->in);
+		vfree(ctx->out);
+		lzo_put_wrkmem();
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void lzo_pcomp_exit_tfm(struct crypto_tfm *tfm)
+{
+	struct lzo_pcomp_ctx *ctx = crypto_tfm_ctx(tfm);
+
+	vfree(ctx->in);
+	vfree(ctx->out);
+	lzo_put_wrkmem();
+}
+
+static int lzo_pcomp_setup(struct crypto_pcomp *tfm, void *params,
+			   unsigned int len)
+{
+	return 0;
+}
+
+static int lzo_pcomp_reset(struct crypto_pcomp *tfm)
+{
+	struct lzo_pcomp_ctx *ctx = crypto_tfm_ctx(crypto_pcomp_tfm(tfm));
+
+	ctx->in_len = 0;
+	ctx->out_len = 0;
+	ctx->out_pos = 0;
+	ctx->done = 0;
+	return 0;
+}
+
+static int lzo_pcomp_stage(struct lzo_pcomp_ctx *ctx, struct comp_request *req)
+{
+	if (ctx->done)
+		return -EINVAL;
+
+	if (req->avail_in > LZO_PCOMP_MAX_LEN - ctx->in_len)
+		return -ENOSPC;
+
+	memcpy(ctx->in + ctx->in_len, req->next_in, req->avail_in);
+	ctx->in_len += req->avail_in;
+	req->next_in += req->avail_in;
+	req->avail_in = 0;
+	return 0;
+}
+
+static int lzo_pcomp_update(struct crypto_pcomp *tfm,
+			    struct comp_request *req)
+{
+	return lzo_pcomp_stage(crypto_tfm_ctx(crypto_pcomp_tfm(tfm)), req);
+}
+
+static int lzo_pcomp_drain(struct lzo_pcomp_ctx *ctx, struct comp_request *req)
+{
+	unsigned int n = min(req->avail_out, ctx->out_len - ctx->out_pos);
+
+	memcpy(req->next_out, ctx->out + ctx->out_pos, n);
+	ctx->out_pos += n;
+	req->next_out += n;
+	req->avail_out -= n;
+
+	return ctx->out_pos < ctx->out_len ? -EAGAIN : n;
+}
+
+static int lzo_pcomp_compress_final(struct crypto_pcomp *tfm,
+				    struct comp_request *req)
+{
+	struct lzo_pcomp_ctx *ctx = crypto_tfm_ctx(crypto_pcomp_tfm(tfm));
+	size_t len = lzo1x_worst_compress(LZO_PCOMP_MAX_LEN);
+	int err;
+
+	if (!ctx->done) {
+		err = lzo_pcomp_stage(ctx, req);
+		if (err)
+			return err;
+
+		err = __lzo_compress(ctx->in, ctx->in_len, ctx->out, &len);
+		if (err != LZO_E_OK)
+			return -EINVAL;
+
+		ctx->out_len = len;
+		ctx->done = 1;
+	}
+
+	return lzo_pcomp_drain(ctx, req);
+}
+
+static int lzo_pcomp_decompress_final(struct crypto_pcomp *tfm,
+				      struct comp_request *req)
+{
+	struct lzo_pcomp_ctx *ctx = crypto_tfm_ctx(crypto_pcomp_tfm(tfm));
+	size_t len = lzo1x_worst_compress(LZO_PCOMP_MAX_LEN);
+	int err;
+
+	if (!ctx->done) {
+		err = lzo_pcomp_stage(ctx, req);
+		if (err)
+			return err;
+
+		err = lzo1x_decompress_safe(ctx->in, ctx->in_len, ctx->out,
+					    &len);
+		if (err != LZO_E_OK)
+			return -EINVAL;
+
+		ctx->out_len = len;
+		ctx->done = 1;
+	}
+
+	return lzo_pcomp_drain(ctx, req);
+}
+
+static struct pcomp_alg lzo_pcomp_alg = {
+	.compress_setup		= lzo_pcomp_setup,
+	.compress_init		= lzo_pcomp_reset,
+	.compress_update	= lzo_pcomp_update,
+	.compress_final		= lzo_pcomp_compress_final,
+	.decompress_setup	= lzo_pcomp_setup,
+	.decompress_init	= lzo_pcomp_reset,
+	.decompress_update	= lzo_pcomp_update,
+	.decompress_final	= lzo_pcomp_decompress_final,
+
+	.base			= {
+		.cra_name	= "lzo",
+		.cra_driver_name = "lzo-pcomp",
+		.cra_flags	= CRYPTO_ALG_TYPE_PCOMPRESS,
+		.cra_ctxsize	= sizeof(struct lzo_pcomp_ctx),
+		.cra_module	= THIS_MODULE,
+		.cra_init	= lzo_pcomp_init_tfm,
+		.cra_exit	= lzo_pcomp_exit_tfm,
+	}
+};
+
 static int __init lzo_mod_init(void)
 {
-	return crypto_register_alg(&alg);
+	int err;
+
+	err = crypto_register_alg(&alg);
+	if (err)
+		return err;
+
+	err = crypto_register_pcomp(&lzo_pcomp_alg);
+	if (err)
+		crypto_unregister_alg(&alg);
+
+	return err;
 }
 
 static void __exit lzo_mod_fini(void)
 {
+	crypto_unregister_pcomp(&lzo_pcomp_alg);
 	crypto_unregister_alg(&alg);
 }
 
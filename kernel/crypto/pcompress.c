@@ -3,11 +3,13 @@
 #include <linux/crypto.h>
 #include <linux/errno.h>
 #include <linux/module.h>
+#include <linux/scatterlist.h>
 #include <linux/seq_file.h>
 #include <linux/string.h>
 
 #include <crypto/compress.h>
 #include <crypto/internal/compress.h>
+#include <crypto/scatterwalk.h>
 
 #include "internal.h"
 
@@ -54,6 +56,121 @@ struct crypto_pcomp *crypto_alloc_pcomp(const char *alg_name, u32 type,
 }
 EXPORT_SYMBOL_GPL(crypto_alloc_pcomp);
 
+/*
+ * Feed a scatterlist through init/update/final one mapped segment at a
+ * time, writing straight into the destination scatterlist.  An update or
+ * final call returning -EAGAIN is retried once a fresh input or output
+ * segment has been mapped.
+ */
+static int crypto_pcomp_walk(struct crypto_pcomp *tfm, int decomp,
+			     struct scatterlist *src, unsigned int slen,
+			     struct scatterlist *dst, unsigned int *dlen)
+{
+	struct pcomp_alg *alg = crypto_pcomp_alg(tfm);
+	int (*update)(struct crypto_pcomp *, struct comp_request *);
+	int (*final)(struct crypto_pcomp *, struct comp_request *);
+	struct scatter_walk in, out;
+	struct comp_request req;
+	unsigned int ilen = 0, olen = 0, left = *dlen, total = 0;
+	void *vin = NULL, *vout = NULL;
+	int done = 0;
+	int ret;
+
+	if (decomp) {
+		update = alg->decompress_update;
+		final = alg->decompress_final;
+		ret = alg->decompress_init(tfm);
+	} else {
+		update = alg->compress_update;
+		final = alg->compress_final;
+		ret = alg->compress_init(tfm);
+	}
+	if (ret)
+		return ret;
+
+	scatterwalk_start(&in, src);
+	scatterwalk_start(&out, dst);
+	memset(&req, 0, sizeof(req));
+
+	for (;;) {
+		if (!vin && slen) {
+			ilen = scatterwalk_clamp(&in, slen);
+			vin = scatterwalk_map(&in, 0);
+			slen -= ilen;
+			req.next_in = vin;
+			req.avail_in = ilen;
+		}
+
+		if (!vout) {
+			if (!left) {
+				ret = -ENOSPC;
+				break;
+			}
+			olen = scatterwalk_clamp(&out, left);
+			vout = scatterwalk_map(&out, 1);
+			req.next_out = vout;
+			req.avail_out = olen;
+		}
+
+		ret = slen ? update(tfm, &req) : final(tfm, &req);
+		if (ret < 0 && ret != -EAGAIN)
+			break;
+		done = !slen && ret >= 0;
+
+		if (vin && (!req.avail_in || done)) {
+			scatterwalk_unmap(vin, 0);
+			scatterwalk_advance(&in, ilen - req.avail_in);
+			scatterwalk_done(&in, 0, slen);
+			vin = NULL;
+		}
+
+		if (!req.avail_out || done) {
+			olen -= req.avail_out;
+			scatterwalk_unmap(vout, 1);
+			scatterwalk_advance(&out, olen);
+			scatterwalk_done(&out, 1, left - olen);
+			left -= olen;
+			total += olen;
+			vout = NULL;
+		}
+
+		if (done)
+			break;
+
+		if (ret == -EAGAIN && vout && (vin || !slen)) {
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	if (vin)
+		scatterwalk_unmap(vin, 0);
+	if (vout)
+		scatterwalk_unmap(vout, 1);
+
+	if (ret < 0)
+		return ret;
+
+	*dlen = total;
+	return 0;
+}
+
+int crypto_pcomp_compress_sg(struct crypto_pcomp *tfm,
+			     struct scatterlist *src, unsigned int slen,
+			     struct scatterlist *dst, unsigned int *dlen)
+{
+	return crypto_pcomp_walk(tfm, 0, src, slen, dst, dlen);
+}
+EXPORT_SYMBOL_GPL(crypto_pcomp_compress_sg);
+
+int crypto_pcomp_decompress_sg(struct crypto_pcomp *tfm,
+			       struct scatterlist *src, unsigned int slen,
+			       struct scatterlist *dst, unsigned int *dlen)
+{
+	return crypto_pcomp_walk(tfm, 1, src, slen, dst, dlen);
+}
+EXPORT_SYMBOL_GPL(crypto_pcomp_decompress_sg);
+
 int crypto_register_pcomp(struct pcomp_alg *alg)
 {
 	struct crypto_alg *base = &alg->base;
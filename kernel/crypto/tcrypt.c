@@ -1,5 +1,6 @@
 
 
+#include <crypto/compress.h>
 #include <crypto/hash.h>
 #include <linux/err.h>
 #include <linux/init.h>
@@ -11,6 +12,9 @@
 #include <linux/jiffies.h>
 #include <linux/timex.h>
 #include <linux/interrupt.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/vmalloc.h>
 #include "tcrypt.h"
 #include "internal.h"
 
@@ -687,6 +691,269 @@ out:
 	crypto_free_ahash(tfm);
 }
 
+static u32 comp_block_sizes[] = { 512, 1024, 4096, 16384, 65536, 0 };
+
+#define COMP_SPEED_MAX	65536
+
+struct comp_speed_ctx {
+	struct crypto_comp *comp;
+	struct crypto_pcomp *pcomp;
+	struct scatterlist src;
+	struct scatterlist dst;
+	u8 *in;
+	u8 *out;
+	unsigned int ilen;
+	unsigned int olen;
+};
+
+static int do_comp_op(struct comp_speed_ctx *ctx, int decomp)
+{
+	unsigned int dlen = 2 * COMP_SPEED_MAX;
+
+	if (ctx->pcomp) {
+		sg_init_one(&ctx->src, ctx->in, ctx->ilen);
+		sg_init_one(&ctx->dst, ctx->out, dlen);
+		return decomp ?
+		       crypto_pcomp_decompress_sg(ctx->pcomp, &ctx->src,
+						  ctx->ilen, &ctx->dst, &dlen) :
+		       crypto_pcomp_compress_sg(ctx->pcomp, &ctx->src,
+						ctx->ilen, &ctx->dst, &dlen);
+	}
+
+	if (decomp)
+		return crypto_comp_decompress(ctx->comp, ctx->in, ctx->ilen,
+					      ctx->out, &dlen);
+	return crypto_comp_compress(ctx->comp, ctx->in, ctx->ilen, ctx->out,
+				    &dlen);
+}
+
+static int test_comp_jiffies(struct comp_speed_ctx *ctx, int decomp,
+			     int blen, int sec)
+{
+	unsigned long start, end;
+	int bcount;
+	int ret;
+
+	for (start = jiffies, end = start + sec * HZ, bcount = 0;
+	     time_before(jiffies, end); bcount++) {
+		ret = do_comp_op(ctx, decomp);
+		if (ret)
+			return ret;
+	}
+
+	printk("%6u opers/sec, %9lu bytes/sec\n",
+	       bcount / sec, ((long)bcount * blen) / sec);
+	return 0;
+}
+
+static int test_comp_cycles(struct comp_speed_ctx *ctx, int decomp, int blen)
+{
+	unsigned long cycles = 0;
+	int ret = 0;
+	int i;
+
+	/* Warm-up run. */
+	for (i = 0; i < 4; i++) {
+		ret = do_comp_op(ctx, decomp);
+		if (ret)
+			return ret;
+	}
+
+	/* The real thing. */
+	for (i = 0; i < 8; i++) {
+		cycles_t start, end;
+
+		start = get_cycles();
+		ret = do_comp_op(ctx, decomp);
+		end = get_cycles();
+
+		if (ret)
+			return ret;
+
+		cycles += end - start;
+	}
+
+	printk("%6lu cycles/operation, %4lu cycles/byte\n",
+	       cycles / 8, cycles / (8 * blen));
+	return 0;
+}
+
+static void test_comp_speed(const char *algo, int partial, unsigned int sec)
+{
+	struct comp_speed_ctx ctx;
+	u8 *plain;
+	unsigned int i;
+	int ret = 0;
+
+	printk(KERN_INFO "\ntesting speed of %s%s\n", algo,
+	       partial ? " (scatterlist partial interface)" : "");
+
+	memset(&ctx, 0, sizeof(ctx));
+	if (partial)
+		ctx.pcomp = crypto_alloc_pcomp(algo, 0, 0);
+	else
+		ctx.comp = crypto_alloc_comp(algo, 0, 0);
+	if (IS_ERR(ctx.comp) || IS_ERR(ctx.pcomp)) {
+		printk(KERN_ERR "failed to load transform for %s: %ld\n", algo,
+		       PTR_ERR(ctx.comp ?: (void *)ctx.pcomp));
+		return;
+	}
+
+	if (ctx.pcomp && (crypto_compress_setup(ctx.pcomp, NULL, 0) ||
+			  crypto_decompress_setup(ctx.pcomp, NULL, 0))) {
+		printk(KERN_ERR "setup failed for %s\n", algo);
+		goto out_free_tfm;
+	}
+
+	plain = kmalloc(COMP_SPEED_MAX, GFP_KERNEL);
+	ctx.in = kmalloc(2 * COMP_SPEED_MAX, GFP_KERNEL);
+	ctx.out = kmalloc(2 * COMP_SPEED_MAX, GFP_KERNEL);
+	if (!plain || !ctx.in || !ctx.out)
+		goto out_free;
+
+	/* Moderately compressible text-like data */
+	for (i = 0; i < COMP_SPEED_MAX; i++)
+		plain[i] = 'a' + ((i * 7) ^ (i >> 5)) % 13;
+
+	for (i = 0; comp_block_sizes[i]; i++) {
+		unsigned int blen = comp_block_sizes[i];
+		unsigned int dlen = 2 * COMP_SPEED_MAX;
+
+		memcpy(ctx.in, plain, blen);
+		ctx.ilen = blen;
+
+		printk("test %u (%u byte blocks): compress ", i, blen);
+		if (sec)
+			ret = test_comp_jiffies(&ctx, 0, blen, sec);
+		else
+			ret = test_comp_cycles(&ctx, 0, blen);
+		if (ret)
+			break;
+
+		/* Keep the compressed form as input for decompression */
+		if (ctx.pcomp) {
+			struct scatterlist sg_in, sg_out;
+
+			sg_init_one(&sg_in, plain, blen);
+			sg_init_one(&sg_out, ctx.in, dlen);
+			ret = crypto_pcomp_compress_sg(ctx.pcomp, &sg_in, blen,
+						       &sg_out, &dlen);
+		} else
+			ret = crypto_comp_compress(ctx.comp, plain, blen,
+						   ctx.in, &dlen);
+		if (ret)
+			break;
+		ctx.ilen = dlen;
+
+		printk("test %u (%u byte blocks, ratio %u%%): decompress ",
+		       i, blen, dlen * 100 / blen);
+		if (sec)
+			ret = test_comp_jiffies(&ctx, 1, blen, sec);
+		else
+			ret = test_comp_cycles(&ctx, 1, blen);
+		if (ret)
+			break;
+	}
+
+	if (ret)
+		printk(KERN_ERR "%s failed: %d\n", algo, ret);
+
+out_free:
+	kfree(plain);
+	kfree(ctx.in);
+	kfree(ctx.out);
+out_free_tfm:
+	if (ctx.pcomp)
+		crypto_free_pcomp(ctx.pcomp);
+	else
+		crypto_free_comp(ctx.comp);
+}
+
+struct alloc_speed_ctx {
+	const char *algo;
+	unsigned long end;
+	unsigned long count;
+	int err;
+	atomic_t *pending;
+	struct completion *done;
+};
+
+static int alloc_speed_thread(void *data)
+{
+	struct alloc_speed_ctx *ctx = data;
+	struct crypto_tfm *tfm;
+
+	while (time_before(jiffies, ctx->end)) {
+		tfm = crypto_alloc_base(ctx->algo, 0, 0);
+		if (IS_ERR(tfm)) {
+			ctx->err = PTR_ERR(tfm);
+			break;
+		}
+		crypto_free_tfm(tfm);
+		ctx->count++;
+		cond_resched();
+	}
+
+	if (atomic_dec_and_test(ctx->pending))
+		complete(ctx->done);
+	return 0;
+}
+
+static void test_alloc_speed(const char *algo, unsigned int sec)
+{
+	struct alloc_speed_ctx *ctx;
+	struct task_struct *thread;
+	DECLARE_COMPLETION_ONSTACK(done);
+	atomic_t pending;
+	unsigned long total = 0;
+	int cpu, err = 0;
+
+	if (!sec)
+		sec = 1;
+
+	printk(KERN_INFO "\ntesting tfm allocation speed of %s on %u cpus "
+	       "for %u seconds\n", algo, num_online_cpus(), sec);
+
+	ctx = kcalloc(nr_cpu_ids, sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return;
+
+	atomic_set(&pending, 1);
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		ctx[cpu].algo = algo;
+		ctx[cpu].end = jiffies + sec * HZ;
+		ctx[cpu].pending = &pending;
+		ctx[cpu].done = &done;
+
+		thread = kthread_create(alloc_speed_thread, &ctx[cpu],
+					"tcrypt/%d", cpu);
+		if (IS_ERR(thread))
+			continue;
+		kthread_bind(thread, cpu);
+		atomic_inc(&pending);
+		wake_up_process(thread);
+	}
+	put_online_cpus();
+
+	if (!atomic_dec_and_test(&pending))
+		wait_for_completion(&done);
+
+	for_each_possible_cpu(cpu) {
+		if (ctx[cpu].err)
+			err = ctx[cpu].err;
+		total += ctx[cpu].count;
+	}
+
+	if (err)
+		printk(KERN_ERR "tcrypt: failed to allocate %s: %d\n",
+		       algo, err);
+	printk(KERN_INFO "%lu allocs in %u seconds (%lu allocs/sec)\n",
+	       total, sec, total / sec);
+
+	kfree(ctx);
+}
+
 static void test_available(void)
 {
 	char **name = check;
@@ -1191,6 +1458,46 @@ static int do_test(int m)
 	case 499:
 		break;
 
+	case 500:
+		/* fall through */
+
+	case 501:
+		test_alloc_speed("sha1", sec);
+		if (mode > 500 && mode < 600) break;
+
+	case 502:
+		test_alloc_speed("cbc(aes)", sec);
+		if (mode > 500 && mode < 600) break;
+
+	case 503:
+		test_alloc_speed("hmac(sha256)", sec);
+		if (mode > 500 && mode < 600) break;
+
+	case 599:
+		break;
+
+	case 600:
+		/* fall through */
+
+	case 601:
+		test_comp_speed("deflate", 0, sec);
+		if (mode > 600 && mode < 700) break;
+
+	case 602:
+		test_comp_speed("lzo", 0, sec);
+		if (mode > 600 && mode < 700) break;
+
+	case 603:
+		test_comp_speed("lzo", 1, sec);
+		if (mode > 600 && mode < 700) break;
+
+	case 604:
+		test_comp_speed("zlib", 1, sec);
+		if (mode > 600 && mode < 700) break;
+
+	case 699:
+		break;
+
 	case 1000:
 		test_available();
 		break;
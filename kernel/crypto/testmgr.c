@@ -1360,12 +1360,96 @@ out:
 	return err;
 }
 
+static int test_comp_sg(struct crypto_pcomp *tfm,
+			struct comp_testvec *template, int tcount, int decomp)
+{
+	const char *algo = crypto_tfm_alg_driver_name(crypto_pcomp_tfm(tfm));
+	struct scatterlist src, dst[2];
+	unsigned int i, dlen;
+	char *input, *result;
+	int ret = -ENOMEM;
+
+	input = kmalloc(COMP_BUF_SIZE, GFP_KERNEL);
+	result = kmalloc(COMP_BUF_SIZE, GFP_KERNEL);
+	if (!input || !result)
+		goto out;
+
+	for (i = 0; i < tcount; i++) {
+		memcpy(input, template[i].input, template[i].inlen);
+		memset(result, 0, COMP_BUF_SIZE);
+
+		/* Split the output to exercise the segment walk */
+		sg_init_one(&src, input, template[i].inlen);
+		sg_init_table(dst, 2);
+		sg_set_buf(&dst[0], result, COMP_BUF_SIZE / 2);
+		sg_set_buf(&dst[1], result + COMP_BUF_SIZE / 2,
+			   COMP_BUF_SIZE / 2);
+
+		dlen = COMP_BUF_SIZE;
+		ret = decomp ?
+		      crypto_pcomp_decompress_sg(tfm, &src, template[i].inlen,
+						 dst, &dlen) :
+		      crypto_pcomp_compress_sg(tfm, &src, template[i].inlen,
+					       dst, &dlen);
+		if (ret) {
+			pr_err("alg: pcomp: %scompression failed on test %d "
+			       "for %s: ret=%d\n", decomp ? "de" : "", i + 1,
+			       algo, -ret);
+			goto out;
+		}
+
+		if (dlen != template[i].outlen ||
+		    memcmp(result, template[i].output, dlen)) {
+			pr_err("alg: pcomp: %scompression test %d failed for "
+			       "%s: output len = %d\n", decomp ? "De" : "C",
+			       i + 1, algo, dlen);
+			hexdump(result, dlen);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	kfree(input);
+	kfree(result);
+	return ret;
+}
+
+static int alg_test_comp_pcomp(const struct alg_test_desc *desc,
+			       const char *driver, u32 type, u32 mask)
+{
+	struct crypto_pcomp *tfm;
+	int err;
+
+	tfm = crypto_alloc_pcomp(driver, type, mask);
+	if (IS_ERR(tfm)) {
+		pr_err("alg: pcomp: Failed to load transform for %s: %ld\n",
+		       driver, PTR_ERR(tfm));
+		return PTR_ERR(tfm);
+	}
+
+	err = test_comp_sg(tfm, desc->suite.comp.comp.vecs,
+			   desc->suite.comp.comp.count, 0);
+	if (!err)
+		err = test_comp_sg(tfm, desc->suite.comp.decomp.vecs,
+				   desc->suite.comp.decomp.count, 1);
+
+	crypto_free_pcomp(tfm);
+	return err;
+}
+
 static int alg_test_comp(const struct alg_test_desc *desc, const char *driver,
 			 u32 type, u32 mask)
 {
 	struct crypto_comp *tfm;
 	int err;
 
+	/* Block compressors that also offer the partial interface */
+	if ((type & CRYPTO_ALG_TYPE_MASK) == CRYPTO_ALG_TYPE_PCOMPRESS)
+		return alg_test_comp_pcomp(desc, driver, type, mask);
+
 	tfm = crypto_alloc_comp(driver, type, mask);
 	if (IS_ERR(tfm)) {
 		printk(KERN_ERR "alg: comp: Failed to load transform for %s: "
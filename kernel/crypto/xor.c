@@ -5,6 +5,10 @@
 #include <linux/gfp.h>
 #include <linux/raid/xor.h>
 #include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/string.h>
 #include <asm/xor.h>
 
 /* The xor routines to use.  */
@@ -41,43 +45,173 @@ EXPORT_SYMBOL(xor_blocks);
 /* Set of all registered templates.  */
 static struct xor_block_template *template_list;
 
-#define BENCH_SIZE (PAGE_SIZE)
+static char xor_template_name[16];
+module_param_string(template, xor_template_name, sizeof(xor_template_name),
+		    0444);
+MODULE_PARM_DESC(template, "Use the named xor routine instead of "
+		 "benchmarking (reports the active routine when read)");
 
+static int xor_speed_kbs;
+module_param_named(speed, xor_speed_kbs, int, 0444);
+MODULE_PARM_DESC(speed, "Measured speed of the active xor routine in KB/s");
+
+/*
+ * Portable 64-bit word routines, eight words per iteration.  On 32-bit
+ * machines without a SIMD unit these still beat the long-sized generic
+ * templates whenever the compiler can pair the loads.
+ */
 static void
-do_xor_speed(struct xor_block_template *tmpl, void *b1, void *b2)
+xor_64_2(unsigned long bytes, unsigned long *v1, unsigned long *v2)
 {
-	int speed;
-	unsigned long now;
-	int i, count, max;
+	u64 *p1 = (u64 *)v1, *p2 = (u64 *)v2;
+	long lines = bytes / (sizeof(u64) * 8);
 
-	tmpl->next = template_list;
-	template_list = tmpl;
+	do {
+		p1[0] ^= p2[0];
+		p1[1] ^= p2[1];
+		p1[2] ^= p2[2];
+		p1[3] ^= p2[3];
+		p1[4] ^= p2[4];
+		p1[5] ^= p2[5];
+		p1[6] ^= p2[6];
+		p1[7] ^= p2[7];
+		p1 += 8;
+		p2 += 8;
+	} while (--lines > 0);
+}
 
-	/*
-	 * Count the number of XORs done during a whole jiffy, and use
-	 * this to calculate the speed of checksumming.  We use a 2-page
-	 * allocation to have guaranteed color L1-cache layout.
-	 */
-	max = 0;
-	for (i = 0; i < 5; i++) {
-		now = jiffies;
+static void
+xor_64_3(unsigned long bytes, unsigned long *v1, unsigned long *v2,
+	 unsigned long *v3)
+{
+	u64 *p1 = (u64 *)v1, *p2 = (u64 *)v2, *p3 = (u64 *)v3;
+	long lines = bytes / (sizeof(u64) * 8);
+
+	do {
+		p1[0] ^= p2[0] ^ p3[0];
+		p1[1] ^= p2[1] ^ p3[1];
+		p1[2] ^= p2[2] ^ p3[2];
+		p1[3] ^= p2[3] ^ p3[3];
+		p1[4] ^= p2[4] ^ p3[4];
+		p1[5] ^= p2[5] ^ p3[5];
+		p1[6] ^= p2[6] ^ p3[6];
+		p1[7] ^= p2[7] ^ p3[7];
+		p1 += 8;
+		p2 += 8;
+		p3 += 8;
+	} while (--lines > 0);
+}
+
+static void
+xor_64_4(unsigned long bytes, unsigned long *v1, unsigned long *v2,
+	 unsigned long *v3, unsigned long *v4)
+{
+	u64 *p1 = (u64 *)v1, *p2 = (u64 *)v2, *p3 = (u64 *)v3;
+	u64 *p4 = (u64 *)v4;
+	long lines = bytes / (sizeof(u64) * 8);
+
+	do {
+		p1[0] ^= p2[0] ^ p3[0] ^ p4[0];
+		p1[1] ^= p2[1] ^ p3[1] ^ p4[1];
+		p1[2] ^= p2[2] ^ p3[2] ^ p4[2];
+		p1[3] ^= p2[3] ^ p3[3] ^ p4[3];
+		p1[4] ^= p2[4] ^ p3[4] ^ p4[4];
+		p1[5] ^= p2[5] ^ p3[5] ^ p4[5];
+		p1[6] ^= p2[6] ^ p3[6] ^ p4[6];
+		p1[7] ^= p2[7] ^ p3[7] ^ p4[7];
+		p1 += 8;
+		p2 += 8;
+		p3 += 8;
+		p4 += 8;
+	} while (--lines > 0);
+}
+
+static void
+xor_64_5(unsigned long bytes, unsigned long *v1, unsigned long *v2,
+	 unsigned long *v3, unsigned long *v4, unsigned long *v5)
+{
+	u64 *p1 = (u64 *)v1, *p2 = (u64 *)v2, *p3 = (u64 *)v3;
+	u64 *p4 = (u64 *)v4, *p5 = (u64 *)v5;
+	long lines = bytes / (sizeof(u64) * 8);
+
+	do {
+		p1[0] ^= p2[0] ^ p3[0] ^ p4[0] ^ p5[0];
+		p1[1] ^= p2[1] ^ p3[1] ^ p4[1] ^ p5[1];
+		p1[2] ^= p2[2] ^ p3[2] ^ p4[2] ^ p5[2];
+		p1[3] ^= p2[3] ^ p3[3] ^ p4[3] ^ p5[3];
+		p1[4] ^= p2[4] ^ p3[4] ^ p4[4] ^ p5[4];
+		p1[5] ^= p2[5] ^ p3[5] ^ p4[5] ^ p5[5];
+		p1[6] ^= p2[6] ^ p3[6] ^ p4[6] ^ p5[6];
+		p1[7] ^= p2[7] ^ p3[7] ^ p4[7] ^ p5[7];
+		p1 += 8;
+		p2 += 8;
+		p3 += 8;
+		p4 += 8;
+		p5 += 8;
+	} while (--lines > 0);
+}
+
+static struct xor_block_template xor_block_64regs8 = {
+	.name = "64regs8",
+	.do_2 = xor_64_2,
+	.do_3 = xor_64_3,
+	.do_4 = xor_64_4,
+	.do_5 = xor_64_5,
+};
+
+#define BENCH_SIZE	(PAGE_SIZE)
+#define BENCH_ROUNDS	5
+#define BENCH_MIN_NS	(200 * NSEC_PER_USEC)
+
+/*
+ * Time back-to-back runs of the routine against the clocksource rather
+ * than counting them across a whole jiffy, and keep the best of a few
+ * rounds so that an interrupt or a busy sibling does not skew the pick.
+ * With a jiffies-only clocksource this degrades to the old behaviour.
+ */
+static void
+xor_bench(struct xor_block_template *tmpl, void *b1, void *b2)
+{
+	unsigned long count;
+	s64 ns;
+	ktime_t start;
+	u64 speed, best = 0;
+	int i;
+
+	for (i = 0; i < BENCH_ROUNDS; i++) {
 		count = 0;
-		while (jiffies == now) {
+		preempt_disable();
+		start = ktime_get();
+		do {
 			mb(); /* prevent loop optimzation */
 			tmpl->do_2(BENCH_SIZE, b1, b2);
 			mb();
 			count++;
-			mb();
-		}
-		if (count > max)
-			max = count;
+			ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		} while (ns < BENCH_MIN_NS);
+		preempt_enable();
+
+		speed = div64_u64((u64)count * BENCH_SIZE * NSEC_PER_SEC,
+				  (u64)ns * 1024);
+		if (speed > best)
+			best = speed;
 	}
 
-	speed = max * (HZ * BENCH_SIZE / 1024);
-	tmpl->speed = speed;
+	tmpl->speed = best;
 
 	printk(KERN_INFO "   %-10s: %5d.%03d MB/sec\n", tmpl->name,
-	       speed / 1000, speed % 1000);
+	       tmpl->speed / 1000, tmpl->speed % 1000);
+}
+
+static void
+do_xor_speed(struct xor_block_template *tmpl, void *b1, void *b2)
+{
+	tmpl->next = template_list;
+	template_list = tmpl;
+	tmpl->speed = 0;
+
+	if (!*xor_template_name)
+		xor_bench(tmpl, b1, b2);
 }
 
 static int __init
@@ -111,18 +245,43 @@ calibrate_xor_blocks(void)
 
 #define xor_speed(templ)	do_xor_speed((templ), b1, b2)
 
-	if (fastest) {
+	if (fastest && !*xor_template_name) {
 		printk(KERN_INFO "xor: automatically using best "
 			"checksumming function: %s\n",
 			fastest->name);
-		xor_speed(fastest);
+		xor_bench(fastest, b1, b2);
 	} else {
-		printk(KERN_INFO "xor: measuring software checksum speed\n");
+		fastest = NULL;
+		if (!*xor_template_name)
+			printk(KERN_INFO "xor: measuring software checksum "
+			       "speed\n");
 		XOR_TRY_TEMPLATES;
-		fastest = template_list;
-		for (f = fastest; f; f = f->next)
-			if (f->speed > fastest->speed)
-				fastest = f;
+		xor_speed(&xor_block_64regs8);
+
+		if (*xor_template_name) {
+			for (f = template_list; f; f = f->next)
+				if (!strcmp(f->name, xor_template_name))
+					fastest = f;
+
+			if (fastest) {
+				printk(KERN_INFO "xor: using preselected "
+				       "function: %s\n", fastest->name);
+				xor_bench(fastest, b1, b2);
+			} else {
+				printk(KERN_WARNING "xor: unknown function "
+				       "%s, measuring software checksum "
+				       "speed\n", xor_template_name);
+				for (f = template_list; f; f = f->next)
+					xor_bench(f, b1, b2);
+			}
+		}
+
+		if (!fastest) {
+			fastest = template_list;
+			for (f = fastest; f; f = f->next)
+				if (f->speed > fastest->speed)
+					fastest = f;
+		}
 	}
 
 	printk(KERN_INFO "xor: using function: %s (%d.%03d MB/sec)\n",
@@ -133,6 +292,8 @@ calibrate_xor_blocks(void)
 	free_pages((unsigned long)b1, 2);
 
 	active_template = fastest;
+	strlcpy(xor_template_name, fastest->name, sizeof(xor_template_name));
+	xor_speed_kbs = fastest->speed;
 	return 0;
 }
 
@@ -170,6 +170,11 @@ static int zlib_compress_final(struct crypto_pcomp *tfm,
 	stream->avail_out = req->avail_out;
 
 	ret = zlib_deflate(stream, Z_FINISH);
+	if ((ret == Z_OK || ret == Z_BUF_ERROR) && !stream->avail_out) {
+		pr_debug("zlib_deflate needs more output space\n");
+		ret = -EAGAIN;
+		goto out;
+	}
 	if (ret != Z_STREAM_END) {
 		pr_debug("zlib_deflate failed %d\n", ret);
 		return -EINVAL;
@@ -179,6 +184,7 @@ static int zlib_compress_final(struct crypto_pcomp *tfm,
 	pr_debug("avail_in %u, avail_out %u (consumed %u, produced %u)\n",
 		 stream->avail_in, stream->avail_out,
 		 req->avail_in - stream->avail_in, ret);
+out:
 	req->next_in = stream->next_in;
 	req->avail_in = stream->avail_in;
 	req->next_out = stream->next_out;
@@ -303,6 +309,11 @@ static int zlib_decompress_final(struct crypto_pcomp *tfm,
 		}
 	} else
 		ret = zlib_inflate(stream, Z_FINISH);
+	if ((ret == Z_OK || ret == Z_BUF_ERROR) && !stream->avail_out) {
+		pr_debug("zlib_inflate needs more output space\n");
+		ret = -EAGAIN;
+		goto out;
+	}
 	if (ret != Z_STREAM_END) {
 		pr_debug("zlib_inflate failed %d\n", ret);
 		return -EINVAL;
@@ -312,6 +323,7 @@ static int zlib_decompress_final(struct crypto_pcomp *tfm,
 	pr_debug("avail_in %u, avail_out %u (consumed %u, produced %u)\n",
 		 stream->avail_in, stream->avail_out,
 		 req->avail_in - stream->avail_in, ret);
+out:
 	req->next_in = stream->next_in;
 	req->avail_in = stream->avail_in;
 	req->next_out = stream->next_out;
@@ -0,0 +1,677 @@
+
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/buffer_head.h> /* invalidate_bh_lrus() */
+#include <linux/crypto.h>
+#include <linux/genhd.h>
+#include <linux/math64.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/vmalloc.h>
+
+#define SECTOR_SHIFT		9
+#define PAGE_SECTORS_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
+#define PAGE_SECTORS		(1 << PAGE_SECTORS_SHIFT)
+
+/*
+ * Compressed pages are kept in slab caches of CRD_CLASS_SIZE steps, so
+ * that a 1100 byte page costs 1152 bytes rather than the 2048 kmalloc
+ * would round it up to.  Pages that do not shrink below CRD_MAX_OBJ are
+ * not worth the decompression cost and are stored as they are.
+ */
+#define CRD_NR_CLASSES		48
+#define CRD_CLASS_SIZE		(PAGE_SIZE >> 6)
+#define CRD_MAX_OBJ		(CRD_NR_CLASSES * CRD_CLASS_SIZE)
+
+/* Worst case LZO output for one page */
+#define CRD_CBUF_SIZE		(2 * PAGE_SIZE)
+
+#define CRD_ZERO		(1 << 0)	/* page is all zeroes */
+#define CRD_RAW			(1 << 1)	/* data is a struct page */
+
+struct crd_slot {
+	void		*data;
+	u16		size;		/* compressed length */
+	u8		flags;
+};
+
+struct crd_device {
+	int		crd_number;
+
+	struct request_queue	*crd_queue;
+	struct gendisk		*crd_disk;
+	struct list_head	crd_list;
+
+	/*
+	 * The slot table is the contents of the device. Readers share
+	 * crd_lock; writers, which use the compression buffers below,
+	 * hold it exclusively.
+	 */
+	struct rw_semaphore	crd_lock;
+	struct crd_slot		*crd_table;
+	unsigned long		crd_nr_pages;
+	struct crypto_comp	*crd_tfm;
+	void			*crd_cbuf;
+	struct page		*crd_ppage;
+
+	/* Under crd_lock */
+	u64		crd_stored;	/* non-zero pages */
+	u64		crd_zero;
+	u64		crd_compr_size;
+	u64		crd_mem_used;
+
+	atomic64_t	crd_reads;
+	atomic64_t	crd_writes;
+};
+
+static struct kmem_cache *crd_classes[CRD_NR_CLASSES];
+static char *crd_class_names[CRD_NR_CLASSES];
+
+static inline struct kmem_cache *crd_class(size_t size)
+{
+	return crd_classes[(size - 1) / CRD_CLASS_SIZE];
+}
+
+static inline size_t crd_class_size(size_t size)
+{
+	return roundup(size, CRD_CLASS_SIZE);
+}
+
+static int crd_page_zero(const void *ptr)
+{
+	const unsigned long *p = ptr;
+	unsigned int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+	return 1;
+}
+
+static void crd_free_slot(struct crd_device *crd, unsigned long index)
+{
+	struct crd_slot *slot = &crd->crd_table[index];
+
+	if (slot->flags & CRD_ZERO) {
+		crd->crd_zero--;
+	} else if (slot->flags & CRD_RAW) {
+		__free_page(slot->data);
+		crd->crd_stored--;
+		crd->crd_compr_size -= PAGE_SIZE;
+		crd->crd_mem_used -= PAGE_SIZE;
+	} else if (slot->data) {
+		kmem_cache_free(crd_class(slot->size), slot->data);
+		crd->crd_stored--;
+		crd->crd_compr_size -= slot->size;
+		crd->crd_mem_used -= crd_class_size(slot->size);
+	}
+
+	slot->data = NULL;
+	slot->size = 0;
+	slot->flags = 0;
+}
+
+static void crd_free_pages(struct crd_device *crd)
+{
+	unsigned long i;
+
+	for (i = 0; i < crd->crd_nr_pages; i++) {
+		crd_free_slot(crd, i);
+		cond_resched();
+	}
+}
+
+/*
+ * Decompress the page at index into dst.  crd_lock must be held, for
+ * read at least: LZO decompression does not touch the per-tfm
+ * workspace, so readers may share crd_tfm.
+ */
+static int crd_load(struct crd_device *crd, unsigned long index, void *dst)
+{
+	struct crd_slot *slot = &crd->crd_table[index];
+	unsigned int dlen = PAGE_SIZE;
+	void *src;
+	int ret;
+
+	if (!slot->data) {
+		memset(dst, 0, PAGE_SIZE);
+		return 0;
+	}
+
+	if (slot->flags & CRD_RAW) {
+		src = kmap_atomic(slot->data, KM_USER1);
+		memcpy(dst, src, PAGE_SIZE);
+		kunmap_atomic(src, KM_USER1);
+		return 0;
+	}
+
+	ret = crypto_comp_decompress(crd->crd_tfm, slot->data, slot->size,
+				     dst, &dlen);
+	if (ret || dlen != PAGE_SIZE) {
+		printk(KERN_ERR "crd%d: corrupt page %lu\n",
+		       crd->crd_number, index);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Compress a full page into the slot at index.  crd_lock must be held
+ * for write.
+ */
+static int crd_store(struct crd_device *crd, unsigned long index,
+		     struct page *page)
+{
+	struct crd_slot *slot = &crd->crd_table[index];
+	unsigned int clen = CRD_CBUF_SIZE;
+	struct page *raw;
+	void *src, *obj;
+	int ret;
+
+	src = kmap_atomic(page, KM_USER0);
+	if (crd_page_zero(src)) {
+		kunmap_atomic(src, KM_USER0);
+		crd_free_slot(crd, index);
+		slot->flags = CRD_ZERO;
+		crd->crd_zero++;
+		return 0;
+	}
+	ret = crypto_comp_compress(crd->crd_tfm, src, PAGE_SIZE,
+				   crd->crd_cbuf, &clen);
+	kunmap_atomic(src, KM_USER0);
+
+	if (ret) {
+		printk(KERN_ERR "crd%d: compression failed: %d\n",
+		       crd->crd_number, ret);
+		return -EIO;
+	}
+
+	if (clen > CRD_MAX_OBJ) {
+		raw = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (!raw)
+			return -ENOMEM;
+		copy_highpage(raw, page);
+
+		crd_free_slot(crd, index);
+		slot->data = raw;
+		slot->flags = CRD_RAW;
+		crd->crd_stored++;
+		crd->crd_compr_size += PAGE_SIZE;
+		crd->crd_mem_used += PAGE_SIZE;
+		return 0;
+	}
+
+	/* Must use NOIO, this may be backing swap */
+	obj = kmem_cache_alloc(crd_class(clen), GFP_NOIO | __GFP_NOWARN);
+	if (!obj)
+		return -ENOMEM;
+	memcpy(obj, crd->crd_cbuf, clen);
+
+	crd_free_slot(crd, index);
+	slot->data = obj;
+	slot->size = clen;
+	crd->crd_stored++;
+	crd->crd_compr_size += clen;
+	crd->crd_mem_used += crd_class_size(clen);
+	return 0;
+}
+
+static int crd_read(struct crd_device *crd, struct page *page,
+		    unsigned int len, unsigned int off,
+		    unsigned long index, unsigned int offset)
+{
+	void *buf = NULL, *dst;
+	int ret;
+
+	if (len != PAGE_SIZE) {
+		buf = kmalloc(PAGE_SIZE, GFP_NOIO);
+		if (!buf)
+			return -ENOMEM;
+	}
+
+	down_read(&crd->crd_lock);
+	dst = kmap_atomic(page, KM_USER0);
+	if (buf) {
+		ret = crd_load(crd, index, buf);
+		memcpy(dst + off, buf + offset, len);
+	} else
+		ret = crd_load(crd, index, dst);
+	kunmap_atomic(dst, KM_USER0);
+	up_read(&crd->crd_lock);
+
+	flush_dcache_page(page);
+	kfree(buf);
+	return ret;
+}
+
+static int crd_write(struct crd_device *crd, struct page *page,
+		     unsigned int len, unsigned int off,
+		     unsigned long index, unsigned int offset)
+{
+	void *src, *buf;
+	int ret;
+
+	flush_dcache_page(page);
+
+	down_write(&crd->crd_lock);
+	if (len != PAGE_SIZE) {
+		/* Partial write: merge into the current contents first */
+		buf = page_address(crd->crd_ppage);
+		ret = crd_load(crd, index, buf);
+		if (ret)
+			goto out;
+		src = kmap_atomic(page, KM_USER0);
+		memcpy(buf + offset, src + off, len);
+		kunmap_atomic(src, KM_USER0);
+		page = crd->crd_ppage;
+	}
+	ret = crd_store(crd, index, page);
+out:
+	up_write(&crd->crd_lock);
+	return ret;
+}
+
+static int crd_do_bvec(struct crd_device *crd, struct page *page,
+			unsigned int len, unsigned int off, int rw,
+			sector_t sector)
+{
+	unsigned long index;
+	unsigned int offset, copy;
+	int err = 0;
+
+	/* A segment need not be aligned to the pages of the device */
+	while (len) {
+		index = sector >> PAGE_SECTORS_SHIFT;
+		offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+		copy = min_t(unsigned int, len, PAGE_SIZE - offset);
+
+		if (rw == READ)
+			err = crd_read(crd, page, copy, off, index, offset);
+		else
+			err = crd_write(crd, page, copy, off, index, offset);
+		if (err)
+			break;
+
+		sector += copy >> SECTOR_SHIFT;
+		off += copy;
+		len -= copy;
+	}
+	return err;
+}
+
+static void discard_from_crd(struct crd_device *crd,
+			sector_t sector, size_t n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+
+	/* Only whole pages can be given back */
+	if (offset) {
+		if (n <= PAGE_SIZE - offset)
+			return;
+		n -= PAGE_SIZE - offset;
+		sector += (PAGE_SIZE - offset) >> SECTOR_SHIFT;
+	}
+
+	down_write(&crd->crd_lock);
+	while (n >= PAGE_SIZE) {
+		crd_free_slot(crd, sector >> PAGE_SECTORS_SHIFT);
+		sector += PAGE_SECTORS;
+		n -= PAGE_SIZE;
+	}
+	up_write(&crd->crd_lock);
+}
+
+static int crd_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct block_device *bdev = bio->bi_bdev;
+	struct crd_device *crd = bdev->bd_disk->private_data;
+	int rw;
+	struct bio_vec *bvec;
+	sector_t sector;
+	int i;
+	int err = -EIO;
+
+	sector = bio->bi_sector;
+	if (sector + (bio->bi_size >> SECTOR_SHIFT) >
+						get_capacity(bdev->bd_disk))
+		goto out;
+
+	if (unlikely(bio_rw_flagged(bio, BIO_RW_DISCARD))) {
+		err = 0;
+		discard_from_crd(crd, sector, bio->bi_size);
+		goto out;
+	}
+
+	rw = bio_rw(bio);
+	if (rw == READA)
+		rw = READ;
+
+	if (rw == READ)
+		atomic64_inc(&crd->crd_reads);
+	else
+		atomic64_inc(&crd->crd_writes);
+
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int len = bvec->bv_len;
+		err = crd_do_bvec(crd, bvec->bv_page, len,
+					bvec->bv_offset, rw, sector);
+		if (err)
+			break;
+		sector += len >> SECTOR_SHIFT;
+	}
+
+out:
+	bio_endio(bio, err);
+
+	return 0;
+}
+
+static int crd_ioctl(struct block_device *bdev, fmode_t mode,
+			unsigned int cmd, unsigned long arg)
+{
+	int error;
+	struct crd_device *crd = bdev->bd_disk->private_data;
+
+	if (cmd != BLKFLSBUF)
+		return -ENOTTY;
+
+	/* As for brd, BLKFLSBUF releases the contents of the device */
+	mutex_lock(&bdev->bd_mutex);
+	error = -EBUSY;
+	if (bdev->bd_openers <= 1) {
+		invalidate_bh_lrus();
+		truncate_inode_pages(bdev->bd_inode->i_mapping, 0);
+		down_write(&crd->crd_lock);
+		crd_free_pages(crd);
+		up_write(&crd->crd_lock);
+		error = 0;
+	}
+	mutex_unlock(&bdev->bd_mutex);
+
+	return error;
+}
+
+static const struct block_device_operations crd_fops = {
+	.owner =		THIS_MODULE,
+	.locked_ioctl =		crd_ioctl,
+};
+
+static struct crd_device *dev_to_crd(struct device *dev)
+{
+	return dev_to_disk(dev)->private_data;
+}
+
+#define CRD_ATTR_U64(_name, _expr)					\
+static ssize_t crd_show_##_name(struct device *dev,			\
+				struct device_attribute *attr, char *buf) \
+{									\
+	struct crd_device *crd = dev_to_crd(dev);			\
+	u64 val;							\
+									\
+	down_read(&crd->crd_lock);					\
+	val = (_expr);							\
+	up_read(&crd->crd_lock);					\
+	return snprintf(buf, PAGE_SIZE, "%llu\n",			\
+			(unsigned long long)val);			\
+}									\
+static DEVICE_ATTR(_name, S_IRUGO, crd_show_##_name, NULL)
+
+CRD_ATTR_U64(num_reads, atomic64_read(&crd->crd_reads));
+CRD_ATTR_U64(num_writes, atomic64_read(&crd->crd_writes));
+CRD_ATTR_U64(zero_pages, crd->crd_zero);
+CRD_ATTR_U64(orig_data_size, crd->crd_stored << PAGE_SHIFT);
+CRD_ATTR_U64(compr_data_size, crd->crd_compr_size);
+CRD_ATTR_U64(mem_used_total, crd->crd_mem_used +
+	     crd->crd_nr_pages * sizeof(struct crd_slot));
+
+static ssize_t crd_show_compr_ratio(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct crd_device *crd = dev_to_crd(dev);
+	u64 orig, used;
+	unsigned int ratio = 0;
+
+	down_read(&crd->crd_lock);
+	orig = crd->crd_stored << PAGE_SHIFT;
+	used = crd->crd_mem_used;
+	up_read(&crd->crd_lock);
+
+	/* Original size over memory actually consumed, in hundredths */
+	if (used)
+		ratio = div64_u64(orig * 100, used);
+
+	return snprintf(buf, PAGE_SIZE, "%u.%02u\n", ratio / 100, ratio % 100);
+}
+static DEVICE_ATTR(compr_ratio, S_IRUGO, crd_show_compr_ratio, NULL);
+
+static struct attribute *crd_attrs[] = {
+	&dev_attr_num_reads.attr,
+	&dev_attr_num_writes.attr,
+	&dev_attr_zero_pages.attr,
+	&dev_attr_orig_data_size.attr,
+	&dev_attr_compr_data_size.attr,
+	&dev_attr_mem_used_total.attr,
+	&dev_attr_compr_ratio.attr,
+	NULL,
+};
+
+static const struct attribute_group crd_attr_group = {
+	.name = "crd",
+	.attrs = crd_attrs,
+};
+
+static int crd_nr = 1;
+static unsigned long crd_size;
+static int crd_major;
+module_param(crd_nr, int, 0);
+MODULE_PARM_DESC(crd_nr, "Number of compressed RAM disks");
+module_param(crd_size, ulong, 0);
+MODULE_PARM_DESC(crd_size, "Size of each disk in kbytes (default: 1/4 of RAM)");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Compressed RAM block device");
+
+static LIST_HEAD(crd_devices);
+
+static struct crd_device *crd_alloc(int i, u64 bytes)
+{
+	struct crd_device *crd;
+	struct gendisk *disk;
+
+	crd = kzalloc(sizeof(*crd), GFP_KERNEL);
+	if (!crd)
+		goto out;
+	crd->crd_number		= i;
+	init_rwsem(&crd->crd_lock);
+	atomic64_set(&crd->crd_reads, 0);
+	atomic64_set(&crd->crd_writes, 0);
+
+	crd->crd_nr_pages = bytes >> PAGE_SHIFT;
+	crd->crd_table = vmalloc(crd->crd_nr_pages * sizeof(struct crd_slot));
+	if (!crd->crd_table)
+		goto out_free_dev;
+	memset(crd->crd_table, 0, crd->crd_nr_pages * sizeof(struct crd_slot));
+
+	crd->crd_tfm = crypto_alloc_comp("lzo", 0, 0);
+	if (IS_ERR(crd->crd_tfm))
+		goto out_free_table;
+
+	crd->crd_cbuf = kmalloc(CRD_CBUF_SIZE, GFP_KERNEL);
+	crd->crd_ppage = alloc_page(GFP_KERNEL);
+	if (!crd->crd_cbuf || !crd->crd_ppage)
+		goto out_free_bufs;
+
+	crd->crd_queue = blk_alloc_queue(GFP_KERNEL);
+	if (!crd->crd_queue)
+		goto out_free_bufs;
+	blk_queue_make_request(crd->crd_queue, crd_make_request);
+	blk_queue_ordered(crd->crd_queue, QUEUE_ORDERED_TAG, NULL);
+	blk_queue_max_hw_sectors(crd->crd_queue, 1024);
+	blk_queue_bounce_limit(crd->crd_queue, BLK_BOUNCE_ANY);
+	blk_queue_physical_block_size(crd->crd_queue, PAGE_SIZE);
+	blk_queue_io_min(crd->crd_queue, PAGE_SIZE);
+
+	/* Partial pages are left alone, so discard does not zero */
+	crd->crd_queue->limits.discard_granularity = PAGE_SIZE;
+	crd->crd_queue->limits.max_discard_sectors = UINT_MAX;
+	crd->crd_queue->limits.discard_zeroes_data = 0;
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, crd->crd_queue);
+
+	disk = crd->crd_disk = alloc_disk(1);
+	if (!disk)
+		goto out_free_queue;
+	disk->major		= crd_major;
+	disk->first_minor	= i;
+	disk->fops		= &crd_fops;
+	disk->private_data	= crd;
+	disk->queue		= crd->crd_queue;
+	disk->flags |= GENHD_FL_SUPPRESS_PARTITION_INFO;
+	sprintf(disk->disk_name, "crd%d", i);
+	set_capacity(disk, crd->crd_nr_pages << PAGE_SECTORS_SHIFT);
+
+	return crd;
+
+out_free_queue:
+	blk_cleanup_queue(crd->crd_queue);
+out_free_bufs:
+	if (crd->crd_ppage)
+		__free_page(crd->crd_ppage);
+	kfree(crd->crd_cbuf);
+	crypto_free_comp(crd->crd_tfm);
+out_free_table:
+	vfree(crd->crd_table);
+out_free_dev:
+	kfree(crd);
+out:
+	return NULL;
+}
+
+static void crd_free(struct crd_device *crd)
+{
+	put_disk(crd->crd_disk);
+	blk_cleanup_queue(crd->crd_queue);
+	crd_free_pages(crd);
+	__free_page(crd->crd_ppage);
+	kfree(crd->crd_cbuf);
+	crypto_free_comp(crd->crd_tfm);
+	vfree(crd->crd_table);
+	kfree(crd);
+}
+
+static void crd_destroy_classes(void)
+{
+	int i;
+
+	for (i = 0; i < CRD_NR_CLASSES; i++) {
+		if (crd_classes[i])
+			kmem_cache_destroy(crd_classes[i]);
+		kfree(crd_class_names[i]);
+		crd_classes[i] = NULL;
+		crd_class_names[i] = NULL;
+	}
+}
+
+static int crd_create_classes(void)
+{
+	size_t size;
+	int i;
+
+	for (i = 0; i < CRD_NR_CLASSES; i++) {
+		size = (i + 1) * CRD_CLASS_SIZE;
+		crd_class_names[i] = kasprintf(GFP_KERNEL, "crd-%zu", size);
+		if (!crd_class_names[i])
+			goto fail;
+		crd_classes[i] = kmem_cache_create(crd_class_names[i], size,
+						   0, 0, NULL);
+		if (!crd_classes[i])
+			goto fail;
+	}
+	return 0;
+
+fail:
+	crd_destroy_classes();
+	return -ENOMEM;
+}
+
+static int __init crd_init(void)
+{
+	struct crd_device *crd, *next;
+	u64 bytes;
+	int i, err;
+
+	if (crd_nr <= 0 || crd_nr > 1 << MINORBITS)
+		return -EINVAL;
+
+	if (crd_size)
+		bytes = (u64)crd_size << 10;
+	else
+		bytes = ((u64)totalram_pages << PAGE_SHIFT) / 4;
+	bytes &= PAGE_MASK;
+
+	err = crd_create_classes();
+	if (err)
+		return err;
+
+	crd_major = register_blkdev(0, "crd");
+	if (crd_major <= 0) {
+		err = -EIO;
+		goto out_classes;
+	}
+
+	err = -ENOMEM;
+	for (i = 0; i < crd_nr; i++) {
+		crd = crd_alloc(i, bytes);
+		if (!crd)
+			goto out_free;
+		list_add_tail(&crd->crd_list, &crd_devices);
+	}
+
+	/* point of no return */
+
+	list_for_each_entry(crd, &crd_devices, crd_list) {
+		add_disk(crd->crd_disk);
+		if (sysfs_create_group(&disk_to_dev(crd->crd_disk)->kobj,
+				       &crd_attr_group))
+			printk(KERN_WARNING "crd%d: failed to create sysfs "
+			       "attributes\n", crd->crd_number);
+	}
+
+	printk(KERN_INFO "crd: %d device(s) of %llu KiB\n", crd_nr,
+	       (unsigned long long)bytes >> 10);
+	return 0;
+
+out_free:
+	list_for_each_entry_safe(crd, next, &crd_devices, crd_list) {
+		list_del(&crd->crd_list);
+		crd_free(crd);
+	}
+	unregister_blkdev(crd_major, "crd");
+out_classes:
+	crd_destroy_classes();
+
+	return err;
+}
+
+static void __exit crd_exit(void)
+{
+	struct crd_device *crd, *next;
+
+	list_for_each_entry_safe(crd, next, &crd_devices, crd_list) {
+		list_del(&crd->crd_list);
+		sysfs_remove_group(&disk_to_dev(crd->crd_disk)->kobj,
+				   &crd_attr_group);
+		del_gendisk(crd->crd_disk);
+		crd_free(crd);
+	}
+
+	unregister_blkdev(crd_major, "crd");
+	crd_destroy_classes();
+}
+
+module_init(crd_init);
+module_exit(crd_exit);
@@ -38,6 +38,8 @@
 extern unsigned int minor_count;
 extern int disable_sendpage;
 extern int allow_oos;
+extern int rs_delay_target;
+extern int rs_max_rate;
 extern unsigned int cn_idx;
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
@@ -875,6 +877,12 @@ struct drbd_conf {
 	unsigned long rs_mark_time;
 	/* skipped because csum was equeal [unit BM_BLOCK_SIZE] */
 	unsigned long rs_same_csum;
+	/* requested, but not yet written locally or acked [unit sectors] */
+	atomic_t rs_sect_in_flight;
+	/* completed since the last resync step [unit sectors] */
+	atomic_t rs_sect_in;
+	/* average of rs_sect_in per resync step, times 8 */
+	int rs_sect_in_avg;
 
 	/* where does the admin want us to start? (sector) */
 	sector_t ov_start_sector;
@@ -1739,6 +1747,13 @@ static inline void inc_ap_pending(struct drbd_conf *mdev)
 		wake_up(&mdev->misc_wait);			\
 	ERR_IF_CNT_IS_NEGATIVE(ap_pending_cnt); } while (0)
 
+/* a resync request has been completely served, see drbd_rs_controller() */
+static inline void drbd_rs_sect_done(struct drbd_conf *mdev, int size)
+{
+	atomic_sub(size >> 9, &mdev->rs_sect_in_flight);
+	atomic_add(size >> 9, &mdev->rs_sect_in);
+}
+
 static inline void inc_rs_pending(struct drbd_conf *mdev)
 {
 	atomic_inc(&mdev->rs_pending_cnt);
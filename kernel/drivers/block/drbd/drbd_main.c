@@ -68,6 +68,10 @@ module_param(disable_sendpage, bool, 0644);
 module_param(allow_oos, bool, 0);
 module_param(cn_idx, uint, 0444);
 module_param(proc_details, int, 0644);
+MODULE_PARM_DESC(rs_delay_target, "Resync latency to aim for in ms, 0 for a fixed rate");
+module_param(rs_delay_target, int, 0644);
+MODULE_PARM_DESC(rs_max_rate, "Resync rate limit in KB/s for the latency controller, 0 for the syncer rate");
+module_param(rs_max_rate, int, 0644);
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 int enable_faults;
@@ -90,6 +94,8 @@ int disable_sendpage;
 int allow_oos;
 unsigned int cn_idx = CN_IDX_DRBD;
 int proc_details;       /* Detail level in proc drbd*/
+int rs_delay_target = 100;
+int rs_max_rate = 102400;
 
 char usermode_helper[80] = "/sbin/drbdadm";
 
@@ -2435,7 +2441,7 @@ static void drbd_set_defaults(struct drbd_conf *mdev)
 		/* .verify_alg = */	{}, 0,
 		/* .cpu_mask = */	{}, 0,
 		/* .csums_alg = */	{}, 0,
-		/* .use_rle = */	0
+		/* .use_rle = */	1
 	};
 
 	/* Have to use that way, because the layout differs between
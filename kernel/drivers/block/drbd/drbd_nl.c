@@ -1497,6 +1497,7 @@ static int drbd_nl_syncer_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *n
 		sc.dp_interval = DRBD_DP_INTERVAL_DEF;
 		sc.throttle_th = DRBD_RS_THROTTLE_TH_DEF;
 		sc.hold_off_th = DRBD_RS_HOLD_OFF_TH_DEF;
+		sc.use_rle    = 1;
 	} else
 		memcpy(&sc, &mdev->sync_conf, sizeof(struct syncer_conf));
 
@@ -1403,6 +1403,8 @@ static int e_end_resync_block(struct drbd_conf *mdev, struct drbd_work *w, int u
 
 	D_ASSERT(hlist_unhashed(&e->colision));
 
+	drbd_rs_sect_done(mdev, e->size);
+
 	if (likely((e->flags & EE_WAS_ERROR) == 0)) {
 		drbd_set_in_sync(mdev, sector, e->size);
 		ok = drbd_send_ack(mdev, P_RS_WRITE_ACK, e);
@@ -4078,6 +4080,7 @@ static int got_IsInSync(struct drbd_conf *mdev, struct p_header *h)
 	drbd_set_in_sync(mdev, sector, blksize);
 	/* rs_same_csums is supposed to count in units of BM_BLOCK_SIZE */
 	mdev->rs_same_csum += (blksize >> BM_BLOCK_SHIFT);
+	drbd_rs_sect_done(mdev, blksize);
 	dec_rs_pending(mdev);
 
 	return TRUE;
@@ -4216,6 +4219,7 @@ static int got_NegRSDReply(struct drbd_conf *mdev, struct p_header *h)
 
 	update_peer_seq(mdev, be32_to_cpu(p->seq_num));
 
+	drbd_rs_sect_done(mdev, size);
 	dec_rs_pending(mdev);
 
 	if (get_ldev_if_state(mdev, D_FAILED)) {
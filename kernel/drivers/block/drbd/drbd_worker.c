@@ -381,6 +381,49 @@ static int calc_resync_rate(struct drbd_conf *mdev)
 		cr + (cr * (td - d) / (hd - td));
 }
 
+/*
+ * Keep enough resync requests in flight that, at the rate they are being
+ * completed, a new one waits rs_delay_target ms behind them (Little's
+ * law).  A request completes when the block is written locally or found
+ * to be in sync, so both the link and the disks at either end slow the
+ * completion rate, and with it the number of new requests.  The
+ * configured syncer rate is only used until there is something to
+ * measure; after that the controller may go up to rs_max_rate.
+ *
+ * Returns the number of BM_BLOCK_SIZE requests to issue in this step.
+ */
+static int drbd_rs_controller(struct drbd_conf *mdev)
+{
+	int sect_in, in_flight, want, req_sect, max_sect, max_rate;
+	int steps = rs_delay_target * HZ / (1000 * SLEEP_TIME);
+
+	sect_in = atomic_xchg(&mdev->rs_sect_in, 0);
+	in_flight = atomic_read(&mdev->rs_sect_in_flight);
+	if (in_flight < 0) {
+		/* left over from a previous connection */
+		atomic_set(&mdev->rs_sect_in_flight, 0);
+		in_flight = 0;
+	}
+
+	mdev->rs_sect_in_avg += sect_in - (mdev->rs_sect_in_avg >> 3);
+
+	max_rate = rs_max_rate > 0 ? rs_max_rate : calc_resync_rate(mdev);
+	max_sect = max_rate * 2 * SLEEP_TIME / HZ;
+
+	if (!mdev->rs_sect_in_avg) {
+		/* nothing measured yet: one step at the configured rate */
+		req_sect = in_flight ? 0 :
+			calc_resync_rate(mdev) * 2 * SLEEP_TIME / HZ;
+	} else {
+		want = (mdev->rs_sect_in_avg >> 3) * max(steps, 1);
+		req_sect = want - in_flight;
+	}
+	req_sect = clamp(req_sect, 0, max_sect);
+
+	mdev->c_sync_rate = req_sect * HZ / (2 * SLEEP_TIME);
+	return req_sect >> (BM_BLOCK_SHIFT - 9);
+}
+
 int w_make_resync_request(struct drbd_conf *mdev,
 		struct drbd_work *w, int cancel)
 {
@@ -418,8 +461,12 @@ int w_make_resync_request(struct drbd_conf *mdev,
 	max_segment_size = mdev->agreed_pro_version < 94 ?
 		queue_max_segment_size(mdev->rq_queue) : DRBD_MAX_SEGMENT_SIZE;
 
-	mdev->c_sync_rate = calc_resync_rate(mdev);
-	number = SLEEP_TIME * mdev->c_sync_rate  / ((BM_BLOCK_SIZE / 1024) * HZ);
+	if (rs_delay_target > 0) {
+		number = drbd_rs_controller(mdev);
+	} else {
+		mdev->c_sync_rate = calc_resync_rate(mdev);
+		number = SLEEP_TIME * mdev->c_sync_rate  / ((BM_BLOCK_SIZE / 1024) * HZ);
+	}
 	pe = atomic_read(&mdev->rs_pending_cnt);
 
 	mutex_lock(&mdev->data.mutex);
@@ -538,6 +585,7 @@ next_sector:
 				return 0;
 			}
 		}
+		atomic_add(size >> 9, &mdev->rs_sect_in_flight);
 	}
 
 	if (mdev->bm_resync_fo >= drbd_bm_bits(mdev)) {
@@ -1300,6 +1348,9 @@ void drbd_start_resync(struct drbd_conf *mdev, enum drbd_conns side)
 		mdev->rs_start     =
 		mdev->rs_mark_time = jiffies;
 		mdev->rs_same_csum = 0;
+		atomic_set(&mdev->rs_sect_in_flight, 0);
+		atomic_set(&mdev->rs_sect_in, 0);
+		mdev->rs_sect_in_avg = 0;
 		_drbd_pause_after(mdev);
 	}
 	write_unlock_irq(&global_state_lock);
@@ -24,6 +24,9 @@
 #include <linux/highmem.h>
 #include <linux/kthread.h>
 #include <linux/splice.h>
+#include <linux/fiemap.h>
+#include <linux/mempool.h>
+#include <linux/rbtree.h>
 
 #include <asm/uaccess.h>
 
@@ -32,6 +35,73 @@ static DEFINE_MUTEX(loop_devices_mutex);
 
 static int max_part;
 static int part_shift;
+static int direct_io;
+
+#define LO_FLAGS_DIRECT_IO	16
+
+/*
+ * Direct I/O mode: the blocks of the backing file are looked up with
+ * fiemap and bios are remapped straight onto the device underneath, so
+ * the backing page cache is bypassed and any number of requests can be
+ * in flight.  Writes into holes and barriers still go through the loop
+ * thread, which writes the range back and refreshes the map afterwards.
+ * Nothing is remapped while a barrier is waiting for the thread.
+ *
+ * The backing file is marked S_SWAPFILE while it is mapped, as swapon
+ * does, so it cannot be truncated, defragmented or swapped on.  Only
+ * filesystems known to overwrite blocks in place, and whose fiemap
+ * reports sectors of s_bdev, are written behind their back, see
+ * loop_dio_fs_ok().  Whatever other openers of the file have cached is
+ * dropped before a direct write completes.
+ *
+ * struct loop_device is shared with the transfer modules, so the state
+ * for this mode is kept in a wrapper private to this file.
+ */
+struct loop_extent {
+	struct rb_node	node;
+	loff_t		pos;		/* offset in the backing file */
+	loff_t		len;
+	sector_t	sector;		/* on dio_bdev */
+};
+
+struct loop_dio_device {
+	struct loop_device	lo;
+
+	spinlock_t		dio_lock;	/* protects the two below */
+	struct block_device	*dio_bdev;	/* NULL when not in use */
+	struct rb_root		dio_extents;
+	bool			dio_whole;	/* backed by dio_bdev itself */
+
+	atomic_t		dio_pending;
+	wait_queue_head_t	dio_wait;
+	atomic_t		dio_barriers;	/* queued to the thread */
+};
+
+struct loop_dio_io {
+	struct loop_dio_device	*ld;
+	struct bio		*bio;
+	atomic_t		remaining;
+	int			error;
+	struct work_struct	work;
+};
+
+#define LOOP_FIEMAP_BATCH	32
+#define LOOP_FIEMAP_UNUSABLE	(FIEMAP_EXTENT_UNKNOWN | \
+				 FIEMAP_EXTENT_DELALLOC | \
+				 FIEMAP_EXTENT_ENCODED | \
+				 FIEMAP_EXTENT_DATA_ENCRYPTED | \
+				 FIEMAP_EXTENT_NOT_ALIGNED | \
+				 FIEMAP_EXTENT_DATA_INLINE | \
+				 FIEMAP_EXTENT_DATA_TAIL | \
+				 FIEMAP_EXTENT_UNWRITTEN)
+
+static mempool_t *loop_dio_pool;
+static struct bio_set *loop_dio_bs;
+
+static inline struct loop_dio_device *to_dio(struct loop_device *lo)
+{
+	return container_of(lo, struct loop_dio_device, lo);
+}
 
 static int transfer_none(struct loop_device *lo, int cmd,
 			 struct page *raw_page, unsigned raw_off,
@@ -383,6 +453,428 @@ lo_receive(struct loop_device *lo, struct bio *bio, int bsize, loff_t pos)
 	return ret;
 }
 
+static void loop_extent_insert(struct loop_dio_device *ld,
+			       struct loop_extent *new)
+{
+	struct rb_node **p, *parent;
+	struct loop_extent *ex;
+
+again:
+	p = &ld->dio_extents.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		ex = rb_entry(parent, struct loop_extent, node);
+		if (new->pos + new->len <= ex->pos)
+			p = &parent->rb_left;
+		else if (new->pos >= ex->pos + ex->len)
+			p = &parent->rb_right;
+		else {
+			/* stale entry for the same range */
+			rb_erase(&ex->node, &ld->dio_extents);
+			kfree(ex);
+			goto again;
+		}
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &ld->dio_extents);
+}
+
+static void loop_extents_free(struct loop_dio_device *ld)
+{
+	struct rb_node *n;
+
+	spin_lock_irq(&ld->dio_lock);
+	while ((n = rb_first(&ld->dio_extents))) {
+		rb_erase(n, &ld->dio_extents);
+		kfree(rb_entry(n, struct loop_extent, node));
+	}
+	spin_unlock_irq(&ld->dio_lock);
+}
+
+/*
+ * Add the plain, block aligned extents of [start, start + len) of the
+ * backing file to the map.
+ */
+static int loop_map_extents(struct loop_dio_device *ld, struct inode *inode,
+			    loff_t start, loff_t len)
+{
+	struct fiemap_extent_info fieinfo;
+	struct fiemap_extent *fe, *e;
+	struct loop_extent *ex;
+	mm_segment_t old_fs;
+	loff_t next;
+	unsigned i;
+	int err = 0;
+
+	fe = kmalloc(LOOP_FIEMAP_BATCH * sizeof(*fe), GFP_NOIO);
+	if (!fe)
+		return -ENOMEM;
+
+	while (len > 0) {
+		memset(&fieinfo, 0, sizeof(fieinfo));
+		fieinfo.fi_extents_max = LOOP_FIEMAP_BATCH;
+		fieinfo.fi_extents_start = (struct fiemap_extent __user *)fe;
+
+		old_fs = get_fs();
+		set_fs(get_ds());
+		err = inode->i_op->fiemap(inode, &fieinfo, start, len);
+		set_fs(old_fs);
+		if (err || !fieinfo.fi_extents_mapped)
+			break;
+
+		for (i = 0; i < fieinfo.fi_extents_mapped; i++) {
+			e = &fe[i];
+			if ((e->fe_flags & LOOP_FIEMAP_UNUSABLE) ||
+			    ((e->fe_logical | e->fe_physical | e->fe_length) &
+			     511))
+				continue;
+
+			ex = kmalloc(sizeof(*ex), GFP_NOIO);
+			if (!ex) {
+				err = -ENOMEM;
+				goto out;
+			}
+			ex->pos = e->fe_logical;
+			ex->len = e->fe_length;
+			ex->sector = e->fe_physical >> 9;
+
+			spin_lock_irq(&ld->dio_lock);
+			loop_extent_insert(ld, ex);
+			spin_unlock_irq(&ld->dio_lock);
+		}
+
+		e = &fe[fieinfo.fi_extents_mapped - 1];
+		if (e->fe_flags & FIEMAP_EXTENT_LAST)
+			break;
+		next = e->fe_logical + e->fe_length;
+		len -= next - start;
+		start = next;
+	}
+out:
+	kfree(fe);
+	return err;
+}
+
+/*
+ * Look up pos in the map.  On return *len is clipped to the run that is
+ * contiguous on disk (or, for a hole, to the start of the next extent).
+ * Returns false for holes.
+ */
+static bool loop_dio_map(struct loop_dio_device *ld, loff_t pos,
+			 loff_t *len, sector_t *sector)
+{
+	struct rb_node *n;
+	struct loop_extent *ex, *next = NULL;
+	unsigned long flags;
+	bool mapped = false;
+
+	if (ld->dio_whole) {
+		*sector = pos >> 9;
+		return true;
+	}
+
+	spin_lock_irqsave(&ld->dio_lock, flags);
+	n = ld->dio_extents.rb_node;
+	while (n) {
+		ex = rb_entry(n, struct loop_extent, node);
+		if (pos < ex->pos) {
+			next = ex;
+			n = n->rb_left;
+		} else if (pos >= ex->pos + ex->len)
+			n = n->rb_right;
+		else {
+			*sector = ex->sector + ((pos - ex->pos) >> 9);
+			*len = min(*len, ex->pos + ex->len - pos);
+			mapped = true;
+			break;
+		}
+	}
+	if (!mapped && next)
+		*len = min(*len, next->pos - pos);
+	spin_unlock_irqrestore(&ld->dio_lock, flags);
+
+	return mapped;
+}
+
+static bool loop_dio_mapped(struct loop_dio_device *ld, loff_t pos,
+			    loff_t len)
+{
+	loff_t run;
+	sector_t sector;
+
+	while (len > 0) {
+		run = len;
+		if (!loop_dio_map(ld, pos, &run, &sector))
+			return false;
+		pos += run;
+		len -= run;
+	}
+	return true;
+}
+
+static struct block_device *loop_dio_get(struct loop_dio_device *ld)
+{
+	struct block_device *bdev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ld->dio_lock, flags);
+	bdev = ld->dio_bdev;
+	if (bdev)
+		atomic_inc(&ld->dio_pending);
+	spin_unlock_irqrestore(&ld->dio_lock, flags);
+
+	return bdev;
+}
+
+static void loop_dio_put(struct loop_dio_device *ld)
+{
+	if (atomic_dec_and_test(&ld->dio_pending))
+		wake_up(&ld->dio_wait);
+}
+
+static void loop_dio_io_done(struct loop_dio_io *io)
+{
+	struct loop_dio_device *ld = io->ld;
+
+	bio_endio(io->bio, io->error);
+	mempool_free(io, loop_dio_pool);
+	loop_dio_put(ld);
+}
+
+static void loop_dio_invalidate(struct work_struct *work)
+{
+	struct loop_dio_io *io = container_of(work, struct loop_dio_io, work);
+	struct loop_device *lo = &io->ld->lo;
+	loff_t pos = ((loff_t)io->bio->bi_sector << 9) + lo->lo_offset;
+
+	invalidate_inode_pages2_range(lo->lo_backing_file->f_mapping,
+			pos >> PAGE_CACHE_SHIFT,
+			(pos + io->bio->bi_size - 1) >> PAGE_CACHE_SHIFT);
+	loop_dio_io_done(io);
+}
+
+static void loop_dio_io_put(struct loop_dio_io *io)
+{
+	struct loop_device *lo = &io->ld->lo;
+
+	if (!atomic_dec_and_test(&io->remaining))
+		return;
+
+	/* Pages someone else read from the file are stale now */
+	if (bio_data_dir(io->bio) == WRITE &&
+	    lo->lo_backing_file->f_mapping->nrpages) {
+		INIT_WORK(&io->work, loop_dio_invalidate);
+		kblockd_schedule_work(lo->lo_queue, &io->work);
+		return;
+	}
+	loop_dio_io_done(io);
+}
+
+static void loop_dio_endio(struct bio *clone, int error)
+{
+	struct loop_dio_io *io = clone->bi_private;
+
+	if (error)
+		io->error = error;
+	bio_put(clone);
+	loop_dio_io_put(io);
+}
+
+static void loop_dio_bio_destructor(struct bio *bio)
+{
+	bio_free(bio, loop_dio_bs);
+}
+
+static struct bio *loop_dio_clone(struct loop_dio_io *io, struct bio *bio,
+				  struct block_device *bdev, sector_t sector,
+				  int idx)
+{
+	struct bio *clone;
+
+	clone = bio_alloc_bioset(GFP_NOIO,
+				 min_t(int, bio->bi_vcnt - idx, BIO_MAX_PAGES),
+				 loop_dio_bs);
+	clone->bi_destructor = loop_dio_bio_destructor;
+	clone->bi_sector = sector;
+	clone->bi_bdev = bdev;
+	clone->bi_rw = bio->bi_rw;
+	clone->bi_end_io = loop_dio_endio;
+	clone->bi_private = io;
+	return clone;
+}
+
+static void loop_dio_issue(struct loop_dio_io *io, struct bio *clone)
+{
+	atomic_inc(&io->remaining);
+	generic_make_request(clone);
+}
+
+/*
+ * Remap bio onto the backing device.  Returns false if it has to go
+ * through the loop thread instead.
+ */
+static bool loop_dio_submit(struct loop_device *lo, struct bio *bio)
+{
+	struct loop_dio_device *ld = to_dio(lo);
+	struct block_device *bdev;
+	struct loop_dio_io *io;
+	struct bio *clone = NULL;
+	struct bio_vec *bvec;
+	sector_t sector;
+	loff_t pos, run;
+	unsigned off, len;
+	int rw = bio_data_dir(bio);
+	int i;
+
+	/* Switch requests have no bdev and must reach the thread */
+	if (!bio->bi_bdev || bio_rw_flagged(bio, BIO_RW_BARRIER) ||
+	    bio_rw_flagged(bio, BIO_RW_DISCARD))
+		return false;
+
+	bdev = loop_dio_get(ld);
+	if (!bdev)
+		return false;
+
+	/*
+	 * Stay behind a barrier the thread has not finished yet.  This is
+	 * checked after loop_dio_get(), so anything that gets past it is
+	 * waited for by loop_dio_drain().
+	 */
+	if (atomic_read(&ld->dio_barriers)) {
+		loop_dio_put(ld);
+		return false;
+	}
+
+	/* The filesystem has to allocate blocks for writes into holes */
+	pos = ((loff_t)bio->bi_sector << 9) + lo->lo_offset;
+	if (rw == WRITE && !loop_dio_mapped(ld, pos, bio->bi_size)) {
+		loop_dio_put(ld);
+		return false;
+	}
+
+	io = mempool_alloc(loop_dio_pool, GFP_NOIO);
+	io->ld = ld;
+	io->bio = bio;
+	io->error = 0;
+	atomic_set(&io->remaining, 1);
+
+	bio_for_each_segment(bvec, bio, i) {
+		off = bvec->bv_offset;
+		len = bvec->bv_len;
+		while (len) {
+			run = len;
+			if (loop_dio_map(ld, pos, &run, &sector)) {
+				if (clone && (clone->bi_sector +
+					      (clone->bi_size >> 9) != sector ||
+					      bio_add_page(clone, bvec->bv_page,
+							   run, off) != run)) {
+					loop_dio_issue(io, clone);
+					clone = NULL;
+				}
+				if (!clone) {
+					clone = loop_dio_clone(io, bio, bdev,
+							       sector, i);
+					if (bio_add_page(clone, bvec->bv_page,
+							 run, off) != run) {
+						io->error = -EIO;
+						goto out;
+					}
+				}
+			} else if (rw == READ) {
+				void *kaddr;
+
+				/* Holes read as zeroes */
+				kaddr = kmap_atomic(bvec->bv_page, KM_USER0);
+				memset(kaddr + off, 0, run);
+				kunmap_atomic(kaddr, KM_USER0);
+				flush_dcache_page(bvec->bv_page);
+			} else {
+				io->error = -EIO;
+				goto out;
+			}
+			pos += run;
+			off += run;
+			len -= run;
+		}
+	}
+
+	if (clone)
+		loop_dio_issue(io, clone);
+	clone = NULL;
+out:
+	if (clone)
+		bio_put(clone);
+	loop_dio_io_put(io);
+	return true;
+}
+
+/*
+ * Wait for direct I/O already in flight and get it onto stable storage,
+ * for barriers.
+ */
+static void loop_dio_drain(struct loop_device *lo)
+{
+	struct loop_dio_device *ld = to_dio(lo);
+	struct block_device *bdev = ld->dio_bdev;
+
+	wait_event(ld->dio_wait, !atomic_read(&ld->dio_pending));
+	if (bdev)
+		blkdev_issue_flush(bdev, GFP_NOIO, NULL, BLKDEV_IFL_WAIT);
+}
+
+/*
+ * After the loop thread went through the page cache for a range, write
+ * it back, drop it from the cache so that it cannot shadow later direct
+ * writes, and pick up any blocks the filesystem allocated for it.
+ */
+static void loop_dio_sync_range(struct loop_device *lo, loff_t pos,
+				loff_t len)
+{
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+	struct inode *inode = mapping->host;
+
+	if (!len)
+		return;
+
+	filemap_write_and_wait_range(mapping, pos, pos + len - 1);
+	invalidate_inode_pages2_range(mapping, pos >> PAGE_CACHE_SHIFT,
+				      (pos + len - 1) >> PAGE_CACHE_SHIFT);
+	if (!S_ISBLK(inode->i_mode))
+		loop_map_extents(to_dio(lo), inode, pos, len);
+}
+
+/*
+ * Hole punching is not available, so discard is passed on to the blocks
+ * the backing file already has.  They stay allocated to the file.
+ */
+static int loop_dio_discard(struct loop_device *lo, struct bio *bio)
+{
+	struct loop_dio_device *ld = to_dio(lo);
+	struct block_device *bdev;
+	sector_t sector;
+	loff_t pos, len, run;
+	int err = 0;
+
+	bdev = loop_dio_get(ld);
+	if (!bdev)
+		return -EOPNOTSUPP;
+
+	pos = ((loff_t)bio->bi_sector << 9) + lo->lo_offset;
+	len = bio->bi_size;
+	while (len > 0 && !err) {
+		run = len;
+		if (loop_dio_map(ld, pos, &run, &sector))
+			err = blkdev_issue_discard(bdev, sector, run >> 9,
+						   GFP_NOIO, BLKDEV_IFL_WAIT);
+		pos += run;
+		len -= run;
+	}
+
+	loop_dio_put(ld);
+	return err == -EOPNOTSUPP ? 0 : err;
+}
+
 static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 {
 	loff_t pos;
@@ -390,6 +882,11 @@ static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 
 	pos = ((loff_t) bio->bi_sector << 9) + lo->lo_offset;
 
+	if (bio_rw_flagged(bio, BIO_RW_DISCARD)) {
+		ret = loop_dio_discard(lo, bio);
+		goto out;
+	}
+
 	if (bio_rw(bio) == WRITE) {
 		bool barrier = bio_rw_flagged(bio, BIO_RW_BARRIER);
 		struct file *file = lo->lo_backing_file;
@@ -400,6 +897,8 @@ static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 				goto out;
 			}
 
+			if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+				loop_dio_drain(lo);
 			ret = vfs_fsync(file, 0);
 			if (unlikely(ret)) {
 				ret = -EIO;
@@ -417,6 +916,8 @@ static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 	} else
 		ret = lo_receive(lo, bio, lo->lo_blocksize, pos);
 
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		loop_dio_sync_range(lo, pos, bio->bi_size);
 out:
 	return ret;
 }
@@ -446,6 +947,16 @@ static int loop_make_request(struct request_queue *q, struct bio *old_bio)
 		goto out;
 	if (unlikely(rw == WRITE && (lo->lo_flags & LO_FLAGS_READ_ONLY)))
 		goto out;
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO) {
+		spin_unlock_irq(&lo->lo_lock);
+		if (loop_dio_submit(lo, old_bio))
+			return 0;
+		spin_lock_irq(&lo->lo_lock);
+		if (lo->lo_state != Lo_bound)
+			goto out;
+	}
+	if (bio_rw_flagged(old_bio, BIO_RW_BARRIER))
+		atomic_inc(&to_dio(lo)->dio_barriers);
 	loop_add_bio(lo, old_bio);
 	wake_up(&lo->lo_event);
 	spin_unlock_irq(&lo->lo_lock);
@@ -477,8 +988,13 @@ static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 	if (unlikely(!bio->bi_bdev)) {
 		do_loop_switch(lo, bio->bi_private);
 		bio_put(bio);
-	} else {
+	} else if (!(lo->lo_flags & LO_FLAGS_DIRECT_IO) ||
+		   !loop_dio_submit(lo, bio)) {
+		bool barrier = bio_rw_flagged(bio, BIO_RW_BARRIER);
 		int ret = do_bio_filebacked(lo, bio);
+
+		if (barrier)
+			atomic_dec(&to_dio(lo)->dio_barriers);
 		bio_endio(bio, ret);
 	}
 }
@@ -554,6 +1070,142 @@ out:
 	complete(&p->wait);
 }
 
+/*
+ * Keep the blocks of the backing file where fiemap found them, the way
+ * swapon does.  fallocate only allocates into holes, which are not
+ * mapped until the loop thread has written them.
+ */
+static int loop_dio_pin(struct inode *inode)
+{
+	int err = 0;
+
+	mutex_lock(&inode->i_mutex);
+	if (IS_SWAPFILE(inode))
+		err = -EBUSY;
+	else
+		inode->i_flags |= S_SWAPFILE;
+	mutex_unlock(&inode->i_mutex);
+
+	return err;
+}
+
+static void loop_dio_unpin(struct inode *inode)
+{
+	mutex_lock(&inode->i_mutex);
+	inode->i_flags &= ~S_SWAPFILE;
+	mutex_unlock(&inode->i_mutex);
+}
+
+/*
+ * Filesystems that overwrite allocated blocks in place and report
+ * sectors of s_bdev in fiemap.  Copy-on-write ones, and btrfs, whose
+ * fe_physical is a logical address, must never be written around.
+ */
+static const char *loop_dio_fstypes[] = { "ext2", "ext3", "ext4", NULL };
+
+static bool loop_dio_fs_ok(struct inode *inode)
+{
+	const char *name = inode->i_sb->s_type->name;
+	int i;
+
+	/* ext3 and ext4 have no direct_IO for data=journal files */
+	if (!inode->i_mapping->a_ops->direct_IO)
+		return false;
+
+	for (i = 0; loop_dio_fstypes[i]; i++)
+		if (!strcmp(name, loop_dio_fstypes[i]))
+			return true;
+	return false;
+}
+
+static int loop_dio_enable(struct loop_device *lo)
+{
+	struct loop_dio_device *ld = to_dio(lo);
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+	struct inode *inode = mapping->host;
+	struct block_device *bdev;
+	struct request_queue *q;
+	int err;
+
+	if (lo->transfer != transfer_none || (lo->lo_offset & 511))
+		return -EINVAL;
+
+	if (S_ISBLK(inode->i_mode))
+		bdev = inode->i_bdev;
+	else if (inode->i_op->fiemap && inode->i_sb->s_bdev &&
+		 loop_dio_fs_ok(inode))
+		bdev = inode->i_sb->s_bdev;
+	else
+		return -EINVAL;
+
+	if (!S_ISBLK(inode->i_mode)) {
+		/* Nobody else may write or map the image while it is bound */
+		if (atomic_read(&inode->i_writecount) >
+		    !!(lo->lo_backing_file->f_mode & FMODE_WRITE) ||
+		    mapping_writably_mapped(mapping))
+			return -EBUSY;
+
+		err = loop_dio_pin(inode);
+		if (err)
+			return err;
+	}
+
+	/*
+	 * From here on the loop thread cleans up behind any page cache I/O
+	 * it does, so once what is already cached has been written back
+	 * and dropped, the cache can no longer shadow the device.
+	 */
+	lo->lo_flags |= LO_FLAGS_DIRECT_IO;
+	loop_flush(lo);
+
+	err = filemap_write_and_wait(mapping);
+	if (!err && !S_ISBLK(inode->i_mode))
+		err = loop_map_extents(ld, inode, 0, i_size_read(inode));
+	if (err) {
+		lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+		loop_extents_free(ld);
+		if (!S_ISBLK(inode->i_mode))
+			loop_dio_unpin(inode);
+		return err;
+	}
+	invalidate_inode_pages2(mapping);
+
+	spin_lock_irq(&ld->dio_lock);
+	ld->dio_whole = S_ISBLK(inode->i_mode);
+	ld->dio_bdev = bdev;
+	spin_unlock_irq(&ld->dio_lock);
+
+	q = bdev_get_queue(bdev);
+	if (blk_queue_discard(q)) {
+		lo->lo_queue->limits.discard_granularity =
+			q->limits.discard_granularity;
+		lo->lo_queue->limits.max_discard_sectors = UINT_MAX;
+		lo->lo_queue->limits.discard_zeroes_data = 0;
+		queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, lo->lo_queue);
+	}
+	return 0;
+}
+
+static void loop_dio_disable(struct loop_device *lo)
+{
+	struct loop_dio_device *ld = to_dio(lo);
+
+	if (!(lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		return;
+
+	queue_flag_clear_unlocked(QUEUE_FLAG_DISCARD, lo->lo_queue);
+
+	spin_lock_irq(&ld->dio_lock);
+	ld->dio_bdev = NULL;
+	spin_unlock_irq(&ld->dio_lock);
+	wait_event(ld->dio_wait, !atomic_read(&ld->dio_pending));
+
+	lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+	loop_extents_free(ld);
+	if (!ld->dio_whole)
+		loop_dio_unpin(lo->lo_backing_file->f_mapping->host);
+}
+
 
 static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 			  unsigned int arg)
@@ -589,6 +1241,7 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 		goto out_putf;
 
 	/* and ... switch */
+	loop_dio_disable(lo);
 	error = loop_switch(lo, file);
 	if (error)
 		goto out_putf;
@@ -723,6 +1376,8 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 	}
 	lo->lo_state = Lo_bound;
 	wake_up_process(lo->lo_thread);
+	if (direct_io)
+		loop_dio_enable(lo);
 	if (max_part > 0)
 		ioctl_by_bdev(bdev, BLKRRPART, 0);
 	return 0;
@@ -802,6 +1457,7 @@ static int loop_clr_fd(struct loop_device *lo, struct block_device *bdev)
 	spin_unlock_irq(&lo->lo_lock);
 
 	kthread_stop(lo->lo_thread);
+	loop_dio_disable(lo);
 
 	lo->lo_queue->unplug_fn = NULL;
 	lo->lo_backing_file = NULL;
@@ -901,6 +1557,20 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 	     (info->lo_flags & LO_FLAGS_AUTOCLEAR))
 		lo->lo_flags ^= LO_FLAGS_AUTOCLEAR;
 
+	/*
+	 * Direct I/O is switched on on request and stays on until the
+	 * device is cleared, or until a transfer or offset it cannot
+	 * handle is set.
+	 */
+	if (lo->transfer != transfer_none || (lo->lo_offset & 511))
+		loop_dio_disable(lo);
+	else if ((info->lo_flags & LO_FLAGS_DIRECT_IO) &&
+		 !(lo->lo_flags & LO_FLAGS_DIRECT_IO)) {
+		err = loop_dio_enable(lo);
+		if (err)
+			return err;
+	}
+
 	lo->lo_encrypt_key_size = info->lo_encrypt_key_size;
 	lo->lo_init[0] = info->lo_init[0];
 	lo->lo_init[1] = info->lo_init[1];
@@ -1329,6 +1999,8 @@ module_param(max_loop, int, 0);
 MODULE_PARM_DESC(max_loop, "Maximum number of loop devices");
 module_param(max_part, int, 0);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per loop device");
+module_param(direct_io, bool, 0644);
+MODULE_PARM_DESC(direct_io, "Bind loop devices in direct I/O mode where possible");
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(LOOP_MAJOR);
 
@@ -1370,12 +2042,19 @@ EXPORT_SYMBOL(loop_unregister_transfer);
 
 static struct loop_device *loop_alloc(int i)
 {
+	struct loop_dio_device *ld;
 	struct loop_device *lo;
 	struct gendisk *disk;
 
-	lo = kzalloc(sizeof(*lo), GFP_KERNEL);
-	if (!lo)
+	ld = kzalloc(sizeof(*ld), GFP_KERNEL);
+	if (!ld)
 		goto out;
+	lo = &ld->lo;
+	spin_lock_init(&ld->dio_lock);
+	ld->dio_extents = RB_ROOT;
+	atomic_set(&ld->dio_pending, 0);
+	init_waitqueue_head(&ld->dio_wait);
+	atomic_set(&ld->dio_barriers, 0);
 
 	lo->lo_queue = blk_alloc_queue(GFP_KERNEL);
 	if (!lo->lo_queue)
@@ -1401,7 +2080,7 @@ static struct loop_device *loop_alloc(int i)
 out_free_queue:
 	blk_cleanup_queue(lo->lo_queue);
 out_free_dev:
-	kfree(lo);
+	kfree(ld);
 out:
 	return NULL;
 }
@@ -1411,7 +2090,7 @@ static void loop_free(struct loop_device *lo)
 	blk_cleanup_queue(lo->lo_queue);
 	put_disk(lo->lo_disk);
 	list_del(&lo->lo_list);
-	kfree(lo);
+	kfree(to_dio(lo));
 }
 
 static struct loop_device *loop_init_one(int i)
@@ -1487,8 +2166,21 @@ static int __init loop_init(void)
 		range = 1UL << (MINORBITS - part_shift);
 	}
 
-	if (register_blkdev(LOOP_MAJOR, "loop"))
+	loop_dio_pool = mempool_create_kmalloc_pool(BIO_POOL_SIZE,
+					sizeof(struct loop_dio_io));
+	if (!loop_dio_pool)
+		return -ENOMEM;
+	loop_dio_bs = bioset_create(BIO_POOL_SIZE, 0);
+	if (!loop_dio_bs) {
+		mempool_destroy(loop_dio_pool);
+		return -ENOMEM;
+	}
+
+	if (register_blkdev(LOOP_MAJOR, "loop")) {
+		bioset_free(loop_dio_bs);
+		mempool_destroy(loop_dio_pool);
 		return -EIO;
+	}
 
 	for (i = 0; i < nr; i++) {
 		lo = loop_alloc(i);
@@ -1515,6 +2207,8 @@ Enomem:
 		loop_free(lo);
 
 	unregister_blkdev(LOOP_MAJOR, "loop");
+	bioset_free(loop_dio_bs);
+	mempool_destroy(loop_dio_pool);
 	return -ENOMEM;
 }
 
@@ -1530,6 +2224,8 @@ static void __exit loop_exit(void)
 
 	blk_unregister_region(MKDEV(LOOP_MAJOR, 0), range);
 	unregister_blkdev(LOOP_MAJOR, "loop");
+	bioset_free(loop_dio_bs);
+	mempool_destroy(loop_dio_pool);
 }
 
 module_init(loop_init);
@@ -19,6 +19,7 @@
 #include <net/sock.h>
 #include <linux/net.h>
 #include <linux/kthread.h>
+#include <linux/hash.h>
 
 #include <asm/uaccess.h>
 #include <asm/system.h>
@@ -43,10 +44,54 @@
 static unsigned int debugflags;
 #endif /* NDEBUG */
 
+/*
+ * A device may be given several sockets to the same server.  Each has
+ * its own sender and receiver; requests are taken from the shared
+ * waiting_queue by whichever sender is free, and replies are matched
+ * through a hash of the requests in flight.  The connection state hangs
+ * off struct nbd_device here rather than in <linux/nbd.h>.
+ */
+#define NBD_MAX_CONNS	16
+#define NBD_HASH_BITS	8
+#define NBD_TX_BATCH	8	/* requests sent back to back with MSG_MORE */
+
+struct nbd_conn {
+	struct nbd_device	*lo;
+	struct file		*file;
+	struct socket		*sock;
+	struct mutex		tx_lock;
+	struct task_struct	*tx_thread;
+	struct task_struct	*rx_thread;
+	atomic_t		in_flight;
+	struct request		*active_req;	/* being sent, under queue_lock */
+
+	/* Sender side statistics, under tx_lock */
+	u64			requests;
+	u64			tx_bytes;
+	unsigned long		tx_errors;
+	/* Receiver side */
+	u64			rx_bytes;
+	unsigned long		rx_errors;
+};
+
+struct nbd_mc_device {
+	struct nbd_device	lo;
+	int			nr_conns;
+	struct nbd_conn		conns[NBD_MAX_CONNS];
+	unsigned int		nr_waiting;	/* under lo.queue_lock */
+	struct list_head	inflight[1 << NBD_HASH_BITS];
+	unsigned long		shutdown;
+};
+
 static unsigned int nbds_max = 16;
-static struct nbd_device *nbd_dev;
+static struct nbd_mc_device *nbd_dev;
 static int max_part;
 
+static inline struct nbd_mc_device *to_mc(struct nbd_device *lo)
+{
+	return container_of(lo, struct nbd_mc_device, lo);
+}
+
 static DEFINE_SPINLOCK(nbd_lock);
 
 #ifndef NDEBUG
@@ -93,24 +138,26 @@ static void nbd_end_request(struct request *req)
 	spin_unlock_irqrestore(q->queue_lock, flags);
 }
 
-static void sock_shutdown(struct nbd_device *lo, int lock)
+static void sock_shutdown(struct nbd_device *lo)
 {
-	/* Forcibly shutdown the socket causing all listeners
-	 * to error
+	struct nbd_mc_device *mc = to_mc(lo);
+	int i;
+
+	/* Forcibly shutdown the sockets causing all listeners
+	 * to error.  The sockets themselves stay around until
+	 * the senders and receivers are gone.
 	 *
 	 * FIXME: This code is duplicated from sys_shutdown, but
 	 * there should be a more generic interface rather than
 	 * calling socket ops directly here */
-	if (lock)
-		mutex_lock(&lo->tx_lock);
-	if (lo->sock) {
-		printk(KERN_WARNING "%s: shutting down socket\n",
-			lo->disk->disk_name);
-		kernel_sock_shutdown(lo->sock, SHUT_RDWR);
-		lo->sock = NULL;
-	}
-	if (lock)
-		mutex_unlock(&lo->tx_lock);
+	if (!mc->nr_conns || test_and_set_bit(0, &mc->shutdown))
+		return;
+
+	printk(KERN_WARNING "%s: shutting down socket%s\n",
+		lo->disk->disk_name, mc->nr_conns > 1 ? "s" : "");
+	for (i = 0; i < mc->nr_conns; i++)
+		kernel_sock_shutdown(mc->conns[i].sock, SHUT_RDWR);
+	lo->sock = NULL;
 }
 
 static void nbd_xmit_timeout(unsigned long arg)
@@ -122,10 +169,11 @@ static void nbd_xmit_timeout(unsigned long arg)
 	force_sig(SIGKILL, task);
 }
 
-static int sock_xmit(struct nbd_device *lo, int send, void *buf, int size,
+static int sock_xmit(struct nbd_conn *conn, int send, void *buf, int size,
 		int msg_flags)
 {
-	struct socket *sock = lo->sock;
+	struct nbd_device *lo = conn->lo;
+	struct socket *sock = conn->sock;
 	int result;
 	struct msghdr msg;
 	struct kvec iov;
@@ -174,7 +222,7 @@ static int sock_xmit(struct nbd_device *lo, int send, void *buf, int size,
 				task_pid_nr(current), current->comm,
 				dequeue_signal_lock(current, &current->blocked, &info));
 			result = -EINTR;
-			sock_shutdown(lo, !send);
+			sock_shutdown(lo);
 			break;
 		}
 
@@ -192,19 +240,24 @@ static int sock_xmit(struct nbd_device *lo, int send, void *buf, int size,
 	return result;
 }
 
-static inline int sock_send_bvec(struct nbd_device *lo, struct bio_vec *bvec,
+static inline int sock_send_bvec(struct nbd_conn *conn, struct bio_vec *bvec,
 		int flags)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(lo, 1, kaddr + bvec->bv_offset, bvec->bv_len, flags);
+	result = sock_xmit(conn, 1, kaddr + bvec->bv_offset, bvec->bv_len, flags);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
-/* always call with the tx_lock held */
-static int nbd_send_req(struct nbd_device *lo, struct request *req)
+/*
+ * always call with the connection's tx_lock held; 'more' says another
+ * request follows straight away, so the last segment is sent with
+ * MSG_MORE as well
+ */
+static int nbd_send_req(struct nbd_conn *conn, struct request *req, int more)
 {
+	struct nbd_device *lo = conn->lo;
 	int result, flags;
 	struct nbd_request request;
 	unsigned long size = blk_rq_bytes(req);
@@ -220,8 +273,8 @@ static int nbd_send_req(struct nbd_device *lo, struct request *req)
 			nbdcmd_to_ascii(nbd_cmd(req)),
 			(unsigned long long)blk_rq_pos(req) << 9,
 			blk_rq_bytes(req));
-	result = sock_xmit(lo, 1, &request, sizeof(request),
-			(nbd_cmd(req) == NBD_CMD_WRITE) ? MSG_MORE : 0);
+	result = sock_xmit(conn, 1, &request, sizeof(request),
+			(nbd_cmd(req) == NBD_CMD_WRITE || more) ? MSG_MORE : 0);
 	if (result <= 0) {
 		printk(KERN_ERR "%s: Send control failed (result %d)\n",
 				lo->disk->disk_name, result);
@@ -237,11 +290,11 @@ static int nbd_send_req(struct nbd_device *lo, struct request *req)
 		 */
 		rq_for_each_segment(bvec, req, iter) {
 			flags = 0;
-			if (!rq_iter_last(req, iter))
+			if (!rq_iter_last(req, iter) || more)
 				flags = MSG_MORE;
 			dprintk(DBG_TX, "%s: request %p: sending %d bytes data\n",
 					lo->disk->disk_name, req, bvec->bv_len);
-			result = sock_send_bvec(lo, bvec, flags);
+			result = sock_send_bvec(conn, bvec, flags);
 			if (result <= 0) {
 				printk(KERN_ERR "%s: Send data failed (result %d)\n",
 						lo->disk->disk_name, result);
@@ -255,51 +308,71 @@ error_out:
 	return -EIO;
 }
 
+static inline struct list_head *nbd_hash(struct nbd_device *lo,
+					 struct request *req)
+{
+	return &to_mc(lo)->inflight[hash_ptr(req, NBD_HASH_BITS)];
+}
+
+static int nbd_req_active(struct nbd_device *lo, struct request *xreq)
+{
+	struct nbd_mc_device *mc = to_mc(lo);
+	int i, active = 0;
+
+	spin_lock_irq(&lo->queue_lock);
+	for (i = 0; i < mc->nr_conns; i++)
+		if (mc->conns[i].active_req == xreq)
+			active = 1;
+	spin_unlock_irq(&lo->queue_lock);
+
+	return active;
+}
+
 static struct request *nbd_find_request(struct nbd_device *lo,
 					struct request *xreq)
 {
-	struct request *req, *tmp;
+	struct request *req;
 	int err;
 
-	err = wait_event_interruptible(lo->active_wq, lo->active_req != xreq);
+	/* a reply can overtake the end of the send; let the sender finish */
+	err = wait_event_interruptible(lo->active_wq,
+				       !nbd_req_active(lo, xreq));
 	if (unlikely(err))
-		goto out;
+		return ERR_PTR(err);
 
-	spin_lock(&lo->queue_lock);
-	list_for_each_entry_safe(req, tmp, &lo->queue_head, queuelist) {
+	spin_lock_irq(&lo->queue_lock);
+	list_for_each_entry(req, nbd_hash(lo, xreq), queuelist) {
 		if (req != xreq)
 			continue;
 		list_del_init(&req->queuelist);
-		spin_unlock(&lo->queue_lock);
+		spin_unlock_irq(&lo->queue_lock);
 		return req;
 	}
-	spin_unlock(&lo->queue_lock);
+	spin_unlock_irq(&lo->queue_lock);
 
-	err = -ENOENT;
-
-out:
-	return ERR_PTR(err);
+	return ERR_PTR(-ENOENT);
 }
 
-static inline int sock_recv_bvec(struct nbd_device *lo, struct bio_vec *bvec)
+static inline int sock_recv_bvec(struct nbd_conn *conn, struct bio_vec *bvec)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(lo, 0, kaddr + bvec->bv_offset, bvec->bv_len,
+	result = sock_xmit(conn, 0, kaddr + bvec->bv_offset, bvec->bv_len,
 			MSG_WAITALL);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
 /* NULL returned = something went wrong, inform userspace */
-static struct request *nbd_read_stat(struct nbd_device *lo)
+static struct request *nbd_read_stat(struct nbd_conn *conn)
 {
+	struct nbd_device *lo = conn->lo;
 	int result;
 	struct nbd_reply reply;
 	struct request *req;
 
 	reply.magic = 0;
-	result = sock_xmit(lo, 0, &reply, sizeof(reply), MSG_WAITALL);
+	result = sock_xmit(conn, 0, &reply, sizeof(reply), MSG_WAITALL);
 	if (result <= 0) {
 		printk(KERN_ERR "%s: Receive control failed (result %d)\n",
 				lo->disk->disk_name, result);
@@ -325,10 +398,12 @@ static struct request *nbd_read_stat(struct nbd_device *lo)
 		result = -EBADR;
 		goto harderror;
 	}
+	atomic_dec(&((struct nbd_conn *)req->special)->in_flight);
 
 	if (ntohl(reply.error)) {
 		printk(KERN_ERR "%s: Other side returned error (%d)\n",
 				lo->disk->disk_name, ntohl(reply.error));
+		conn->rx_errors++;
 		req->errors++;
 		return req;
 	}
@@ -340,13 +415,15 @@ static struct request *nbd_read_stat(struct nbd_device *lo)
 		struct bio_vec *bvec;
 
 		rq_for_each_segment(bvec, req, iter) {
-			result = sock_recv_bvec(lo, bvec);
+			result = sock_recv_bvec(conn, bvec);
 			if (result <= 0) {
 				printk(KERN_ERR "%s: Receive data failed (result %d)\n",
 						lo->disk->disk_name, result);
+				conn->rx_errors++;
 				req->errors++;
 				return req;
 			}
+			conn->rx_bytes += bvec->bv_len;
 			dprintk(DBG_RX, "%s: request %p: got %d bytes data\n",
 				lo->disk->disk_name, req, bvec->bv_len);
 		}
@@ -371,10 +448,69 @@ static struct device_attribute pid_attr = {
 	.show = pid_show,
 };
 
-static int nbd_do_it(struct nbd_device *lo)
+/*
+ * One line per connection:
+ * <index> <requests> <in flight> <bytes sent> <bytes received> <errors>
+ */
+static ssize_t connections_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct nbd_device *lo = dev_to_disk(dev)->private_data;
+	struct nbd_mc_device *mc = to_mc(lo);
+	struct nbd_conn *conn;
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < mc->nr_conns; i++) {
+		conn = &mc->conns[i];
+		len += snprintf(buf + len, PAGE_SIZE - len,
+				"%d %llu %d %llu %llu %lu\n", i,
+				(unsigned long long)conn->requests,
+				atomic_read(&conn->in_flight),
+				(unsigned long long)conn->tx_bytes,
+				(unsigned long long)conn->rx_bytes,
+				conn->tx_errors + conn->rx_errors);
+	}
+	return len;
+}
+
+static struct device_attribute connections_attr = {
+	.attr = { .name = "connections", .mode = S_IRUGO},
+	.show = connections_show,
+};
+
+static void nbd_rx_loop(struct nbd_conn *conn)
 {
 	struct request *req;
-	int ret;
+
+	while ((req = nbd_read_stat(conn)) != NULL)
+		nbd_end_request(req);
+
+	/* one connection going down takes the others with it */
+	sock_shutdown(conn->lo);
+}
+
+static int nbd_rx_thread(void *data)
+{
+	struct nbd_conn *conn = data;
+
+	nbd_rx_loop(conn);
+
+	/* stay around for kthread_stop() */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static int nbd_do_it(struct nbd_device *lo, int nr)
+{
+	struct nbd_mc_device *mc = to_mc(lo);
+	struct nbd_conn *conn;
+	int ret, i;
 
 	BUG_ON(lo->magic != LO_MAGIC);
 
@@ -385,44 +521,89 @@ static int nbd_do_it(struct nbd_device *lo)
 		lo->pid = 0;
 		return ret;
 	}
+	if (sysfs_create_file(&disk_to_dev(lo->disk)->kobj,
+			      &connections_attr.attr))
+		printk(KERN_WARNING "%s: no connection statistics\n",
+			lo->disk->disk_name);
 
-	while ((req = nbd_read_stat(lo)) != NULL)
-		nbd_end_request(req);
+	/* the caller receives on the first connection, threads on the rest */
+	for (i = 1; i < nr; i++) {
+		conn = &mc->conns[i];
+		conn->rx_thread = kthread_run(nbd_rx_thread, conn, "%s-rx%d",
+					      lo->disk->disk_name, i);
+		if (IS_ERR(conn->rx_thread)) {
+			ret = PTR_ERR(conn->rx_thread);
+			conn->rx_thread = NULL;
+			sock_shutdown(lo);
+			break;
+		}
+	}
+
+	if (!ret)
+		nbd_rx_loop(&mc->conns[0]);
 
+	for (i = 1; i < nr; i++) {
+		conn = &mc->conns[i];
+		if (conn->rx_thread)
+			kthread_stop(conn->rx_thread);
+		conn->rx_thread = NULL;
+	}
+
+	sysfs_remove_file(&disk_to_dev(lo->disk)->kobj, &connections_attr.attr);
 	sysfs_remove_file(&disk_to_dev(lo->disk)->kobj, &pid_attr.attr);
 	lo->pid = 0;
-	return 0;
+	return ret;
 }
 
 static void nbd_clear_que(struct nbd_device *lo)
 {
+	struct nbd_mc_device *mc = to_mc(lo);
+	struct list_head *head;
 	struct request *req;
+	int i;
 
 	BUG_ON(lo->magic != LO_MAGIC);
 
 	/*
-	 * Because we have set lo->sock to NULL under the tx_lock, all
-	 * modifications to the list must have completed by now.  For
-	 * the same reason, the active_req must be NULL.
+	 * Because we have set lo->sock to NULL and stopped the senders
+	 * and receivers, all modifications to the in-flight table must
+	 * have completed by now.
 	 *
 	 * As a consequence, we don't need to take the spin lock while
-	 * purging the list here.
+	 * purging the table here.
 	 */
 	BUG_ON(lo->sock);
-	BUG_ON(lo->active_req);
 
-	while (!list_empty(&lo->queue_head)) {
-		req = list_entry(lo->queue_head.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
-		req->errors++;
-		nbd_end_request(req);
+	for (i = 0; i < ARRAY_SIZE(mc->inflight); i++) {
+		head = &mc->inflight[i];
+		while (!list_empty(head)) {
+			req = list_entry(head->next, struct request,
+					 queuelist);
+			list_del_init(&req->queuelist);
+			atomic_dec(&((struct nbd_conn *)req->special)->in_flight);
+			req->errors++;
+			nbd_end_request(req);
+		}
 	}
 }
 
+static int nbd_inflight_empty(struct nbd_device *lo)
+{
+	struct nbd_mc_device *mc = to_mc(lo);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(mc->inflight); i++)
+		if (!list_empty(&mc->inflight[i]))
+			return 0;
+	return 1;
+}
 
-static void nbd_handle_req(struct nbd_device *lo, struct request *req)
+static void nbd_handle_req(struct nbd_conn *conn, struct request *req,
+			   int more)
 {
+	struct nbd_device *lo = conn->lo;
+	int ret;
+
 	if (!blk_fs_request(req))
 		goto error_out;
 
@@ -438,31 +619,46 @@ static void nbd_handle_req(struct nbd_device *lo, struct request *req)
 
 	req->errors = 0;
 
-	mutex_lock(&lo->tx_lock);
 	if (unlikely(!lo->sock)) {
-		mutex_unlock(&lo->tx_lock);
 		printk(KERN_ERR "%s: Attempted send on closed socket\n",
 		       lo->disk->disk_name);
 		goto error_out;
 	}
 
-	lo->active_req = req;
+	conn->requests++;
+	if (nbd_cmd(req) == NBD_CMD_WRITE)
+		conn->tx_bytes += blk_rq_bytes(req);
+
+	/*
+	 * Hash the request before sending it: the reply may be read on
+	 * the other side of the socket before nbd_send_req() returns.
+	 * The receiver does not match it while it is still active here.
+	 */
+	req->special = conn;
+	atomic_inc(&conn->in_flight);
+	spin_lock_irq(&lo->queue_lock);
+	conn->active_req = req;
+	list_add_tail(&req->queuelist, nbd_hash(lo, req));
+	spin_unlock_irq(&lo->queue_lock);
+
+	ret = nbd_send_req(conn, req, more);
+
+	spin_lock_irq(&lo->queue_lock);
+	if (ret)
+		list_del_init(&req->queuelist);
+	conn->active_req = NULL;
+	spin_unlock_irq(&lo->queue_lock);
+	wake_up_all(&lo->active_wq);
 
-	if (nbd_send_req(lo, req) != 0) {
+	if (ret) {
 		printk(KERN_ERR "%s: Request send failed\n",
 				lo->disk->disk_name);
+		conn->tx_errors++;
+		atomic_dec(&conn->in_flight);
 		req->errors++;
 		nbd_end_request(req);
-	} else {
-		spin_lock(&lo->queue_lock);
-		list_add(&req->queuelist, &lo->queue_head);
-		spin_unlock(&lo->queue_lock);
 	}
 
-	lo->active_req = NULL;
-	mutex_unlock(&lo->tx_lock);
-	wake_up_all(&lo->active_wq);
-
 	return;
 
 error_out:
@@ -472,8 +668,11 @@ error_out:
 
 static int nbd_thread(void *data)
 {
-	struct nbd_device *lo = data;
-	struct request *req;
+	struct nbd_conn *conn = data;
+	struct nbd_device *lo = conn->lo;
+	struct nbd_mc_device *mc = to_mc(lo);
+	struct request *batch[NBD_TX_BATCH];
+	unsigned int n, i, share;
 
 	set_user_nice(current, -20);
 	while (!kthread_should_stop() || !list_empty(&lo->waiting_queue)) {
@@ -482,18 +681,28 @@ static int nbd_thread(void *data)
 					 kthread_should_stop() ||
 					 !list_empty(&lo->waiting_queue));
 
-		/* extract request */
+		/* extract requests, leaving the other senders their share */
 		if (list_empty(&lo->waiting_queue))
 			continue;
 
+		n = 0;
 		spin_lock_irq(&lo->queue_lock);
-		req = list_entry(lo->waiting_queue.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
+		share = DIV_ROUND_UP(mc->nr_waiting, mc->nr_conns);
+		while (n < min_t(unsigned int, share, NBD_TX_BATCH) &&
+		       !list_empty(&lo->waiting_queue)) {
+			batch[n] = list_entry(lo->waiting_queue.next,
+					      struct request, queuelist);
+			list_del_init(&batch[n]->queuelist);
+			mc->nr_waiting--;
+			n++;
+		}
 		spin_unlock_irq(&lo->queue_lock);
 
-		/* handle request */
-		nbd_handle_req(lo, req);
+		/* handle requests */
+		mutex_lock(&conn->tx_lock);
+		for (i = 0; i < n; i++)
+			nbd_handle_req(conn, batch[i], i + 1 < n);
+		mutex_unlock(&conn->tx_lock);
 	}
 	return 0;
 }
@@ -526,6 +735,7 @@ static void do_nbd_request(struct request_queue *q)
 
 		spin_lock_irq(&lo->queue_lock);
 		list_add_tail(&req->queuelist, &lo->waiting_queue);
+		to_mc(lo)->nr_waiting++;
 		spin_unlock_irq(&lo->queue_lock);
 
 		wake_up(&lo->waiting_wq);
@@ -536,12 +746,33 @@ static void do_nbd_request(struct request_queue *q)
 
 /* Must be called with tx_lock held */
 
+static void nbd_release_socks(struct nbd_device *lo)
+{
+	struct nbd_mc_device *mc = to_mc(lo);
+	struct nbd_conn *conn;
+	int i;
+
+	lo->sock = NULL;
+	lo->file = NULL;
+	for (i = 0; i < mc->nr_conns; i++) {
+		conn = &mc->conns[i];
+		if (conn->file)
+			fput(conn->file);
+		conn->file = NULL;
+		conn->sock = NULL;
+	}
+	mc->nr_conns = 0;
+}
+
 static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		       unsigned int cmd, unsigned long arg)
 {
+	struct nbd_mc_device *mc = to_mc(lo);
+
 	switch (cmd) {
 	case NBD_DISCONNECT: {
 		struct request sreq;
+		int i;
 
 	        printk(KERN_INFO "%s: NBD_DISCONNECT\n", lo->disk->disk_name);
 
@@ -550,33 +781,43 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		nbd_cmd(&sreq) = NBD_CMD_DISC;
 		if (!lo->sock)
 			return -EINVAL;
-		nbd_send_req(lo, &sreq);
+		for (i = 0; i < mc->nr_conns; i++) {
+			mutex_lock(&mc->conns[i].tx_lock);
+			nbd_send_req(&mc->conns[i], &sreq, 0);
+			mutex_unlock(&mc->conns[i].tx_lock);
+		}
                 return 0;
 	}
  
-	case NBD_CLEAR_SOCK: {
-		struct file *file;
-
+	case NBD_CLEAR_SOCK:
 		lo->sock = NULL;
-		file = lo->file;
-		lo->file = NULL;
 		nbd_clear_que(lo);
-		BUG_ON(!list_empty(&lo->queue_head));
-		if (file)
-			fput(file);
+		BUG_ON(!nbd_inflight_empty(lo));
+		nbd_release_socks(lo);
 		return 0;
-	}
 
 	case NBD_SET_SOCK: {
+		struct nbd_conn *conn;
 		struct file *file;
-		if (lo->file)
+
+		/* sockets may be added until NBD_DO_IT */
+		if (lo->pid || mc->nr_conns == NBD_MAX_CONNS)
 			return -EBUSY;
 		file = fget(arg);
 		if (file) {
 			struct inode *inode = file->f_path.dentry->d_inode;
 			if (S_ISSOCK(inode->i_mode)) {
-				lo->file = file;
-				lo->sock = SOCKET_I(inode);
+				conn = &mc->conns[mc->nr_conns];
+				conn->file = file;
+				conn->sock = SOCKET_I(inode);
+				conn->requests = conn->tx_bytes = 0;
+				conn->rx_bytes = 0;
+				conn->tx_errors = conn->rx_errors = 0;
+				if (!mc->nr_conns++) {
+					clear_bit(0, &mc->shutdown);
+					lo->file = file;
+					lo->sock = conn->sock;
+				}
 				if (max_part > 0)
 					bdev->bd_invalidated = 1;
 				return 0;
@@ -614,9 +855,10 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		return 0;
 
 	case NBD_DO_IT: {
-		struct task_struct *thread;
-		struct file *file;
-		int error;
+		struct nbd_conn *conn;
+		int nr = mc->nr_conns;
+		int error = 0;
+		int i;
 
 		if (lo->pid)
 			return -EBUSY;
@@ -625,25 +867,33 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 
 		mutex_unlock(&lo->tx_lock);
 
-		thread = kthread_create(nbd_thread, lo, lo->disk->disk_name);
-		if (IS_ERR(thread)) {
-			mutex_lock(&lo->tx_lock);
-			return PTR_ERR(thread);
+		for (i = 0; i < nr; i++) {
+			conn = &mc->conns[i];
+			conn->tx_thread = kthread_run(nbd_thread, conn,
+					nr > 1 ? "%s-%d" : "%s",
+					lo->disk->disk_name, i);
+			if (IS_ERR(conn->tx_thread)) {
+				error = PTR_ERR(conn->tx_thread);
+				conn->tx_thread = NULL;
+				break;
+			}
+		}
+		if (!error)
+			error = nbd_do_it(lo, nr);
+		for (i = 0; i < nr; i++) {
+			conn = &mc->conns[i];
+			if (conn->tx_thread)
+				kthread_stop(conn->tx_thread);
+			conn->tx_thread = NULL;
 		}
-		wake_up_process(thread);
-		error = nbd_do_it(lo);
-		kthread_stop(thread);
 
 		mutex_lock(&lo->tx_lock);
 		if (error)
 			return error;
-		sock_shutdown(lo, 0);
-		file = lo->file;
-		lo->file = NULL;
+		sock_shutdown(lo);
 		nbd_clear_que(lo);
 		printk(KERN_WARNING "%s: queue cleared\n", lo->disk->disk_name);
-		if (file)
-			fput(file);
+		nbd_release_socks(lo);
 		lo->bytesize = 0;
 		bdev->bd_inode->i_size = 0;
 		set_capacity(lo->disk, 0);
@@ -657,16 +907,19 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		 * This is for compatibility only.  The queue is always cleared
 		 * by NBD_DO_IT or NBD_CLEAR_SOCK.
 		 */
-		BUG_ON(!lo->sock && !list_empty(&lo->queue_head));
+		BUG_ON(!lo->sock && !nbd_inflight_empty(lo));
 		return 0;
 
-	case NBD_PRINT_DEBUG:
-		printk(KERN_INFO "%s: next = %p, prev = %p, head = %p\n",
-			bdev->bd_disk->disk_name,
-			lo->queue_head.next, lo->queue_head.prev,
-			&lo->queue_head);
+	case NBD_PRINT_DEBUG: {
+		int i;
+
+		for (i = 0; i < mc->nr_conns; i++)
+			printk(KERN_INFO "%s: connection %d: %d in flight\n",
+				bdev->bd_disk->disk_name, i,
+				atomic_read(&mc->conns[i].in_flight));
 		return 0;
 	}
+	}
 	return -ENOTTY;
 }
 
@@ -724,7 +977,7 @@ static int __init nbd_init(void)
 		struct gendisk *disk = alloc_disk(1 << part_shift);
 		if (!disk)
 			goto out;
-		nbd_dev[i].disk = disk;
+		nbd_dev[i].lo.disk = disk;
 		/*
 		 * The new linux 2.5 block layer implementation requires
 		 * every gendisk to have its very own request_queue struct.
@@ -750,22 +1003,33 @@ static int __init nbd_init(void)
 	dprintk(DBG_INIT, "nbd: debugflags=0x%x\n", debugflags);
 
 	for (i = 0; i < nbds_max; i++) {
-		struct gendisk *disk = nbd_dev[i].disk;
-		nbd_dev[i].file = NULL;
-		nbd_dev[i].magic = LO_MAGIC;
-		nbd_dev[i].flags = 0;
-		INIT_LIST_HEAD(&nbd_dev[i].waiting_queue);
-		spin_lock_init(&nbd_dev[i].queue_lock);
-		INIT_LIST_HEAD(&nbd_dev[i].queue_head);
-		mutex_init(&nbd_dev[i].tx_lock);
-		init_waitqueue_head(&nbd_dev[i].active_wq);
-		init_waitqueue_head(&nbd_dev[i].waiting_wq);
-		nbd_dev[i].blksize = 1024;
-		nbd_dev[i].bytesize = 0;
+		struct nbd_mc_device *mc = &nbd_dev[i];
+		struct nbd_device *lo = &mc->lo;
+		struct gendisk *disk = lo->disk;
+		int j;
+
+		lo->file = NULL;
+		lo->magic = LO_MAGIC;
+		lo->flags = 0;
+		INIT_LIST_HEAD(&lo->waiting_queue);
+		spin_lock_init(&lo->queue_lock);
+		INIT_LIST_HEAD(&lo->queue_head);
+		mutex_init(&lo->tx_lock);
+		init_waitqueue_head(&lo->active_wq);
+		init_waitqueue_head(&lo->waiting_wq);
+		lo->blksize = 1024;
+		lo->bytesize = 0;
+		for (j = 0; j < NBD_MAX_CONNS; j++) {
+			mc->conns[j].lo = lo;
+			mutex_init(&mc->conns[j].tx_lock);
+			atomic_set(&mc->conns[j].in_flight, 0);
+		}
+		for (j = 0; j < ARRAY_SIZE(mc->inflight); j++)
+			INIT_LIST_HEAD(&mc->inflight[j]);
 		disk->major = NBD_MAJOR;
 		disk->first_minor = i << part_shift;
 		disk->fops = &nbd_fops;
-		disk->private_data = &nbd_dev[i];
+		disk->private_data = lo;
 		sprintf(disk->disk_name, "nbd%d", i);
 		set_capacity(disk, 0);
 		add_disk(disk);
@@ -774,8 +1038,8 @@ static int __init nbd_init(void)
 	return 0;
 out:
 	while (i--) {
-		blk_cleanup_queue(nbd_dev[i].disk->queue);
-		put_disk(nbd_dev[i].disk);
+		blk_cleanup_queue(nbd_dev[i].lo.disk->queue);
+		put_disk(nbd_dev[i].lo.disk);
 	}
 	kfree(nbd_dev);
 	return err;
@@ -785,8 +1049,8 @@ static void __exit nbd_cleanup(void)
 {
 	int i;
 	for (i = 0; i < nbds_max; i++) {
-		struct gendisk *disk = nbd_dev[i].disk;
-		nbd_dev[i].magic = 0;
+		struct gendisk *disk = nbd_dev[i].lo.disk;
+		nbd_dev[i].lo.magic = 0;
 		if (disk) {
 			del_gendisk(disk);
 			blk_cleanup_queue(disk->queue);
@@ -10,14 +10,49 @@
 
 #define PART_BITS 4
 
+/* Multiqueue support, not yet described in <linux/virtio_blk.h> */
+#define VIRTIO_BLK_F_MQ		12
+#define VIRTIO_BLK_CFG_NUM_QUEUES	34	/* __u16, after opt_io_size */
+
+/* Bios added to a virtqueue before the host is notified regardless */
+#define VIRTBLK_KICK_BATCH	16
+
 static int major, index;
 
-struct virtio_blk
+/*
+ * With more than one virtqueue, ordinary reads and writes bypass the
+ * request queue: virtblk_make_request() puts each bio straight on the
+ * virtqueue of the submitting CPU under that queue's own lock.  Barriers
+ * and the requests built by the driver itself still go through the
+ * request queue, which uses the first virtqueue and its lock.
+ */
+struct virtio_blk_vq
 {
 	spinlock_t lock;
+	struct virtqueue *vq;
+	struct scatterlist *sg;
 
+	/* Buffers added since the host was last notified. */
+	unsigned int pending;
+	/* Bios on the ring. */
+	unsigned int in_flight;
+	/* Submitters waiting for room on the ring. */
+	wait_queue_head_t wait;
+
+	char name[16];
+} ____cacheline_aligned_in_smp;
+
+struct virtio_blk
+{
 	struct virtio_device *vdev;
-	struct virtqueue *vq;
+	struct virtio_blk_vq *vqs;
+	unsigned int nr_vqs;
+	make_request_fn *rq_make_request;
+
+	/* Set while a barrier waits for the bios ahead of it. */
+	bool draining;
+	struct mutex barrier_mutex;
+	wait_queue_head_t drain_wq;
 
 	/* The disk structure for the kernel. */
 	struct gendisk *disk;
@@ -38,49 +73,123 @@ struct virtblk_req
 {
 	struct list_head list;
 	struct request *req;
+	struct bio *bio;
+	/* Disk statistics for bios that bypass the request queue. */
+	struct hd_struct *part;
+	unsigned long start_time;
 	struct virtio_blk_outhdr out_hdr;
 	struct virtio_scsi_inhdr in_hdr;
 	u8 status;
 };
 
+static int virtblk_result(struct virtblk_req *vbr)
+{
+	switch (vbr->status) {
+	case VIRTIO_BLK_S_OK:
+		return 0;
+	case VIRTIO_BLK_S_UNSUPP:
+		return -ENOTTY;
+	default:
+		return -EIO;
+	}
+}
+
+static bool virtblk_idle(struct virtio_blk *vblk)
+{
+	unsigned int i;
+
+	for (i = 0; i < vblk->nr_vqs; i++)
+		if (ACCESS_ONCE(vblk->vqs[i].in_flight))
+			return false;
+	return true;
+}
+
+static void virtblk_account_start(struct virtio_blk *vblk,
+				  struct virtblk_req *vbr)
+{
+	struct bio *bio = vbr->bio;
+	int rw = bio_data_dir(bio);
+	int cpu;
+
+	cpu = part_stat_lock();
+	vbr->part = disk_map_sector_rcu(vblk->disk, bio->bi_sector);
+	part_round_stats(cpu, vbr->part);
+	part_inc_in_flight(vbr->part, rw);
+	part_stat_unlock();
+	vbr->start_time = jiffies;
+}
+
+static void virtblk_account_done(struct virtblk_req *vbr)
+{
+	struct bio *bio = vbr->bio;
+	int rw = bio_data_dir(bio);
+	int cpu;
+
+	cpu = part_stat_lock();
+	part_stat_inc(cpu, vbr->part, ios[rw]);
+	part_stat_add(cpu, vbr->part, sectors[rw], bio_sectors(bio));
+	part_stat_add(cpu, vbr->part, ticks[rw], jiffies - vbr->start_time);
+	part_round_stats(cpu, vbr->part);
+	part_dec_in_flight(vbr->part, rw);
+	part_stat_unlock();
+}
+
 static void blk_done(struct virtqueue *vq)
 {
 	struct virtio_blk *vblk = vq->vdev->priv;
-	struct virtblk_req *vbr;
+	struct virtio_blk_vq *bvq = vq->priv;
+	struct virtblk_req *vbr, *next;
+	LIST_HEAD(bios);
 	unsigned int len;
 	unsigned long flags;
 
-	spin_lock_irqsave(&vblk->lock, flags);
-	while ((vbr = virtqueue_get_buf(vblk->vq, &len)) != NULL) {
-		int error;
-
-		switch (vbr->status) {
-		case VIRTIO_BLK_S_OK:
-			error = 0;
-			break;
-		case VIRTIO_BLK_S_UNSUPP:
-			error = -ENOTTY;
-			break;
-		default:
-			error = -EIO;
-			break;
+	spin_lock_irqsave(&bvq->lock, flags);
+	do {
+		/* Take everything the host has finished in one go. */
+		virtqueue_disable_cb(vq);
+		while ((vbr = virtqueue_get_buf(vq, &len)) != NULL) {
+			int error;
+
+			if (vbr->bio) {
+				bvq->in_flight--;
+				list_add_tail(&vbr->list, &bios);
+				continue;
+			}
+
+			error = virtblk_result(vbr);
+
+			if (blk_pc_request(vbr->req)) {
+				vbr->req->resid_len = vbr->in_hdr.residual;
+				vbr->req->sense_len = vbr->in_hdr.sense_len;
+				vbr->req->errors = vbr->in_hdr.errors;
+			}
+			if (blk_special_request(vbr->req))
+				vbr->req->errors = (error != 0);
+
+			__blk_end_request_all(vbr->req, error);
+			list_del(&vbr->list);
+			mempool_free(vbr, vblk->pool);
 		}
+	} while (!virtqueue_enable_cb(vq));
 
-		if (blk_pc_request(vbr->req)) {
-			vbr->req->resid_len = vbr->in_hdr.residual;
-			vbr->req->sense_len = vbr->in_hdr.sense_len;
-			vbr->req->errors = vbr->in_hdr.errors;
-		}
-		if (blk_special_request(vbr->req))
-			vbr->req->errors = (error != 0);
-
-		__blk_end_request_all(vbr->req, error);
-		list_del(&vbr->list);
+	/* In case queue is stopped waiting for more buffers. */
+	if (bvq == &vblk->vqs[0])
+		blk_start_queue(vblk->disk->queue);
+	if (waitqueue_active(&bvq->wait))
+		wake_up(&bvq->wait);
+	spin_unlock_irqrestore(&bvq->lock, flags);
+
+	if (list_empty(&bios))
+		return;
+
+	/* Bios are completed without holding the virtqueue lock. */
+	list_for_each_entry_safe(vbr, next, &bios, list) {
+		virtblk_account_done(vbr);
+		bio_endio(vbr->bio, virtblk_result(vbr));
 		mempool_free(vbr, vblk->pool);
 	}
-	/* In case queue is stopped waiting for more buffers. */
-	blk_start_queue(vblk->disk->queue);
-	spin_unlock_irqrestore(&vblk->lock, flags);
+	if (unlikely(vblk->draining) && virtblk_idle(vblk))
+		wake_up(&vblk->drain_wq);
 }
 
 static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
@@ -95,6 +204,7 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		return false;
 
 	vbr->req = req;
+	vbr->bio = NULL;
 	switch (req->cmd_type) {
 	case REQ_TYPE_FS:
 		vbr->out_hdr.type = 0;
@@ -159,7 +269,7 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		}
 	}
 
-	if (virtqueue_add_buf(vblk->vq, vblk->sg, out, in, vbr) < 0) {
+	if (virtqueue_add_buf(vblk->vqs[0].vq, vblk->sg, out, in, vbr) < 0) {
 		mempool_free(vbr, vblk->pool);
 		return false;
 	}
@@ -188,7 +298,174 @@ static void do_virtblk_request(struct request_queue *q)
 	}
 
 	if (issued)
-		virtqueue_kick(vblk->vq);
+		virtqueue_kick(vblk->vqs[0].vq);
+}
+
+static void virtblk_kick(struct virtio_blk_vq *bvq)
+{
+	if (bvq->pending) {
+		bvq->pending = 0;
+		virtqueue_kick(bvq->vq);
+	}
+}
+
+static void virtblk_unplug(struct request_queue *q)
+{
+	struct virtio_blk *vblk = q->queuedata;
+	struct virtio_blk_vq *bvq;
+	unsigned long flags;
+	unsigned int i;
+
+	for (i = 0; i < vblk->nr_vqs; i++) {
+		bvq = &vblk->vqs[i];
+		if (!ACCESS_ONCE(bvq->pending))
+			continue;
+		spin_lock_irqsave(&bvq->lock, flags);
+		virtblk_kick(bvq);
+		spin_unlock_irqrestore(&bvq->lock, flags);
+	}
+
+	generic_unplug_device(q);
+}
+
+struct virtblk_barrier
+{
+	bio_end_io_t *end_io;
+	void *private;
+	struct completion done;
+};
+
+static void virtblk_barrier_endio(struct bio *bio, int error)
+{
+	struct virtblk_barrier *b = bio->bi_private;
+
+	bio->bi_end_io = b->end_io;
+	bio->bi_private = b->private;
+	if (bio->bi_end_io)
+		bio->bi_end_io(bio, error);
+	complete(&b->done);
+}
+
+/*
+ * A barrier has to wait for the bios already on the virtqueues, and the
+ * bios after it have to wait for the barrier.  The barrier itself goes
+ * through the request queue, which knows how to flush or tag it.
+ */
+static void virtblk_barrier(struct virtio_blk *vblk, struct request_queue *q,
+			    struct bio *bio)
+{
+	struct virtblk_barrier b;
+	unsigned int i;
+
+	mutex_lock(&vblk->barrier_mutex);
+
+	vblk->draining = true;
+	/* Anyone already past the check has queued their bio after this. */
+	for (i = 0; i < vblk->nr_vqs; i++) {
+		spin_lock_irq(&vblk->vqs[i].lock);
+		virtblk_kick(&vblk->vqs[i]);
+		spin_unlock_irq(&vblk->vqs[i].lock);
+	}
+	wait_event(vblk->drain_wq, virtblk_idle(vblk));
+
+	b.end_io = bio->bi_end_io;
+	b.private = bio->bi_private;
+	init_completion(&b.done);
+	bio->bi_end_io = virtblk_barrier_endio;
+	bio->bi_private = &b;
+	vblk->rq_make_request(q, bio);
+	generic_unplug_device(q);
+	wait_for_completion(&b.done);
+
+	vblk->draining = false;
+	wake_up_all(&vblk->drain_wq);
+	mutex_unlock(&vblk->barrier_mutex);
+}
+
+static int virtblk_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct virtio_blk *vblk = q->queuedata;
+	struct virtio_blk_vq *bvq;
+	struct virtblk_req *vbr;
+	struct bio_vec *bvec;
+	unsigned int out = 0, in = 0;
+	bool kick;
+	int i;
+
+	if (unlikely(bio_rw_flagged(bio, BIO_RW_BARRIER))) {
+		virtblk_barrier(vblk, q, bio);
+		return 0;
+	}
+
+	/* Nothing may overtake a barrier, not even the fallback below */
+	if (unlikely(vblk->draining))
+		wait_event(vblk->drain_wq, !vblk->draining);
+
+	blk_queue_bounce(q, &bio);
+
+	/* Too many pieces for one descriptor chain: let the queue merge */
+	if (unlikely(bio_segments(bio) + 2 > vblk->sg_elems))
+		return vblk->rq_make_request(q, bio);
+
+	vbr = mempool_alloc(vblk->pool, GFP_NOIO);
+	vbr->req = NULL;
+	vbr->bio = bio;
+	vbr->out_hdr.type = 0;
+	vbr->out_hdr.sector = bio->bi_sector;
+	vbr->out_hdr.ioprio = bio_prio(bio);
+	virtblk_account_start(vblk, vbr);
+
+	bvq = &vblk->vqs[raw_smp_processor_id() % vblk->nr_vqs];
+	spin_lock_irq(&bvq->lock);
+
+	while (unlikely(vblk->draining)) {
+		spin_unlock_irq(&bvq->lock);
+		wait_event(vblk->drain_wq, !vblk->draining);
+		spin_lock_irq(&bvq->lock);
+	}
+
+	sg_set_buf(&bvq->sg[out++], &vbr->out_hdr, sizeof(vbr->out_hdr));
+	bio_for_each_segment(bvec, bio, i)
+		sg_set_page(&bvq->sg[out++], bvec->bv_page, bvec->bv_len,
+			    bvec->bv_offset);
+	if (bio_data_dir(bio) == WRITE) {
+		vbr->out_hdr.type |= VIRTIO_BLK_T_OUT;
+	} else if (out > 1) {
+		vbr->out_hdr.type |= VIRTIO_BLK_T_IN;
+		in = out - 1;
+		out = 1;
+	}
+	sg_set_buf(&bvq->sg[out + in++], &vbr->status, sizeof(vbr->status));
+
+	while (virtqueue_add_buf(bvq->vq, bvq->sg, out, in, vbr) < 0) {
+		DEFINE_WAIT(wait);
+
+		/* Ring full: make sure the host is working on it and wait */
+		virtblk_kick(bvq);
+		prepare_to_wait_exclusive(&bvq->wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		spin_unlock_irq(&bvq->lock);
+		io_schedule();
+		finish_wait(&bvq->wait, &wait);
+		spin_lock_irq(&bvq->lock);
+	}
+	bvq->in_flight++;
+
+	/*
+	 * Notify the host once per batch: now if the submitter is about to
+	 * wait for this bio or enough have piled up, else when the queue is
+	 * unplugged.
+	 */
+	bvq->pending++;
+	kick = bio_rw_flagged(bio, BIO_RW_UNPLUG) ||
+		bvq->pending >= VIRTBLK_KICK_BATCH || blk_queue_stopped(q);
+	if (kick)
+		virtblk_kick(bvq);
+	spin_unlock_irq(&bvq->lock);
+
+	if (!kick)
+		blk_plug_device_unlocked(q);
+	return 0;
 }
 
 static void virtblk_prepare_flush(struct request_queue *q, struct request *req)
@@ -280,6 +557,75 @@ static int index_to_minor(int index)
 	return index << PART_BITS;
 }
 
+static int virtblk_init_vqs(struct virtio_blk *vblk)
+{
+	struct virtio_device *vdev = vblk->vdev;
+	struct virtqueue **vqs;
+	vq_callback_t **callbacks;
+	const char **names;
+	struct virtio_blk_vq *bvq;
+	unsigned int i;
+	u16 num_queues;
+	int err;
+
+	err = virtio_config_val(vdev, VIRTIO_BLK_F_MQ,
+				VIRTIO_BLK_CFG_NUM_QUEUES, &num_queues);
+	if (err || !num_queues)
+		num_queues = 1;
+	err = -ENOMEM;
+	vblk->nr_vqs = min_t(unsigned int, num_queues, nr_cpu_ids);
+
+	vblk->vqs = kcalloc(vblk->nr_vqs, sizeof(*vblk->vqs), GFP_KERNEL);
+	vqs = kmalloc(vblk->nr_vqs * sizeof(*vqs), GFP_KERNEL);
+	callbacks = kmalloc(vblk->nr_vqs * sizeof(*callbacks), GFP_KERNEL);
+	names = kmalloc(vblk->nr_vqs * sizeof(*names), GFP_KERNEL);
+	if (!vblk->vqs || !vqs || !callbacks || !names)
+		goto out;
+
+	for (i = 0; i < vblk->nr_vqs; i++) {
+		bvq = &vblk->vqs[i];
+		spin_lock_init(&bvq->lock);
+		init_waitqueue_head(&bvq->wait);
+		bvq->sg = kmalloc(sizeof(*bvq->sg) * vblk->sg_elems,
+				  GFP_KERNEL);
+		if (!bvq->sg)
+			goto out;
+		sg_init_table(bvq->sg, vblk->sg_elems);
+		if (vblk->nr_vqs == 1)
+			strcpy(bvq->name, "requests");
+		else
+			snprintf(bvq->name, sizeof(bvq->name), "requests.%u", i);
+		callbacks[i] = blk_done;
+		names[i] = bvq->name;
+	}
+
+	err = vdev->config->find_vqs(vdev, vblk->nr_vqs, vqs, callbacks, names);
+	if (err)
+		goto out;
+
+	for (i = 0; i < vblk->nr_vqs; i++) {
+		vblk->vqs[i].vq = vqs[i];
+		vqs[i]->priv = &vblk->vqs[i];
+	}
+
+out:
+	kfree(names);
+	kfree(callbacks);
+	kfree(vqs);
+	return err;
+}
+
+static void virtblk_free_vqs(struct virtio_blk *vblk)
+{
+	unsigned int i;
+
+	if (!vblk->vqs)
+		return;
+	for (i = 0; i < vblk->nr_vqs; i++)
+		kfree(vblk->vqs[i].sg);
+	kfree(vblk->vqs);
+}
+
 static int __devinit virtblk_probe(struct virtio_device *vdev)
 {
 	struct virtio_blk *vblk;
@@ -304,7 +650,7 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 
 	/* We need an extra sg elements at head and tail. */
 	sg_elems += 2;
-	vdev->priv = vblk = kmalloc(sizeof(*vblk) +
+	vdev->priv = vblk = kzalloc(sizeof(*vblk) +
 				    sizeof(vblk->sg[0]) * sg_elems, GFP_KERNEL);
 	if (!vblk) {
 		err = -ENOMEM;
@@ -312,17 +658,16 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 	}
 
 	INIT_LIST_HEAD(&vblk->reqs);
-	spin_lock_init(&vblk->lock);
+	mutex_init(&vblk->barrier_mutex);
+	init_waitqueue_head(&vblk->drain_wq);
 	vblk->vdev = vdev;
 	vblk->sg_elems = sg_elems;
 	sg_init_table(vblk->sg, vblk->sg_elems);
 
-	/* We expect one virtqueue, for output. */
-	vblk->vq = virtio_find_single_vq(vdev, blk_done, "requests");
-	if (IS_ERR(vblk->vq)) {
-		err = PTR_ERR(vblk->vq);
+	/* One virtqueue for output, or one per CPU if the host offers. */
+	err = virtblk_init_vqs(vblk);
+	if (err)
 		goto out_free_vblk;
-	}
 
 	vblk->pool = mempool_create_kmalloc_pool(1,sizeof(struct virtblk_req));
 	if (!vblk->pool) {
@@ -337,13 +682,19 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 		goto out_mempool;
 	}
 
-	q = vblk->disk->queue = blk_init_queue(do_virtblk_request, &vblk->lock);
+	q = vblk->disk->queue = blk_init_queue(do_virtblk_request,
+					       &vblk->vqs[0].lock);
 	if (!q) {
 		err = -ENOMEM;
 		goto out_put_disk;
 	}
 
 	q->queuedata = vblk;
+	if (vblk->nr_vqs > 1) {
+		vblk->rq_make_request = q->make_request_fn;
+		blk_queue_make_request(q, virtblk_make_request);
+		q->unplug_fn = virtblk_unplug;
+	}
 
 	if (index < 26) {
 		sprintf(vblk->disk->disk_name, "vd%c", 'a' + index % 26);
@@ -453,6 +804,7 @@ out_mempool:
 out_free_vq:
 	vdev->config->del_vqs(vdev);
 out_free_vblk:
+	virtblk_free_vqs(vblk);
 	kfree(vblk);
 out:
 	return err;
@@ -464,6 +816,7 @@ static void __devexit virtblk_remove(struct virtio_device *vdev)
 
 	/* Nothing should be pending. */
 	BUG_ON(!list_empty(&vblk->reqs));
+	BUG_ON(!virtblk_idle(vblk));
 
 	/* Stop all the virtqueues. */
 	vdev->config->reset(vdev);
@@ -473,6 +826,7 @@ static void __devexit virtblk_remove(struct virtio_device *vdev)
 	put_disk(vblk->disk);
 	mempool_destroy(vblk->pool);
 	vdev->config->del_vqs(vdev);
+	virtblk_free_vqs(vblk);
 	kfree(vblk);
 }
 
@@ -484,7 +838,8 @@ static const struct virtio_device_id id_table[] = {
 static unsigned int features[] = {
 	VIRTIO_BLK_F_BARRIER, VIRTIO_BLK_F_SEG_MAX, VIRTIO_BLK_F_SIZE_MAX,
 	VIRTIO_BLK_F_GEOMETRY, VIRTIO_BLK_F_RO, VIRTIO_BLK_F_BLK_SIZE,
-	VIRTIO_BLK_F_SCSI, VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_TOPOLOGY
+	VIRTIO_BLK_F_SCSI, VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_TOPOLOGY,
+	VIRTIO_BLK_F_MQ
 };
 
 static struct virtio_driver __refdata virtio_blk = {
@@ -572,9 +572,192 @@ static ssize_t extract_entropy_user(struct entropy_store *r, void __user *buf,
 	return ret;
 }
 
+/*
+ * Output generator for get_random_bytes() and /dev/urandom.  Each CPU runs
+ * its own ChaCha20 keystream, keyed from the nonblocking pool and rekeyed
+ * from it every CRNG_RESEED_INTERVAL, so readers no longer serialize on
+ * the pool lock and pay a SHA-1 pass over the pool for every 10 bytes.
+ * Entropy accounting for the pools is unchanged: a reseed is an ordinary
+ * extraction from the nonblocking pool.  After every request the key is
+ * replaced with fresh keystream so earlier output cannot be recovered
+ * from the state.  In FIPS mode the pool is used directly as before so
+ * the continuous output test keeps covering every byte.
+ */
+#define CHACHA20_BLOCK_WORDS	16
+#define CHACHA20_BLOCK_SIZE	(CHACHA20_BLOCK_WORDS * 4)
+#define CRNG_KEY_WORDS		8
+#define CRNG_RESEED_INTERVAL	(300 * HZ)
+
+struct crng_state {
+	__u32 state[CHACHA20_BLOCK_WORDS];
+	unsigned long init_time;
+	int seeded;
+};
+
+static DEFINE_PER_CPU(struct crng_state, crng_state);
+
+#define CHACHA20_QR(a, b, c, d) do {					\
+	a += b; d = rol32(d ^ a, 16);					\
+	c += d; b = rol32(b ^ c, 12);					\
+	a += b; d = rol32(d ^ a, 8);					\
+	c += d; b = rol32(b ^ c, 7);					\
+} while (0)
+
+static void chacha20_block(__u32 *state, __u32 *out)
+{
+	__u32 x[CHACHA20_BLOCK_WORDS];
+	int i;
+
+	memcpy(x, state, sizeof(x));
+
+	for (i = 0; i < 20; i += 2) {
+		CHACHA20_QR(x[0], x[4], x[8],  x[12]);
+		CHACHA20_QR(x[1], x[5], x[9],  x[13]);
+		CHACHA20_QR(x[2], x[6], x[10], x[14]);
+		CHACHA20_QR(x[3], x[7], x[11], x[15]);
+
+		CHACHA20_QR(x[0], x[5], x[10], x[15]);
+		CHACHA20_QR(x[1], x[6], x[11], x[12]);
+		CHACHA20_QR(x[2], x[7], x[8],  x[13]);
+		CHACHA20_QR(x[3], x[4], x[9],  x[14]);
+	}
+
+	for (i = 0; i < CHACHA20_BLOCK_WORDS; i++)
+		out[i] = x[i] + state[i];
+
+	if (!++state[12])
+		state[13]++;
+
+	memset(x, 0, sizeof(x));
+}
+
+static void crng_reseed(void)
+{
+	static const __u32 sigma[4] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574
+	};
+	__u32 seed[CRNG_KEY_WORDS + 4];
+	struct crng_state *crng;
+	unsigned long flags;
+	int i;
+
+	extract_entropy(&nonblocking_pool, seed, sizeof(seed), 0, 0);
+
+	local_irq_save(flags);
+	crng = &__get_cpu_var(crng_state);
+	if (!crng->seeded)
+		memcpy(crng->state, sigma, sizeof(sigma));
+	for (i = 0; i < CRNG_KEY_WORDS; i++)
+		crng->state[4 + i] ^= seed[i];
+	for (i = 0; i < 4; i++)
+		crng->state[12 + i] ^= seed[CRNG_KEY_WORDS + i];
+	crng->init_time = jiffies;
+	/* Until the input pool has real entropy, come back for more soon */
+	if (input_pool.entropy_count < CRNG_KEY_WORDS * 32)
+		crng->init_time -= CRNG_RESEED_INTERVAL - HZ;
+	crng->seeded = 1;
+	local_irq_restore(flags);
+
+	memset(seed, 0, sizeof(seed));
+}
+
+static void extract_crng(__u32 out[CHACHA20_BLOCK_WORDS])
+{
+	struct crng_state *crng;
+	unsigned long flags;
+
+	/*
+	 * crng_reseed() seeds whichever CPU it ends up on, so check again
+	 * on the CPU we are on now before using its state.
+	 */
+	local_irq_save(flags);
+	crng = &__get_cpu_var(crng_state);
+	while (unlikely(!crng->seeded ||
+			time_after(jiffies, crng->init_time +
+				   CRNG_RESEED_INTERVAL))) {
+		local_irq_restore(flags);
+		crng_reseed();
+		local_irq_save(flags);
+		crng = &__get_cpu_var(crng_state);
+	}
+	chacha20_block(crng->state, out);
+	local_irq_restore(flags);
+}
+
+static void crng_backtrack_protect(void)
+{
+	__u32 tmp[CHACHA20_BLOCK_WORDS];
+	struct crng_state *crng;
+	unsigned long flags;
+	int i;
+
+	local_irq_save(flags);
+	crng = &__get_cpu_var(crng_state);
+	chacha20_block(crng->state, tmp);
+	for (i = 0; i < CRNG_KEY_WORDS; i++)
+		crng->state[4 + i] ^= tmp[i];
+	local_irq_restore(flags);
+
+	memset(tmp, 0, sizeof(tmp));
+}
+
+static ssize_t extract_crng_user(void __user *buf, size_t nbytes)
+{
+	ssize_t ret = 0, i;
+	__u32 tmp[CHACHA20_BLOCK_WORDS];
+
+	while (nbytes) {
+		if (need_resched()) {
+			if (signal_pending(current)) {
+				if (ret == 0)
+					ret = -ERESTARTSYS;
+				break;
+			}
+			schedule();
+		}
+
+		extract_crng(tmp);
+		i = min_t(size_t, nbytes, CHACHA20_BLOCK_SIZE);
+		if (copy_to_user(buf, tmp, i)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		nbytes -= i;
+		buf += i;
+		ret += i;
+	}
+
+	crng_backtrack_protect();
+
+	/* Wipe data just returned from memory */
+	memset(tmp, 0, sizeof(tmp));
+
+	return ret;
+}
+
 void get_random_bytes(void *buf, int nbytes)
 {
-	extract_entropy(&nonblocking_pool, buf, nbytes, 0, 0);
+	__u32 tmp[CHACHA20_BLOCK_WORDS];
+	int i;
+
+	if (fips_enabled) {
+		extract_entropy(&nonblocking_pool, buf, nbytes, 0, 0);
+		return;
+	}
+
+	while (nbytes > 0) {
+		extract_crng(tmp);
+		i = min_t(int, nbytes, CHACHA20_BLOCK_SIZE);
+		memcpy(buf, tmp, i);
+		nbytes -= i;
+		buf += i;
+	}
+
+	crng_backtrack_protect();
+
+	/* Wipe data just returned from memory */
+	memset(tmp, 0, sizeof(tmp));
 }
 EXPORT_SYMBOL(get_random_bytes);
 
@@ -693,7 +876,10 @@ random_read(struct file *file, char __user *buf, size_t nbytes, loff_t *ppos)
 static ssize_t
 urandom_read(struct file *file, char __user *buf, size_t nbytes, loff_t *ppos)
 {
-	return extract_entropy_user(&nonblocking_pool, buf, nbytes);
+	if (fips_enabled)
+		return extract_entropy_user(&nonblocking_pool, buf, nbytes);
+
+	return extract_crng_user(buf, nbytes);
 }
 
 static unsigned int
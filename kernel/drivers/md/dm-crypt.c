@@ -11,6 +11,9 @@
 #include <linux/slab.h>
 #include <linux/crypto.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/percpu.h>
+#include <linux/rbtree.h>
 #include <linux/backing-dev.h>
 #include <asm/atomic.h>
 #include <linux/scatterlist.h>
@@ -45,6 +48,8 @@ struct dm_crypt_io {
 	int error;
 	sector_t sector;
 	struct dm_crypt_io *base_io;
+
+	struct rb_node rb_node;
 };
 
 struct dm_crypt_request {
@@ -75,6 +80,32 @@ struct iv_benbi_private {
 };
 
 enum flags { DM_CRYPT_SUSPENDED, DM_CRYPT_KEY_VALID };
+
+/*
+ * Per-CPU crypto state.  crypt_convert() only runs from the bound,
+ * per-CPU kcryptd threads, so each CPU's request is never shared.
+ *
+ * Each CPU also keeps a small stash of write buffer pages, refilled as
+ * writes complete, so that a steady write load does not go back to the
+ * page allocator (or wait on the mempool) for every bio.  The stash size
+ * is the stash_pages module parameter, and the stashes are emptied under
+ * memory pressure.
+ */
+#define CRYPT_CPU_PAGES	64
+
+static unsigned int stash_pages = 16;
+module_param(stash_pages, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(stash_pages, "Write buffer pages kept per CPU and target "
+		 "(at most 64)");
+
+struct crypt_cpu {
+	struct ablkcipher_request *req;
+
+	spinlock_t lock;
+	unsigned int nr_pages;
+	struct page *pages[CRYPT_CPU_PAGES];
+};
+
 struct crypt_config {
 	struct dm_dev *dev;
 	sector_t start;
@@ -91,6 +122,15 @@ struct crypt_config {
 	struct workqueue_struct *io_queue;
 	struct workqueue_struct *crypt_queue;
 
+	/*
+	 * Encrypted writes complete out of order across CPUs; they are
+	 * collected here and submitted in sector order by write_thread.
+	 */
+	struct task_struct *write_thread;
+	wait_queue_head_t write_thread_wait;
+	spinlock_t write_lock;
+	struct rb_root write_tree;
+
 	/*
 	 * crypto related data
 	 */
@@ -117,7 +157,15 @@ struct crypt_config {
 	 * correctly aligned.
 	 */
 	unsigned int dmreq_start;
-	struct ablkcipher_request *req;
+	struct crypt_cpu __percpu *cpu;
+
+	atomic_t stashed;
+	struct shrinker shrinker;
+
+	/* write buffer allocation statistics, reported in the status */
+	atomic_t stash_hits;
+	atomic_t pool_waits;
+	atomic_t partial_buffers;
 
 	char cipher[CRYPTO_MAX_ALG_NAME];
 	char chainmode[CRYPTO_MAX_ALG_NAME];
@@ -422,18 +470,22 @@ static void kcryptd_async_done(struct crypto_async_request *async_req,
 static void crypt_alloc_req(struct crypt_config *cc,
 			    struct convert_context *ctx)
 {
-	if (!cc->req)
-		cc->req = mempool_alloc(cc->req_pool, GFP_NOIO);
-	ablkcipher_request_set_tfm(cc->req, cc->tfm);
-	ablkcipher_request_set_callback(cc->req, CRYPTO_TFM_REQ_MAY_BACKLOG |
+	struct crypt_cpu *this_cc = this_cpu_ptr(cc->cpu);
+
+	if (!this_cc->req)
+		this_cc->req = mempool_alloc(cc->req_pool, GFP_NOIO);
+	ablkcipher_request_set_tfm(this_cc->req, cc->tfm);
+	ablkcipher_request_set_callback(this_cc->req,
+					CRYPTO_TFM_REQ_MAY_BACKLOG |
 					CRYPTO_TFM_REQ_MAY_SLEEP,
 					kcryptd_async_done,
-					dmreq_of_req(cc, cc->req));
+					dmreq_of_req(cc, this_cc->req));
 }
 
 static int crypt_convert(struct crypt_config *cc,
 			 struct convert_context *ctx)
 {
+	struct crypt_cpu *this_cc;
 	int r;
 
 	atomic_set(&ctx->pending, 1);
@@ -442,10 +494,11 @@ static int crypt_convert(struct crypt_config *cc,
 	      ctx->idx_out < ctx->bio_out->bi_vcnt) {
 
 		crypt_alloc_req(cc, ctx);
+		this_cc = this_cpu_ptr(cc->cpu);
 
 		atomic_inc(&ctx->pending);
 
-		r = crypt_convert_block(cc, ctx, cc->req);
+		r = crypt_convert_block(cc, ctx, this_cc->req);
 
 		switch (r) {
 		/* async */
@@ -454,7 +507,7 @@ static int crypt_convert(struct crypt_config *cc,
 			INIT_COMPLETION(ctx->restart);
 			/* fall through*/
 		case -EINPROGRESS:
-			cc->req = NULL;
+			this_cc->req = NULL;
 			ctx->sector++;
 			continue;
 
@@ -483,6 +536,111 @@ static void dm_crypt_bio_destructor(struct bio *bio)
 	bio_free(bio, cc->bs);
 }
 
+static struct page *crypt_stash_get(struct crypt_config *cc)
+{
+	struct crypt_cpu *cpu_cc;
+	struct page *page = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	cpu_cc = this_cpu_ptr(cc->cpu);
+	spin_lock(&cpu_cc->lock);
+	if (cpu_cc->nr_pages)
+		page = cpu_cc->pages[--cpu_cc->nr_pages];
+	spin_unlock(&cpu_cc->lock);
+	local_irq_restore(flags);
+
+	if (page)
+		atomic_dec(&cc->stashed);
+	return page;
+}
+
+static void crypt_free_page(struct crypt_config *cc, struct page *page)
+{
+	struct crypt_cpu *cpu_cc;
+	unsigned int max = min_t(unsigned int, stash_pages, CRYPT_CPU_PAGES);
+	unsigned long flags;
+
+	/* the mempool reserve must be refilled first */
+	if (cc->page_pool->curr_nr < cc->page_pool->min_nr) {
+		mempool_free(page, cc->page_pool);
+		return;
+	}
+
+	local_irq_save(flags);
+	cpu_cc = this_cpu_ptr(cc->cpu);
+	spin_lock(&cpu_cc->lock);
+	if (cpu_cc->nr_pages < max) {
+		cpu_cc->pages[cpu_cc->nr_pages++] = page;
+		page = NULL;
+	}
+	spin_unlock(&cpu_cc->lock);
+	local_irq_restore(flags);
+
+	if (page)
+		mempool_free(page, cc->page_pool);
+	else
+		atomic_inc(&cc->stashed);
+}
+
+/*
+ * Give every stashed page back to the mempool.  Used before sleeping on
+ * the mempool, as pages idling in other CPUs' stashes would otherwise
+ * never reach it.
+ */
+static void crypt_drain_stash(struct crypt_config *cc)
+{
+	struct crypt_cpu *cpu_cc;
+	unsigned long flags;
+	struct page *page;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cpu_cc = per_cpu_ptr(cc->cpu, cpu);
+		spin_lock_irqsave(&cpu_cc->lock, flags);
+		while (cpu_cc->nr_pages) {
+			page = cpu_cc->pages[--cpu_cc->nr_pages];
+			spin_unlock_irqrestore(&cpu_cc->lock, flags);
+			atomic_dec(&cc->stashed);
+			mempool_free(page, cc->page_pool);
+			spin_lock_irqsave(&cpu_cc->lock, flags);
+		}
+		spin_unlock_irqrestore(&cpu_cc->lock, flags);
+	}
+}
+
+/* Stashed pages are only a cache, hand them all back when memory is short */
+static int crypt_stash_shrink(struct shrinker *shrink, int nr_to_scan,
+			      gfp_t gfp_mask)
+{
+	struct crypt_config *cc = container_of(shrink, struct crypt_config,
+					       shrinker);
+
+	if (nr_to_scan)
+		crypt_drain_stash(cc);
+
+	return atomic_read(&cc->stashed);
+}
+
+static struct page *crypt_alloc_page(struct crypt_config *cc, gfp_t gfp_mask)
+{
+	struct page *page;
+
+	page = crypt_stash_get(cc);
+	if (page) {
+		atomic_inc(&cc->stash_hits);
+		return page;
+	}
+
+	page = mempool_alloc(cc->page_pool, gfp_mask & ~__GFP_WAIT);
+	if (page || !(gfp_mask & __GFP_WAIT))
+		return page;
+
+	atomic_inc(&cc->pool_waits);
+	crypt_drain_stash(cc);
+	return mempool_alloc(cc->page_pool, gfp_mask);
+}
+
 static struct bio *crypt_alloc_buffer(struct dm_crypt_io *io, unsigned size,
 				      unsigned *out_of_pages)
 {
@@ -493,6 +651,13 @@ static struct bio *crypt_alloc_buffer(struct dm_crypt_io *io, unsigned size,
 	unsigned i, len;
 	struct page *page;
 
+	/*
+	 * A clone holds at most BIO_MAX_PAGES pages; the rest of a bigger
+	 * bio goes in further clones, as for a partial allocation.
+	 */
+	if (nr_iovecs > BIO_MAX_PAGES)
+		nr_iovecs = BIO_MAX_PAGES;
+
 	clone = bio_alloc_bioset(GFP_NOIO, nr_iovecs, cc->bs);
 	if (!clone)
 		return NULL;
@@ -501,8 +666,9 @@ static struct bio *crypt_alloc_buffer(struct dm_crypt_io *io, unsigned size,
 	*out_of_pages = 0;
 
 	for (i = 0; i < nr_iovecs; i++) {
-		page = mempool_alloc(cc->page_pool, gfp_mask);
+		page = crypt_alloc_page(cc, gfp_mask);
 		if (!page) {
+			atomic_inc(&cc->partial_buffers);
 			*out_of_pages = 1;
 			break;
 		}
@@ -518,7 +684,7 @@ static struct bio *crypt_alloc_buffer(struct dm_crypt_io *io, unsigned size,
 		len = (size > PAGE_SIZE) ? PAGE_SIZE : size;
 
 		if (!bio_add_page(clone, page, len, 0)) {
-			mempool_free(page, cc->page_pool);
+			crypt_free_page(cc, page);
 			break;
 		}
 
@@ -541,7 +707,7 @@ static void crypt_free_buffer_pages(struct crypt_config *cc, struct bio *clone)
 	for (i = 0; i < clone->bi_vcnt; i++) {
 		bv = bio_iovec_idx(clone, i);
 		BUG_ON(!bv->bv_page);
-		mempool_free(bv->bv_page, cc->page_pool);
+		crypt_free_page(cc, bv->bv_page);
 		bv->bv_page = NULL;
 	}
 }
@@ -628,25 +794,25 @@ static void clone_init(struct dm_crypt_io *io, struct bio *clone)
 	clone->bi_destructor = dm_crypt_bio_destructor;
 }
 
-static void kcryptd_io_read(struct dm_crypt_io *io)
+/*
+ * Returns 1 if the clone could not be allocated with @gfp.
+ */
+static int kcryptd_io_read(struct dm_crypt_io *io, gfp_t gfp)
 {
 	struct crypt_config *cc = io->target->private;
 	struct bio *base_bio = io->base_bio;
 	struct bio *clone;
 
-	crypt_inc_pending(io);
-
 	/*
 	 * The block layer might modify the bvec array, so always
 	 * copy the required bvecs because we need the original
 	 * one in order to decrypt the whole bio data *afterwards*.
 	 */
-	clone = bio_alloc_bioset(GFP_NOIO, bio_segments(base_bio), cc->bs);
-	if (unlikely(!clone)) {
-		io->error = -ENOMEM;
-		crypt_dec_pending(io);
-		return;
-	}
+	clone = bio_alloc_bioset(gfp, bio_segments(base_bio), cc->bs);
+	if (unlikely(!clone))
+		return 1;
+
+	crypt_inc_pending(io);
 
 	clone_init(io, clone);
 	clone->bi_idx = 0;
@@ -657,6 +823,7 @@ static void kcryptd_io_read(struct dm_crypt_io *io)
 	       sizeof(struct bio_vec) * clone->bi_vcnt);
 
 	generic_make_request(clone);
+	return 0;
 }
 
 static void kcryptd_io_write(struct dm_crypt_io *io)
@@ -665,14 +832,75 @@ static void kcryptd_io_write(struct dm_crypt_io *io)
 	generic_make_request(clone);
 }
 
+static int dmcrypt_write(void *data)
+{
+	struct crypt_config *cc = data;
+	struct rb_root write_tree;
+	struct dm_crypt_io *io;
+
+	while (1) {
+		wait_event_interruptible(cc->write_thread_wait,
+			!RB_EMPTY_ROOT(&cc->write_tree) ||
+			kthread_should_stop());
+
+		spin_lock_irq(&cc->write_lock);
+		write_tree = cc->write_tree;
+		cc->write_tree = RB_ROOT;
+		spin_unlock_irq(&cc->write_lock);
+
+		if (RB_EMPTY_ROOT(&write_tree)) {
+			if (kthread_should_stop())
+				break;
+			continue;
+		}
+
+		do {
+			io = rb_entry(rb_first(&write_tree),
+				      struct dm_crypt_io, rb_node);
+			rb_erase(&io->rb_node, &write_tree);
+			kcryptd_io_write(io);
+		} while (!RB_EMPTY_ROOT(&write_tree));
+	}
+
+	return 0;
+}
+
+static void kcryptd_queue_write(struct dm_crypt_io *io)
+{
+	struct crypt_config *cc = io->target->private;
+	sector_t sector = io->ctx.bio_out->bi_sector;
+	struct rb_node **p, *parent = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cc->write_lock, flags);
+	p = &cc->write_tree.rb_node;
+	while (*p) {
+		parent = *p;
+		if (sector < rb_entry(parent, struct dm_crypt_io,
+				      rb_node)->ctx.bio_out->bi_sector)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&io->rb_node, parent, p);
+	rb_insert_color(&io->rb_node, &cc->write_tree);
+	spin_unlock_irqrestore(&cc->write_lock, flags);
+
+	wake_up(&cc->write_thread_wait);
+}
+
 static void kcryptd_io(struct work_struct *work)
 {
 	struct dm_crypt_io *io = container_of(work, struct dm_crypt_io, work);
 
-	if (bio_data_dir(io->base_bio) == READ)
-		kcryptd_io_read(io);
-	else
+	if (bio_data_dir(io->base_bio) == READ) {
+		crypt_inc_pending(io);
+		if (kcryptd_io_read(io, GFP_NOIO))
+			io->error = -ENOMEM;
+		crypt_dec_pending(io);
+	} else {
 		kcryptd_io_write(io);
+	}
 }
 
 static void kcryptd_queue_io(struct dm_crypt_io *io)
@@ -683,8 +911,7 @@ static void kcryptd_queue_io(struct dm_crypt_io *io)
 	queue_work(cc->io_queue, &io->work);
 }
 
-static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io,
-					  int error, int async)
+static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io, int error)
 {
 	struct bio *clone = io->ctx.bio_out;
 	struct crypt_config *cc = io->target->private;
@@ -702,10 +929,7 @@ static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io,
 
 	clone->bi_sector = cc->start + io->sector;
 
-	if (async)
-		kcryptd_queue_io(io);
-	else
-		generic_make_request(clone);
+	kcryptd_queue_write(io);
 }
 
 static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
@@ -748,7 +972,7 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 
 		/* Encryption was already finished, submit io now */
 		if (crypt_finished) {
-			kcryptd_crypt_write_io_submit(io, r, 0);
+			kcryptd_crypt_write_io_submit(io, r);
 
 			/*
 			 * If there was an error, do not try next fragments.
@@ -756,8 +980,6 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 			 */
 			if (unlikely(r < 0))
 				break;
-
-			io->sector = sector;
 		}
 
 		/*
@@ -768,10 +990,12 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 			congestion_wait(BLK_RW_ASYNC, HZ/100);
 
 		/*
-		 * With async crypto it is unsafe to share the crypto context
-		 * between fragments, so switch to a new dm_crypt_io structure.
+		 * Each fragment is queued to the write thread through its
+		 * own dm_crypt_io, and with async crypto it is unsafe to
+		 * share the crypto context between fragments anyway, so
+		 * switch to a new dm_crypt_io structure.
 		 */
-		if (unlikely(!crypt_finished && remaining)) {
+		if (unlikely(remaining)) {
 			new_io = crypt_io_alloc(io->target, io->base_bio,
 						sector);
 			crypt_inc_pending(new_io);
@@ -846,7 +1070,7 @@ static void kcryptd_async_done(struct crypto_async_request *async_req,
 	if (bio_data_dir(io->base_bio) == READ)
 		kcryptd_crypt_read_done(io, error);
 	else
-		kcryptd_crypt_write_io_submit(io, error, 1);
+		kcryptd_crypt_write_io_submit(io, error);
 }
 
 static void kcryptd_crypt(struct work_struct *work)
@@ -938,6 +1162,7 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	char *ivopts;
 	unsigned int key_size;
 	unsigned long long tmpll;
+	int cpu;
 
 	if (argc != 5) {
 		ti->error = "Not enough arguments";
@@ -1058,7 +1283,13 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		ti->error = "Cannot allocate crypt request mempool";
 		goto bad_req_pool;
 	}
-	cc->req = NULL;
+	cc->cpu = alloc_percpu(struct crypt_cpu);
+	if (!cc->cpu) {
+		ti->error = "Cannot allocate per cpu state";
+		goto bad_cpu;
+	}
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(cc->cpu, cpu)->lock);
 
 	cc->page_pool = mempool_create_page_pool(MIN_POOL_PAGES, 0);
 	if (!cc->page_pool) {
@@ -1107,16 +1338,32 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad_io_queue;
 	}
 
-	cc->crypt_queue = create_singlethread_workqueue("kcryptd");
+	cc->crypt_queue = create_workqueue("kcryptd");
 	if (!cc->crypt_queue) {
 		ti->error = "Couldn't create kcryptd queue";
 		goto bad_crypt_queue;
 	}
 
+	init_waitqueue_head(&cc->write_thread_wait);
+	spin_lock_init(&cc->write_lock);
+	cc->write_tree = RB_ROOT;
+
+	cc->write_thread = kthread_run(dmcrypt_write, cc, "dmcrypt_write");
+	if (IS_ERR(cc->write_thread)) {
+		ti->error = "Couldn't spawn write thread";
+		goto bad_write_thread;
+	}
+
+	cc->shrinker.shrink = crypt_stash_shrink;
+	cc->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&cc->shrinker);
+
 	ti->num_flush_requests = 1;
 	ti->private = cc;
 	return 0;
 
+bad_write_thread:
+	destroy_workqueue(cc->crypt_queue);
 bad_crypt_queue:
 	destroy_workqueue(cc->io_queue);
 bad_io_queue:
@@ -1128,6 +1375,8 @@ bad_device:
 bad_bs:
 	mempool_destroy(cc->page_pool);
 bad_page_pool:
+	free_percpu(cc->cpu);
+bad_cpu:
 	mempool_destroy(cc->req_pool);
 bad_req_pool:
 	mempool_destroy(cc->io_pool);
@@ -1145,12 +1394,21 @@ bad_cipher:
 static void crypt_dtr(struct dm_target *ti)
 {
 	struct crypt_config *cc = (struct crypt_config *) ti->private;
+	struct crypt_cpu *cpu_cc;
+	int cpu;
 
+	unregister_shrinker(&cc->shrinker);
 	destroy_workqueue(cc->io_queue);
 	destroy_workqueue(cc->crypt_queue);
+	kthread_stop(cc->write_thread);
 
-	if (cc->req)
-		mempool_free(cc->req, cc->req_pool);
+	crypt_drain_stash(cc);
+	for_each_possible_cpu(cpu) {
+		cpu_cc = per_cpu_ptr(cc->cpu, cpu);
+		if (cpu_cc->req)
+			mempool_free(cpu_cc->req, cc->req_pool);
+	}
+	free_percpu(cc->cpu);
 
 	bioset_free(cc->bs);
 	mempool_destroy(cc->page_pool);
@@ -1181,10 +1439,16 @@ static int crypt_map(struct dm_target *ti, struct bio *bio,
 
 	io = crypt_io_alloc(ti, bio, bio->bi_sector - ti->begin);
 
-	if (bio_data_dir(io->base_bio) == READ)
-		kcryptd_queue_io(io);
-	else
+	/*
+	 * Reads are submitted from here unless the clone needs to wait for
+	 * memory; only that case goes through kcryptd_io.
+	 */
+	if (bio_data_dir(io->base_bio) == READ) {
+		if (kcryptd_io_read(io, GFP_NOWAIT))
+			kcryptd_queue_io(io);
+	} else {
 		kcryptd_queue_crypt(io);
+	}
 
 	return DM_MAPIO_SUBMITTED;
 }
@@ -1197,7 +1461,9 @@ static int crypt_status(struct dm_target *ti, status_type_t type,
 
 	switch (type) {
 	case STATUSTYPE_INFO:
-		result[0] = '\0';
+		DMEMIT("%u %u %u", atomic_read(&cc->stash_hits),
+		       atomic_read(&cc->pool_waits),
+		       atomic_read(&cc->partial_buffers));
 		break;
 
 	case STATUSTYPE_TABLE:
@@ -1313,7 +1579,7 @@ static int crypt_iterate_devices(struct dm_target *ti,
 
 static struct target_type crypt_target = {
 	.name   = "crypt",
-	.version = {1, 7, 0},
+	.version = {1, 8, 0},
 	.module = THIS_MODULE,
 	.ctr    = crypt_ctr,
 	.dtr    = crypt_dtr,
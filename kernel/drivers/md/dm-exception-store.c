@@ -173,6 +173,7 @@ int dm_exception_store_create(struct dm_target *ti, int argc, char **argv,
 	struct dm_exception_store_type *type = NULL;
 	struct dm_exception_store *tmp_store;
 	char persistent;
+	char *slot = NULL;
 
 	if (argc < 2) {
 		ti->error = "Insufficient exception store arguments";
@@ -190,8 +191,12 @@ int dm_exception_store_create(struct dm_target *ti, int argc, char **argv,
 		type = get_type("P");
 	else if (persistent == 'N')
 		type = get_type("N");
-	else {
-		ti->error = "Persistent flag is not P or N";
+	else if (persistent == 'S') {
+		/* "S<n>": snapshot n of a shared store */
+		type = get_type("S");
+		slot = argv[0] + 1;
+	} else {
+		ti->error = "Persistent flag is not P, N or S";
 		r = -EINVAL;
 		goto bad_type;
 	}
@@ -209,7 +214,7 @@ int dm_exception_store_create(struct dm_target *ti, int argc, char **argv,
 	if (r)
 		goto bad;
 
-	r = type->ctr(tmp_store, 0, NULL);
+	r = type->ctr(tmp_store, slot ? 1 : 0, slot ? &slot : NULL);
 	if (r) {
 		ti->error = "Exception store type constructor failed";
 		goto bad;
@@ -251,16 +256,25 @@ int dm_exception_store_init(void)
 		goto persistent_fail;
 	}
 
+	r = dm_shared_snapshot_init();
+	if (r) {
+		DMERR("Unable to register shared exception store type");
+		goto shared_fail;
+	}
+
 	return 0;
 
-persistent_fail:
+shared_fail:
 	dm_persistent_snapshot_exit();
+persistent_fail:
+	dm_transient_snapshot_exit();
 transient_fail:
 	return r;
 }
 
 void dm_exception_store_exit(void)
 {
+	dm_shared_snapshot_exit();
 	dm_persistent_snapshot_exit();
 	dm_transient_snapshot_exit();
 }
@@ -38,6 +38,26 @@ struct dm_exception_store_type {
 					      chunk_t old, chunk_t new),
 			      void *callback_context);
 
+	/*
+	 * Optional, for stores that do not report every exception from
+	 * read_metadata.  Returns 1 and sets *new if old has been copied
+	 * for this snapshot, 0 if not.
+	 *
+	 * Called from map context with can_block == 0, in which case
+	 * the store returns -EWOULDBLOCK instead of waiting for I/O or
+	 * a busy lock, and the bio is retried from ksnapd.
+	 */
+	int (*lookup_exception) (struct dm_exception_store *store,
+				 chunk_t old, chunk_t *new, int can_block);
+
+	/*
+	 * Optional, for shared stores.  Returns 1 if an origin write to
+	 * old must first copy it for some snapshot in the store.
+	 * can_block is as for lookup_exception.
+	 */
+	int (*need_exception) (struct dm_exception_store *store, chunk_t old,
+			       int can_block);
+
 	/*
 	 * Find somewhere to store the next exception.
 	 */
@@ -52,6 +72,13 @@ struct dm_exception_store_type {
 				  void (*callback) (void *, int success),
 				  void *callback_context);
 
+	/*
+	 * Optional.  The copy for an exception that was prepared failed,
+	 * so it will never be committed.
+	 */
+	void (*abort_exception) (struct dm_exception_store *store,
+				 struct dm_exception *e);
+
 	/*
 	 * Returns 0 if the exception store is empty.
 	 *
@@ -74,6 +101,19 @@ struct dm_exception_store_type {
 	 */
 	void (*drop_snapshot) (struct dm_exception_store *store);
 
+	/*
+	 * Optional.  Stores holding several snapshots on one COW device
+	 * return the object they share and set *slot, if given, to this
+	 * snapshot's number within it.
+	 */
+	void *(*shared) (struct dm_exception_store *store, unsigned *slot);
+
+	/*
+	 * Optional.  Handles a message sent to the snapshot target.
+	 */
+	int (*message) (struct dm_exception_store *store,
+			unsigned argc, char **argv);
+
 	unsigned (*status) (struct dm_exception_store *store,
 			    status_type_t status, char *result,
 			    unsigned maxlen);
@@ -190,4 +230,7 @@ void dm_persistent_snapshot_exit(void);
 int dm_transient_snapshot_init(void);
 void dm_transient_snapshot_exit(void);
 
+int dm_shared_snapshot_init(void);
+void dm_shared_snapshot_exit(void);
+
 #endif /* _LINUX_DM_EXCEPTION_STORE */
@@ -13,6 +13,7 @@
 #include <linux/vmalloc.h>
 #include <linux/workqueue.h>
 #include <linux/mutex.h>
+#include <linux/mm.h>
 #include <linux/device-mapper.h>
 #include <linux/dm-kcopyd.h>
 
@@ -38,22 +39,43 @@ struct dm_kcopyd_client {
 	struct list_head complete_jobs;
 	struct list_head io_jobs;
 	struct list_head pages_jobs;
+
+	/*
+	 * Statistics, shown through the owning device's dm sysfs
+	 * directory.  The latency fields are only updated from the
+	 * kcopyd thread.
+	 */
+	struct list_head list;
+	struct mapped_device *md;
+	const char *owner;
+	sector_t owner_begin;
+
+	atomic_long_t nr_submitted;
+	atomic_long_t nr_merged;
+	atomic_long_t sectors;
+	unsigned long nr_completed;
+	unsigned long page_waits;
+	unsigned long total_latency;
+	unsigned long max_latency;
 };
 
+static LIST_HEAD(_clients);
+static DEFINE_MUTEX(_clients_lock);
+
 static void wake(struct dm_kcopyd_client *kc)
 {
 	queue_work(kc->kcopyd_wq, &kc->kcopyd_work);
 }
 
-static struct page_list *alloc_pl(void)
+static struct page_list *alloc_pl(gfp_t gfp)
 {
 	struct page_list *pl;
 
-	pl = kmalloc(sizeof(*pl), GFP_KERNEL);
+	pl = kmalloc(sizeof(*pl), gfp);
 	if (!pl)
 		return NULL;
 
-	pl->page = alloc_page(GFP_KERNEL);
+	pl->page = alloc_page(gfp);
 	if (!pl->page) {
 		kfree(pl);
 		return NULL;
@@ -68,41 +90,131 @@ static void free_pl(struct page_list *pl)
 	kfree(pl);
 }
 
-static int kcopyd_get_pages(struct dm_kcopyd_client *kc,
-			    unsigned int nr, struct page_list **pages)
+/*
+ * Each client owns a fixed set of pages that guarantees progress.  On
+ * top of that, pages are borrowed from a reserve shared by all clients
+ * or allocated without blocking; pages not needed to refill a client's
+ * own set go back to the shared reserve, which the VM can shrink.
+ */
+#define RESERVE_MAX_PAGES 2048
+
+static DEFINE_SPINLOCK(_reserve_lock);
+static struct page_list *_reserve_pages;
+static unsigned int _reserve_nr;
+
+static struct page_list *reserve_get(void)
 {
 	struct page_list *pl;
 
-	spin_lock(&kc->lock);
-	if (kc->nr_free_pages < nr) {
-		spin_unlock(&kc->lock);
-		return -ENOMEM;
+	spin_lock(&_reserve_lock);
+	pl = _reserve_pages;
+	if (pl) {
+		_reserve_pages = pl->next;
+		_reserve_nr--;
 	}
+	spin_unlock(&_reserve_lock);
 
-	kc->nr_free_pages -= nr;
-	for (*pages = pl = kc->pages; --nr; pl = pl->next)
-		;
+	if (!pl)
+		pl = alloc_pl(GFP_NOIO | __GFP_NOWARN | __GFP_NORETRY);
 
-	kc->pages = pl->next;
-	pl->next = NULL;
+	return pl;
+}
 
-	spin_unlock(&kc->lock);
+static void reserve_put(struct page_list *pl)
+{
+	struct page_list *next;
 
-	return 0;
+	spin_lock(&_reserve_lock);
+	while (pl && _reserve_nr < RESERVE_MAX_PAGES) {
+		next = pl->next;
+		pl->next = _reserve_pages;
+		_reserve_pages = pl;
+		_reserve_nr++;
+		pl = next;
+	}
+	spin_unlock(&_reserve_lock);
+
+	while (pl) {
+		next = pl->next;
+		free_pl(pl);
+		pl = next;
+	}
 }
 
+static int reserve_shrink(struct shrinker *shrink, int nr_to_scan,
+			  gfp_t gfp_mask)
+{
+	struct page_list *pl;
+
+	while (nr_to_scan--) {
+		spin_lock(&_reserve_lock);
+		pl = _reserve_pages;
+		if (pl) {
+			_reserve_pages = pl->next;
+			_reserve_nr--;
+		}
+		spin_unlock(&_reserve_lock);
+		if (!pl)
+			break;
+		free_pl(pl);
+	}
+
+	return _reserve_nr;
+}
+
+static struct shrinker reserve_shrinker = {
+	.shrink = reserve_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static void kcopyd_put_pages(struct dm_kcopyd_client *kc, struct page_list *pl)
 {
-	struct page_list *cursor;
+	struct page_list *next;
 
 	spin_lock(&kc->lock);
-	for (cursor = pl; cursor->next; cursor = cursor->next)
+	while (pl && kc->nr_free_pages < kc->nr_pages) {
+		next = pl->next;
+		pl->next = kc->pages;
+		kc->pages = pl;
 		kc->nr_free_pages++;
+		pl = next;
+	}
+	spin_unlock(&kc->lock);
+
+	if (pl)
+		reserve_put(pl);
+}
 
-	kc->nr_free_pages++;
-	cursor->next = kc->pages;
-	kc->pages = pl;
+static int kcopyd_get_pages(struct dm_kcopyd_client *kc,
+			    unsigned int nr, struct page_list **pages)
+{
+	struct page_list *pl = NULL, *next;
+
+	spin_lock(&kc->lock);
+	while (nr && kc->pages) {
+		next = kc->pages;
+		kc->pages = next->next;
+		kc->nr_free_pages--;
+		next->next = pl;
+		pl = next;
+		nr--;
+	}
 	spin_unlock(&kc->lock);
+
+	while (nr) {
+		next = reserve_get();
+		if (!next) {
+			if (pl)
+				kcopyd_put_pages(kc, pl);
+			return -ENOMEM;
+		}
+		next->next = pl;
+		pl = next;
+		nr--;
+	}
+
+	*pages = pl;
+	return 0;
 }
 
 static void drop_pages(struct page_list *pl)
@@ -122,7 +234,7 @@ static int client_alloc_pages(struct dm_kcopyd_client *kc, unsigned int nr)
 	struct page_list *pl = NULL, *next;
 
 	for (i = 0; i < nr; i++) {
-		next = alloc_pl();
+		next = alloc_pl(GFP_KERNEL);
 		if (!next) {
 			if (pl)
 				drop_pages(pl);
@@ -132,8 +244,8 @@ static int client_alloc_pages(struct dm_kcopyd_client *kc, unsigned int nr)
 		pl = next;
 	}
 
-	kcopyd_put_pages(kc, pl);
 	kc->nr_pages += nr;
+	kcopyd_put_pages(kc, pl);
 	return 0;
 }
 
@@ -186,6 +298,13 @@ struct kcopyd_job {
 	struct mutex lock;
 	atomic_t sub_jobs;
 	sector_t progress;
+
+	/*
+	 * Jobs that were coalesced into this one; they share its I/O
+	 * and are completed along with it.
+	 */
+	struct list_head merged;
+	unsigned long start;
 };
 
 /* FIXME: this should scale with the number of pages */
@@ -199,11 +318,17 @@ int __init dm_kcopyd_init(void)
 	if (!_job_cache)
 		return -ENOMEM;
 
+	register_shrinker(&reserve_shrinker);
 	return 0;
 }
 
 void dm_kcopyd_exit(void)
 {
+	unregister_shrinker(&reserve_shrinker);
+	drop_pages(_reserve_pages);
+	_reserve_pages = NULL;
+	_reserve_nr = 0;
+
 	kmem_cache_destroy(_job_cache);
 	_job_cache = NULL;
 }
@@ -246,6 +371,24 @@ static void push_head(struct list_head *jobs, struct kcopyd_job *job)
 	spin_unlock_irqrestore(&kc->job_lock, flags);
 }
 
+static void segment_complete(int read_err, unsigned long write_err,
+			     void *context);
+
+static void account_complete(struct dm_kcopyd_client *kc,
+			     struct kcopyd_job *job)
+{
+	unsigned long latency = jiffies - job->start;
+
+	/* split jobs are accounted once, through their parent */
+	if (job->fn == segment_complete)
+		return;
+
+	kc->nr_completed++;
+	kc->total_latency += latency;
+	if (latency > kc->max_latency)
+		kc->max_latency = latency;
+}
+
 static int run_complete_job(struct kcopyd_job *job)
 {
 	void *context = job->context;
@@ -253,12 +396,28 @@ static int run_complete_job(struct kcopyd_job *job)
 	unsigned long write_err = job->write_err;
 	dm_kcopyd_notify_fn fn = job->fn;
 	struct dm_kcopyd_client *kc = job->kc;
+	struct kcopyd_job *m, *tmp;
+	LIST_HEAD(merged);
+
+	list_splice_init(&job->merged, &merged);
+	account_complete(kc, job);
 
 	if (job->pages)
 		kcopyd_put_pages(kc, job->pages);
 	mempool_free(job, kc->job_pool);
 	fn(read_err, write_err, context);
 
+	list_for_each_entry_safe(m, tmp, &merged, list) {
+		list_del(&m->list);
+		account_complete(kc, m);
+		fn = m->fn;
+		context = m->context;
+		mempool_free(m, kc->job_pool);
+		fn(read_err, write_err, context);
+
+		atomic_dec(&kc->nr_jobs);
+	}
+
 	if (atomic_dec_and_test(&kc->nr_jobs))
 		wake_up(&kc->destroyq);
 
@@ -328,9 +487,11 @@ static int run_pages_job(struct kcopyd_job *job)
 		return 0;
 	}
 
-	if (r == -ENOMEM)
+	if (r == -ENOMEM) {
 		/* can't complete now */
+		job->kc->page_waits++;
 		return 1;
+	}
 
 	return r;
 }
@@ -440,6 +601,7 @@ static void segment_complete(int read_err, unsigned long write_err,
 							   GFP_NOIO);
 
 		*sub_job = *job;
+		INIT_LIST_HEAD(&sub_job->merged);
 		sub_job->source.sector += progress;
 		sub_job->source.count = count;
 
@@ -468,6 +630,71 @@ static void segment_complete(int read_err, unsigned long write_err,
 	}
 }
 
+/*
+ * Small copies of adjacent regions (as issued by snapshot COW and mirror
+ * recovery) are coalesced with the last job still waiting for pages, so
+ * that they are read and written with one I/O.
+ */
+#define MERGE_MAX_SECTORS 1024
+
+static int jobs_adjacent(struct kcopyd_job *prev, struct kcopyd_job *job)
+{
+	unsigned int i;
+
+	if (prev->fn == segment_complete || prev->flags != job->flags ||
+	    prev->num_dests != job->num_dests)
+		return 0;
+
+	if (prev->source.bdev != job->source.bdev ||
+	    prev->source.sector + prev->source.count != job->source.sector)
+		return 0;
+
+	for (i = 0; i < job->num_dests; i++)
+		if (prev->dests[i].bdev != job->dests[i].bdev ||
+		    prev->dests[i].count != prev->source.count ||
+		    job->dests[i].count != job->source.count ||
+		    prev->dests[i].sector + prev->dests[i].count !=
+		    job->dests[i].sector)
+			return 0;
+
+	return 1;
+}
+
+static int merge_job(struct kcopyd_job *job)
+{
+	struct dm_kcopyd_client *kc = job->kc;
+	struct kcopyd_job *prev;
+	unsigned long flags;
+	sector_t count;
+	unsigned int i;
+	int merged = 0;
+
+	if (!job->source.count)
+		return 0;
+
+	spin_lock_irqsave(&kc->job_lock, flags);
+	if (list_empty(&kc->pages_jobs))
+		goto out;
+
+	prev = list_entry(kc->pages_jobs.prev, struct kcopyd_job, list);
+	count = prev->source.count + job->source.count;
+	if (count > MERGE_MAX_SECTORS ||
+	    dm_div_up(count, PAGE_SIZE >> 9) > kc->nr_pages ||
+	    !jobs_adjacent(prev, job))
+		goto out;
+
+	prev->source.count = count;
+	for (i = 0; i < prev->num_dests; i++)
+		prev->dests[i].count = count;
+	list_add_tail(&job->list, &prev->merged);
+	atomic_inc(&kc->nr_jobs);
+	atomic_long_inc(&kc->nr_merged);
+	merged = 1;
+out:
+	spin_unlock_irqrestore(&kc->job_lock, flags);
+	return merged;
+}
+
 #define SPLIT_COUNT 8
 static void split_job(struct kcopyd_job *job)
 {
@@ -512,8 +739,15 @@ int dm_kcopyd_copy(struct dm_kcopyd_client *kc, struct dm_io_region *from,
 	job->fn = fn;
 	job->context = context;
 
-	if (job->source.count < SUB_JOB_SIZE)
-		dispatch_job(job);
+	INIT_LIST_HEAD(&job->merged);
+	job->start = jiffies;
+	atomic_long_inc(&kc->nr_submitted);
+	atomic_long_add(from->count, &kc->sectors);
+
+	if (job->source.count < SUB_JOB_SIZE) {
+		if (!merge_job(job))
+			dispatch_job(job);
+	}
 
 	else {
 		mutex_init(&job->lock);
@@ -573,6 +807,19 @@ int dm_kcopyd_client_create(unsigned int nr_pages,
 	init_waitqueue_head(&kc->destroyq);
 	atomic_set(&kc->nr_jobs, 0);
 
+	kc->md = NULL;
+	kc->owner = NULL;
+	kc->owner_begin = 0;
+	atomic_long_set(&kc->nr_submitted, 0);
+	atomic_long_set(&kc->nr_merged, 0);
+	atomic_long_set(&kc->sectors, 0);
+	kc->nr_completed = kc->page_waits = 0;
+	kc->total_latency = kc->max_latency = 0;
+
+	mutex_lock(&_clients_lock);
+	list_add_tail(&kc->list, &_clients);
+	mutex_unlock(&_clients_lock);
+
 	*result = kc;
 	return 0;
 
@@ -597,6 +844,11 @@ void dm_kcopyd_client_destroy(struct dm_kcopyd_client *kc)
 	BUG_ON(!list_empty(&kc->complete_jobs));
 	BUG_ON(!list_empty(&kc->io_jobs));
 	BUG_ON(!list_empty(&kc->pages_jobs));
+
+	mutex_lock(&_clients_lock);
+	list_del(&kc->list);
+	mutex_unlock(&_clients_lock);
+
 	destroy_workqueue(kc->kcopyd_wq);
 	dm_io_client_destroy(kc->io_client);
 	client_free_pages(kc);
@@ -604,3 +856,50 @@ void dm_kcopyd_client_destroy(struct dm_kcopyd_client *kc)
 	kfree(kc);
 }
 EXPORT_SYMBOL(dm_kcopyd_client_destroy);
+
+/*
+ * Associate a client with the target using it, so that its statistics
+ * appear under that device's dm sysfs directory.
+ */
+void dm_kcopyd_client_set_owner(struct dm_kcopyd_client *kc,
+				struct dm_target *ti)
+{
+	mutex_lock(&_clients_lock);
+	kc->md = dm_table_get_md(ti->table);
+	kc->owner = ti->type->name;
+	kc->owner_begin = ti->begin;
+	mutex_unlock(&_clients_lock);
+}
+EXPORT_SYMBOL(dm_kcopyd_client_set_owner);
+
+ssize_t dm_kcopyd_stats_show(struct mapped_device *md, char *buf)
+{
+	struct dm_kcopyd_client *kc;
+	ssize_t sz = 0;
+
+	mutex_lock(&_clients_lock);
+	list_for_each_entry(kc, &_clients, list) {
+		if (kc->md != md)
+			continue;
+		sz += scnprintf(buf + sz, PAGE_SIZE - sz,
+				"%s %llu: jobs %ld merged %ld sectors %ld "
+				"completed %lu avg_ms %u max_ms %u "
+				"page_waits %lu pages %u/%u\n",
+				kc->owner, (unsigned long long)kc->owner_begin,
+				atomic_long_read(&kc->nr_submitted),
+				atomic_long_read(&kc->nr_merged),
+				atomic_long_read(&kc->sectors),
+				kc->nr_completed,
+				kc->nr_completed ?
+				jiffies_to_msecs(kc->total_latency /
+						 kc->nr_completed) : 0,
+				jiffies_to_msecs(kc->max_latency),
+				kc->page_waits, kc->nr_free_pages,
+				kc->nr_pages);
+	}
+	sz += scnprintf(buf + sz, PAGE_SIZE - sz, "reserve pages %u\n",
+			_reserve_nr);
+	mutex_unlock(&_clients_lock);
+
+	return sz;
+}
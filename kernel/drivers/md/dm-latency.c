@@ -0,0 +1,379 @@
+
+
+#include "dm.h"
+#include "dm-path-selector.h"
+
+#include <linux/slab.h>
+#include <linux/ctype.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/spinlock.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+
+#define DM_MSG_PREFIX	"multipath latency"
+#define LT_MIN_IO	1
+#define LT_DECAY_DEFAULT	4	/* a new sample weighs 1/16 */
+#define LT_DECAY_MAX	10
+#define LT_SAMPLE_NS	(10 * NSEC_PER_MSEC)	/* throughput sample period */
+#define LT_PROBE_INTERVAL	HZ	/* re-measure paths left idle this long */
+#define LT_VERSION	"0.1.0"
+
+struct selector {
+	struct list_head valid_paths;
+	struct list_head failed_paths;
+	unsigned decay;
+};
+
+struct path_info {
+	struct list_head list;
+	struct dm_path *path;
+	unsigned repeat_count;
+
+	spinlock_t lock;
+	unsigned in_flight;
+	size_t in_flight_size;
+
+	u64 latency;		/* EWMA of completion latency, ns */
+	u64 throughput;		/* EWMA of bytes per ms while busy */
+	unsigned long last_done;
+
+	/* Current throughput sample */
+	u64 done_bytes;
+	u64 busy_ns;
+	ktime_t busy_start;
+};
+
+static struct selector *alloc_selector(void)
+{
+	struct selector *s = kmalloc(sizeof(*s), GFP_KERNEL);
+
+	if (s) {
+		INIT_LIST_HEAD(&s->valid_paths);
+		INIT_LIST_HEAD(&s->failed_paths);
+		s->decay = LT_DECAY_DEFAULT;
+	}
+
+	return s;
+}
+
+static int lt_create(struct path_selector *ps, unsigned argc, char **argv)
+{
+	struct selector *s;
+	unsigned decay = LT_DECAY_DEFAULT;
+
+	/*
+	 * Arguments: [<decay>]
+	 *	<decay>: Each new sample moves the averages by 1/2^decay.
+	 *		 The valid range: 1-<LT_DECAY_MAX>
+	 */
+	if (argc > 1)
+		return -EINVAL;
+
+	if (argc && (sscanf(argv[0], "%u", &decay) != 1 ||
+		     !decay || decay > LT_DECAY_MAX)) {
+		DMERR("invalid decay %s", argv[0]);
+		return -EINVAL;
+	}
+
+	s = alloc_selector();
+	if (!s)
+		return -ENOMEM;
+
+	s->decay = decay;
+	ps->context = s;
+	return 0;
+}
+
+static void lt_free_paths(struct list_head *paths)
+{
+	struct path_info *pi, *next;
+
+	list_for_each_entry_safe(pi, next, paths, list) {
+		list_del(&pi->list);
+		kfree(pi);
+	}
+}
+
+static void lt_destroy(struct path_selector *ps)
+{
+	struct selector *s = ps->context;
+
+	lt_free_paths(&s->valid_paths);
+	lt_free_paths(&s->failed_paths);
+	kfree(s);
+	ps->context = NULL;
+}
+
+static int lt_status(struct path_selector *ps, struct dm_path *path,
+		     status_type_t type, char *result, unsigned maxlen)
+{
+	struct selector *s = ps->context;
+	unsigned sz = 0;
+	struct path_info *pi;
+	unsigned long flags;
+	unsigned in_flight;
+	u64 latency, throughput;
+
+	if (!path) {
+		if (type == STATUSTYPE_TABLE)
+			DMEMIT("1 %u ", s->decay);
+		else
+			DMEMIT("0 ");
+		return sz;
+	}
+
+	pi = path->pscontext;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		spin_lock_irqsave(&pi->lock, flags);
+		in_flight = pi->in_flight;
+		latency = pi->latency;
+		throughput = pi->throughput;
+		spin_unlock_irqrestore(&pi->lock, flags);
+
+		/* <in-flight> <latency in us> <throughput in KiB/s> */
+		DMEMIT("%u %llu %llu ", in_flight,
+		       (unsigned long long)div_u64(latency, NSEC_PER_USEC),
+		       (unsigned long long)div_u64(throughput * MSEC_PER_SEC,
+						   1024));
+		break;
+	case STATUSTYPE_TABLE:
+		DMEMIT("%u ", pi->repeat_count);
+		break;
+	}
+
+	return sz;
+}
+
+static int lt_add_path(struct path_selector *ps, struct dm_path *path,
+		       int argc, char **argv, char **error)
+{
+	struct selector *s = ps->context;
+	struct path_info *pi;
+	unsigned repeat_count = LT_MIN_IO;
+
+	/*
+	 * Arguments: [<repeat_count>]
+	 *	<repeat_count>: The number of I/Os before switching path.
+	 *			If not given, default (LT_MIN_IO) is used.
+	 */
+	if (argc > 1) {
+		*error = "latency ps: incorrect number of arguments";
+		return -EINVAL;
+	}
+
+	if (argc && (sscanf(argv[0], "%u", &repeat_count) != 1)) {
+		*error = "latency ps: invalid repeat count";
+		return -EINVAL;
+	}
+
+	pi = kzalloc(sizeof(*pi), GFP_KERNEL);
+	if (!pi) {
+		*error = "latency ps: Error allocating path context";
+		return -ENOMEM;
+	}
+
+	pi->path = path;
+	pi->repeat_count = repeat_count;
+	spin_lock_init(&pi->lock);
+	pi->last_done = jiffies;
+
+	path->pscontext = pi;
+
+	list_add_tail(&pi->list, &s->valid_paths);
+
+	return 0;
+}
+
+static void lt_fail_path(struct path_selector *ps, struct dm_path *path)
+{
+	struct selector *s = ps->context;
+	struct path_info *pi = path->pscontext;
+
+	list_move(&pi->list, &s->failed_paths);
+}
+
+static int lt_reinstate_path(struct path_selector *ps, struct dm_path *path)
+{
+	struct selector *s = ps->context;
+	struct path_info *pi = path->pscontext;
+	unsigned long flags;
+
+	/* What was measured before the failure says little now */
+	spin_lock_irqsave(&pi->lock, flags);
+	pi->latency = 0;
+	pi->throughput = 0;
+	pi->done_bytes = 0;
+	pi->busy_ns = 0;
+	spin_unlock_irqrestore(&pi->lock, flags);
+
+	list_move_tail(&pi->list, &s->valid_paths);
+
+	return 0;
+}
+
+static u64 lt_ewma(u64 avg, u64 sample, unsigned decay)
+{
+	if (!avg)
+		return sample;
+
+	return avg - (avg >> decay) + (sample >> decay);
+}
+
+/*
+ * Expected time, in ns, for an I/O of 'incoming' bytes sent now to
+ * complete: the time to drain what is already queued on the path at
+ * its measured throughput, plus its measured per-I/O latency.
+ *
+ * A path without measurements, or one left idle for a while, is given
+ * an estimate of zero so that it is tried and measured again.
+ */
+static u64 lt_estimate(struct path_info *pi, size_t incoming)
+{
+	unsigned long flags;
+	unsigned in_flight;
+	size_t in_flight_size;
+	u64 latency, throughput;
+
+	spin_lock_irqsave(&pi->lock, flags);
+	in_flight = pi->in_flight;
+	in_flight_size = pi->in_flight_size;
+	latency = pi->latency;
+	throughput = pi->throughput;
+	spin_unlock_irqrestore(&pi->lock, flags);
+
+	if (!latency ||
+	    (!in_flight && time_after(jiffies, pi->last_done +
+						LT_PROBE_INTERVAL)))
+		return in_flight;
+
+	if (!throughput)
+		return latency * (in_flight + 1);
+
+	return latency + div64_u64((u64)(in_flight_size + incoming) *
+				   NSEC_PER_MSEC, throughput);
+}
+
+static struct dm_path *lt_select_path(struct path_selector *ps,
+				      unsigned *repeat_count, size_t nr_bytes)
+{
+	struct selector *s = ps->context;
+	struct path_info *pi = NULL, *best = NULL;
+	u64 est, best_est = 0;
+
+	if (list_empty(&s->valid_paths))
+		return NULL;
+
+	/* Change preferred (first in list) path to evenly balance. */
+	list_move_tail(s->valid_paths.next, &s->valid_paths);
+
+	list_for_each_entry(pi, &s->valid_paths, list) {
+		est = lt_estimate(pi, nr_bytes);
+		if (!best || est < best_est) {
+			best = pi;
+			best_est = est;
+		}
+	}
+
+	if (!best)
+		return NULL;
+
+	*repeat_count = best->repeat_count;
+
+	return best->path;
+}
+
+static int lt_start_io(struct path_selector *ps, struct dm_path *path,
+		       size_t nr_bytes)
+{
+	struct path_info *pi = path->pscontext;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pi->lock, flags);
+	if (!pi->in_flight++)
+		pi->busy_start = ktime_get();
+	pi->in_flight_size += nr_bytes;
+	spin_unlock_irqrestore(&pi->lock, flags);
+
+	return 0;
+}
+
+static int lt_end_io(struct path_selector *ps, struct dm_path *path,
+		     size_t nr_bytes, ktime_t start_time)
+{
+	struct selector *s = ps->context;
+	struct path_info *pi = path->pscontext;
+	ktime_t now = ktime_get();
+	u64 latency = ktime_to_ns(ktime_sub(now, start_time));
+	unsigned long flags;
+
+	spin_lock_irqsave(&pi->lock, flags);
+
+	pi->in_flight--;
+	pi->in_flight_size -= nr_bytes;
+	pi->latency = lt_ewma(pi->latency, latency, s->decay);
+	pi->last_done = jiffies;
+
+	/* Throughput only counts the time the path had I/O outstanding */
+	pi->done_bytes += nr_bytes;
+	pi->busy_ns += ktime_to_ns(ktime_sub(now, pi->busy_start));
+	pi->busy_start = now;
+
+	if (pi->busy_ns >= LT_SAMPLE_NS) {
+		pi->throughput = lt_ewma(pi->throughput,
+					 div64_u64(pi->done_bytes *
+						   NSEC_PER_MSEC,
+						   pi->busy_ns),
+					 s->decay);
+		pi->done_bytes = 0;
+		pi->busy_ns = 0;
+	}
+
+	spin_unlock_irqrestore(&pi->lock, flags);
+
+	return 0;
+}
+
+static struct path_selector_type lt_ps = {
+	.name		= "latency",
+	.module		= THIS_MODULE,
+	.table_args	= 1,
+	.info_args	= 3,
+	.create		= lt_create,
+	.destroy	= lt_destroy,
+	.status		= lt_status,
+	.add_path	= lt_add_path,
+	.fail_path	= lt_fail_path,
+	.reinstate_path	= lt_reinstate_path,
+	.select_path	= lt_select_path,
+	.start_io	= lt_start_io,
+	.end_io		= lt_end_io,
+};
+
+static int __init dm_lt_init(void)
+{
+	int r = dm_register_path_selector(&lt_ps);
+
+	if (r < 0)
+		DMERR("register failed %d", r);
+
+	DMINFO("version " LT_VERSION " loaded");
+
+	return r;
+}
+
+static void __exit dm_lt_exit(void)
+{
+	int r = dm_unregister_path_selector(&lt_ps);
+
+	if (r < 0)
+		DMERR("unregister failed %d", r);
+}
+
+module_init(dm_lt_init);
+module_exit(dm_lt_exit);
+
+MODULE_DESCRIPTION(DM_NAME " latency oriented path selector");
+MODULE_LICENSE("GPL");
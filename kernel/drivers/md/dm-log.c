@@ -164,6 +164,7 @@ EXPORT_SYMBOL(dm_dirty_log_destroy);
 
 #define MIRROR_DISK_VERSION 2
 #define LOG_OFFSET 2
+#define BYTE_SHIFT 3
 
 struct log_header {
 	uint32_t magic;
@@ -211,6 +212,13 @@ struct log_c {
 
 	struct dm_io_region header_location;
 	struct log_header *disk_header;
+
+	/*
+	 * Regions [dirty_lo, dirty_hi) of clean_bits have changed since
+	 * they were last written, so a flush only writes that span.
+	 */
+	unsigned dirty_lo;
+	unsigned dirty_hi;
 };
 
 static inline int log_test_bit(uint32_t *bs, unsigned bit)
@@ -218,11 +226,23 @@ static inline int log_test_bit(uint32_t *bs, unsigned bit)
 	return ext2_test_bit(bit, (unsigned long *) bs) ? 1 : 0;
 }
 
+static inline void log_touch_bit(struct log_c *l, uint32_t *bs, unsigned bit)
+{
+	if (bs != l->clean_bits)
+		return;
+
+	if (bit < l->dirty_lo)
+		l->dirty_lo = bit;
+	if (bit >= l->dirty_hi)
+		l->dirty_hi = bit + 1;
+}
+
 static inline void log_set_bit(struct log_c *l,
 			       uint32_t *bs, unsigned bit)
 {
 	ext2_set_bit(bit, (unsigned long *) bs);
 	l->touched_cleaned = 1;
+	log_touch_bit(l, bs, bit);
 }
 
 static inline void log_clear_bit(struct log_c *l,
@@ -230,6 +250,13 @@ static inline void log_clear_bit(struct log_c *l,
 {
 	ext2_clear_bit(bit, (unsigned long *) bs);
 	l->touched_dirtied = 1;
+	log_touch_bit(l, bs, bit);
+}
+
+static void reset_dirty_range(struct log_c *lc)
+{
+	lc->dirty_lo = UINT_MAX;
+	lc->dirty_hi = 0;
 }
 
 static void header_to_disk(struct log_header *core, struct log_header *disk)
@@ -253,6 +280,45 @@ static int rw_header(struct log_c *lc, int rw)
 	return dm_io(&lc->io_req, 1, &lc->header_location, NULL);
 }
 
+/*
+ * Write back the part of the bitset that changed since the last flush,
+ * rounded out to whole logical blocks.  However many regions were marked
+ * or cleared since then, this is a single write.
+ */
+static int write_dirty_bits(struct log_c *lc)
+{
+	struct dm_io_region where = {
+		.bdev = lc->header_location.bdev,
+	};
+	size_t block = bdev_logical_block_size(where.bdev);
+	size_t start, end;
+	int r;
+
+	if (lc->dirty_lo >= lc->dirty_hi)
+		return 0;
+
+	start = (LOG_OFFSET << SECTOR_SHIFT) + (lc->dirty_lo >> BYTE_SHIFT);
+	end = (LOG_OFFSET << SECTOR_SHIFT) +
+	      dm_div_up(lc->dirty_hi, 1 << BYTE_SHIFT);
+
+	start &= ~(block - 1);
+	end = min_t(size_t, dm_round_up(end, block),
+		    lc->header_location.count << SECTOR_SHIFT);
+
+	where.sector = start >> SECTOR_SHIFT;
+	where.count = (end - start) >> SECTOR_SHIFT;
+
+	lc->io_req.bi_rw = WRITE;
+	lc->io_req.mem.ptr.vma = (char *)lc->disk_header + start;
+	r = dm_io(&lc->io_req, 1, &where, NULL);
+	lc->io_req.mem.ptr.vma = lc->disk_header;
+
+	if (!r)
+		reset_dirty_range(lc);
+
+	return r;
+}
+
 static int flush_header(struct log_c *lc)
 {
 	struct dm_io_region null_location = {
@@ -307,7 +373,6 @@ static int _check_region_size(struct dm_target *ti, uint32_t region_size)
 	return 1;
 }
 
-#define BYTE_SHIFT 3
 static int create_log_context(struct dm_dirty_log *log, struct dm_target *ti,
 			      unsigned int argc, char **argv,
 			      struct dm_dev *dev)
@@ -358,6 +423,7 @@ static int create_log_context(struct dm_dirty_log *log, struct dm_target *ti,
 	lc->region_size = region_size;
 	lc->region_count = region_count;
 	lc->sync = sync;
+	reset_dirty_range(lc);
 
 	/*
 	 * Work out how many "unsigned long"s we need to hold the bitset.
@@ -586,6 +652,7 @@ static int disk_resume(struct dm_dirty_log *log)
 	/* write the new header */
 	r = rw_header(lc, WRITE);
 	if (!r) {
+		reset_dirty_range(lc);
 		r = flush_header(lc);
 		if (r)
 			lc->log_dev_flush_failed = 1;
@@ -652,7 +719,7 @@ static int disk_flush(struct dm_dirty_log *log)
 			log_clear_bit(lc, lc->clean_bits, i);
 	}
 
-	r = rw_header(lc, WRITE);
+	r = write_dirty_bits(lc);
 	if (r)
 		fail_log_device(lc);
 	else {
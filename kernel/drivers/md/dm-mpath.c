@@ -92,6 +92,7 @@ struct multipath {
 struct dm_mpath_io {
 	struct pgpath *pgpath;
 	size_t nr_bytes;
+	ktime_t start_time;
 };
 
 typedef int (*action_fn) (struct pgpath *pgpath);
@@ -352,6 +353,7 @@ static int map_io(struct multipath *m, struct request *clone,
 
 	mpio->pgpath = pgpath;
 	mpio->nr_bytes = nr_bytes;
+	mpio->start_time = ktime_get();
 
 	if (r == DM_MAPIO_REMAPPED && pgpath->pg->ps.type->start_io)
 		pgpath->pg->ps.type->start_io(&pgpath->pg->ps, &pgpath->path,
@@ -1218,7 +1220,8 @@ static int multipath_end_io(struct dm_target *ti, struct request *clone,
 	if (pgpath) {
 		ps = &pgpath->pg->ps;
 		if (ps->type->end_io)
-			ps->type->end_io(ps, &pgpath->path, mpio->nr_bytes);
+			ps->type->end_io(ps, &pgpath->path, mpio->nr_bytes,
+					 mpio->start_time);
 	}
 	mempool_free(mpio, m->mpio_pool);
 
@@ -1,6 +1,7 @@
 
 
 #include "dm-bio-record.h"
+#include "dm.h"
 
 #include <linux/init.h>
 #include <linux/mempool.h>
@@ -1036,6 +1037,7 @@ static int mirror_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	r = dm_kcopyd_client_create(DM_KCOPYD_PAGES, &ms->kcopyd_client);
 	if (r)
 		goto err_destroy_wq;
+	dm_kcopyd_client_set_owner(ms->kcopyd_client, ti);
 
 	wakeup_mirrord(ms);
 	return 0;
@@ -6,6 +6,7 @@
 #include <linux/ctype.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/rculist.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 
@@ -20,14 +21,17 @@ struct dm_region_hash {
 	/* holds persistent region state */
 	struct dm_dirty_log *log;
 
-	/* hash table */
-	rwlock_t hash_lock;
+	/*
+	 * hash table: lookups are RCU protected, hash_lock serialises
+	 * insertion and removal.
+	 */
+	spinlock_t hash_lock;
 	mempool_t *region_pool;
 	unsigned mask;
 	unsigned nr_buckets;
 	unsigned prime;
 	unsigned shift;
-	struct list_head *buckets;
+	struct hlist_head *buckets;
 
 	unsigned max_recovery; /* Max # of regions to recover in parallel */
 
@@ -62,11 +66,13 @@ struct dm_region {
 	region_t key;
 	int state;
 
-	struct list_head hash_list;
+	struct hlist_node hash_list;
 	struct list_head list;
 
 	atomic_t pending;
 	struct bio_list delayed_bios;
+
+	struct rcu_head rcu;
 };
 
 static region_t dm_rh_sector_to_region(struct dm_region_hash *rh, sector_t sector)
@@ -145,7 +151,7 @@ struct dm_region_hash *dm_region_hash_create(
 	rh->log = log;
 	rh->region_size = region_size;
 	rh->region_shift = ffs(region_size) - 1;
-	rwlock_init(&rh->hash_lock);
+	spin_lock_init(&rh->hash_lock);
 	rh->mask = nr_buckets - 1;
 	rh->nr_buckets = nr_buckets;
 
@@ -160,7 +166,7 @@ struct dm_region_hash *dm_region_hash_create(
 	}
 
 	for (i = 0; i < nr_buckets; i++)
-		INIT_LIST_HEAD(rh->buckets + i);
+		INIT_HLIST_HEAD(rh->buckets + i);
 
 	spin_lock_init(&rh->region_lock);
 	sema_init(&rh->recovery_count, 0);
@@ -186,17 +192,21 @@ EXPORT_SYMBOL_GPL(dm_region_hash_create);
 void dm_region_hash_destroy(struct dm_region_hash *rh)
 {
 	unsigned h;
-	struct dm_region *reg, *nreg;
+	struct dm_region *reg;
+	struct hlist_node *pos, *n;
 
 	BUG_ON(!list_empty(&rh->quiesced_regions));
 	for (h = 0; h < rh->nr_buckets; h++) {
-		list_for_each_entry_safe(reg, nreg, rh->buckets + h,
-					 hash_list) {
+		hlist_for_each_entry_safe(reg, pos, n, rh->buckets + h,
+					  hash_list) {
 			BUG_ON(atomic_read(&reg->pending));
 			mempool_free(reg, rh->region_pool);
 		}
 	}
 
+	/* Regions dropped by dm_rh_update_states() */
+	rcu_barrier();
+
 	if (rh->log)
 		dm_dirty_log_destroy(rh->log);
 
@@ -219,12 +229,16 @@ static unsigned rh_hash(struct dm_region_hash *rh, region_t region)
 	return (unsigned) ((region * rh->prime) >> rh->shift) & rh->mask;
 }
 
+/*
+ * Must be called under rcu_read_lock() or with hash_lock held.
+ */
 static struct dm_region *__rh_lookup(struct dm_region_hash *rh, region_t region)
 {
 	struct dm_region *reg;
-	struct list_head *bucket = rh->buckets + rh_hash(rh, region);
+	struct hlist_node *pos;
+	struct hlist_head *bucket = rh->buckets + rh_hash(rh, region);
 
-	list_for_each_entry(reg, bucket, hash_list)
+	hlist_for_each_entry_rcu(reg, pos, bucket, hash_list)
 		if (reg->key == region)
 			return reg;
 
@@ -233,10 +247,17 @@ static struct dm_region *__rh_lookup(struct dm_region_hash *rh, region_t region)
 
 static void __rh_insert(struct dm_region_hash *rh, struct dm_region *reg)
 {
-	list_add(&reg->hash_list, rh->buckets + rh_hash(rh, reg->key));
+	hlist_add_head_rcu(&reg->hash_list, rh->buckets + rh_hash(rh, reg->key));
 }
 
-static struct dm_region *__rh_alloc(struct dm_region_hash *rh, region_t region)
+static void rh_free_region(struct rcu_head *rcu)
+{
+	struct dm_region *reg = container_of(rcu, struct dm_region, rcu);
+
+	mempool_free(reg, reg->rh->region_pool);
+}
+
+static void __rh_alloc(struct dm_region_hash *rh, region_t region)
 {
 	struct dm_region *reg, *nreg;
 
@@ -252,7 +273,7 @@ static struct dm_region *__rh_alloc(struct dm_region_hash *rh, region_t region)
 	atomic_set(&nreg->pending, 0);
 	bio_list_init(&nreg->delayed_bios);
 
-	write_lock_irq(&rh->hash_lock);
+	spin_lock_irq(&rh->hash_lock);
 	reg = __rh_lookup(rh, region);
 	if (reg)
 		/* We lost the race. */
@@ -264,24 +285,46 @@ static struct dm_region *__rh_alloc(struct dm_region_hash *rh, region_t region)
 			list_add(&nreg->list, &rh->clean_regions);
 			spin_unlock(&rh->region_lock);
 		}
+	}
+	spin_unlock_irq(&rh->hash_lock);
+}
+
+/*
+ * Must be called under rcu_read_lock(), which is dropped while a
+ * missing region is allocated.
+ */
+static struct dm_region *__rh_find(struct dm_region_hash *rh, region_t region)
+{
+	struct dm_region *reg;
 
-		reg = nreg;
+	while (!(reg = __rh_lookup(rh, region))) {
+		rcu_read_unlock();
+		__rh_alloc(rh, region);
+		rcu_read_lock();
 	}
-	write_unlock_irq(&rh->hash_lock);
 
 	return reg;
 }
 
-static struct dm_region *__rh_find(struct dm_region_hash *rh, region_t region)
+/*
+ * Find or allocate the region and return with region_lock held.
+ * dm_rh_update_states() unhashes regions under region_lock, so once
+ * it is held a region that is still hashed cannot go away.
+ */
+static struct dm_region *rh_find_locked(struct dm_region_hash *rh,
+					region_t region, unsigned long *flags)
 {
 	struct dm_region *reg;
 
-	reg = __rh_lookup(rh, region);
-	if (!reg) {
-		read_unlock(&rh->hash_lock);
-		reg = __rh_alloc(rh, region);
-		read_lock(&rh->hash_lock);
+	rcu_read_lock();
+	for (;;) {
+		reg = __rh_find(rh, region);
+		spin_lock_irqsave(&rh->region_lock, *flags);
+		if (!hlist_unhashed(&reg->hash_list))
+			break;
+		spin_unlock_irqrestore(&rh->region_lock, *flags);
 	}
+	rcu_read_unlock();
 
 	return reg;
 }
@@ -291,12 +334,13 @@ int dm_rh_get_state(struct dm_region_hash *rh, region_t region, int may_block)
 	int r;
 	struct dm_region *reg;
 
-	read_lock(&rh->hash_lock);
+	rcu_read_lock();
 	reg = __rh_lookup(rh, region);
-	read_unlock(&rh->hash_lock);
+	r = reg ? reg->state : -1;
+	rcu_read_unlock();
 
-	if (reg)
-		return reg->state;
+	if (r >= 0)
+		return r;
 
 	/*
 	 * The region wasn't in the hash, so we fall back to the
@@ -349,15 +393,8 @@ void dm_rh_mark_nosync(struct dm_region_hash *rh, struct bio *bio)
 	/* We must inform the log that the sync count has changed. */
 	log->type->set_region_sync(log, region, 0);
 
-	read_lock(&rh->hash_lock);
-	reg = __rh_find(rh, region);
-	read_unlock(&rh->hash_lock);
+	reg = rh_find_locked(rh, region, &flags);
 
-	/* region hash entry should exist because write was in-flight */
-	BUG_ON(!reg);
-	BUG_ON(!list_empty(&reg->list));
-
-	spin_lock_irqsave(&rh->region_lock, flags);
 	/*
 	 * Possible cases:
 	 *   1) DM_RH_DIRTY
@@ -386,20 +423,20 @@ void dm_rh_update_states(struct dm_region_hash *rh, int errors_handled)
 	/*
 	 * Quickly grab the lists.
 	 */
-	write_lock_irq(&rh->hash_lock);
+	spin_lock_irq(&rh->hash_lock);
 	spin_lock(&rh->region_lock);
 	if (!list_empty(&rh->clean_regions)) {
 		list_splice_init(&rh->clean_regions, &clean);
 
 		list_for_each_entry(reg, &clean, list)
-			list_del(&reg->hash_list);
+			hlist_del_init_rcu(&reg->hash_list);
 	}
 
 	if (!list_empty(&rh->recovered_regions)) {
 		list_splice_init(&rh->recovered_regions, &recovered);
 
 		list_for_each_entry(reg, &recovered, list)
-			list_del(&reg->hash_list);
+			hlist_del_init_rcu(&reg->hash_list);
 	}
 
 	if (!list_empty(&rh->failed_recovered_regions)) {
@@ -407,68 +444,86 @@ void dm_rh_update_states(struct dm_region_hash *rh, int errors_handled)
 				 &failed_recovered);
 
 		list_for_each_entry(reg, &failed_recovered, list)
-			list_del(&reg->hash_list);
+			hlist_del_init_rcu(&reg->hash_list);
 	}
 
 	spin_unlock(&rh->region_lock);
-	write_unlock_irq(&rh->hash_lock);
+	spin_unlock_irq(&rh->hash_lock);
 
 	/*
 	 * All the regions on the recovered and clean lists have
 	 * now been pulled out of the system, so no need to do
-	 * any more locking.
+	 * any more locking.  Lockless lookups may still see them
+	 * until a grace period has passed.
 	 */
 	list_for_each_entry_safe(reg, next, &recovered, list) {
 		rh->log->type->clear_region(rh->log, reg->key);
 		complete_resync_work(reg, 1);
-		mempool_free(reg, rh->region_pool);
+		call_rcu(&reg->rcu, rh_free_region);
 	}
 
 	list_for_each_entry_safe(reg, next, &failed_recovered, list) {
 		complete_resync_work(reg, errors_handled ? 0 : 1);
-		mempool_free(reg, rh->region_pool);
+		call_rcu(&reg->rcu, rh_free_region);
 	}
 
 	list_for_each_entry_safe(reg, next, &clean, list) {
 		rh->log->type->clear_region(rh->log, reg->key);
-		mempool_free(reg, rh->region_pool);
+		call_rcu(&reg->rcu, rh_free_region);
 	}
 
 	rh->log->type->flush(rh->log);
 }
 EXPORT_SYMBOL_GPL(dm_rh_update_states);
 
-static void rh_inc(struct dm_region_hash *rh, region_t region)
+static struct dm_region *rh_inc(struct dm_region_hash *rh, region_t region)
 {
 	struct dm_region *reg;
+	unsigned long flags;
 
-	read_lock(&rh->hash_lock);
-	reg = __rh_find(rh, region);
+	/*
+	 * A region with writes in flight is already dirty and cannot
+	 * be freed, so only its count needs to change.
+	 */
+	rcu_read_lock();
+	reg = __rh_lookup(rh, region);
+	if (reg && atomic_inc_not_zero(&reg->pending)) {
+		rcu_read_unlock();
+		return reg;
+	}
+	rcu_read_unlock();
 
-	spin_lock_irq(&rh->region_lock);
+	reg = rh_find_locked(rh, region, &flags);
 	atomic_inc(&reg->pending);
 
 	if (reg->state == DM_RH_CLEAN) {
 		reg->state = DM_RH_DIRTY;
 		list_del_init(&reg->list);	/* take off the clean list */
-		spin_unlock_irq(&rh->region_lock);
+		spin_unlock_irqrestore(&rh->region_lock, flags);
 
 		rh->log->type->mark_region(rh->log, reg->key);
 	} else
-		spin_unlock_irq(&rh->region_lock);
+		spin_unlock_irqrestore(&rh->region_lock, flags);
 
-
-	read_unlock(&rh->hash_lock);
+	return reg;
 }
 
 void dm_rh_inc_pending(struct dm_region_hash *rh, struct bio_list *bios)
 {
 	struct bio *bio;
+	struct dm_region *reg = NULL;
+	region_t region;
 
 	for (bio = bios->head; bio; bio = bio->bi_next) {
 		if (bio_empty_barrier(bio))
 			continue;
-		rh_inc(rh, dm_rh_bio_to_region(rh, bio));
+
+		/* Consecutive bios usually hit the region we hold already */
+		region = dm_rh_bio_to_region(rh, bio);
+		if (reg && reg->key == region)
+			atomic_inc(&reg->pending);
+		else
+			reg = rh_inc(rh, region);
 	}
 }
 EXPORT_SYMBOL_GPL(dm_rh_inc_pending);
@@ -479,9 +534,10 @@ void dm_rh_dec(struct dm_region_hash *rh, region_t region)
 	struct dm_region *reg;
 	int should_wake = 0;
 
-	read_lock(&rh->hash_lock);
+	/* Our pending count keeps the region hashed */
+	rcu_read_lock();
 	reg = __rh_lookup(rh, region);
-	read_unlock(&rh->hash_lock);
+	rcu_read_unlock();
 
 	spin_lock_irqsave(&rh->region_lock, flags);
 	if (atomic_dec_and_test(&reg->pending)) {
@@ -524,6 +580,7 @@ static int __rh_recovery_prepare(struct dm_region_hash *rh)
 	int r;
 	region_t region;
 	struct dm_region *reg;
+	unsigned long flags;
 
 	/*
 	 * Ask the dirty log what's next.
@@ -536,11 +593,7 @@ static int __rh_recovery_prepare(struct dm_region_hash *rh)
 	 * Get this region, and start it quiescing by setting the
 	 * recovering flag.
 	 */
-	read_lock(&rh->hash_lock);
-	reg = __rh_find(rh, region);
-	read_unlock(&rh->hash_lock);
-
-	spin_lock_irq(&rh->region_lock);
+	reg = rh_find_locked(rh, region, &flags);
 	reg->state = DM_RH_RECOVERING;
 
 	/* Already quiesced ? */
@@ -549,7 +602,7 @@ static int __rh_recovery_prepare(struct dm_region_hash *rh)
 	else
 		list_move(&reg->list, &rh->quiesced_regions);
 
-	spin_unlock_irq(&rh->region_lock);
+	spin_unlock_irqrestore(&rh->region_lock, flags);
 
 	return 1;
 }
@@ -622,11 +675,11 @@ EXPORT_SYMBOL_GPL(dm_rh_flush);
 void dm_rh_delay(struct dm_region_hash *rh, struct bio *bio)
 {
 	struct dm_region *reg;
+	unsigned long flags;
 
-	read_lock(&rh->hash_lock);
-	reg = __rh_find(rh, dm_rh_bio_to_region(rh, bio));
+	reg = rh_find_locked(rh, dm_rh_bio_to_region(rh, bio), &flags);
 	bio_list_add(&reg->delayed_bios, bio);
-	read_unlock(&rh->hash_lock);
+	spin_unlock_irqrestore(&rh->region_lock, flags);
 }
 EXPORT_SYMBOL_GPL(dm_rh_delay);
 
@@ -0,0 +1,1559 @@
+
+
+#include "dm-exception-store.h"
+
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/dm-io.h>
+
+#define DM_MSG_PREFIX "shared snapshot"
+
+/*
+ * A shared exception store keeps up to SHARED_MAX_SLOTS snapshots of one
+ * origin on a single COW device.  A chunk copied on an origin write is
+ * recorded once, tagged with the set of snapshots that need it, so the
+ * cost of an origin write does not grow with the number of snapshots.
+ *
+ * The mapping lives in an on-disk B+tree keyed by (old_chunk, new_chunk)
+ * whose nodes are read as lookups reach them, so activation does not
+ * depend on how much the snapshots hold.
+ *
+ * Layout, in chunks: 0 is the header; everything else is handed out in
+ * order from next_free to both tree nodes and copied data.
+ *
+ * "S <chunk_size>" allocates the first free slot for a new snapshot and
+ * "S<n> <chunk_size>" activates snapshot n.  The message "delete <n>",
+ * sent to any snapshot of the store, frees an inactive slot once its
+ * bit has been cleared from every copy.  Chunks that only the deleted
+ * snapshot used are not reused.
+ */
+#define SHARED_MAGIC 0x68536e53
+#define SHARED_DISK_VERSION 1
+
+#define SHARED_MAX_SLOTS 64
+#define SHARED_MAX_DEPTH 8
+
+/*
+ * next_free is only written to the header once every SHARED_ALLOC_BATCH
+ * allocations; a crash costs at most that many chunks.
+ */
+#define SHARED_ALLOC_BATCH 64
+
+#define SHARED_NODE_MAGIC 0x65646f4e
+#define SHARED_NODE_HASH_SIZE 64
+#define SHARED_NODE_CACHE_BYTES (4 << 20)
+#define SHARED_NODE_CACHE_MIN 16
+
+/*
+ * Committed exceptions are acknowledged once the nodes they dirtied are
+ * on disk: when no other copy is in flight, or after this many.
+ */
+#define SHARED_COMMIT_BATCH 32
+
+struct disk_header {
+	__le32 magic;
+	__le32 valid;
+	__le32 version;
+
+	/* In sectors */
+	__le32 chunk_size;
+
+	__le64 root;
+	__le32 depth;
+	__le32 nr_nodes;
+	__le64 next_free;
+
+	/* Allocated snapshots */
+	__le64 slots;
+
+	/* Deleted snapshots whose bits may still be set in the tree */
+	__le64 deleting;
+};
+
+/*
+ * In a leaf, value is the mask of snapshots using new_chunk.
+ * In an internal node it is the child, and (old_chunk, new_chunk)
+ * the lowest key below it; the first key of a node is ignored.
+ */
+struct disk_entry {
+	__le64 old_chunk;
+	__le64 new_chunk;
+	__le64 value;
+};
+
+struct disk_node {
+	__le32 magic;
+	__le32 level;
+	__le32 nr;
+	__le32 pad;
+
+	/* Next leaf, 0 at the end */
+	__le64 next;
+
+	struct disk_entry entries[0];
+};
+
+struct shared_node {
+	struct list_head hash_list;
+	struct list_head lru;
+	struct list_head dirty_list;
+	chunk_t chunk;
+	struct disk_node *data;
+	int dirty;
+	int is_new;
+};
+
+struct commit_callback {
+	void (*callback)(void *, int);
+	void *context;
+};
+
+struct shared_cow {
+	struct list_head list;
+	struct block_device *bdev;
+	unsigned count;
+
+	struct mutex lock;
+	int loaded;
+	int valid;
+
+	unsigned chunk_size;
+	unsigned entries_per_node;
+
+	chunk_t root;
+	unsigned depth;
+	/* What the header on disk says, until the nodes are written */
+	chunk_t disk_root;
+	unsigned disk_depth;
+	unsigned nr_nodes;
+	chunk_t next_free;
+	chunk_t alloc_limit;
+	uint64_t slots;
+	uint64_t deleting;
+
+	/* Slots held by a loaded snapshot */
+	uint64_t active;
+	struct mutex delete_lock;
+
+	void *header_area;
+	struct dm_io_client *io_client;
+	struct workqueue_struct *metadata_wq;
+
+	struct list_head node_hash[SHARED_NODE_HASH_SIZE];
+	struct list_head node_lru;
+	unsigned nr_cached;
+	unsigned max_cached;
+
+	/* The commit batch */
+	struct list_head dirty;
+	int split_internal;
+	unsigned pending;
+	unsigned nr_callbacks;
+	struct commit_callback callbacks[SHARED_COMMIT_BATCH];
+};
+
+struct shared_snap {
+	struct shared_cow *sc;
+	unsigned slot;
+	int active;
+};
+
+static LIST_HEAD(_shared_cows);
+static DEFINE_MUTEX(_shared_cows_lock);
+
+static struct shared_snap *get_info(struct dm_exception_store *store)
+{
+	return (struct shared_snap *) store->context;
+}
+
+static unsigned sectors_to_pages(unsigned sectors)
+{
+	return DIV_ROUND_UP(sectors, PAGE_SIZE >> 9);
+}
+
+static size_t chunk_bytes(struct shared_cow *sc)
+{
+	return (size_t)sc->chunk_size << SECTOR_SHIFT;
+}
+
+struct mdata_req {
+	struct dm_io_region *where;
+	struct dm_io_request *io_req;
+	struct work_struct work;
+	int result;
+};
+
+static void do_metadata(struct work_struct *work)
+{
+	struct mdata_req *req = container_of(work, struct mdata_req, work);
+
+	req->result = dm_io(req->io_req, 1, req->where, NULL);
+}
+
+/*
+ * Chunk allocation can still write the header from an origin write's map
+ * function, so all metadata I/O is issued from a different thread to
+ * avoid generic_make_request recursion.
+ */
+static int chunk_io(struct shared_cow *sc, void *area, chunk_t chunk, int rw)
+{
+	struct dm_io_region where = {
+		.bdev = sc->bdev,
+		.sector = (sector_t)sc->chunk_size * chunk,
+		.count = sc->chunk_size,
+	};
+	struct dm_io_request io_req = {
+		.bi_rw = rw,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.vma = area,
+		.client = sc->io_client,
+		.notify.fn = NULL,
+	};
+	struct mdata_req req;
+
+	req.where = &where;
+	req.io_req = &io_req;
+
+	INIT_WORK_ON_STACK(&req.work, do_metadata);
+	queue_work(sc->metadata_wq, &req.work);
+	flush_workqueue(sc->metadata_wq);
+
+	return req.result;
+}
+
+/*-----------------------------------------------------------------
+ * Header
+ *---------------------------------------------------------------*/
+static int write_header(struct shared_cow *sc)
+{
+	struct disk_header *dh = sc->header_area;
+
+	memset(sc->header_area, 0, chunk_bytes(sc));
+
+	dh->magic = cpu_to_le32(SHARED_MAGIC);
+	dh->valid = cpu_to_le32(sc->valid);
+	dh->version = cpu_to_le32(SHARED_DISK_VERSION);
+	dh->chunk_size = cpu_to_le32(sc->chunk_size);
+	dh->root = cpu_to_le64(sc->disk_root);
+	dh->depth = cpu_to_le32(sc->disk_depth);
+	dh->nr_nodes = cpu_to_le32(sc->nr_nodes);
+	dh->next_free = cpu_to_le64(sc->alloc_limit);
+	dh->slots = cpu_to_le64(sc->slots);
+	dh->deleting = cpu_to_le64(sc->deleting);
+
+	return chunk_io(sc, sc->header_area, 0, WRITE_BARRIER);
+}
+
+static void free_buffers(struct shared_cow *sc)
+{
+	if (sc->header_area)
+		vfree(sc->header_area);
+	sc->header_area = NULL;
+
+	if (sc->io_client)
+		dm_io_client_destroy(sc->io_client);
+	sc->io_client = NULL;
+}
+
+static int alloc_buffers(struct shared_cow *sc)
+{
+	sc->io_client = dm_io_client_create(sectors_to_pages(sc->chunk_size));
+	if (IS_ERR(sc->io_client)) {
+		int r = PTR_ERR(sc->io_client);
+
+		sc->io_client = NULL;
+		return r;
+	}
+
+	sc->header_area = vmalloc(chunk_bytes(sc));
+	if (!sc->header_area) {
+		free_buffers(sc);
+		return -ENOMEM;
+	}
+
+	sc->entries_per_node = (chunk_bytes(sc) - sizeof(struct disk_node)) /
+			       sizeof(struct disk_entry);
+	sc->max_cached = max_t(unsigned, SHARED_NODE_CACHE_MIN,
+			       SHARED_NODE_CACHE_BYTES / chunk_bytes(sc));
+
+	return 0;
+}
+
+static int read_header(struct shared_cow *sc, struct dm_exception_store *store)
+{
+	struct disk_header *dh;
+	unsigned chunk_size;
+	char *chunk_err;
+	int r;
+
+	sc->chunk_size = store->chunk_size;
+	r = alloc_buffers(sc);
+	if (r)
+		return r;
+
+	r = chunk_io(sc, sc->header_area, 0, READ);
+	if (r)
+		return r;
+
+	dh = sc->header_area;
+
+	if (le32_to_cpu(dh->magic) == 0) {
+		sc->valid = 1;
+		sc->root = sc->disk_root = 0;
+		sc->depth = sc->disk_depth = 0;
+		sc->nr_nodes = 0;
+		sc->next_free = sc->alloc_limit = 1;
+		sc->slots = 0;
+		sc->deleting = 0;
+		return write_header(sc);
+	}
+
+	if (le32_to_cpu(dh->magic) != SHARED_MAGIC) {
+		DMWARN("Invalid or corrupt shared snapshot store");
+		return -ENXIO;
+	}
+
+	if (le32_to_cpu(dh->version) != SHARED_DISK_VERSION) {
+		DMWARN("unable to handle shared snapshot disk version %d",
+		       le32_to_cpu(dh->version));
+		return -EINVAL;
+	}
+
+	sc->valid = le32_to_cpu(dh->valid);
+	sc->root = sc->disk_root = le64_to_cpu(dh->root);
+	sc->depth = sc->disk_depth = le32_to_cpu(dh->depth);
+	sc->nr_nodes = le32_to_cpu(dh->nr_nodes);
+	sc->next_free = sc->alloc_limit = le64_to_cpu(dh->next_free);
+	sc->slots = le64_to_cpu(dh->slots);
+	sc->deleting = le64_to_cpu(dh->deleting);
+	chunk_size = le32_to_cpu(dh->chunk_size);
+
+	if (sc->depth > SHARED_MAX_DEPTH) {
+		DMWARN("shared snapshot store tree too deep");
+		return -EINVAL;
+	}
+
+	if (chunk_size == sc->chunk_size)
+		return 0;
+
+	DMWARN("chunk size %u in device metadata overrides "
+	       "table chunk size of %u.", chunk_size, sc->chunk_size);
+
+	r = dm_exception_store_set_chunk_size(store, chunk_size, &chunk_err);
+	if (r) {
+		DMERR("invalid on-disk chunk size %u: %s.",
+		      chunk_size, chunk_err);
+		return r;
+	}
+
+	free_buffers(sc);
+	sc->chunk_size = chunk_size;
+
+	return alloc_buffers(sc);
+}
+
+/*-----------------------------------------------------------------
+ * Chunk allocation
+ *---------------------------------------------------------------*/
+static int alloc_chunk(struct shared_cow *sc, chunk_t *chunk)
+{
+	sector_t size = get_dev_size(sc->bdev);
+	int r;
+
+	if (size < (sc->next_free + 1) * sc->chunk_size)
+		return -ENOSPC;
+
+	if (sc->next_free >= sc->alloc_limit) {
+		sc->alloc_limit = sc->next_free + SHARED_ALLOC_BATCH;
+		r = write_header(sc);
+		if (r)
+			return r;
+	}
+
+	*chunk = sc->next_free++;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------
+ * Node cache
+ *
+ * Nodes are only evicted between operations, so pointers taken while
+ * sc->lock is held stay valid until it is dropped, and never while they
+ * are dirty.  Lookups made from
+ * map context pass can_block == 0 and get -EWOULDBLOCK rather than
+ * wait for a node to be read.
+ *---------------------------------------------------------------*/
+static struct list_head *node_bucket(struct shared_cow *sc, chunk_t chunk)
+{
+	return &sc->node_hash[(unsigned long)chunk & (SHARED_NODE_HASH_SIZE - 1)];
+}
+
+static void free_node(struct shared_node *n)
+{
+	list_del(&n->hash_list);
+	list_del(&n->lru);
+	vfree(n->data);
+	kfree(n);
+}
+
+static void shrink_node_cache(struct shared_cow *sc)
+{
+	struct shared_node *n, *tmp;
+
+	list_for_each_entry_safe_reverse(n, tmp, &sc->node_lru, lru) {
+		if (sc->nr_cached <= sc->max_cached)
+			break;
+		if (n->dirty)
+			continue;
+		free_node(n);
+		sc->nr_cached--;
+	}
+}
+
+static void drop_node_cache(struct shared_cow *sc)
+{
+	struct shared_node *n, *tmp;
+
+	list_for_each_entry_safe(n, tmp, &sc->node_lru, lru)
+		free_node(n);
+	sc->nr_cached = 0;
+}
+
+static struct shared_node *cache_node(struct shared_cow *sc, chunk_t chunk)
+{
+	struct shared_node *n;
+
+	n = kmalloc(sizeof(*n), GFP_NOIO);
+	if (!n)
+		return NULL;
+
+	n->data = __vmalloc(chunk_bytes(sc), GFP_NOIO | __GFP_HIGHMEM,
+			    PAGE_KERNEL);
+	if (!n->data) {
+		kfree(n);
+		return NULL;
+	}
+
+	n->chunk = chunk;
+	n->dirty = 0;
+	n->is_new = 0;
+	INIT_LIST_HEAD(&n->dirty_list);
+	list_add(&n->hash_list, node_bucket(sc, chunk));
+	list_add(&n->lru, &sc->node_lru);
+	sc->nr_cached++;
+
+	return n;
+}
+
+static void mark_dirty(struct shared_cow *sc, struct shared_node *n)
+{
+	if (n->dirty)
+		return;
+
+	n->dirty = 1;
+	list_add_tail(&n->dirty_list, &sc->dirty);
+}
+
+static int get_node(struct shared_cow *sc, chunk_t chunk, int can_block,
+		    struct shared_node **result)
+{
+	struct shared_node *n;
+	int r;
+
+	list_for_each_entry(n, node_bucket(sc, chunk), hash_list)
+		if (n->chunk == chunk) {
+			list_move(&n->lru, &sc->node_lru);
+			*result = n;
+			return 0;
+		}
+
+	if (!can_block)
+		return -EWOULDBLOCK;
+
+	n = cache_node(sc, chunk);
+	if (!n)
+		return -ENOMEM;
+
+	r = chunk_io(sc, n->data, chunk, READ);
+	if (!r && (le32_to_cpu(n->data->magic) != SHARED_NODE_MAGIC ||
+		   le32_to_cpu(n->data->nr) > sc->entries_per_node)) {
+		DMERR("corrupt shared snapshot node %llu",
+		      (unsigned long long)chunk);
+		r = -EIO;
+	}
+
+	if (r) {
+		free_node(n);
+		sc->nr_cached--;
+		return r;
+	}
+
+	*result = n;
+	return 0;
+}
+
+static int new_node(struct shared_cow *sc, unsigned level,
+		    struct shared_node **result)
+{
+	struct shared_node *n;
+	chunk_t chunk;
+	int r;
+
+	r = alloc_chunk(sc, &chunk);
+	if (r)
+		return r;
+
+	n = cache_node(sc, chunk);
+	if (!n)
+		return -ENOMEM;
+
+	memset(n->data, 0, chunk_bytes(sc));
+	n->data->magic = cpu_to_le32(SHARED_NODE_MAGIC);
+	n->data->level = cpu_to_le32(level);
+	n->is_new = 1;
+	mark_dirty(sc, n);
+	sc->nr_nodes++;
+
+	*result = n;
+	return 0;
+}
+
+/*-----------------------------------------------------------------
+ * Writing a commit batch
+ *
+ * A node may only reach the disk after everything it refers to: the
+ * copied data for a leaf entry, or a new child for an internal node.
+ * Nodes are changed in the cache and written together by flush_nodes().
+ *---------------------------------------------------------------*/
+struct node_io {
+	atomic_t count;
+	int error;
+	struct completion done;
+};
+
+static void node_io_init(struct node_io *io)
+{
+	atomic_set(&io->count, 1);
+	io->error = 0;
+	init_completion(&io->done);
+}
+
+static void node_io_done(unsigned long error, void *context)
+{
+	struct node_io *io = context;
+
+	if (error)
+		io->error = -EIO;
+
+	if (atomic_dec_and_test(&io->count))
+		complete(&io->done);
+}
+
+static void node_io_start(struct shared_cow *sc, struct node_io *io,
+			  struct shared_node *n)
+{
+	struct dm_io_region where = {
+		.bdev = sc->bdev,
+		.sector = (sector_t)sc->chunk_size * n->chunk,
+		.count = sc->chunk_size,
+	};
+	struct dm_io_request io_req = {
+		.bi_rw = WRITE,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.vma = n->data,
+		.client = sc->io_client,
+		.notify.fn = node_io_done,
+		.notify.context = io,
+	};
+
+	atomic_inc(&io->count);
+	if (dm_io(&io_req, 1, &where, NULL))
+		node_io_done(1, io);
+}
+
+static int node_io_wait(struct node_io *io)
+{
+	node_io_done(0, io);
+	wait_for_completion(&io->done);
+
+	return io->error;
+}
+
+static void clear_dirty(struct shared_cow *sc)
+{
+	struct shared_node *n, *tmp;
+
+	list_for_each_entry_safe(n, tmp, &sc->dirty, dirty_list) {
+		list_del_init(&n->dirty_list);
+		n->dirty = 0;
+		n->is_new = 0;
+	}
+	sc->split_internal = 0;
+}
+
+static unsigned node_level(struct shared_node *n)
+{
+	return le32_to_cpu(n->data->level);
+}
+
+/*
+ * New nodes go first, as nothing on disk points to them yet, then the
+ * header if it publishes a new root, which still leads to every entry
+ * while the old root is not yet truncated.  The first write after them
+ * is a barrier, which orders everything behind the new nodes and the
+ * copied data.  A leaf truncated by a split still leads to its new right
+ * half through ->next until its parent is written; internal nodes have
+ * no such link, so a batch that split one writes each level, top down,
+ * behind a barrier.
+ */
+static int flush_nodes(struct shared_cow *sc)
+{
+	struct shared_node *n;
+	struct node_io io;
+	unsigned level, top = 0;
+	int barrier = 1, r;
+
+	node_io_init(&io);
+	list_for_each_entry(n, &sc->dirty, dirty_list) {
+		if (n->is_new)
+			node_io_start(sc, &io, n);
+		top = max(top, node_level(n));
+	}
+	r = node_io_wait(&io);
+
+	if (!r && (sc->root != sc->disk_root || sc->depth != sc->disk_depth)) {
+		sc->disk_root = sc->root;
+		sc->disk_depth = sc->depth;
+		r = write_header(sc);
+		barrier = 0;
+	}
+
+	for (level = top + 1; !r && level--; ) {
+		node_io_init(&io);
+		list_for_each_entry(n, &sc->dirty, dirty_list) {
+			if (n->is_new || node_level(n) != level)
+				continue;
+
+			if (!barrier) {
+				node_io_start(sc, &io, n);
+				continue;
+			}
+
+			r = chunk_io(sc, n->data, n->chunk, WRITE_BARRIER);
+			if (r)
+				break;
+			barrier = 0;
+		}
+		r = node_io_wait(&io) ? : r;
+
+		if (sc->split_internal)
+			barrier = 1;
+	}
+
+	clear_dirty(sc);
+	return r;
+}
+
+/*-----------------------------------------------------------------
+ * B+tree
+ *---------------------------------------------------------------*/
+static int key_cmp(struct disk_entry *e, chunk_t old_chunk, chunk_t new_chunk)
+{
+	chunk_t eo = le64_to_cpu(e->old_chunk);
+	chunk_t en = le64_to_cpu(e->new_chunk);
+
+	if (eo != old_chunk)
+		return eo < old_chunk ? -1 : 1;
+	if (en != new_chunk)
+		return en < new_chunk ? -1 : 1;
+	return 0;
+}
+
+/* Index of the first entry not below the key. */
+static unsigned lower_bound(struct disk_node *node, chunk_t old_chunk,
+			    chunk_t new_chunk)
+{
+	unsigned lo = 0, hi = le32_to_cpu(node->nr), mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (key_cmp(node->entries + mid, old_chunk, new_chunk) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+struct shared_path {
+	struct shared_node *node[SHARED_MAX_DEPTH];
+	unsigned index[SHARED_MAX_DEPTH];
+};
+
+/*
+ * Walk from the root to the leaf that should hold the key, recording the
+ * child taken at every level.  path->node[0] is the leaf.
+ */
+static int find_leaf(struct shared_cow *sc, chunk_t old_chunk,
+		     chunk_t new_chunk, int can_block, struct shared_path *path)
+{
+	struct shared_node *n;
+	chunk_t chunk = sc->root;
+	unsigned level, i;
+	int r;
+
+	for (level = sc->depth; level--; ) {
+		r = get_node(sc, chunk, can_block, &n);
+		if (r)
+			return r;
+
+		if (le32_to_cpu(n->data->level) != level) {
+			DMERR("shared snapshot node %llu at wrong level",
+			      (unsigned long long)chunk);
+			return -EIO;
+		}
+
+		path->node[level] = n;
+		if (!level)
+			break;
+
+		i = lower_bound(n->data, old_chunk, new_chunk);
+		if (i == le32_to_cpu(n->data->nr) ||
+		    key_cmp(n->data->entries + i, old_chunk, new_chunk) > 0)
+			i = i ? i - 1 : 0;
+		path->index[level] = i;
+		chunk = le64_to_cpu(n->data->entries[i].value);
+	}
+
+	return 0;
+}
+
+/*
+ * Call fn for each leaf entry of old_chunk until it returns non-zero.
+ */
+static int for_each_copy(struct shared_cow *sc, chunk_t old_chunk,
+			 int can_block,
+			 int (*fn)(struct disk_entry *e, void *context),
+			 void *context)
+{
+	struct shared_path path;
+	struct shared_node *n;
+	struct disk_entry *e;
+	chunk_t next;
+	unsigned i;
+	int r;
+
+	if (!sc->depth)
+		return 0;
+
+	r = find_leaf(sc, old_chunk, 0, can_block, &path);
+	if (r)
+		return r;
+
+	n = path.node[0];
+	i = lower_bound(n->data, old_chunk, 0);
+
+	for (;;) {
+		for (; i < le32_to_cpu(n->data->nr); i++) {
+			e = n->data->entries + i;
+			if (le64_to_cpu(e->old_chunk) != old_chunk)
+				return 0;
+			r = fn(e, context);
+			if (r)
+				return r;
+		}
+
+		next = le64_to_cpu(n->data->next);
+		if (!next)
+			return 0;
+
+		r = get_node(sc, next, can_block, &n);
+		if (r)
+			return r;
+		i = 0;
+	}
+}
+
+static void insert_entry(struct disk_node *node, unsigned i,
+			 chunk_t old_chunk, chunk_t new_chunk, uint64_t value)
+{
+	unsigned nr = le32_to_cpu(node->nr);
+
+	memmove(node->entries + i + 1, node->entries + i,
+		(nr - i) * sizeof(struct disk_entry));
+
+	node->entries[i].old_chunk = cpu_to_le64(old_chunk);
+	node->entries[i].new_chunk = cpu_to_le64(new_chunk);
+	node->entries[i].value = cpu_to_le64(value);
+	node->nr = cpu_to_le32(nr + 1);
+}
+
+/*
+ * Insert into path->node[level], splitting it if it is full.  The nodes
+ * are only changed in the cache; flush_nodes() writes them in an order
+ * that leaves every entry reachable if a crash interrupts it.
+ */
+static int insert_at(struct shared_cow *sc, struct shared_path *path,
+		     unsigned level, chunk_t old_chunk, chunk_t new_chunk,
+		     uint64_t value)
+{
+	struct shared_node *n = path->node[level], *right, *root;
+	struct disk_node *left;
+	unsigned i, nr, split;
+	int r;
+
+	i = lower_bound(n->data, old_chunk, new_chunk);
+	nr = le32_to_cpu(n->data->nr);
+
+	if (nr < sc->entries_per_node) {
+		insert_entry(n->data, i, old_chunk, new_chunk, value);
+		mark_dirty(sc, n);
+		return 0;
+	}
+
+	r = new_node(sc, level, &right);
+	if (r)
+		return r;
+	if (level)
+		sc->split_internal = 1;
+
+	left = n->data;
+	split = nr / 2;
+	memcpy(right->data->entries, left->entries + split,
+	       (nr - split) * sizeof(struct disk_entry));
+	right->data->nr = cpu_to_le32(nr - split);
+	right->data->next = left->next;
+
+	if (i > split)
+		insert_entry(right->data, i - split, old_chunk, new_chunk,
+			     value);
+
+	if (level + 1 == sc->depth) {
+		if (sc->depth == SHARED_MAX_DEPTH)
+			return -ENOSPC;
+
+		r = new_node(sc, level + 1, &root);
+		if (r)
+			return r;
+
+		insert_entry(root->data, 0, 0, 0, n->chunk);
+		insert_entry(root->data, 1,
+			     le64_to_cpu(right->data->entries[0].old_chunk),
+			     le64_to_cpu(right->data->entries[0].new_chunk),
+			     right->chunk);
+
+		sc->root = root->chunk;
+		sc->depth++;
+	} else
+		r = insert_at(sc, path, level + 1,
+			      le64_to_cpu(right->data->entries[0].old_chunk),
+			      le64_to_cpu(right->data->entries[0].new_chunk),
+			      right->chunk);
+	if (r)
+		return r;
+
+	left->nr = cpu_to_le32(split);
+	if (!level)
+		left->next = cpu_to_le64(right->chunk);
+	if (i <= split)
+		insert_entry(left, i, old_chunk, new_chunk, value);
+
+	mark_dirty(sc, n);
+	return 0;
+}
+
+static int insert_copy(struct shared_cow *sc, chunk_t old_chunk,
+		       chunk_t new_chunk, uint64_t slots)
+{
+	struct shared_path path;
+	struct shared_node *leaf;
+	int r;
+
+	if (!sc->depth) {
+		r = new_node(sc, 0, &leaf);
+		if (r)
+			return r;
+
+		insert_entry(leaf->data, 0, old_chunk, new_chunk, slots);
+
+		sc->root = leaf->chunk;
+		sc->depth = 1;
+		return 0;
+	}
+
+	r = find_leaf(sc, old_chunk, new_chunk, 1, &path);
+	if (r)
+		return r;
+
+	return insert_at(sc, &path, 0, old_chunk, new_chunk, slots);
+}
+
+/*-----------------------------------------------------------------
+ * Lookups
+ *---------------------------------------------------------------*/
+struct find_slot {
+	uint64_t mask;
+	chunk_t new_chunk;
+};
+
+static int copy_has_slot(struct disk_entry *e, void *context)
+{
+	struct find_slot *f = context;
+
+	if (!(le64_to_cpu(e->value) & f->mask))
+		return 0;
+
+	f->new_chunk = le64_to_cpu(e->new_chunk);
+	return 1;
+}
+
+static int copy_slots(struct disk_entry *e, void *context)
+{
+	uint64_t *covered = context;
+
+	*covered |= le64_to_cpu(e->value);
+	return 0;
+}
+
+/* Snapshots in the store that do not yet have a copy of old_chunk. */
+static int uncovered_slots(struct shared_cow *sc, chunk_t old_chunk,
+			   int can_block, uint64_t *slots)
+{
+	uint64_t covered = 0;
+	int r;
+
+	r = for_each_copy(sc, old_chunk, can_block, copy_slots, &covered);
+	if (r)
+		return r;
+
+	*slots = sc->slots & ~covered;
+	return 0;
+}
+
+/*-----------------------------------------------------------------
+ * Slot deletion
+ *---------------------------------------------------------------*/
+static int clear_leaf(struct shared_cow *sc, struct shared_node *n,
+		      uint64_t mask)
+{
+	struct disk_entry *e = n->data->entries;
+	unsigned i, dirty = 0;
+	uint64_t value;
+
+	for (i = 0; i < le32_to_cpu(n->data->nr); i++, e++) {
+		value = le64_to_cpu(e->value);
+		if (value & mask) {
+			e->value = cpu_to_le64(value & ~mask);
+			dirty = 1;
+		}
+	}
+
+	if (!dirty)
+		return 0;
+
+	mark_dirty(sc, n);
+	return flush_nodes(sc);
+}
+
+/*
+ * Clear the bits of sc->deleting from every leaf, left to right, then
+ * drop them from the header.  sc->lock is released between leaves; a
+ * split only moves entries into a new leaf further along the chain, and
+ * new copies never carry a deleted slot, so nothing is missed.
+ */
+static int delete_slots(struct shared_cow *sc)
+{
+	struct shared_path path;
+	struct shared_node *n;
+	uint64_t mask;
+	chunk_t chunk;
+	int r = 0;
+
+	mutex_lock(&sc->delete_lock);
+	mutex_lock(&sc->lock);
+
+	mask = sc->deleting;
+	if (!mask)
+		goto out;
+
+	if (sc->depth) {
+		r = find_leaf(sc, 0, 0, 1, &path);
+		if (r)
+			goto out;
+		chunk = path.node[0]->chunk;
+
+		for (;;) {
+			r = get_node(sc, chunk, 1, &n);
+			if (!r)
+				r = clear_leaf(sc, n, mask);
+			if (r)
+				goto out;
+
+			chunk = le64_to_cpu(n->data->next);
+			shrink_node_cache(sc);
+			if (!chunk)
+				break;
+
+			mutex_unlock(&sc->lock);
+			cond_resched();
+			mutex_lock(&sc->lock);
+		}
+	}
+
+	sc->deleting &= ~mask;
+	r = write_header(sc);
+
+out:
+	shrink_node_cache(sc);
+	mutex_unlock(&sc->lock);
+	mutex_unlock(&sc->delete_lock);
+	return r;
+}
+
+/*-----------------------------------------------------------------
+ * Exception store interface
+ *---------------------------------------------------------------*/
+static struct shared_cow *get_shared_cow(struct block_device *bdev)
+{
+	struct shared_cow *sc;
+	int i;
+
+	mutex_lock(&_shared_cows_lock);
+
+	list_for_each_entry(sc, &_shared_cows, list)
+		if (sc->bdev == bdev) {
+			sc->count++;
+			goto out;
+		}
+
+	sc = kzalloc(sizeof(*sc), GFP_KERNEL);
+	if (!sc)
+		goto out;
+
+	sc->metadata_wq = create_singlethread_workqueue("ksnapsd");
+	if (!sc->metadata_wq) {
+		DMERR("couldn't start metadata update thread");
+		kfree(sc);
+		sc = NULL;
+		goto out;
+	}
+
+	sc->bdev = bdev;
+	sc->count = 1;
+	mutex_init(&sc->lock);
+	mutex_init(&sc->delete_lock);
+	for (i = 0; i < SHARED_NODE_HASH_SIZE; i++)
+		INIT_LIST_HEAD(sc->node_hash + i);
+	INIT_LIST_HEAD(&sc->node_lru);
+	INIT_LIST_HEAD(&sc->dirty);
+	list_add(&sc->list, &_shared_cows);
+
+out:
+	mutex_unlock(&_shared_cows_lock);
+	return sc;
+}
+
+static void put_shared_cow(struct shared_cow *sc)
+{
+	mutex_lock(&_shared_cows_lock);
+	if (--sc->count) {
+		mutex_unlock(&_shared_cows_lock);
+		return;
+	}
+	list_del(&sc->list);
+	mutex_unlock(&_shared_cows_lock);
+
+	destroy_workqueue(sc->metadata_wq);
+	drop_node_cache(sc);
+	free_buffers(sc);
+	kfree(sc);
+}
+
+/* Read the header on first use.  Called with sc->lock held. */
+static int load_shared_cow(struct shared_cow *sc,
+			   struct dm_exception_store *store)
+{
+	char *chunk_err;
+	int r;
+
+	if (!sc->loaded) {
+		r = read_header(sc, store);
+		if (r) {
+			free_buffers(sc);
+			return r;
+		}
+		sc->loaded = 1;
+		return 0;
+	}
+
+	if (store->chunk_size == sc->chunk_size)
+		return 0;
+
+	r = dm_exception_store_set_chunk_size(store, sc->chunk_size,
+					      &chunk_err);
+	if (r)
+		DMERR("invalid shared chunk size %u: %s.",
+		      sc->chunk_size, chunk_err);
+
+	return r;
+}
+
+/*
+ * Claim ss->slot for this snapshot.  Another loaded snapshot with the
+ * same slot is only possible as a table handover, which skips
+ * read_metadata and so never gets here.
+ */
+static int claim_slot(struct shared_snap *ss)
+{
+	struct shared_cow *sc = ss->sc;
+	uint64_t bit = 1ULL << ss->slot;
+
+	if (ss->active)
+		return 0;
+
+	if (sc->active & bit) {
+		DMERR("shared snapshot %u is already in use", ss->slot);
+		return -EBUSY;
+	}
+
+	if (sc->deleting & bit) {
+		DMERR("shared snapshot %u is being deleted", ss->slot);
+		return -EBUSY;
+	}
+
+	sc->active |= bit;
+	ss->active = 1;
+
+	if (sc->slots & bit)
+		return 0;
+
+	sc->slots |= bit;
+	return write_header(sc);
+}
+
+static int alloc_slot(struct shared_snap *ss, struct dm_exception_store *store)
+{
+	struct shared_cow *sc = ss->sc;
+	uint64_t used;
+	int r;
+
+	mutex_lock(&sc->lock);
+
+	r = load_shared_cow(sc, store);
+	if (r)
+		goto out;
+
+	used = sc->slots | sc->deleting | sc->active;
+	for (ss->slot = 0; ss->slot < SHARED_MAX_SLOTS; ss->slot++)
+		if (!(used & (1ULL << ss->slot)))
+			break;
+
+	if (ss->slot == SHARED_MAX_SLOTS) {
+		DMERR("no free snapshot slot in shared store");
+		r = -ENOSPC;
+		goto out;
+	}
+
+	r = claim_slot(ss);
+
+out:
+	mutex_unlock(&sc->lock);
+	return r;
+}
+
+static void release_slot(struct shared_snap *ss)
+{
+	struct shared_cow *sc = ss->sc;
+
+	if (!ss->active)
+		return;
+
+	mutex_lock(&sc->lock);
+	sc->active &= ~(1ULL << ss->slot);
+	mutex_unlock(&sc->lock);
+	ss->active = 0;
+}
+
+static int shared_ctr(struct dm_exception_store *store,
+		      unsigned argc, char **argv)
+{
+	struct shared_snap *ss;
+	unsigned long slot = SHARED_MAX_SLOTS;
+	int r;
+
+	if (argc != 1 ||
+	    (*argv[0] && (strict_strtoul(argv[0], 10, &slot) ||
+			  slot >= SHARED_MAX_SLOTS))) {
+		DMERR("shared store needs a snapshot number below %d",
+		      SHARED_MAX_SLOTS);
+		return -EINVAL;
+	}
+
+	ss = kmalloc(sizeof(*ss), GFP_KERNEL);
+	if (!ss)
+		return -ENOMEM;
+
+	ss->slot = slot;
+	ss->active = 0;
+	ss->sc = get_shared_cow(dm_snap_cow(store->snap)->bdev);
+	if (!ss->sc) {
+		kfree(ss);
+		return -ENOMEM;
+	}
+
+	/* No number given: this is a new snapshot */
+	if (slot == SHARED_MAX_SLOTS) {
+		r = alloc_slot(ss, store);
+		if (r) {
+			release_slot(ss);
+			put_shared_cow(ss->sc);
+			kfree(ss);
+			return r;
+		}
+	}
+
+	store->context = ss;
+
+	return 0;
+}
+
+static void shared_dtr(struct dm_exception_store *store)
+{
+	struct shared_snap *ss = get_info(store);
+
+	release_slot(ss);
+	put_shared_cow(ss->sc);
+	kfree(ss);
+}
+
+/*
+ * Nothing is read beyond the header: exceptions are found through
+ * lookup_exception() as they are needed.
+ */
+static int shared_read_metadata(struct dm_exception_store *store,
+				int (*callback)(void *callback_context,
+						chunk_t old, chunk_t new),
+				void *callback_context)
+{
+	struct shared_snap *ss = get_info(store);
+	struct shared_cow *sc = ss->sc;
+	uint64_t deleting;
+	int r;
+
+	mutex_lock(&sc->lock);
+	r = load_shared_cow(sc, store);
+	if (!r)
+		r = claim_slot(ss);
+	deleting = sc->deleting;
+	mutex_unlock(&sc->lock);
+
+	if (r)
+		return r;
+
+	/* Finish a delete interrupted by a crash */
+	if (deleting) {
+		r = delete_slots(sc);
+		if (r)
+			return r;
+	}
+
+	return sc->valid ? 0 : 1;
+}
+
+static int lock_shared_cow(struct shared_cow *sc, int can_block)
+{
+	if (!can_block)
+		return mutex_trylock(&sc->lock) ? 0 : -EWOULDBLOCK;
+
+	mutex_lock(&sc->lock);
+	return 0;
+}
+
+static int shared_lookup_exception(struct dm_exception_store *store,
+				   chunk_t old, chunk_t *new, int can_block)
+{
+	struct shared_snap *ss = get_info(store);
+	struct shared_cow *sc = ss->sc;
+	struct find_slot f = { .mask = 1ULL << ss->slot };
+	int r;
+
+	r = lock_shared_cow(sc, can_block);
+	if (r)
+		return r;
+
+	if (!sc->valid)
+		r = -EIO;
+	else
+		r = for_each_copy(sc, old, can_block, copy_has_slot, &f);
+	shrink_node_cache(sc);
+	mutex_unlock(&sc->lock);
+
+	if (r > 0)
+		*new = f.new_chunk;
+
+	return r;
+}
+
+static int shared_need_exception(struct dm_exception_store *store,
+				  chunk_t old, int can_block)
+{
+	struct shared_cow *sc = get_info(store)->sc;
+	uint64_t slots = 0;
+	int r;
+
+	r = lock_shared_cow(sc, can_block);
+	if (r)
+		return r;
+
+	if (!sc->valid)
+		r = -EIO;
+	else
+		r = uncovered_slots(sc, old, can_block, &slots);
+	shrink_node_cache(sc);
+	mutex_unlock(&sc->lock);
+
+	return r ? r : !!slots;
+}
+
+static int shared_prepare_exception(struct dm_exception_store *store,
+				    struct dm_exception *e)
+{
+	struct shared_cow *sc = get_info(store)->sc;
+	int r;
+
+	mutex_lock(&sc->lock);
+	r = sc->valid ? alloc_chunk(sc, &e->new_chunk) : -EIO;
+	if (!r)
+		sc->pending++;
+	mutex_unlock(&sc->lock);
+
+	return r;
+}
+
+static void invalidate_store(struct shared_cow *sc)
+{
+	clear_dirty(sc);
+	sc->valid = 0;
+	if (write_header(sc))
+		DMWARN("write header failed");
+}
+
+/*
+ * One exception fewer in flight.  Once none is, or the batch is full,
+ * write the batch out and move its callbacks to done, for the caller to
+ * run after dropping sc->lock.  Returns how many there are.
+ */
+static unsigned end_exception(struct shared_cow *sc,
+			      struct commit_callback *done)
+{
+	unsigned nr;
+
+	sc->pending--;
+	if (sc->pending && sc->nr_callbacks < SHARED_COMMIT_BATCH)
+		return 0;
+
+	if (sc->valid && flush_nodes(sc))
+		invalidate_store(sc);
+
+	nr = sc->nr_callbacks;
+	memcpy(done, sc->callbacks, nr * sizeof(*done));
+	sc->nr_callbacks = 0;
+
+	return nr;
+}
+
+/*
+ * The copy is recorded for every snapshot still missing the chunk when
+ * it commits.  The origin write waiting on it cannot proceed until the
+ * batch is written, so they all saw the data that was copied.
+ */
+static void shared_commit_exception(struct dm_exception_store *store,
+				    struct dm_exception *e,
+				    void (*callback) (void *, int success),
+				    void *callback_context)
+{
+	struct shared_cow *sc = get_info(store)->sc;
+	struct commit_callback done[SHARED_COMMIT_BATCH], *cb;
+	uint64_t slots;
+	unsigned i, nr;
+	int valid;
+
+	mutex_lock(&sc->lock);
+
+	if (sc->valid && (uncovered_slots(sc, e->old_chunk, 1, &slots) ||
+			  (slots && insert_copy(sc, e->old_chunk,
+						e->new_chunk, slots))))
+		invalidate_store(sc);
+
+	cb = sc->callbacks + sc->nr_callbacks++;
+	cb->callback = callback;
+	cb->context = callback_context;
+
+	nr = end_exception(sc, done);
+	valid = sc->valid;
+	shrink_node_cache(sc);
+	mutex_unlock(&sc->lock);
+
+	for (i = 0; i < nr; i++)
+		done[i].callback(done[i].context, valid);
+}
+
+/* The copy failed, so the batch need not wait for it any more. */
+static void shared_abort_exception(struct dm_exception_store *store,
+				   struct dm_exception *e)
+{
+	struct shared_cow *sc = get_info(store)->sc;
+	struct commit_callback done[SHARED_COMMIT_BATCH];
+	unsigned i, nr;
+	int valid;
+
+	mutex_lock(&sc->lock);
+	nr = end_exception(sc, done);
+	valid = sc->valid;
+	shrink_node_cache(sc);
+	mutex_unlock(&sc->lock);
+
+	for (i = 0; i < nr; i++)
+		done[i].callback(done[i].context, valid);
+}
+
+static void shared_drop_snapshot(struct dm_exception_store *store)
+{
+	struct shared_cow *sc = get_info(store)->sc;
+
+	mutex_lock(&sc->lock);
+	sc->valid = 0;
+	if (sc->loaded && write_header(sc))
+		DMWARN("write header failed");
+	mutex_unlock(&sc->lock);
+}
+
+static int shared_message(struct dm_exception_store *store,
+			  unsigned argc, char **argv)
+{
+	struct shared_cow *sc = get_info(store)->sc;
+	unsigned long slot;
+	uint64_t bit;
+	int r;
+
+	if (argc != 2 || strcasecmp(argv[0], "delete") ||
+	    strict_strtoul(argv[1], 10, &slot) || slot >= SHARED_MAX_SLOTS) {
+		DMWARN("unrecognised message received.");
+		return -EINVAL;
+	}
+
+	bit = 1ULL << slot;
+
+	mutex_lock(&sc->lock);
+	if (!(sc->slots & bit)) {
+		DMWARN("shared snapshot %lu does not exist", slot);
+		r = -EINVAL;
+	} else if (sc->active & bit) {
+		DMWARN("shared snapshot %lu is in use", slot);
+		r = -EBUSY;
+	} else {
+		sc->slots &= ~bit;
+		sc->deleting |= bit;
+		r = write_header(sc);
+	}
+	mutex_unlock(&sc->lock);
+
+	return r ? r : delete_slots(sc);
+}
+
+static void *shared_group(struct dm_exception_store *store, unsigned *slot)
+{
+	struct shared_snap *ss = get_info(store);
+
+	if (slot)
+		*slot = ss->slot;
+
+	return ss->sc;
+}
+
+static void shared_usage(struct dm_exception_store *store,
+			 sector_t *total_sectors,
+			 sector_t *sectors_allocated,
+			 sector_t *metadata_sectors)
+{
+	struct shared_cow *sc = get_info(store)->sc;
+
+	mutex_lock(&sc->lock);
+	*sectors_allocated = sc->next_free * store->chunk_size;
+	*total_sectors = get_dev_size(sc->bdev);
+	*metadata_sectors = (sc->nr_nodes + 1) * store->chunk_size;
+	mutex_unlock(&sc->lock);
+}
+
+static unsigned shared_status(struct dm_exception_store *store,
+			      status_type_t status, char *result,
+			      unsigned maxlen)
+{
+	unsigned sz = 0;
+
+	switch (status) {
+	case STATUSTYPE_INFO:
+		break;
+	case STATUSTYPE_TABLE:
+		DMEMIT(" S%u %llu", get_info(store)->slot,
+		       (unsigned long long)store->chunk_size);
+	}
+
+	return sz;
+}
+
+static struct dm_exception_store_type _shared_type = {
+	.name = "shared",
+	.module = THIS_MODULE,
+	.ctr = shared_ctr,
+	.dtr = shared_dtr,
+	.read_metadata = shared_read_metadata,
+	.lookup_exception = shared_lookup_exception,
+	.need_exception = shared_need_exception,
+	.prepare_exception = shared_prepare_exception,
+	.commit_exception = shared_commit_exception,
+	.abort_exception = shared_abort_exception,
+	.drop_snapshot = shared_drop_snapshot,
+	.message = shared_message,
+	.shared = shared_group,
+	.usage = shared_usage,
+	.status = shared_status,
+};
+
+/* The same type under its table name, "S" */
+static struct dm_exception_store_type _shared_compat_type;
+
+int dm_shared_snapshot_init(void)
+{
+	int r;
+
+	_shared_compat_type = _shared_type;
+	_shared_compat_type.name = "S";
+
+	r = dm_exception_store_type_register(&_shared_type);
+	if (r) {
+		DMERR("Unable to register shared exception store type");
+		return r;
+	}
+
+	r = dm_exception_store_type_register(&_shared_compat_type);
+	if (r) {
+		DMERR("Unable to register short-form shared exception "
+		      "store type");
+		dm_exception_store_type_unregister(&_shared_type);
+		return r;
+	}
+
+	return r;
+}
+
+void dm_shared_snapshot_exit(void)
+{
+	dm_exception_store_type_unregister(&_shared_type);
+	dm_exception_store_type_unregister(&_shared_compat_type);
+}
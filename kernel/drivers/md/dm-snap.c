@@ -16,6 +16,7 @@
 #include <linux/workqueue.h>
 
 #include "dm-exception-store.h"
+#include "dm.h"
 
 #define DM_MSG_PREFIX "snapshots"
 
@@ -240,6 +241,47 @@ static void __check_for_conflicting_io(struct dm_snapshot *s, chunk_t chunk)
 		msleep(1);
 }
 
+/*
+ * Bios whose exception lookup would have to wait for the store to read
+ * its metadata are mapped again from ksnapd instead of in map context.
+ */
+struct dm_snap_deferred_bio {
+	struct list_head list;
+	struct bio *bio;
+
+	/* NULL for an origin write */
+	struct dm_snapshot *snap;
+	struct dm_dev *origin;
+	union map_info *map_context;
+};
+
+static struct kmem_cache *deferred_cache;
+static mempool_t *deferred_pool;
+
+static LIST_HEAD(_deferred_bios);
+static DEFINE_SPINLOCK(_deferred_lock);
+static void process_deferred_bios(struct work_struct *work);
+static DECLARE_WORK(_deferred_work, process_deferred_bios);
+
+static void defer_bio(struct dm_snapshot *s, struct dm_dev *origin,
+		      struct bio *bio, union map_info *map_context)
+{
+	struct dm_snap_deferred_bio *d = mempool_alloc(deferred_pool,
+						       GFP_NOIO);
+	unsigned long flags;
+
+	d->bio = bio;
+	d->snap = s;
+	d->origin = origin;
+	d->map_context = map_context;
+
+	spin_lock_irqsave(&_deferred_lock, flags);
+	list_add_tail(&d->list, &_deferred_bios);
+	spin_unlock_irqrestore(&_deferred_lock, flags);
+
+	queue_work(ksnapd, &_deferred_work);
+}
+
 struct origin {
 	/* The origin device */
 	struct block_device *bdev;
@@ -306,6 +348,29 @@ static void __insert_origin(struct origin *o)
 	list_add_tail(&o->hash_list, sl);
 }
 
+static void *snap_shared(struct dm_snapshot *s, unsigned *slot)
+{
+	if (!s->store->type->shared)
+		return NULL;
+
+	return s->store->type->shared(s->store, slot);
+}
+
+/*
+ * Snapshots in a shared exception store have the same COW device but
+ * are only the same snapshot if they also have the same slot.
+ */
+static int same_snapshot_store(struct dm_snapshot *a, struct dm_snapshot *b)
+{
+	unsigned slot_a, slot_b;
+	void *shared = snap_shared(a, &slot_a);
+
+	if (shared != snap_shared(b, &slot_b))
+		return 0;
+
+	return !shared || slot_a == slot_b;
+}
+
 static int __find_snapshots_sharing_cow(struct dm_snapshot *snap,
 					struct dm_snapshot **snap_src,
 					struct dm_snapshot **snap_dest,
@@ -323,7 +388,8 @@ static int __find_snapshots_sharing_cow(struct dm_snapshot *snap,
 	list_for_each_entry(s, &o->snapshots, list) {
 		if (dm_target_is_snapshot_merge(s->ti) && snap_merge)
 			*snap_merge = s;
-		if (!bdev_equal(s->cow->bdev, snap->cow->bdev))
+		if (!bdev_equal(s->cow->bdev, snap->cow->bdev) ||
+		    !same_snapshot_store(s, snap))
 			continue;
 
 		down_read(&s->lock);
@@ -391,11 +457,20 @@ static int __validate_exception_handover(struct dm_snapshot *snap)
 static void __insert_snapshot(struct origin *o, struct dm_snapshot *s)
 {
 	struct dm_snapshot *l;
+	void *shared = snap_shared(s, NULL);
 
-	/* Sort the list according to chunk size, largest-first smallest-last */
-	list_for_each_entry(l, &o->snapshots, list)
+	/*
+	 * Sort the list according to chunk size, largest-first smallest-last,
+	 * keeping the snapshots of a shared store together.
+	 */
+	list_for_each_entry(l, &o->snapshots, list) {
+		if (shared && snap_shared(l, NULL) == shared) {
+			list_add(&s->list, &l->list);
+			return;
+		}
 		if (l->store->chunk_size < s->store->chunk_size)
 			break;
+	}
 	list_add_tail(&s->list, &l->list);
 }
 
@@ -624,6 +699,39 @@ static int dm_add_exception(void *context, chunk_t old, chunk_t new)
 	return 0;
 }
 
+/*
+ * Ask a store that does not load all its exceptions up front, and
+ * cache the answer in s->complete.  If there is no memory for the
+ * cache entry the result is returned in *tmp instead.
+ */
+static struct dm_exception *__load_exception(struct dm_snapshot *s,
+					     chunk_t chunk,
+					     struct dm_exception *tmp,
+					     int can_block)
+{
+	struct dm_exception *e;
+	chunk_t new_chunk;
+	int r;
+
+	r = s->store->type->lookup_exception(s->store, chunk, &new_chunk,
+					     can_block);
+	if (r <= 0)
+		return r ? ERR_PTR(r) : NULL;
+
+	e = alloc_completed_exception();
+	if (!e)
+		e = tmp;
+
+	e->old_chunk = chunk;
+	e->new_chunk = new_chunk;
+	if (e == tmp)
+		return e;
+
+	dm_insert_exception(&s->complete, e);
+
+	return dm_lookup_exception(&s->complete, chunk);
+}
+
 #define min_not_zero(l, r) (((l) == 0) ? (r) : (((r) == 0) ? (l) : min(l, r)))
 
 static sector_t __minimum_chunk_size(struct origin *o)
@@ -1008,6 +1116,14 @@ static int snapshot_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	argv += args_used;
 	argc -= args_used;
 
+	if (s->store->type->shared &&
+	    (dm_table_get_mode(ti->table) & FMODE_WRITE)) {
+		ti->error = "Snapshots in a shared exception store "
+			    "must be read-only";
+		r = -EINVAL;
+		goto bad_hash_tables;
+	}
+
 	s->ti = ti;
 	s->valid = 1;
 	s->active = 0;
@@ -1034,6 +1150,7 @@ static int snapshot_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		ti->error = "Could not create kcopyd client";
 		goto bad_kcopyd;
 	}
+	dm_kcopyd_client_set_owner(s->kcopyd_client, ti);
 
 	s->pending_pool = mempool_create_slab_pool(MIN_IOS, pending_cache);
 	if (!s->pending_pool) {
@@ -1301,6 +1418,32 @@ static void __invalidate_snapshot(struct dm_snapshot *s, int err)
 	dm_table_event(s->ti->table);
 }
 
+/*
+ * A copy made for a shared store may be used by any snapshot in it, so
+ * wait for reads of the old origin data in all of them.  Taking each
+ * snapshot's lock ensures that any read which missed the newly committed
+ * exception is already being tracked.
+ */
+static void wait_for_shared_reads(struct dm_snapshot *s, chunk_t chunk)
+{
+	struct dm_snapshot *snap;
+	struct origin *o;
+	void *shared = snap_shared(s, NULL);
+
+	down_read(&_origins_lock);
+	o = __lookup_origin(s->origin->bdev);
+	if (o)
+		list_for_each_entry(snap, &o->snapshots, list) {
+			if (snap_shared(snap, NULL) != shared)
+				continue;
+
+			down_write(&snap->lock);
+			up_write(&snap->lock);
+			__check_for_conflicting_io(snap, chunk);
+		}
+	up_read(&_origins_lock);
+}
+
 static void pending_complete(struct dm_snap_pending_exception *pe, int success)
 {
 	struct dm_exception *e;
@@ -1317,6 +1460,15 @@ static void pending_complete(struct dm_snap_pending_exception *pe, int success)
 		goto out;
 	}
 
+	/* The store has recorded the copy for the snapshots that need it */
+	if (snap_shared(s, NULL)) {
+		wait_for_shared_reads(s, pe->e.old_chunk);
+		down_write(&s->lock);
+		if (!s->valid)
+			error = 1;
+		goto out;
+	}
+
 	e = alloc_completed_exception();
 	if (!e) {
 		down_write(&s->lock);
@@ -1373,10 +1525,11 @@ static void copy_callback(int read_err, unsigned long write_err, void *context)
 	struct dm_snap_pending_exception *pe = context;
 	struct dm_snapshot *s = pe->snap;
 
-	if (read_err || write_err)
+	if (read_err || write_err) {
+		if (s->store->type->abort_exception)
+			s->store->type->abort_exception(s->store, &pe->e);
 		pending_complete(pe, 0);
-
-	else
+	} else
 		/* Update the metadata if we are persistent */
 		s->store->type->commit_exception(s->store, &pe->e,
 						 commit_callback, pe);
@@ -1453,11 +1606,10 @@ static void remap_exception(struct dm_snapshot *s, struct dm_exception *e,
 					  s->store->chunk_mask);
 }
 
-static int snapshot_map(struct dm_target *ti, struct bio *bio,
-			union map_info *map_context)
+static int __snapshot_map(struct dm_snapshot *s, struct bio *bio,
+			  union map_info *map_context, int can_block)
 {
-	struct dm_exception *e;
-	struct dm_snapshot *s = ti->private;
+	struct dm_exception *e, tmp;
 	int r = DM_MAPIO_REMAPPED;
 	chunk_t chunk;
 	struct dm_snap_pending_exception *pe = NULL;
@@ -1485,6 +1637,17 @@ static int snapshot_map(struct dm_target *ti, struct bio *bio,
 
 	/* If the block is already remapped - use that, else remap it */
 	e = dm_lookup_exception(&s->complete, chunk);
+	if (!e && s->store->type->lookup_exception) {
+		e = __load_exception(s, chunk, &tmp, can_block);
+		if (IS_ERR(e)) {
+			r = PTR_ERR(e);
+			if (r != -EWOULDBLOCK) {
+				__invalidate_snapshot(s, r);
+				r = -EIO;
+			}
+			goto out_unlock;
+		}
+	}
 	if (e) {
 		remap_exception(s, e, bio, chunk);
 		goto out_unlock;
@@ -1495,7 +1658,10 @@ static int snapshot_map(struct dm_target *ti, struct bio *bio,
 	 * flags so we should only get this if we are
 	 * writeable.
 	 */
-	if (bio_rw(bio) == WRITE) {
+	if (bio_rw(bio) == WRITE && snap_shared(s, NULL)) {
+		r = -EIO;
+		goto out_unlock;
+	} else if (bio_rw(bio) == WRITE) {
 		pe = __lookup_pending_exception(s, chunk);
 		if (!pe) {
 			up_write(&s->lock);
@@ -1546,6 +1712,21 @@ static int snapshot_map(struct dm_target *ti, struct bio *bio,
 	return r;
 }
 
+static int snapshot_map(struct dm_target *ti, struct bio *bio,
+			union map_info *map_context)
+{
+	struct dm_snapshot *s = ti->private;
+	int r;
+
+	r = __snapshot_map(s, bio, map_context, 0);
+	if (r == -EWOULDBLOCK) {
+		defer_bio(s, NULL, bio, map_context);
+		r = DM_MAPIO_SUBMITTED;
+	}
+
+	return r;
+}
+
 static int snapshot_merge_map(struct dm_target *ti, struct bio *bio,
 			      union map_info *map_context)
 {
@@ -1764,6 +1945,18 @@ static int snapshot_status(struct dm_target *ti, status_type_t type,
 	return 0;
 }
 
+static int snapshot_message(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct dm_snapshot *snap = ti->private;
+
+	if (!snap->store->type->message) {
+		DMWARN("unrecognised message received.");
+		return -EINVAL;
+	}
+
+	return snap->store->type->message(snap->store, argc, argv);
+}
+
 static int snapshot_iterate_devices(struct dm_target *ti,
 				    iterate_devices_callout_fn fn, void *data)
 {
@@ -1780,13 +1973,45 @@ static int snapshot_iterate_devices(struct dm_target *ti,
 
 
 
+/*
+ * Does an origin write to chunk have to wait for a copy into snap?
+ * For a shared store this is asked once on behalf of all its snapshots.
+ */
+static int __origin_chunk_needed(struct dm_snapshot *snap, chunk_t chunk,
+				 int can_block)
+{
+	int r;
+
+	if (!snap_shared(snap, NULL))
+		return !dm_lookup_exception(&snap->complete, chunk);
+
+	if (__lookup_pending_exception(snap, chunk))
+		return 1;
+
+	r = snap->store->type->need_exception(snap->store, chunk, can_block);
+	if (r == -EWOULDBLOCK)
+		return r;
+	if (r < 0) {
+		__invalidate_snapshot(snap, r);
+		return 0;
+	}
+
+	return r;
+}
+
+/*
+ * Without can_block, returns -EWOULDBLOCK if a shared store cannot answer
+ * without reading metadata and bio is not yet queued on an exception.
+ * Once it is queued, the exception's completion retries it anyway.
+ */
 static int __origin_write(struct list_head *snapshots, sector_t sector,
-			  struct bio *bio)
+			  struct bio *bio, int can_block)
 {
 	int r = DM_MAPIO_REMAPPED;
+	int needed;
 	struct dm_snapshot *snap;
-	struct dm_exception *e;
 	struct dm_snap_pending_exception *pe;
+	void *shared, *last_shared = NULL;
 	struct dm_snap_pending_exception *pe_to_start_now = NULL;
 	struct dm_snap_pending_exception *pe_to_start_last = NULL;
 	chunk_t chunk;
@@ -1800,6 +2025,14 @@ static int __origin_write(struct list_head *snapshots, sector_t sector,
 		if (dm_target_is_snapshot_merge(snap->ti))
 			continue;
 
+		/*
+		 * The first usable snapshot of a shared store copies
+		 * for all of them.
+		 */
+		shared = snap_shared(snap, NULL);
+		if (shared && shared == last_shared)
+			continue;
+
 		down_write(&snap->lock);
 
 		/* Only deal with valid and active snapshots */
@@ -1810,6 +2043,8 @@ static int __origin_write(struct list_head *snapshots, sector_t sector,
 		if (sector >= dm_table_get_size(snap->ti->table))
 			goto next_snapshot;
 
+		last_shared = shared;
+
 		/*
 		 * Remember, different snapshots can have
 		 * different chunk sizes.
@@ -1821,8 +2056,10 @@ static int __origin_write(struct list_head *snapshots, sector_t sector,
 		 * is already remapped in this snapshot
 		 * and trigger an exception if not.
 		 */
-		e = dm_lookup_exception(&snap->complete, chunk);
-		if (e)
+		needed = __origin_chunk_needed(snap, chunk, can_block);
+		if (needed == -EWOULDBLOCK && bio)
+			goto defer;
+		if (needed <= 0)
 			goto next_snapshot;
 
 		pe = __lookup_pending_exception(snap, chunk);
@@ -1836,9 +2073,11 @@ static int __origin_write(struct list_head *snapshots, sector_t sector,
 				goto next_snapshot;
 			}
 
-			e = dm_lookup_exception(&snap->complete, chunk);
-			if (e) {
+			needed = __origin_chunk_needed(snap, chunk, can_block);
+			if (needed <= 0) {
 				free_pending_exception(pe);
+				if (needed == -EWOULDBLOCK && bio)
+					goto defer;
 				goto next_snapshot;
 			}
 
@@ -1888,22 +2127,97 @@ static int __origin_write(struct list_head *snapshots, sector_t sector,
 		start_copy(pe_to_start_last);
 
 	return r;
+
+ defer:
+	up_write(&snap->lock);
+	return -EWOULDBLOCK;
 }
 
-static int do_origin(struct dm_dev *origin, struct bio *bio)
+/*
+ * Read what the shared stores need to know about an origin write into
+ * their caches before __origin_write() takes each snapshot's lock.
+ */
+static void __prefetch_origin_chunk(struct list_head *snapshots,
+				    sector_t sector)
+{
+	struct dm_snapshot *snap;
+	void *shared, *last_shared = NULL;
+
+	list_for_each_entry(snap, snapshots, list) {
+		shared = snap_shared(snap, NULL);
+		if (!shared || shared == last_shared ||
+		    dm_target_is_snapshot_merge(snap->ti))
+			continue;
+
+		last_shared = shared;
+		snap->store->type->need_exception(snap->store,
+				sector_to_chunk(snap->store, sector), 1);
+	}
+}
+
+static int __do_origin(struct dm_dev *origin, struct bio *bio, int can_block)
 {
 	struct origin *o;
 	int r = DM_MAPIO_REMAPPED;
 
 	down_read(&_origins_lock);
 	o = __lookup_origin(origin->bdev);
-	if (o)
-		r = __origin_write(&o->snapshots, bio->bi_sector, bio);
+	if (o) {
+		if (can_block)
+			__prefetch_origin_chunk(&o->snapshots, bio->bi_sector);
+		r = __origin_write(&o->snapshots, bio->bi_sector, bio,
+				   can_block);
+	}
 	up_read(&_origins_lock);
 
 	return r;
 }
 
+static int do_origin(struct dm_dev *origin, struct bio *bio)
+{
+	int r;
+
+	r = __do_origin(origin, bio, 0);
+	if (r == -EWOULDBLOCK) {
+		defer_bio(NULL, origin, bio, NULL);
+		r = DM_MAPIO_SUBMITTED;
+	}
+
+	return r;
+}
+
+static void process_deferred_bios(struct work_struct *work)
+{
+	struct dm_snap_deferred_bio *d, *tmp;
+	struct dm_snapshot *s;
+	chunk_t new_chunk;
+	LIST_HEAD(bios);
+	int r;
+
+	spin_lock_irq(&_deferred_lock);
+	list_splice_init(&_deferred_bios, &bios);
+	spin_unlock_irq(&_deferred_lock);
+
+	list_for_each_entry_safe(d, tmp, &bios, list) {
+		s = d->snap;
+		if (s) {
+			/* Read the metadata in before taking s->lock */
+			s->store->type->lookup_exception(s->store,
+				sector_to_chunk(s->store, d->bio->bi_sector),
+				&new_chunk, 1);
+			r = __snapshot_map(s, d->bio, d->map_context, 1);
+		} else
+			r = __do_origin(d->origin, d->bio, 1);
+
+		if (r == DM_MAPIO_REMAPPED)
+			generic_make_request(d->bio);
+		else if (r < 0)
+			bio_endio(d->bio, r);
+
+		mempool_free(d, deferred_pool);
+	}
+}
+
 static int origin_write_extent(struct dm_snapshot *merging_snap,
 			       sector_t sector, unsigned size)
 {
@@ -1918,7 +2232,7 @@ static int origin_write_extent(struct dm_snapshot *merging_snap,
 	down_read(&_origins_lock);
 	o = __lookup_origin(merging_snap->origin->bdev);
 	for (n = 0; n < size; n += merging_snap->ti->split_io)
-		if (__origin_write(&o->snapshots, sector + n, NULL) ==
+		if (__origin_write(&o->snapshots, sector + n, NULL, 1) ==
 		    DM_MAPIO_SUBMITTED)
 			must_wait = 1;
 	up_read(&_origins_lock);
@@ -2025,6 +2339,7 @@ static struct target_type snapshot_target = {
 	.preresume  = snapshot_preresume,
 	.resume  = snapshot_resume,
 	.status  = snapshot_status,
+	.message = snapshot_message,
 	.iterate_devices = snapshot_iterate_devices,
 };
 
@@ -2099,6 +2414,20 @@ static int __init dm_snapshot_init(void)
 		goto bad_tracked_chunk_cache;
 	}
 
+	deferred_cache = KMEM_CACHE(dm_snap_deferred_bio, 0);
+	if (!deferred_cache) {
+		DMERR("Couldn't create deferred bio cache.");
+		r = -ENOMEM;
+		goto bad_deferred_cache;
+	}
+
+	deferred_pool = mempool_create_slab_pool(MIN_IOS, deferred_cache);
+	if (!deferred_pool) {
+		DMERR("Couldn't create deferred bio pool.");
+		r = -ENOMEM;
+		goto bad_deferred_pool;
+	}
+
 	ksnapd = create_singlethread_workqueue("ksnapd");
 	if (!ksnapd) {
 		DMERR("Failed to create ksnapd workqueue.");
@@ -2109,6 +2438,10 @@ static int __init dm_snapshot_init(void)
 	return 0;
 
 bad_pending_pool:
+	mempool_destroy(deferred_pool);
+bad_deferred_pool:
+	kmem_cache_destroy(deferred_cache);
+bad_deferred_cache:
 	kmem_cache_destroy(tracked_chunk_cache);
 bad_tracked_chunk_cache:
 	kmem_cache_destroy(pending_cache);
@@ -2140,6 +2473,8 @@ static void __exit dm_snapshot_exit(void)
 	kmem_cache_destroy(pending_cache);
 	kmem_cache_destroy(exception_cache);
 	kmem_cache_destroy(tracked_chunk_cache);
+	mempool_destroy(deferred_pool);
+	kmem_cache_destroy(deferred_cache);
 
 	dm_exception_store_exit();
 }
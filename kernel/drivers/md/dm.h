@@ -92,6 +92,11 @@ void dm_io_exit(void);
 int dm_kcopyd_init(void);
 void dm_kcopyd_exit(void);
 
+struct dm_kcopyd_client;
+void dm_kcopyd_client_set_owner(struct dm_kcopyd_client *kc,
+				struct dm_target *ti);
+ssize_t dm_kcopyd_stats_show(struct mapped_device *md, char *buf);
+
 struct dm_md_mempools *dm_alloc_md_mempools(unsigned type);
 void dm_free_md_mempools(struct dm_md_mempools *pools);
 
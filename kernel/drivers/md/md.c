@@ -133,6 +133,45 @@ static DEFINE_SPINLOCK(all_mddevs_lock);
 		)
 
 
+struct md_lat_bio {
+	mddev_t *mddev;
+	unsigned long start;
+	bio_end_io_t *bi_end_io;
+	void *bi_private;
+};
+
+static void md_lat_end_io(struct bio *bio, int err)
+{
+	struct md_lat_bio *lb = bio->bi_private;
+	mddev_t *mddev = lb->mddev;
+
+	atomic_long_inc(&mddev->lat_ios);
+	atomic_long_add(jiffies - lb->start, &mddev->lat_ticks);
+	bio->bi_end_io = lb->bi_end_io;
+	bio->bi_private = lb->bi_private;
+	kfree(lb);
+	bio_endio(bio, err);
+}
+
+/*
+ * Time a request to the array for mddev_sync_latency().  Not worth failing
+ * the request for, so it just goes unmeasured if there is no memory.
+ */
+static void md_lat_start(mddev_t *mddev, struct bio *bio)
+{
+	struct md_lat_bio *lb;
+
+	lb = kmalloc(sizeof(*lb), GFP_NOIO);
+	if (!lb)
+		return;
+	lb->mddev = mddev;
+	lb->start = jiffies;
+	lb->bi_end_io = bio->bi_end_io;
+	lb->bi_private = bio->bi_private;
+	bio->bi_end_io = md_lat_end_io;
+	bio->bi_private = lb;
+}
+
 static int md_make_request(struct request_queue *q, struct bio *bio)
 {
 	const int rw = bio_data_dir(bio);
@@ -161,6 +200,9 @@ static int md_make_request(struct request_queue *q, struct bio *bio)
 	atomic_inc(&mddev->active_io);
 	rcu_read_unlock();
 
+	if (mddev->sync_latency_target && mddev->curr_resync)
+		md_lat_start(mddev, bio);
+
 	rv = mddev->pers->make_request(mddev, bio);
 
 	cpu = part_stat_lock();
@@ -3589,6 +3631,38 @@ sync_max_store(mddev_t *mddev, const char *buf, size_t len)
 static struct md_sysfs_entry md_sync_max =
 __ATTR(sync_speed_max, S_IRUGO|S_IWUSR, sync_max_show, sync_max_store);
 
+static ssize_t
+sync_latency_target_show(mddev_t *mddev, char *page)
+{
+	return sprintf(page, "%d\n", mddev->sync_latency_target);
+}
+
+static ssize_t
+sync_latency_target_store(mddev_t *mddev, const char *buf, size_t len)
+{
+	unsigned long ms;
+	char *e;
+	ms = simple_strtoul(buf, &e, 10);
+	if (buf == e || (*e && *e != '\n') || ms > 60000)
+		return -EINVAL;
+	mddev->sync_latency_target = ms;
+	return len;
+}
+
+static struct md_sysfs_entry md_sync_latency_target =
+__ATTR(sync_latency_target, S_IRUGO|S_IWUSR, sync_latency_target_show,
+       sync_latency_target_store);
+
+static ssize_t
+sync_speed_target_show(mddev_t *mddev, char *page)
+{
+	if (!mddev->sync_latency_target || !mddev->curr_resync)
+		return sprintf(page, "none\n");
+	return sprintf(page, "%d\n", mddev->sync_speed_target);
+}
+
+static struct md_sysfs_entry md_sync_speed_target = __ATTR_RO(sync_speed_target);
+
 static ssize_t
 degraded_show(mddev_t *mddev, char *page)
 {
@@ -3885,6 +3959,8 @@ static struct attribute *md_redundancy_attrs[] = {
 	&md_mismatches.attr,
 	&md_sync_min.attr,
 	&md_sync_max.attr,
+	&md_sync_latency_target.attr,
+	&md_sync_speed_target.attr,
 	&md_sync_speed.attr,
 	&md_sync_force_parallel.attr,
 	&md_sync_completed.attr,
@@ -4413,6 +4489,7 @@ static void md_clean(mddev_t *mddev)
 	mddev->resync_mismatches = 0;
 	mddev->suspend_lo = mddev->suspend_hi = 0;
 	mddev->sync_speed_min = mddev->sync_speed_max = 0;
+	mddev->sync_latency_target = 0;
 	mddev->recovery = 0;
 	mddev->in_sync = 0;
 	mddev->degraded = 0;
@@ -6205,6 +6282,22 @@ static int is_mddev_idle(mddev_t *mddev, int init)
 	return idle;
 }
 
+/*
+ * Average service time, in msec, of the array requests completed since the
+ * previous call.  Returns -1 if nothing completed.  The member devices'
+ * statistics can't be used here as they include the resync I/O itself.
+ */
+static int mddev_sync_latency(mddev_t *mddev)
+{
+	unsigned long ios, ticks;
+
+	ios = atomic_long_xchg(&mddev->lat_ios, 0);
+	ticks = atomic_long_xchg(&mddev->lat_ticks, 0);
+	if (!ios)
+		return -1;
+	return jiffies_to_msecs(ticks) / ios;
+}
+
 void md_done_sync(mddev_t *mddev, int blocks, int ok)
 {
 	/* another "blocks" (512byte) blocks have been synced */
@@ -6308,6 +6401,7 @@ void md_do_sync(mddev_t *mddev)
 	int skipped = 0;
 	mdk_rdev_t *rdev;
 	char *desc;
+	unsigned long last_sample;
 
 	/* just incase thread restarts... */
 	if (test_bit(MD_RECOVERY_DONE, &mddev->recovery))
@@ -6429,6 +6523,9 @@ void md_do_sync(mddev_t *mddev)
 	       speed_max(mddev), desc);
 
 	is_mddev_idle(mddev, 1); /* this initializes IO event counters */
+	mddev_sync_latency(mddev);
+	last_sample = jiffies;
+	mddev->sync_speed_target = speed_min(mddev);
 
 	io_sectors = 0;
 	for (m = 0; m < SYNC_MARKS; m++) {
@@ -6553,7 +6650,32 @@ void md_do_sync(mddev_t *mddev)
 		currspeed = ((unsigned long)(io_sectors-mddev->resync_mark_cnt))/2
 			/((jiffies-mddev->resync_mark)/HZ +1) +1;
 
-		if (currspeed > speed_min(mddev)) {
+		if (mddev->sync_latency_target) {
+			/* Rather than backing off whenever the array is
+			 * not idle, chase the highest rate that keeps the
+			 * array's request latency under the target: halve
+			 * it when requests are too slow, creep back up when
+			 * they are not.
+			 */
+			if (time_after_eq(jiffies, last_sample + HZ/10)) {
+				int lat = mddev_sync_latency(mddev);
+				int target = mddev->sync_speed_target;
+
+				last_sample = jiffies;
+				if (lat > mddev->sync_latency_target)
+					target /= 2;
+				else if (lat >= 0)
+					target += speed_max(mddev) / 16 + 1;
+				target = max(target, speed_min(mddev));
+				target = min(target, speed_max(mddev));
+				mddev->sync_speed_target = target;
+			}
+			if (currspeed > speed_min(mddev) &&
+			    currspeed > mddev->sync_speed_target) {
+				msleep(100);
+				goto repeat;
+			}
+		} else if (currspeed > speed_min(mddev)) {
 			if ((currspeed > speed_max(mddev)) ||
 					!is_mddev_idle(mddev, 0)) {
 				msleep(500);
@@ -186,6 +186,13 @@ struct mddev_s
 	/* if zero, use the system-wide default */
 	int				sync_speed_min;
 	int				sync_speed_max;
+	/* if set, request latency (msec) above which resync backs off */
+	int				sync_latency_target;
+	int				sync_speed_target; /* KB/sec, adaptive */
+	/* array requests completed, and their service time, while
+	 * sync_latency_target is in effect */
+	atomic_long_t			lat_ios;
+	atomic_long_t			lat_ticks;
 
 	/* resync even though the same disks are shared among md-devices */
 	int				parallel_resync;
@@ -16,6 +16,7 @@
 
 
 #define NR_STRIPES		256
+#define MAX_STRIPES		4096
 #define STRIPE_SIZE		PAGE_SIZE
 #define STRIPE_SHIFT		(PAGE_SHIFT - 9)
 #define STRIPE_SECTORS		(STRIPE_SIZE>>9)
@@ -127,12 +128,25 @@ static int stripe_operations_active(struct stripe_head *sh)
 	       test_bit(STRIPE_COMPUTE_RUN, &sh->state);
 }
 
+/* called with device_lock held, which raid5_set_workers swaps them under */
+static struct r5worker *stripe_worker(raid5_conf_t *conf,
+				      struct stripe_head *sh)
+{
+	sector_t stripe = sh->sector >> STRIPE_SHIFT;
+
+	if (!conf->worker_cnt)
+		return NULL;
+	return &conf->workers[sector_div(stripe, conf->worker_cnt)];
+}
+
 static void __release_stripe(raid5_conf_t *conf, struct stripe_head *sh)
 {
 	if (atomic_dec_and_test(&sh->count)) {
 		BUG_ON(!list_empty(&sh->lru));
 		BUG_ON(atomic_read(&conf->active_stripes)==0);
 		if (test_bit(STRIPE_HANDLE, &sh->state)) {
+			struct r5worker *worker = NULL;
+
 			if (test_bit(STRIPE_DELAYED, &sh->state)) {
 				list_add_tail(&sh->lru, &conf->delayed_list);
 				blk_plug_device(conf->mddev->queue);
@@ -142,9 +156,18 @@ static void __release_stripe(raid5_conf_t *conf, struct stripe_head *sh)
 				blk_plug_device(conf->mddev->queue);
 			} else {
 				clear_bit(STRIPE_BIT_DELAY, &sh->state);
-				list_add_tail(&sh->lru, &conf->handle_list);
+				worker = stripe_worker(conf, sh);
+				if (worker)
+					list_add_tail(&sh->lru,
+						      &worker->handle_list);
+				else
+					list_add_tail(&sh->lru,
+						      &conf->handle_list);
 			}
-			md_wakeup_thread(conf->mddev->thread);
+			if (worker)
+				wake_up(&worker->wait);
+			else
+				md_wakeup_thread(conf->mddev->thread);
 		} else {
 			BUG_ON(stripe_operations_active(sh));
 			if (test_and_clear_bit(STRIPE_PREREAD_ACTIVE, &sh->state)) {
@@ -226,7 +249,7 @@ static void shrink_buffers(struct stripe_head *sh)
 	}
 }
 
-static int grow_buffers(struct stripe_head *sh)
+static int grow_buffers(struct stripe_head *sh, gfp_t gfp)
 {
 	int i;
 	int num = sh->raid_conf->pool_size;
@@ -234,7 +257,7 @@ static int grow_buffers(struct stripe_head *sh)
 	for (i = 0; i < num; i++) {
 		struct page *page;
 
-		if (!(page = alloc_page(GFP_KERNEL))) {
+		if (!(page = alloc_page(gfp))) {
 			return 1;
 		}
 		sh->dev[i].page = page;
@@ -373,12 +396,18 @@ get_active_stripe(raid5_conf_t *conf, sector_t sector,
 				    conf->device_lock, /* nothing */);
 		sh = __find_stripe(conf, sector, conf->generation - previous);
 		if (!sh) {
+			conf->stripe_misses++;
 			if (!conf->inactive_blocked)
 				sh = get_free_stripe(conf);
 			if (noblock && sh == NULL)
 				break;
 			if (!sh) {
+				unsigned long start = jiffies;
+
 				conf->inactive_blocked = 1;
+				conf->stripe_waits++;
+				if (conf->max_nr_stripes < conf->stripe_cache_max)
+					schedule_work(&conf->grow_work);
 				wait_event_lock_irq(conf->wait_for_stripe,
 						    !list_empty(&conf->inactive_list) &&
 						    (atomic_read(&conf->active_stripes)
@@ -388,9 +417,11 @@ get_active_stripe(raid5_conf_t *conf, sector_t sector,
 						    raid5_unplug_device(conf->mddev->queue)
 					);
 				conf->inactive_blocked = 0;
+				conf->stripe_wait_jiffies += jiffies - start;
 			} else
 				init_stripe(sh, sector, previous);
 		} else {
+			conf->stripe_hits++;
 			if (atomic_read(&sh->count)) {
 				BUG_ON(!list_empty(&sh->lru)
 				    && !test_bit(STRIPE_EXPANDING, &sh->state));
@@ -1218,10 +1249,10 @@ static void raid_run_ops(struct stripe_head *sh, unsigned long ops_request)
 #define raid_run_ops __raid_run_ops
 #endif
 
-static int grow_one_stripe(raid5_conf_t *conf)
+static int grow_one_stripe(raid5_conf_t *conf, gfp_t gfp)
 {
 	struct stripe_head *sh;
-	sh = kmem_cache_alloc(conf->slab_cache, GFP_KERNEL);
+	sh = kmem_cache_alloc(conf->slab_cache, gfp);
 	if (!sh)
 		return 0;
 	memset(sh, 0, sizeof(*sh) + (conf->pool_size-1)*sizeof(struct r5dev));
@@ -1231,7 +1262,7 @@ static int grow_one_stripe(raid5_conf_t *conf)
 	init_waitqueue_head(&sh->ops.wait_for_ops);
 	#endif
 
-	if (grow_buffers(sh)) {
+	if (grow_buffers(sh, gfp)) {
 		shrink_buffers(sh);
 		kmem_cache_free(conf->slab_cache, sh);
 		return 0;
@@ -1262,7 +1293,7 @@ static int grow_stripes(raid5_conf_t *conf, int num)
 	conf->slab_cache = sc;
 	conf->pool_size = devs;
 	while (num--)
-		if (!grow_one_stripe(conf))
+		if (!grow_one_stripe(conf, GFP_KERNEL))
 			return 1;
 	return 0;
 }
@@ -1441,6 +1472,50 @@ static int drop_one_stripe(raid5_conf_t *conf)
 	return 1;
 }
 
+/*
+ * The stripe cache grows on its own, STRIPE_GROW_BATCH stripes at a time,
+ * whenever get_active_stripe() has to wait for a free stripe, up to
+ * stripe_cache_max.  Stripes above stripe_cache_size (the floor) are
+ * given back when the VM asks for memory.
+ */
+#define STRIPE_GROW_BATCH	32
+
+static void raid5_grow_work(struct work_struct *work)
+{
+	raid5_conf_t *conf = container_of(work, raid5_conf_t, grow_work);
+	int i;
+
+	mutex_lock(&conf->cache_size_mutex);
+	for (i = 0; i < STRIPE_GROW_BATCH &&
+		     conf->max_nr_stripes < conf->stripe_cache_max; i++) {
+		if (!grow_one_stripe(conf, GFP_NOIO | __GFP_NOWARN))
+			break;
+		conf->max_nr_stripes++;
+		conf->stripe_grows++;
+	}
+	mutex_unlock(&conf->cache_size_mutex);
+}
+
+static int raid5_cache_shrink(struct shrinker *shrink, int nr_to_scan,
+			      gfp_t gfp_mask)
+{
+	raid5_conf_t *conf = container_of(shrink, raid5_conf_t, shrinker);
+
+	if (nr_to_scan) {
+		if (!mutex_trylock(&conf->cache_size_mutex))
+			return -1;
+		while (nr_to_scan-- &&
+		       conf->max_nr_stripes > conf->min_nr_stripes) {
+			if (!drop_one_stripe(conf))
+				break;
+			conf->max_nr_stripes--;
+			conf->stripe_shrinks++;
+		}
+		mutex_unlock(&conf->cache_size_mutex);
+	}
+	return max(conf->max_nr_stripes - conf->min_nr_stripes, 0);
+}
+
 static void shrink_stripes(raid5_conf_t *conf)
 {
 	while (drop_one_stripe(conf))
@@ -3733,6 +3808,28 @@ static int chunk_aligned_read(mddev_t *mddev, struct bio * raid_bio)
 	}
 }
 
+/*
+ * 'sh' was taken from a handle list (raid5d's or a worker's) ahead of
+ * the delayed prereads on hold_list; account for it so that they get
+ * their turn after bypass_threshold such stripes.
+ * Called with device_lock held.
+ */
+static void bypass_hold_list(raid5_conf_t *conf, struct stripe_head *sh)
+{
+	if (list_empty(&conf->hold_list))
+		conf->bypass_count = 0;
+	else if (!test_bit(STRIPE_IO_STARTED, &sh->state)) {
+		if (conf->hold_list.next == conf->last_hold)
+			conf->bypass_count++;
+		else {
+			conf->last_hold = conf->hold_list.next;
+			conf->bypass_count -= conf->bypass_threshold;
+			if (conf->bypass_count < 0)
+				conf->bypass_count = 0;
+		}
+	}
+}
+
 static struct stripe_head *__get_priority_stripe(raid5_conf_t *conf)
 {
 	struct stripe_head *sh;
@@ -3745,19 +3842,7 @@ static struct stripe_head *__get_priority_stripe(raid5_conf_t *conf)
 
 	if (!list_empty(&conf->handle_list)) {
 		sh = list_entry(conf->handle_list.next, typeof(*sh), lru);
-
-		if (list_empty(&conf->hold_list))
-			conf->bypass_count = 0;
-		else if (!test_bit(STRIPE_IO_STARTED, &sh->state)) {
-			if (conf->hold_list.next == conf->last_hold)
-				conf->bypass_count++;
-			else {
-				conf->last_hold = conf->hold_list.next;
-				conf->bypass_count -= conf->bypass_threshold;
-				if (conf->bypass_count < 0)
-					conf->bypass_count = 0;
-			}
-		}
+		bypass_hold_list(conf, sh);
 	} else if (!list_empty(&conf->hold_list) &&
 		   ((conf->bypass_threshold &&
 		     conf->bypass_count > conf->bypass_threshold) ||
@@ -3776,6 +3861,65 @@ static struct stripe_head *__get_priority_stripe(raid5_conf_t *conf)
 	return sh;
 }
 
+/*
+ * A large write visits each stripe_head once per data disk.  Releasing
+ * the stripe after every visit lets raid5d start on it while it is only
+ * partly covered, which costs a read-modify-write.  Instead, hold on to
+ * the stripes a write touches and release them together once they have
+ * all been filled, so that each becomes a full-stripe write and the
+ * parity for the whole batch is computed back to back.
+ * A chunk's worth of data disk sectors spans chunk_sectors/STRIPE_SECTORS
+ * stripes, so that is the batch size, within the limits below.
+ * The batch lives on the stack of make_request(), which can be deep
+ * under stacked devices: 16 covers the default 64K chunk.
+ */
+#define STRIPE_BATCH_MAX	16
+
+struct stripe_batch {
+	int			cnt;
+	int			max;
+	struct stripe_head	*sh[STRIPE_BATCH_MAX];
+};
+
+static void init_stripe_batch(raid5_conf_t *conf, struct stripe_batch *b)
+{
+	int max = conf->chunk_sectors / STRIPE_SECTORS;
+
+	/* Leave most of the stripe cache to other writers */
+	max = min(max, conf->max_nr_stripes / 4);
+	b->max = clamp(max, 1, STRIPE_BATCH_MAX);
+	b->cnt = 0;
+}
+
+static void release_stripe_batch(raid5_conf_t *conf, struct stripe_batch *b)
+{
+	int i;
+
+	if (!b->cnt)
+		return;
+	spin_lock_irq(&conf->device_lock);
+	for (i = 0; i < b->cnt; i++)
+		__release_stripe(conf, b->sh[i]);
+	spin_unlock_irq(&conf->device_lock);
+	b->cnt = 0;
+}
+
+/* Keep our reference to 'sh' in the batch, or drop it if already held */
+static void batch_stripe(raid5_conf_t *conf, struct stripe_batch *b,
+			 struct stripe_head *sh)
+{
+	int i;
+
+	for (i = 0; i < b->cnt; i++)
+		if (b->sh[i] == sh) {
+			release_stripe(sh);
+			return;
+		}
+	if (b->cnt == b->max)
+		release_stripe_batch(conf, b);
+	b->sh[b->cnt++] = sh;
+}
+
 static int make_request(mddev_t *mddev, struct bio * bi)
 {
 	raid5_conf_t *conf = mddev->private;
@@ -3785,6 +3929,7 @@ static int make_request(mddev_t *mddev, struct bio * bi)
 	struct stripe_head *sh;
 	const int rw = bio_data_dir(bi);
 	int remaining;
+	struct stripe_batch batch;
 
 	if (unlikely(bio_rw_flagged(bi, BIO_RW_BARRIER))) {
 		/* Drain all pending writes.  We only really need
@@ -3808,6 +3953,7 @@ static int make_request(mddev_t *mddev, struct bio * bi)
 	last_sector = bi->bi_sector + (bi->bi_size>>9);
 	bi->bi_next = NULL;
 	bi->bi_phys_segments = 1;	/* over-loaded to count active stripes */
+	init_stripe_batch(conf, &batch);
 
 	for (;logical_sector < last_sector; logical_sector += STRIPE_SECTORS) {
 		DEFINE_WAIT(w);
@@ -3838,6 +3984,7 @@ static int make_request(mddev_t *mddev, struct bio * bi)
 				    ? logical_sector < conf->reshape_safe
 				    : logical_sector >= conf->reshape_safe) {
 					spin_unlock_irq(&conf->device_lock);
+					release_stripe_batch(conf, &batch);
 					schedule();
 					goto retry;
 				}
@@ -3853,8 +4000,20 @@ static int make_request(mddev_t *mddev, struct bio * bi)
 			(unsigned long long)new_sector, 
 			(unsigned long long)logical_sector);
 
+		/* Never sleep for a free stripe while holding a batch.
+		 * A pending quiesce waits for our held stripes, so give
+		 * them up and wait for it like everybody else.
+		 */
+		if (batch.cnt && conf->quiesce)
+			release_stripe_batch(conf, &batch);
 		sh = get_active_stripe(conf, new_sector, previous,
-				       (bi->bi_rw&RWA_MASK), 0);
+				       (bi->bi_rw&RWA_MASK) || batch.cnt,
+				       batch.cnt);
+		if (!sh && batch.cnt) {
+			release_stripe_batch(conf, &batch);
+			sh = get_active_stripe(conf, new_sector, previous,
+					       (bi->bi_rw&RWA_MASK), 0);
+		}
 		if (sh) {
 			if (unlikely(previous)) {
 				/* expansion might have moved on while waiting for a
@@ -3875,6 +4034,7 @@ static int make_request(mddev_t *mddev, struct bio * bi)
 				spin_unlock_irq(&conf->device_lock);
 				if (must_retry) {
 					release_stripe(sh);
+					release_stripe_batch(conf, &batch);
 					schedule();
 					goto retry;
 				}
@@ -3884,6 +4044,7 @@ static int make_request(mddev_t *mddev, struct bio * bi)
 			    logical_sector >= mddev->suspend_lo &&
 			    logical_sector < mddev->suspend_hi) {
 				release_stripe(sh);
+				release_stripe_batch(conf, &batch);
 				/* As the suspend_* range is controlled by
 				 * userspace, we want an interruptible
 				 * wait.
@@ -3903,8 +4064,9 @@ static int make_request(mddev_t *mddev, struct bio * bi)
 				 * add failed due to overlap.  Flush everything
 				 * and wait a while
 				 */
-				raid5_unplug_device(mddev->queue);
 				release_stripe(sh);
+				release_stripe_batch(conf, &batch);
+				raid5_unplug_device(mddev->queue);
 				schedule();
 				goto retry;
 			}
@@ -3914,7 +4076,10 @@ static int make_request(mddev_t *mddev, struct bio * bi)
 			if (mddev->barrier && 
 			    !test_and_set_bit(STRIPE_PREREAD_ACTIVE, &sh->state))
 				atomic_inc(&conf->preread_active_stripes);
-			release_stripe(sh);
+			if (rw == WRITE)
+				batch_stripe(conf, &batch, sh);
+			else
+				release_stripe(sh);
 		} else {
 			/* cannot get stripe for read-ahead, just give-up */
 			clear_bit(BIO_UPTODATE, &bi->bi_flags);
@@ -3923,6 +4088,7 @@ static int make_request(mddev_t *mddev, struct bio * bi)
 		}
 			
 	}
+	release_stripe_batch(conf, &batch);
 	spin_lock_irq(&conf->device_lock);
 	remaining = raid5_dec_bi_phys_segments(bi);
 	spin_unlock_irq(&conf->device_lock);
@@ -4377,6 +4543,98 @@ static void raid5d(mddev_t *mddev)
 	pr_debug("--- raid5d inactive\n");
 }
 
+static int raid5_worker_thread(void *arg)
+{
+	struct r5worker *worker = arg;
+	raid5_conf_t *conf = worker->conf;
+	struct stripe_head *sh;
+	int handled;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(worker->wait,
+			!list_empty_careful(&worker->handle_list) ||
+			kthread_should_stop());
+
+		handled = 0;
+		spin_lock_irq(&conf->device_lock);
+		while (!list_empty(&worker->handle_list)) {
+			sh = list_entry(worker->handle_list.next,
+					struct stripe_head, lru);
+			list_del_init(&sh->lru);
+			atomic_inc(&sh->count);
+			BUG_ON(atomic_read(&sh->count) != 1);
+			bypass_hold_list(conf, sh);
+			/* hold_list is only served by raid5d */
+			if (conf->bypass_threshold &&
+			    conf->bypass_count > conf->bypass_threshold)
+				md_wakeup_thread(conf->mddev->thread);
+			spin_unlock_irq(&conf->device_lock);
+
+			handled++;
+			handle_stripe(sh);
+			release_stripe(sh);
+			cond_resched();
+
+			spin_lock_irq(&conf->device_lock);
+		}
+		spin_unlock_irq(&conf->device_lock);
+
+		if (handled) {
+			async_tx_issue_pending_all();
+			unplug_slaves(conf->mddev);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Replace the current set of stripe workers with 'cnt' new ones.  Any
+ * stripes still queued to the old workers are handed back to raid5d.
+ */
+static int raid5_set_workers(raid5_conf_t *conf, int cnt)
+{
+	struct r5worker *old, *new = NULL;
+	int old_cnt, i;
+
+	if (cnt) {
+		new = kcalloc(cnt, sizeof(*new), GFP_KERNEL);
+		if (!new)
+			return -ENOMEM;
+		for (i = 0; i < cnt; i++) {
+			new[i].conf = conf;
+			INIT_LIST_HEAD(&new[i].handle_list);
+			init_waitqueue_head(&new[i].wait);
+			new[i].tsk = kthread_run(raid5_worker_thread, &new[i],
+						 "%s_raid5w%d",
+						 mdname(conf->mddev), i);
+			if (IS_ERR(new[i].tsk)) {
+				int err = PTR_ERR(new[i].tsk);
+
+				while (i--)
+					kthread_stop(new[i].tsk);
+				kfree(new);
+				return err;
+			}
+		}
+	}
+
+	spin_lock_irq(&conf->device_lock);
+	old = conf->workers;
+	old_cnt = conf->worker_cnt;
+	for (i = 0; i < old_cnt; i++)
+		list_splice_tail_init(&old[i].handle_list, &conf->handle_list);
+	conf->workers = new;
+	conf->worker_cnt = cnt;
+	spin_unlock_irq(&conf->device_lock);
+
+	for (i = 0; i < old_cnt; i++)
+		kthread_stop(old[i].tsk);
+	kfree(old);
+
+	md_wakeup_thread(conf->mddev->thread);
+	return 0;
+}
+
 static ssize_t
 raid5_show_stripe_cache_size(mddev_t *mddev, char *page)
 {
@@ -4403,6 +4661,10 @@ raid5_store_stripe_cache_size(mddev_t *mddev, const char *page, size_t len)
 		return -EINVAL;
 	if (new <= 16 || new > 32768)
 		return -EINVAL;
+	mutex_lock(&conf->cache_size_mutex);
+	conf->min_nr_stripes = new;
+	if (conf->stripe_cache_max < new)
+		conf->stripe_cache_max = new;
 	while (new < conf->max_nr_stripes) {
 		if (drop_one_stripe(conf))
 			conf->max_nr_stripes--;
@@ -4411,13 +4673,15 @@ raid5_store_stripe_cache_size(mddev_t *mddev, const char *page, size_t len)
 	}
 	err = md_allow_write(mddev);
 	if (err)
-		return err;
+		goto out;
 	while (new > conf->max_nr_stripes) {
-		if (grow_one_stripe(conf))
+		if (grow_one_stripe(conf, GFP_KERNEL))
 			conf->max_nr_stripes++;
 		else break;
 	}
-	return len;
+out:
+	mutex_unlock(&conf->cache_size_mutex);
+	return err ?: len;
 }
 
 static struct md_sysfs_entry
@@ -4472,10 +4736,114 @@ stripe_cache_active_show(mddev_t *mddev, char *page)
 static struct md_sysfs_entry
 raid5_stripecache_active = __ATTR_RO(stripe_cache_active);
 
+static ssize_t
+raid5_show_stripe_cache_max(mddev_t *mddev, char *page)
+{
+	raid5_conf_t *conf = mddev->private;
+	if (conf)
+		return sprintf(page, "%d\n", conf->stripe_cache_max);
+	else
+		return 0;
+}
+
+static ssize_t
+raid5_store_stripe_cache_max(mddev_t *mddev, const char *page, size_t len)
+{
+	raid5_conf_t *conf = mddev->private;
+	unsigned long new;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (!conf)
+		return -ENODEV;
+
+	if (strict_strtoul(page, 10, &new))
+		return -EINVAL;
+	if (new > 32768)
+		return -EINVAL;
+	mutex_lock(&conf->cache_size_mutex);
+	if (new < conf->min_nr_stripes)
+		new = conf->min_nr_stripes;
+	conf->stripe_cache_max = new;
+	while (conf->max_nr_stripes > new) {
+		if (!drop_one_stripe(conf))
+			break;
+		conf->max_nr_stripes--;
+	}
+	mutex_unlock(&conf->cache_size_mutex);
+	return len;
+}
+
+static struct md_sysfs_entry
+raid5_stripecache_max = __ATTR(stripe_cache_max, S_IRUGO | S_IWUSR,
+			       raid5_show_stripe_cache_max,
+			       raid5_store_stripe_cache_max);
+
+static ssize_t
+stripe_cache_stats_show(mddev_t *mddev, char *page)
+{
+	raid5_conf_t *conf = mddev->private;
+	if (conf)
+		return sprintf(page, "hits=%lu misses=%lu waits=%lu "
+			       "wait_ms=%u grows=%lu shrinks=%lu\n",
+			       conf->stripe_hits, conf->stripe_misses,
+			       conf->stripe_waits,
+			       jiffies_to_msecs(conf->stripe_wait_jiffies),
+			       conf->stripe_grows, conf->stripe_shrinks);
+	else
+		return 0;
+}
+
+static struct md_sysfs_entry
+raid5_stripecache_stats = __ATTR_RO(stripe_cache_stats);
+
+static ssize_t
+raid5_show_stripe_workers(mddev_t *mddev, char *page)
+{
+	raid5_conf_t *conf = mddev->private;
+	if (conf)
+		return sprintf(page, "%d\n", conf->worker_cnt);
+	else
+		return 0;
+}
+
+static ssize_t
+raid5_store_stripe_workers(mddev_t *mddev, const char *page, size_t len)
+{
+	raid5_conf_t *conf = mddev->private;
+	unsigned long new;
+	int err;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (!conf)
+		return -ENODEV;
+
+	if (strict_strtoul(page, 10, &new))
+		return -EINVAL;
+	if (new > num_possible_cpus())
+		return -EINVAL;
+	if (new == conf->worker_cnt)
+		return len;
+	/* no stripe may be hashed to a worker while they are replaced */
+	mddev->pers->quiesce(mddev, 1);
+	err = raid5_set_workers(conf, new);
+	mddev->pers->quiesce(mddev, 0);
+	return err ?: len;
+}
+
+static struct md_sysfs_entry
+raid5_stripe_workers = __ATTR(stripe_workers, S_IRUGO | S_IWUSR,
+			      raid5_show_stripe_workers,
+			      raid5_store_stripe_workers);
+
 static struct attribute *raid5_attrs[] =  {
 	&raid5_stripecache_size.attr,
 	&raid5_stripecache_active.attr,
+	&raid5_stripecache_max.attr,
+	&raid5_stripecache_stats.attr,
 	&raid5_preread_bypass_threshold.attr,
+	&raid5_stripe_workers.attr,
 	NULL,
 };
 static struct attribute_group raid5_attrs_group = {
@@ -4523,6 +4891,11 @@ static void raid5_free_percpu(raid5_conf_t *conf)
 
 static void free_conf(raid5_conf_t *conf)
 {
+	if (conf->shrinker.shrink)
+		unregister_shrinker(&conf->shrinker);
+	cancel_work_sync(&conf->grow_work);
+	if (conf->workers)
+		raid5_set_workers(conf, 0);
 	shrink_stripes(conf);
 	raid5_free_percpu(conf);
 	kfree(conf->disks);
@@ -4655,6 +5028,8 @@ static raid5_conf_t *setup_conf(mddev_t *mddev)
 	init_waitqueue_head(&conf->wait_for_overlap);
 	INIT_LIST_HEAD(&conf->handle_list);
 	INIT_LIST_HEAD(&conf->hold_list);
+	mutex_init(&conf->cache_size_mutex);
+	INIT_WORK(&conf->grow_work, raid5_grow_work);
 	INIT_LIST_HEAD(&conf->delayed_list);
 	INIT_LIST_HEAD(&conf->bitmap_list);
 	INIT_LIST_HEAD(&conf->inactive_list);
@@ -4714,6 +5089,8 @@ static raid5_conf_t *setup_conf(mddev_t *mddev)
 		conf->max_degraded = 1;
 	conf->algorithm = mddev->new_layout;
 	conf->max_nr_stripes = NR_STRIPES;
+	conf->min_nr_stripes = NR_STRIPES;
+	conf->stripe_cache_max = MAX_STRIPES;
 	conf->reshape_progress = mddev->reshape_position;
 	if (conf->reshape_progress != MaxSector) {
 		conf->prev_chunk_sectors = mddev->chunk_sectors;
@@ -4731,6 +5108,10 @@ static raid5_conf_t *setup_conf(mddev_t *mddev)
 		printk(KERN_INFO "md/raid:%s: allocated %dkB\n",
 		       mdname(mddev), memory);
 
+	conf->shrinker.shrink = raid5_cache_shrink;
+	conf->shrinker.seeks = DEFAULT_SEEKS * conf->raid_disks * 4;
+	register_shrinker(&conf->shrinker);
+
 	conf->thread = md_register_thread(raid5d, mddev, NULL);
 	if (!conf->thread) {
 		printk(KERN_ERR
@@ -5264,6 +5645,7 @@ static int check_stripe_cache(mddev_t *mddev)
 static int check_reshape(mddev_t *mddev)
 {
 	raid5_conf_t *conf = mddev->private;
+	int err;
 
 	if (mddev->delta_disks == 0 &&
 	    mddev->new_layout == mddev->layout &&
@@ -5290,7 +5672,10 @@ static int check_reshape(mddev_t *mddev)
 	if (!check_stripe_cache(mddev))
 		return -ENOSPC;
 
-	return resize_stripes(conf, conf->raid_disks + mddev->delta_disks);
+	mutex_lock(&conf->cache_size_mutex);
+	err = resize_stripes(conf, conf->raid_disks + mddev->delta_disks);
+	mutex_unlock(&conf->cache_size_mutex);
+	return err;
 }
 
 static int raid5_start_reshape(mddev_t *mddev)
@@ -137,6 +137,18 @@ struct disk_info {
 	mdk_rdev_t	*rdev;
 };
 
+/*
+ * Optional pool of threads that share the stripe handling work with
+ * raid5d.  Each stripe is always queued to the same worker (chosen by
+ * its sector) so that work on one stripe is never reordered.
+ */
+struct r5worker {
+	struct raid5_private_data *conf;
+	struct list_head	handle_list; /* stripes hashed to this worker */
+	wait_queue_head_t	wait;
+	struct task_struct	*tsk;
+};
+
 struct raid5_private_data {
 	struct hlist_head	*stripe_hashtbl;
 	mddev_t			*mddev;
@@ -145,7 +157,19 @@ struct raid5_private_data {
 	int			level, algorithm;
 	int			max_degraded;
 	int			raid_disks;
-	int			max_nr_stripes;
+	int			max_nr_stripes; /* current cache size */
+	int			min_nr_stripes; /* stripe_cache_size */
+	int			stripe_cache_max; /* auto-grow limit */
+	struct mutex		cache_size_mutex;
+	struct work_struct	grow_work;
+	struct shrinker		shrinker;
+	/* stripe cache statistics */
+	unsigned long		stripe_hits;
+	unsigned long		stripe_misses;
+	unsigned long		stripe_waits;
+	unsigned long		stripe_wait_jiffies;
+	unsigned long		stripe_grows;
+	unsigned long		stripe_shrinks;
 
 	/* reshape_progress is the leading edge of a 'reshape'
 	 * It has value MaxSector when no reshape is happening
@@ -165,6 +189,8 @@ struct raid5_private_data {
 						     * metadata */
 
 	struct list_head	handle_list; /* stripes needing handling */
+	struct r5worker		*workers;
+	int			worker_cnt; /* 0: raid5d handles everything */
 	struct list_head	hold_list; /* preread ready stripes */
 	struct list_head	delayed_list; /* stripes that have plugged requests */
 	struct list_head	bitmap_list; /* stripes delaying awaiting bitmap update */
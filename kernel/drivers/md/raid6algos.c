@@ -6,7 +6,12 @@
 #ifndef __KERNEL__
 #include <sys/mman.h>
 #include <stdio.h>
+#include <string.h>
 #else
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/string.h>
 #if !RAID6_USE_EMPTY_ZERO_PAGE
 /* In .bss so it's zeroed */
 const char raid6_empty_zero_page[PAGE_SIZE] __attribute__((aligned(256)));
@@ -49,11 +54,74 @@ const struct raid6_calls * const raid6_algos[] = {
 };
 
 #ifdef __KERNEL__
-#define RAID6_TIME_JIFFIES_LG2	4
+static char raid6_algo_name[16];
+module_param_string(algo, raid6_algo_name, sizeof(raid6_algo_name), 0444);
+MODULE_PARM_DESC(algo, "Use the named syndrome routine instead of "
+		 "benchmarking (reports the active routine when read)");
+
+static unsigned long raid6_speed;
+module_param_named(speed, raid6_speed, ulong, 0444);
+MODULE_PARM_DESC(speed, "Measured speed of the active syndrome routine "
+		 "in MB/s");
+
+#define RAID6_BENCH_ROUNDS	4
+#define RAID6_BENCH_MIN_NS	(500 * NSEC_PER_USEC)
+
+/*
+ * Time back-to-back syndrome generations against the clocksource and
+ * keep the best of a few short rounds.  This is both quicker and less
+ * sensitive to a busy CPU than counting iterations across 16 jiffies.
+ */
+static unsigned long raid6_bench(const struct raid6_calls *algo, int disks,
+				 void **dptrs)
+{
+	unsigned long count, perf, bestperf = 0;
+	ktime_t start;
+	s64 ns;
+	int i;
+
+	for (i = 0; i < RAID6_BENCH_ROUNDS; i++) {
+		count = 0;
+		preempt_disable();
+		start = ktime_get();
+		do {
+			algo->gen_syndrome(disks, PAGE_SIZE, dptrs);
+			count++;
+			ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		} while (ns < RAID6_BENCH_MIN_NS);
+		preempt_enable();
+
+		/* Each call covers 64K of data */
+		perf = div64_u64((u64)count * NSEC_PER_SEC, (u64)ns << 4);
+		if (perf > bestperf)
+			bestperf = perf;
+	}
+
+	return bestperf;
+}
 #else
+static char raid6_algo_name[16];
+
 /* Need more time to be stable in userspace */
 #define RAID6_TIME_JIFFIES_LG2	9
 #define time_before(x, y) ((x) < (y))
+
+static unsigned long raid6_bench(const struct raid6_calls *algo, int disks,
+				 void **dptrs)
+{
+	unsigned long perf = 0;
+	unsigned long j0, j1;
+
+	j0 = jiffies;
+	while ( (j1 = jiffies) == j0 )
+		cpu_relax();
+	while (time_before(jiffies, j1 + (1<<RAID6_TIME_JIFFIES_LG2))) {
+		algo->gen_syndrome(disks, PAGE_SIZE, dptrs);
+		perf++;
+	}
+
+	return (perf*HZ) >> (20-16+RAID6_TIME_JIFFIES_LG2);
+}
 #endif
 
 /* Try to pick the best algorithm */
@@ -68,7 +136,6 @@ int __init raid6_select_algo(void)
 	int i, disks;
 	unsigned long perf, bestperf;
 	int bestprefer;
-	unsigned long j0, j1;
 
 	disks = (65536/PAGE_SIZE)+2;
 	for ( i = 0 ; i < disks-2 ; i++ ) {
@@ -88,20 +155,27 @@ int __init raid6_select_algo(void)
 
 	bestperf = 0;  bestprefer = 0;  best = NULL;
 
-	for ( algo = raid6_algos ; *algo ; algo++ ) {
+	if ( *raid6_algo_name ) {
+		for ( algo = raid6_algos ; *algo ; algo++ ) {
+			if ( strcmp((*algo)->name, raid6_algo_name) ||
+			     ((*algo)->valid && !(*algo)->valid()) )
+				continue;
+
+			best = *algo;
+			bestperf = raid6_bench(best, disks, dptrs);
+			printk("raid6: using preselected algorithm %s\n",
+			       best->name);
+			break;
+		}
+
+		if ( !best )
+			printk("raid6: algorithm %s not available, "
+			       "benchmarking\n", raid6_algo_name);
+	}
+
+	for ( algo = raid6_algos ; !best && *algo ; algo++ ) {
 		if ( !(*algo)->valid || (*algo)->valid() ) {
-			perf = 0;
-
-			preempt_disable();
-			j0 = jiffies;
-			while ( (j1 = jiffies) == j0 )
-				cpu_relax();
-			while (time_before(jiffies,
-					    j1 + (1<<RAID6_TIME_JIFFIES_LG2))) {
-				(*algo)->gen_syndrome(disks, PAGE_SIZE, dptrs);
-				perf++;
-			}
-			preempt_enable();
+			perf = raid6_bench(*algo, disks, dptrs);
 
 			if ( (*algo)->prefer > bestprefer ||
 			     ((*algo)->prefer == bestprefer &&
@@ -110,16 +184,19 @@ int __init raid6_select_algo(void)
 				bestprefer = best->prefer;
 				bestperf = perf;
 			}
-			printk("raid6: %-8s %5ld MB/s\n", (*algo)->name,
-			       (perf*HZ) >> (20-16+RAID6_TIME_JIFFIES_LG2));
+			printk("raid6: %-8s %5ld MB/s\n", (*algo)->name, perf);
 		}
 	}
 
 	if (best) {
 		printk("raid6: using algorithm %s (%ld MB/s)\n",
-		       best->name,
-		       (bestperf*HZ) >> (20-16+RAID6_TIME_JIFFIES_LG2));
+		       best->name, bestperf);
 		raid6_call = *best;
+		strncpy(raid6_algo_name, best->name,
+			sizeof(raid6_algo_name) - 1);
+#ifdef __KERNEL__
+		raid6_speed = bestperf;
+#endif
 	} else
 		printk("raid6: Yikes!  No algorithm found!\n");
 
@@ -4,9 +4,12 @@
 #include <linux/mmc/card.h>
 #include <linux/mmc/host.h>
 #include <linux/mmc/mmc.h>
+#include <linux/mmc/async.h>
 #include <linux/slab.h>
 
 #include <linux/scatterlist.h>
+#include <linux/time.h>
+#include <linux/math64.h>
 
 #define RESULT_OK		0
 #define RESULT_FAIL		1
@@ -16,6 +19,22 @@
 #define BUFFER_ORDER		2
 #define BUFFER_SIZE		(PAGE_SIZE << BUFFER_ORDER)
 
+/* Bytes moved by each performance test */
+#define AREA_SIZE		(1024 * 1024)
+/* Size of a "small" write in the performance tests */
+#define SMALL_SIZE		4096
+/* Request size for the sequential performance tests */
+#define SEQ_SIZE		(64 * 1024)
+
+/* Pages for the performance tests, and where on the card they go */
+struct mmc_test_area {
+	struct page		**pages;
+	unsigned int		nr_pages;
+	struct scatterlist	*sg;
+	struct scatterlist	*sg2;	/* for a second request in flight */
+	unsigned int		dev_addr;
+};
+
 struct mmc_test_card {
 	struct mmc_card	*card;
 
@@ -24,6 +43,7 @@ struct mmc_test_card {
 #ifdef CONFIG_HIGHMEM
 	struct page	*highmem;
 #endif
+	struct mmc_test_area area;
 };
 
 /*******************************************************************/
@@ -850,6 +870,333 @@ static int mmc_test_multi_read_high(struct mmc_test_card *test)
 
 #endif /* CONFIG_HIGHMEM */
 
+/*******************************************************************/
+/*  Performance tests                                              */
+/*******************************************************************/
+
+static unsigned int mmc_test_capacity(struct mmc_card *card)
+{
+	if (!mmc_card_sd(card) && mmc_card_blockaddr(card))
+		return card->ext_csd.sectors;
+	else
+		return card->csd.capacity << (card->csd.read_blkbits - 9);
+}
+
+static int mmc_test_area_cleanup(struct mmc_test_card *test)
+{
+	struct mmc_test_area *t = &test->area;
+	unsigned int i;
+
+	if (t->pages) {
+		for (i = 0; i < t->nr_pages; i++)
+			if (t->pages[i])
+				__free_page(t->pages[i]);
+	}
+	kfree(t->pages);
+	kfree(t->sg);
+	kfree(t->sg2);
+	memset(t, 0, sizeof(*t));
+
+	return 0;
+}
+
+/*
+ * The performance tests write AREA_SIZE bytes a quarter of the way into
+ * the card, away from the blocks the other tests use.
+ */
+static int mmc_test_area_prepare(struct mmc_test_card *test)
+{
+	struct mmc_test_area *t = &test->area;
+	unsigned int i, sectors = AREA_SIZE >> 9;
+	int ret;
+
+	if (mmc_test_capacity(test->card) < 4 * sectors)
+		return RESULT_UNSUP_CARD;
+
+	t->nr_pages = AREA_SIZE >> PAGE_SHIFT;
+	t->pages = kzalloc(t->nr_pages * sizeof(*t->pages), GFP_KERNEL);
+	t->sg = kmalloc(t->nr_pages * sizeof(*t->sg), GFP_KERNEL);
+	t->sg2 = kmalloc(t->nr_pages * sizeof(*t->sg2), GFP_KERNEL);
+	if (!t->pages || !t->sg || !t->sg2)
+		goto out_free;
+
+	for (i = 0; i < t->nr_pages; i++) {
+		t->pages[i] = alloc_page(GFP_KERNEL);
+		if (!t->pages[i])
+			goto out_free;
+		memset(page_address(t->pages[i]), i, PAGE_SIZE);
+	}
+
+	t->dev_addr = mmc_test_capacity(test->card) / 4;
+	t->dev_addr -= t->dev_addr % sectors;
+
+	ret = mmc_test_set_blksize(test, 512);
+	if (ret)
+		mmc_test_area_cleanup(test);
+	return ret;
+
+out_free:
+	mmc_test_area_cleanup(test);
+	return -ENOMEM;
+}
+
+/*
+ * Largest transfer the host takes in one request, at most AREA_SIZE,
+ * with one page per scatterlist entry.
+ */
+static unsigned int mmc_test_area_max(struct mmc_test_card *test)
+{
+	struct mmc_host *host = test->card->host;
+	unsigned int sz = AREA_SIZE;
+
+	sz = min(sz, host->max_req_size);
+	sz = min(sz, host->max_blk_count * 512);
+	sz = min(sz, (unsigned int)host->max_hw_segs << PAGE_SHIFT);
+	if (host->max_seg_size < PAGE_SIZE)
+		sz = min(sz, host->max_seg_size);
+
+	return sz & ~511;
+}
+
+/* Map sz bytes of the area, from byte offset off, into sg. */
+static unsigned int mmc_test_area_map(struct mmc_test_card *test,
+	struct scatterlist *sg, unsigned int off, unsigned int sz)
+{
+	struct mmc_test_area *t = &test->area;
+	unsigned int sg_len = 0, len;
+
+	sg_init_table(sg, t->nr_pages);
+	while (sz) {
+		len = min_t(unsigned int, sz, PAGE_SIZE - (off & ~PAGE_MASK));
+		sg_set_page(&sg[sg_len++], t->pages[off >> PAGE_SHIFT], len,
+			    off & ~PAGE_MASK);
+		off += len;
+		sz -= len;
+	}
+	sg_mark_end(&sg[sg_len - 1]);
+
+	return sg_len;
+}
+
+/* Write sz bytes of the area, from byte offset off, as one request. */
+static int mmc_test_area_write(struct mmc_test_card *test, unsigned int off,
+	unsigned int sz)
+{
+	struct mmc_test_area *t = &test->area;
+	unsigned int sg_len = mmc_test_area_map(test, t->sg, off, sz);
+
+	return mmc_test_simple_transfer(test, t->sg, sg_len,
+		t->dev_addr + (off >> 9), sz >> 9, 512, 1);
+}
+
+struct mmc_test_async_req {
+	struct mmc_request	mrq;
+	struct mmc_command	cmd;
+	struct mmc_command	stop;
+	struct mmc_data		data;
+	struct completion	complete;
+};
+
+static void mmc_test_area_mrq(struct mmc_test_card *test,
+	struct mmc_test_async_req *areq, struct scatterlist *sg,
+	unsigned int off, unsigned int sz, int write)
+{
+	struct mmc_test_area *t = &test->area;
+	unsigned int sg_len;
+
+	memset(areq, 0, sizeof(*areq));
+	areq->mrq.cmd = &areq->cmd;
+	areq->mrq.data = &areq->data;
+	areq->mrq.stop = &areq->stop;
+
+	sg_len = mmc_test_area_map(test, sg, off, sz);
+	mmc_test_prepare_mrq(test, &areq->mrq, sg, sg_len,
+		t->dev_addr + (off >> 9), sz >> 9, 512, write);
+}
+
+static int mmc_test_area_finish(struct mmc_test_card *test,
+	struct mmc_test_async_req *areq, int write)
+{
+	mmc_wait_for_req_done(&areq->mrq);
+	mmc_post_req(test->card->host, &areq->mrq, areq->data.error);
+
+	if (write)
+		mmc_test_wait_busy(test);
+
+	return mmc_test_check_result(test, &areq->mrq);
+}
+
+/*
+ * Move the area in requests of sz bytes.  Blocking, a request is only
+ * set up once the previous one is done.  Non-blocking, it is set up,
+ * host DMA mapping included, while the previous one is on the bus.
+ */
+static int mmc_test_area_seq(struct mmc_test_card *test, unsigned int sz,
+	int write, int nonblock)
+{
+	struct mmc_test_area *t = &test->area;
+	struct mmc_host *host = test->card->host;
+	struct mmc_test_async_req areq[2];
+	struct mmc_test_async_req *cur, *prev = NULL;
+	unsigned int off;
+	int ret;
+
+	for (off = 0; off + sz <= AREA_SIZE; off += sz) {
+		cur = prev == &areq[0] ? &areq[1] : &areq[0];
+		mmc_test_area_mrq(test, cur, cur == &areq[0] ? t->sg : t->sg2,
+			off, sz, write);
+
+		if (!nonblock) {
+			mmc_wait_for_req(host, &cur->mrq);
+			if (write)
+				mmc_test_wait_busy(test);
+			ret = mmc_test_check_result(test, &cur->mrq);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		mmc_pre_req(host, &cur->mrq, !prev);
+		if (prev) {
+			ret = mmc_test_area_finish(test, prev, write);
+			if (ret) {
+				mmc_post_req(host, &cur->mrq, ret);
+				return ret;
+			}
+		}
+		mmc_start_req(host, &cur->mrq, &cur->complete);
+		prev = cur;
+	}
+
+	if (prev)
+		return mmc_test_area_finish(test, prev, write);
+
+	return 0;
+}
+
+static void mmc_test_print_rate(struct mmc_test_card *test, const char *what,
+	unsigned int bytes, struct timespec *ts1, struct timespec *ts2)
+{
+	struct timespec ts = timespec_sub(*ts2, *ts1);
+	u64 ns = timespec_to_ns(&ts);
+	unsigned int rate = 0;
+
+	if (ns)
+		rate = div64_u64((u64)bytes * NSEC_PER_SEC, ns) >> 10;
+
+	printk(KERN_INFO "%s: %s: %u bytes in %lu.%09lu seconds (%u kB/s)\n",
+		mmc_hostname(test->card->host), what, bytes,
+		(unsigned long)ts.tv_sec, (unsigned long)ts.tv_nsec, rate);
+}
+
+/*
+ * The whole area in small writes, one request each, as the block
+ * driver issues small writes it cannot pack.
+ */
+static int mmc_test_perf_small_write(struct mmc_test_card *test)
+{
+	struct timespec ts1, ts2;
+	unsigned int off;
+	char what[48];
+	int ret;
+
+	if (mmc_test_area_max(test) < SMALL_SIZE)
+		return RESULT_UNSUP_HOST;
+
+	getnstimeofday(&ts1);
+	for (off = 0; off < AREA_SIZE; off += SMALL_SIZE) {
+		ret = mmc_test_area_write(test, off, SMALL_SIZE);
+		if (ret)
+			return ret;
+	}
+	getnstimeofday(&ts2);
+
+	snprintf(what, sizeof(what), "%ukB writes, one per request",
+		 SMALL_SIZE >> 10);
+	mmc_test_print_rate(test, what, AREA_SIZE, &ts1, &ts2);
+
+	return 0;
+}
+
+/*
+ * The same writes joined n at a time into one multiple block write, a
+ * page per write, which is what mmc_block makes of contiguous writes it
+ * packs, for n doubling up to what the host takes in one request.
+ * scripts/blockbench/mmc.sh measures packing through mmcblk itself.
+ */
+static int mmc_test_perf_packed_write(struct mmc_test_card *test)
+{
+	struct timespec ts1, ts2;
+	unsigned int max = mmc_test_area_max(test);
+	unsigned int n, sz, off;
+	char what[48];
+	int ret;
+
+	if (test->card->host->max_blk_count == 1 || max < 2 * SMALL_SIZE)
+		return RESULT_UNSUP_HOST;
+
+	for (n = 2; n * SMALL_SIZE <= max; n <<= 1) {
+		sz = n * SMALL_SIZE;
+
+		getnstimeofday(&ts1);
+		for (off = 0; off + sz <= AREA_SIZE; off += sz) {
+			ret = mmc_test_area_write(test, off, sz);
+			if (ret)
+				return ret;
+		}
+		getnstimeofday(&ts2);
+
+		snprintf(what, sizeof(what), "%ukB writes, %u per request",
+			 SMALL_SIZE >> 10, n);
+		mmc_test_print_rate(test, what, off, &ts1, &ts2);
+	}
+
+	return 0;
+}
+
+/*
+ * The area in sequential requests, first each started only when the
+ * one before it is done, then each started as the one before it
+ * completes, having been set up meanwhile.
+ */
+static int mmc_test_perf_seq(struct mmc_test_card *test, int write)
+{
+	struct timespec ts1, ts2;
+	unsigned int sz = min_t(unsigned int, mmc_test_area_max(test),
+				SEQ_SIZE);
+	char what[48];
+	int nonblock, ret;
+
+	if (sz < 1024)
+		return RESULT_UNSUP_HOST;
+
+	for (nonblock = 0; nonblock < 2; nonblock++) {
+		getnstimeofday(&ts1);
+		ret = mmc_test_area_seq(test, sz, write, nonblock);
+		if (ret)
+			return ret;
+		getnstimeofday(&ts2);
+
+		snprintf(what, sizeof(what), "%ukB %s, %s", sz >> 10,
+			 write ? "writes" : "reads",
+			 nonblock ? "non-blocking" : "blocking");
+		mmc_test_print_rate(test, what, AREA_SIZE / sz * sz,
+				    &ts1, &ts2);
+	}
+
+	return 0;
+}
+
+static int mmc_test_perf_seq_write(struct mmc_test_card *test)
+{
+	return mmc_test_perf_seq(test, 1);
+}
+
+static int mmc_test_perf_seq_read(struct mmc_test_card *test)
+{
+	return mmc_test_perf_seq(test, 0);
+}
+
 static const struct mmc_test_case mmc_test_cases[] = {
 	{
 		.name = "Basic write (no data verification)",
@@ -997,6 +1344,34 @@ static const struct mmc_test_case mmc_test_cases[] = {
 
 #endif /* CONFIG_HIGHMEM */
 
+	{
+		.name = "Small write performance, one write per request",
+		.prepare = mmc_test_area_prepare,
+		.run = mmc_test_perf_small_write,
+		.cleanup = mmc_test_area_cleanup,
+	},
+
+	{
+		.name = "Small write performance, writes packed per request",
+		.prepare = mmc_test_area_prepare,
+		.run = mmc_test_perf_packed_write,
+		.cleanup = mmc_test_area_cleanup,
+	},
+
+	{
+		.name = "Sequential write performance, blocking and non-blocking",
+		.prepare = mmc_test_area_prepare,
+		.run = mmc_test_perf_seq_write,
+		.cleanup = mmc_test_area_cleanup,
+	},
+
+	{
+		.name = "Sequential read performance, blocking and non-blocking",
+		.prepare = mmc_test_area_prepare,
+		.run = mmc_test_perf_seq_read,
+		.cleanup = mmc_test_area_cleanup,
+	},
+
 };
 
 static DEFINE_MUTEX(mmc_test_lock);
@@ -14,6 +14,9 @@
 
 #define MMC_QUEUE_SUSPENDED	(1 << 0)
 
+/* Most writes to pack behind the one fetched */
+#define MMC_QUEUE_PACK_MAX	16
+
 static int mmc_prep_request(struct request_queue *q, struct request *req)
 {
 	/*
@@ -29,6 +32,81 @@ static int mmc_prep_request(struct request_queue *q, struct request *req)
 	return BLKPREP_OK;
 }
 
+/*
+ * Writes queued behind req that continue exactly where it ends are
+ * started as well, so that they all go to the card as one multiple
+ * block write: small writes then pay for the command, the stop and the
+ * busy wait only once.  Called with the queue lock held.
+ */
+static void mmc_queue_pack(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
+{
+	struct request_queue *q = mq->queue;
+	struct request *req = mqrq->req;
+	struct request *next;
+	sector_t pos = blk_rq_pos(req) + blk_rq_sectors(req);
+	unsigned int sectors = blk_rq_sectors(req);
+	unsigned int segs = req->nr_phys_segments;
+
+	if (rq_data_dir(req) != WRITE || blk_barrier_rq(req) ||
+	    mq->card->host->max_blk_count == 1)
+		return;
+
+	while (mqrq->packed_nr < MMC_QUEUE_PACK_MAX) {
+		next = blk_peek_request(q);
+		if (!next || rq_data_dir(next) != WRITE ||
+		    blk_barrier_rq(next) || blk_rq_pos(next) != pos)
+			break;
+		if (sectors + blk_rq_sectors(next) > queue_max_hw_sectors(q) ||
+		    segs + next->nr_phys_segments > queue_max_segments(q))
+			break;
+
+		blk_start_request(next);
+		list_add_tail(&next->queuelist, &mqrq->packed);
+		mqrq->packed_nr++;
+		mqrq->packed_sectors += blk_rq_sectors(next);
+
+		pos += blk_rq_sectors(next);
+		sectors += blk_rq_sectors(next);
+		segs += next->nr_phys_segments;
+	}
+}
+
+/* Called with the queue lock held */
+static struct request *mmc_queue_fetch(struct mmc_queue *mq,
+				       struct mmc_queue_req *mqrq)
+{
+	struct request_queue *q = mq->queue;
+
+	if (blk_queue_plugged(q))
+		return NULL;
+
+	mqrq->req = blk_fetch_request(q);
+	if (mqrq->req)
+		mmc_queue_pack(mq, mqrq);
+
+	return mqrq->req;
+}
+
+/*
+ * Fetch the request to issue after the current one, so that it can be
+ * got ready while the current one is on the bus.  Returns NULL if
+ * there is none, or if one was fetched already.
+ */
+struct mmc_queue_req *mmc_queue_fetch_next(struct mmc_queue *mq)
+{
+	struct mmc_queue_req *mqrq = mq->mqrq_next;
+	struct request *req;
+
+	if (mqrq->req)
+		return NULL;
+
+	spin_lock_irq(mq->queue->queue_lock);
+	req = mmc_queue_fetch(mq, mqrq);
+	spin_unlock_irq(mq->queue->queue_lock);
+
+	return req ? mqrq : NULL;
+}
+
 static int mmc_queue_thread(void *d)
 {
 	struct mmc_queue *mq = d;
@@ -42,8 +120,9 @@ static int mmc_queue_thread(void *d)
 
 		spin_lock_irq(q->queue_lock);
 		set_current_state(TASK_INTERRUPTIBLE);
-		if (!blk_queue_plugged(q))
-			req = blk_fetch_request(q);
+		req = mq->mqrq_cur->req;
+		if (!req)
+			req = mmc_queue_fetch(mq, mq->mqrq_cur);
 		mq->req = req;
 		spin_unlock_irq(q->queue_lock);
 
@@ -60,6 +139,10 @@ static int mmc_queue_thread(void *d)
 		set_current_state(TASK_RUNNING);
 
 		mq->issue_fn(mq, req);
+
+		/* Go on with whatever was fetched meanwhile */
+		mq->mqrq_cur->req = NULL;
+		swap(mq->mqrq_cur, mq->mqrq_next);
 	} while (1);
 	up(&mq->thread_sem);
 
@@ -83,9 +166,26 @@ static void mmc_request(struct request_queue *q)
 		wake_up_process(mq->thread);
 }
 
+static void mmc_queue_free_bufs(struct mmc_queue *mq)
+{
+	struct mmc_queue_req *mqrq;
+
+	for (mqrq = mq->mqrq; mqrq < mq->mqrq + ARRAY_SIZE(mq->mqrq); mqrq++) {
+		kfree(mqrq->bounce_sg);
+		mqrq->bounce_sg = NULL;
+
+		kfree(mqrq->sg);
+		mqrq->sg = NULL;
+
+		kfree(mqrq->bounce_buf);
+		mqrq->bounce_buf = NULL;
+	}
+}
+
 int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock)
 {
 	struct mmc_host *host = card->host;
+	struct mmc_queue_req *mqrq;
 	u64 limit = BLK_BOUNCE_HIGH;
 	int ret;
 
@@ -100,6 +200,12 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 	mq->queue->queuedata = mq;
 	mq->req = NULL;
 
+	memset(mq->mqrq, 0, sizeof(mq->mqrq));
+	for (mqrq = mq->mqrq; mqrq < mq->mqrq + ARRAY_SIZE(mq->mqrq); mqrq++)
+		INIT_LIST_HEAD(&mqrq->packed);
+	mq->mqrq_cur = &mq->mqrq[0];
+	mq->mqrq_next = &mq->mqrq[1];
+
 	blk_queue_prep_rq(mq->queue, mmc_prep_request);
 	blk_queue_ordered(mq->queue, QUEUE_ORDERED_DRAIN, NULL);
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, mq->queue);
@@ -117,54 +223,68 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 		if (bouncesz > (host->max_blk_count * 512))
 			bouncesz = host->max_blk_count * 512;
 
+		/* Both slots bounce, or neither does */
 		if (bouncesz > 512) {
-			mq->bounce_buf = kmalloc(bouncesz, GFP_KERNEL);
-			if (!mq->bounce_buf) {
+			mq->mqrq[0].bounce_buf = kmalloc(bouncesz, GFP_KERNEL);
+			mq->mqrq[1].bounce_buf = kmalloc(bouncesz, GFP_KERNEL);
+			if (!mq->mqrq[0].bounce_buf ||
+			    !mq->mqrq[1].bounce_buf) {
 				printk(KERN_WARNING "%s: unable to "
 					"allocate bounce buffer\n",
 					mmc_card_name(card));
+				kfree(mq->mqrq[0].bounce_buf);
+				mq->mqrq[0].bounce_buf = NULL;
+				kfree(mq->mqrq[1].bounce_buf);
+				mq->mqrq[1].bounce_buf = NULL;
 			}
 		}
 
-		if (mq->bounce_buf) {
+		if (mq->mqrq[0].bounce_buf) {
 			blk_queue_bounce_limit(mq->queue, BLK_BOUNCE_ANY);
 			blk_queue_max_hw_sectors(mq->queue, bouncesz / 512);
 			blk_queue_max_segments(mq->queue, bouncesz / 512);
 			blk_queue_max_segment_size(mq->queue, bouncesz);
 
-			mq->sg = kmalloc(sizeof(struct scatterlist),
-				GFP_KERNEL);
-			if (!mq->sg) {
-				ret = -ENOMEM;
-				goto cleanup_queue;
-			}
-			sg_init_table(mq->sg, 1);
-
-			mq->bounce_sg = kmalloc(sizeof(struct scatterlist) *
-				bouncesz / 512, GFP_KERNEL);
-			if (!mq->bounce_sg) {
-				ret = -ENOMEM;
-				goto cleanup_queue;
+			for (mqrq = mq->mqrq;
+			     mqrq < mq->mqrq + ARRAY_SIZE(mq->mqrq); mqrq++) {
+				mqrq->sg = kmalloc(sizeof(struct scatterlist),
+					GFP_KERNEL);
+				if (!mqrq->sg) {
+					ret = -ENOMEM;
+					goto cleanup_queue;
+				}
+				sg_init_table(mqrq->sg, 1);
+
+				mqrq->bounce_sg =
+					kmalloc(sizeof(struct scatterlist) *
+						bouncesz / 512, GFP_KERNEL);
+				if (!mqrq->bounce_sg) {
+					ret = -ENOMEM;
+					goto cleanup_queue;
+				}
+				sg_init_table(mqrq->bounce_sg, bouncesz / 512);
 			}
-			sg_init_table(mq->bounce_sg, bouncesz / 512);
 		}
 	}
 #endif
 
-	if (!mq->bounce_buf) {
+	if (!mq->mqrq[0].bounce_buf) {
 		blk_queue_bounce_limit(mq->queue, limit);
 		blk_queue_max_hw_sectors(mq->queue,
 			min(host->max_blk_count, host->max_req_size / 512));
 		blk_queue_max_segments(mq->queue, host->max_hw_segs);
 		blk_queue_max_segment_size(mq->queue, host->max_seg_size);
 
-		mq->sg = kmalloc(sizeof(struct scatterlist) *
-			host->max_phys_segs, GFP_KERNEL);
-		if (!mq->sg) {
-			ret = -ENOMEM;
-			goto cleanup_queue;
+		for (mqrq = mq->mqrq;
+		     mqrq < mq->mqrq + ARRAY_SIZE(mq->mqrq); mqrq++) {
+			mqrq->sg = kmalloc(sizeof(struct scatterlist) *
+				host->max_phys_segs, GFP_KERNEL);
+			if (!mqrq->sg) {
+				ret = -ENOMEM;
+				goto cleanup_queue;
+			}
+			sg_init_table(mqrq->sg, host->max_phys_segs);
 		}
-		sg_init_table(mq->sg, host->max_phys_segs);
 	}
 
 	init_MUTEX(&mq->thread_sem);
@@ -172,21 +292,12 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 	mq->thread = kthread_run(mmc_queue_thread, mq, "mmcqd");
 	if (IS_ERR(mq->thread)) {
 		ret = PTR_ERR(mq->thread);
-		goto free_bounce_sg;
+		goto cleanup_queue;
 	}
 
 	return 0;
- free_bounce_sg:
- 	if (mq->bounce_sg)
- 		kfree(mq->bounce_sg);
- 	mq->bounce_sg = NULL;
  cleanup_queue:
- 	if (mq->sg)
-		kfree(mq->sg);
-	mq->sg = NULL;
-	if (mq->bounce_buf)
-		kfree(mq->bounce_buf);
-	mq->bounce_buf = NULL;
+	mmc_queue_free_bufs(mq);
 	blk_cleanup_queue(mq->queue);
 	return ret;
 }
@@ -208,16 +319,7 @@ void mmc_cleanup_queue(struct mmc_queue *mq)
 	blk_start_queue(q);
 	spin_unlock_irqrestore(q->queue_lock, flags);
 
- 	if (mq->bounce_sg)
- 		kfree(mq->bounce_sg);
- 	mq->bounce_sg = NULL;
-
-	kfree(mq->sg);
-	mq->sg = NULL;
-
-	if (mq->bounce_buf)
-		kfree(mq->bounce_buf);
-	mq->bounce_buf = NULL;
+	mmc_queue_free_bufs(mq);
 
 	mq->card = NULL;
 }
@@ -255,60 +357,105 @@ void mmc_queue_resume(struct mmc_queue *mq)
 	}
 }
 
-unsigned int mmc_queue_map_sg(struct mmc_queue *mq)
+/*
+ * Complete the writes packed behind mqrq->req, given the bytes of them
+ * the card took.  Whatever it did not take goes back on the queue to be
+ * tried on its own.  Called with the queue lock held.
+ */
+void mmc_queue_end_packed(struct mmc_queue *mq, struct mmc_queue_req *mqrq,
+			  unsigned int bytes)
+{
+	struct request *req, *tmp;
+	unsigned int done;
+	LIST_HEAD(left);
+
+	list_for_each_entry_safe(req, tmp, &mqrq->packed, queuelist) {
+		list_del_init(&req->queuelist);
+		done = min(bytes, blk_rq_bytes(req));
+		bytes -= done;
+		if (__blk_end_request(req, 0, done))
+			list_add(&req->queuelist, &left);
+	}
+
+	/* Requeueing adds to the front, so go backwards to keep the order */
+	list_for_each_entry_safe(req, tmp, &left, queuelist) {
+		list_del_init(&req->queuelist);
+		blk_requeue_request(mq->queue, req);
+	}
+	mqrq->packed_nr = 0;
+	mqrq->packed_sectors = 0;
+}
+
+static unsigned int mmc_queue_map_rqs(struct mmc_queue *mq,
+				      struct mmc_queue_req *mqrq,
+				      struct scatterlist *sg)
+{
+	struct request *req;
+	unsigned int sg_len;
+
+	sg_len = blk_rq_map_sg(mq->queue, mqrq->req, sg);
+	list_for_each_entry(req, &mqrq->packed, queuelist) {
+		/* blk_rq_map_sg() ended the list after the previous one */
+		sg[sg_len - 1].page_link &= ~0x02;
+		sg_len += blk_rq_map_sg(mq->queue, req, sg + sg_len);
+	}
+
+	return sg_len;
+}
+
+unsigned int mmc_queue_map_sg(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
 {
 	unsigned int sg_len;
 	size_t buflen;
 	struct scatterlist *sg;
 	int i;
 
-	if (!mq->bounce_buf)
-		return blk_rq_map_sg(mq->queue, mq->req, mq->sg);
+	if (!mqrq->bounce_buf)
+		return mmc_queue_map_rqs(mq, mqrq, mqrq->sg);
 
-	BUG_ON(!mq->bounce_sg);
+	BUG_ON(!mqrq->bounce_sg);
 
-	sg_len = blk_rq_map_sg(mq->queue, mq->req, mq->bounce_sg);
+	sg_len = mmc_queue_map_rqs(mq, mqrq, mqrq->bounce_sg);
 
-	mq->bounce_sg_len = sg_len;
+	mqrq->bounce_sg_len = sg_len;
 
 	buflen = 0;
-	for_each_sg(mq->bounce_sg, sg, sg_len, i)
+	for_each_sg(mqrq->bounce_sg, sg, sg_len, i)
 		buflen += sg->length;
 
-	sg_init_one(mq->sg, mq->bounce_buf, buflen);
+	sg_init_one(mqrq->sg, mqrq->bounce_buf, buflen);
 
 	return 1;
 }
 
-void mmc_queue_bounce_pre(struct mmc_queue *mq)
+void mmc_queue_bounce_pre(struct mmc_queue_req *mqrq)
 {
 	unsigned long flags;
 
-	if (!mq->bounce_buf)
+	if (!mqrq->bounce_buf)
 		return;
 
-	if (rq_data_dir(mq->req) != WRITE)
+	if (rq_data_dir(mqrq->req) != WRITE)
 		return;
 
 	local_irq_save(flags);
-	sg_copy_to_buffer(mq->bounce_sg, mq->bounce_sg_len,
-		mq->bounce_buf, mq->sg[0].length);
+	sg_copy_to_buffer(mqrq->bounce_sg, mqrq->bounce_sg_len,
+		mqrq->bounce_buf, mqrq->sg[0].length);
 	local_irq_restore(flags);
 }
 
-void mmc_queue_bounce_post(struct mmc_queue *mq)
+void mmc_queue_bounce_post(struct mmc_queue_req *mqrq)
 {
 	unsigned long flags;
 
-	if (!mq->bounce_buf)
+	if (!mqrq->bounce_buf)
 		return;
 
-	if (rq_data_dir(mq->req) != READ)
+	if (rq_data_dir(mqrq->req) != READ)
 		return;
 
 	local_irq_save(flags);
-	sg_copy_from_buffer(mq->bounce_sg, mq->bounce_sg_len,
-		mq->bounce_buf, mq->sg[0].length);
+	sg_copy_from_buffer(mqrq->bounce_sg, mqrq->bounce_sg_len,
+		mqrq->bounce_buf, mqrq->sg[0].length);
 	local_irq_restore(flags);
 }
-
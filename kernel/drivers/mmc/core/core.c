@@ -17,6 +17,7 @@
 #include <linux/mmc/host.h>
 #include <linux/mmc/mmc.h>
 #include <linux/mmc/sd.h>
+#include <linux/mmc/async.h>
 
 #include "core.h"
 #include "bus.h"
@@ -178,6 +179,63 @@ void mmc_wait_for_req(struct mmc_host *host, struct mmc_request *mrq)
 
 EXPORT_SYMBOL(mmc_wait_for_req);
 
+static const struct mmc_host_async_ops *mmc_async_ops(struct mmc_host *host)
+{
+	if (!(host->caps & MMC_CAP_PRE_POST_REQ))
+		return NULL;
+
+	return container_of(host->ops, struct mmc_host_async_ops, ops);
+}
+
+/*
+ * Let the host driver do its setup for a request, such as DMA mapping,
+ * while the previous one is still on the bus.
+ */
+void mmc_pre_req(struct mmc_host *host, struct mmc_request *mrq,
+		 bool is_first_req)
+{
+	const struct mmc_host_async_ops *ops = mmc_async_ops(host);
+
+	if (ops && ops->pre_req)
+		ops->pre_req(host, mrq, is_first_req);
+}
+
+EXPORT_SYMBOL(mmc_pre_req);
+
+void mmc_post_req(struct mmc_host *host, struct mmc_request *mrq, int err)
+{
+	const struct mmc_host_async_ops *ops = mmc_async_ops(host);
+
+	if (ops && ops->post_req)
+		ops->post_req(host, mrq, err);
+}
+
+EXPORT_SYMBOL(mmc_post_req);
+
+/*
+ * Start a request and return at once.  The caller may get its next
+ * request ready meanwhile, but must mmc_wait_for_req_done() before
+ * looking at the result or starting anything else on the host.
+ */
+void mmc_start_req(struct mmc_host *host, struct mmc_request *mrq,
+		   struct completion *complete)
+{
+	init_completion(complete);
+	mrq->done_data = complete;
+	mrq->done = mmc_wait_done;
+
+	mmc_start_request(host, mrq);
+}
+
+EXPORT_SYMBOL(mmc_start_req);
+
+void mmc_wait_for_req_done(struct mmc_request *mrq)
+{
+	wait_for_completion(mrq->done_data);
+}
+
+EXPORT_SYMBOL(mmc_wait_for_req_done);
+
 int mmc_wait_for_cmd(struct mmc_host *host, struct mmc_command *cmd, int retries)
 {
 	struct mmc_request mrq;
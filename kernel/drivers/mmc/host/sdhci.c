@@ -10,6 +10,7 @@
 #include <linux/leds.h>
 
 #include <linux/mmc/host.h>
+#include <linux/mmc/async.h>
 
 #include "sdhci.h"
 
@@ -379,6 +380,25 @@ static void sdhci_set_adma_desc(u8 *desc, u32 addr, int len, unsigned cmd)
 	dataddr[0] = cpu_to_le32(addr);
 }
 
+/*
+ * Map data for DMA, unless sdhci_pre_req() already did so while the
+ * previous request was running.
+ */
+static int sdhci_map_data(struct sdhci_host *host, struct mmc_data *data)
+{
+	int sg_count;
+
+	if (host->next_data == data) {
+		sg_count = host->next_sg_count;
+		host->next_data = NULL;
+		return sg_count;
+	}
+
+	return dma_map_sg(mmc_dev(host->mmc), data->sg, data->sg_len,
+			  (data->flags & MMC_DATA_READ) ?
+				DMA_FROM_DEVICE : DMA_TO_DEVICE);
+}
+
 static int sdhci_adma_table_pre(struct sdhci_host *host,
 	struct mmc_data *data)
 {
@@ -416,8 +436,7 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 		goto fail;
 	BUG_ON(host->align_addr & 0x3);
 
-	host->sg_count = dma_map_sg(mmc_dev(host->mmc),
-		data->sg, data->sg_len, direction);
+	host->sg_count = sdhci_map_data(host, data);
 	if (host->sg_count == 0)
 		goto unmap_align;
 
@@ -728,11 +747,7 @@ static void sdhci_prepare_data(struct sdhci_host *host, struct mmc_data *data)
 		} else {
 			int sg_cnt;
 
-			sg_cnt = dma_map_sg(mmc_dev(host->mmc),
-					data->sg, data->sg_len,
-					(data->flags & MMC_DATA_READ) ?
-						DMA_FROM_DEVICE :
-						DMA_TO_DEVICE);
+			sg_cnt = sdhci_map_data(host, data);
 			if (sg_cnt == 0) {
 				/*
 				 * This only happens when someone fed
@@ -1200,11 +1215,86 @@ out:
 	spin_unlock_irqrestore(&host->lock, flags);
 }
 
-static const struct mmc_host_ops sdhci_ops = {
-	.request	= sdhci_request,
-	.set_ios	= sdhci_set_ios,
-	.get_ro		= sdhci_get_ro,
-	.enable_sdio_irq = sdhci_enable_sdio_irq,
+/*
+ * Do the DMA mapping of the next request while the current one is on
+ * the bus.  Hosts whose quirks may turn a request over to PIO are left
+ * to map at request time, as is a request with nothing running before
+ * it.  The unmapping is still done on completion.
+ */
+static void sdhci_pre_req(struct mmc_host *mmc, struct mmc_request *mrq,
+			  bool is_first_req)
+{
+	struct sdhci_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+	unsigned long flags;
+	int sg_count;
+
+	if (is_first_req || !data ||
+	    !(host->flags & (SDHCI_USE_SDMA | SDHCI_USE_ADMA)))
+		return;
+
+	if (host->quirks & (SDHCI_QUIRK_32BIT_DMA_ADDR |
+			    SDHCI_QUIRK_32BIT_DMA_SIZE |
+			    SDHCI_QUIRK_32BIT_ADMA_SIZE))
+		return;
+
+	/* SDMA takes a single segment */
+	if (!(host->flags & SDHCI_USE_ADMA) && data->sg_len != 1)
+		return;
+
+	spin_lock_irqsave(&host->lock, flags);
+	if (host->next_data) {
+		spin_unlock_irqrestore(&host->lock, flags);
+		return;
+	}
+	spin_unlock_irqrestore(&host->lock, flags);
+
+	sg_count = dma_map_sg(mmc_dev(mmc), data->sg, data->sg_len,
+			      (data->flags & MMC_DATA_READ) ?
+				DMA_FROM_DEVICE : DMA_TO_DEVICE);
+	if (!sg_count)
+		return;
+
+	spin_lock_irqsave(&host->lock, flags);
+	host->next_data = data;
+	host->next_sg_count = sg_count;
+	spin_unlock_irqrestore(&host->lock, flags);
+}
+
+static void sdhci_post_req(struct mmc_host *mmc, struct mmc_request *mrq,
+			   int err)
+{
+	struct sdhci_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+	unsigned long flags;
+	int mapped = 0;
+
+	if (!data)
+		return;
+
+	/* Only a request that never reached the controller is still mapped */
+	spin_lock_irqsave(&host->lock, flags);
+	if (host->next_data == data) {
+		host->next_data = NULL;
+		mapped = 1;
+	}
+	spin_unlock_irqrestore(&host->lock, flags);
+
+	if (mapped)
+		dma_unmap_sg(mmc_dev(mmc), data->sg, data->sg_len,
+			     (data->flags & MMC_DATA_READ) ?
+				DMA_FROM_DEVICE : DMA_TO_DEVICE);
+}
+
+static const struct mmc_host_async_ops sdhci_ops = {
+	.ops = {
+		.request	= sdhci_request,
+		.set_ios	= sdhci_set_ios,
+		.get_ro		= sdhci_get_ro,
+		.enable_sdio_irq = sdhci_enable_sdio_irq,
+	},
+	.pre_req	= sdhci_pre_req,
+	.post_req	= sdhci_post_req,
 };
 
 
@@ -1736,14 +1826,14 @@ int sdhci_add_host(struct sdhci_host *host)
 	/*
 	 * Set host parameters.
 	 */
-	mmc->ops = &sdhci_ops;
+	mmc->ops = &sdhci_ops.ops;
 	if (host->quirks & SDHCI_QUIRK_NONSTANDARD_CLOCK &&
 			host->ops->set_clock && host->ops->get_min_clock)
 		mmc->f_min = host->ops->get_min_clock(host);
 	else
 		mmc->f_min = host->max_clk / 256;
 	mmc->f_max = host->max_clk;
-	mmc->caps = MMC_CAP_SDIO_IRQ;
+	mmc->caps = MMC_CAP_SDIO_IRQ | MMC_CAP_PRE_POST_REQ;
 
 	if (!(host->quirks & SDHCI_QUIRK_FORCE_1_BIT_DATA))
 		mmc->caps |= MMC_CAP_4_BIT_DATA;
@@ -269,6 +269,9 @@ struct sdhci_host {
 
 	int			sg_count;	/* Mapped sg entries */
 
+	struct mmc_data		*next_data;	/* Mapped by sdhci_pre_req() */
+	int			next_sg_count;
+
 	u8			*adma_desc;	/* ADMA descriptor table */
 	u8			*align_buffer;	/* Bounce buffer */
 
@@ -20,6 +20,17 @@
 #include <linux/mtd/partitions.h>
 #endif
 
+#include "nand_cache.h"
+
+/* Cache read sequence commands */
+#ifndef NAND_CMD_READCACHESEQ
+#define NAND_CMD_READCACHESEQ	0x31
+#define NAND_CMD_READCACHEEND	0x3f
+#endif
+
+/* nand_write_page() result: the page cache programmed before failed */
+#define NAND_WRITE_FAIL_N1	1
+
 /* Define default oob placement schemes for large and small page devices */
 static struct nand_ecclayout nand_oob_8 = {
 	.eccbytes = 3,
@@ -577,6 +588,18 @@ static void nand_command_lp(struct mtd_info *mtd, unsigned int command,
 	nand_wait_ready(mtd);
 }
 
+/*
+ * Chips with NAND_CACHEPRG in nand_ids.c do cache program, the ones with
+ * NAND_CACHERD cache read. The sequences are only issued through the
+ * generic large page command function, as the ones of board drivers may
+ * not know the commands.
+ */
+static inline int nand_can_cache(struct mtd_info *mtd, struct nand_chip *chip,
+				 unsigned int option)
+{
+	return (chip->options & option) && chip->cmdfunc == nand_command_lp;
+}
+
 static void panic_nand_get_device(struct nand_chip *chip,
 		      struct mtd_info *mtd, int new_state)
 {
@@ -1121,6 +1144,7 @@ static int nand_do_read_ops(struct mtd_info *mtd, loff_t from,
 	struct mtd_ecc_stats stats;
 	int blkcheck = (1 << (chip->phys_erase_shift - chip->page_shift)) - 1;
 	int sndcmd = 1;
+	int cacheread = nand_can_cache(mtd, chip, NAND_CACHERD), cacheseq = 0;
 	int ret = 0;
 	uint32_t readlen = ops->len;
 	uint32_t oobreadlen = ops->ooblen;
@@ -1147,15 +1171,35 @@ static int nand_do_read_ops(struct mtd_info *mtd, loff_t from,
 		aligned = (bytes == mtd->writesize);
 
 		/* Is the current page in the buffer ? */
-		if (realpage != chip->pagebuf || oob) {
+		if (realpage != chip->pagebuf || oob || cacheseq) {
 			bufpoi = aligned ? buf : chip->buffers->databuf;
 
 #if  (CONFIG_MTK_MTD_NAND)
             ret = chip->read_page(mtd, chip, bufpoi, page);
 #else
+			/*
+			 * In a cache read the chip loads the next page of the
+			 * eraseblock while this one is transferred. The last
+			 * page is moved to the cache without loading another.
+			 */
 			if (likely(sndcmd)) {
 				chip->cmdfunc(mtd, NAND_CMD_READ0, 0x00, page);
 				sndcmd = 0;
+				if (cacheread && readlen > bytes &&
+				    ((page + 1) & blkcheck)) {
+					chip->cmdfunc(mtd, NAND_CMD_READCACHESEQ,
+						      -1, -1);
+					cacheseq = 1;
+				}
+			} else if (cacheseq) {
+				if (readlen > bytes && ((page + 1) & blkcheck))
+					chip->cmdfunc(mtd, NAND_CMD_READCACHESEQ,
+						      -1, -1);
+				else {
+					chip->cmdfunc(mtd, NAND_CMD_READCACHEEND,
+						      -1, -1);
+					cacheseq = 0;
+				}
 			}
 
 			/* Now read the page into the buffer */
@@ -1230,10 +1274,14 @@ static int nand_do_read_ops(struct mtd_info *mtd, loff_t from,
 		/* Check, if the chip supports auto page increment
 		 * or if we have hit a block boundary.
 		 */
-		if (!NAND_CANAUTOINCR(chip) || !(page & blkcheck))
+		if (!cacheseq && (!NAND_CANAUTOINCR(chip) || !(page & blkcheck)))
 			sndcmd = 1;
 	}
 
+	/* Do not leave the chip in a cache read cut short by an error */
+	if (cacheseq)
+		chip->cmdfunc(mtd, NAND_CMD_READCACHEEND, -1, -1);
+
 	ops->retlen = ops->len - (size_t) readlen;
 	if (oob)
 		ops->oobretlen = ops->ooblen - oobreadlen;
@@ -1652,6 +1700,8 @@ static void nand_write_page_syndrome(struct mtd_info *mtd,
 static int nand_write_page(struct mtd_info *mtd, struct nand_chip *chip,
 			   const uint8_t *buf, int page, int cached, int raw)
 {
+	/* Only then does the status tell about the page before this one */
+	int prevcached = chip->state == FL_CACHEDPRG;
 	int status;
 
 	chip->cmdfunc(mtd, NAND_CMD_SEQIN, 0x00, page);
@@ -1661,16 +1711,16 @@ static int nand_write_page(struct mtd_info *mtd, struct nand_chip *chip,
 	else
 		chip->ecc.write_page(mtd, chip, buf);
 
-	/*
-	 * Cached progamming disabled for now, Not sure if its worth the
-	 * trouble. The speed gain is not very impressive. (2.3->2.6Mib/s)
-	 */
+#ifdef CONFIG_MTD_NAND_VERIFY_WRITE
+	/* Reading the page back would break the cache program sequence */
 	cached = 0;
+#endif
 
-	if (!cached || !(chip->options & NAND_CACHEPRG)) {
+	if (!cached || !nand_can_cache(mtd, chip, NAND_CACHEPRG)) {
 
 		chip->cmdfunc(mtd, NAND_CMD_PAGEPROG, -1, -1);
 		status = chip->waitfunc(mtd, chip);
+		chip->state = FL_WRITING;
 		/*
 		 * See if operation failed and additional status checks are
 		 * available
@@ -1679,11 +1729,25 @@ static int nand_write_page(struct mtd_info *mtd, struct nand_chip *chip,
 			status = chip->errstat(mtd, chip, FL_WRITING, status,
 					       page);
 
+		if (prevcached && (status & NAND_STATUS_FAIL_N1))
+			return NAND_WRITE_FAIL_N1;
+
 		if (status & NAND_STATUS_FAIL)
 			return -EIO;
 	} else {
+		/*
+		 * The chip takes the next page as soon as this one has moved
+		 * from the cache, the status is the one of the page before.
+		 */
 		chip->cmdfunc(mtd, NAND_CMD_CACHEDPROG, -1, -1);
 		status = chip->waitfunc(mtd, chip);
+		if (prevcached && (status & NAND_STATUS_FAIL_N1)) {
+			/* Abort this page too, the caller retries elsewhere */
+			chip->cmdfunc(mtd, NAND_CMD_RESET, -1, -1);
+			chip->state = FL_WRITING;
+			return NAND_WRITE_FAIL_N1;
+		}
+		chip->state = FL_CACHEDPRG;
 	}
 
 #ifdef CONFIG_MTD_NAND_VERIFY_WRITE
@@ -1822,6 +1886,11 @@ static int nand_do_write_ops(struct mtd_info *mtd, loff_t to,
 
 		ret = chip->write_page(mtd, chip, wbuf, page, cached,
 				       (ops->mode == MTD_OOB_RAW));
+		if (ret == NAND_WRITE_FAIL_N1) {
+			/* The whole page before this one is lost as well */
+			writelen += mtd->writesize;
+			ret = -EIO;
+		}
 		if (ret)
 			break;
 
@@ -2456,7 +2525,7 @@ static struct nand_flash_dev *nand_get_flash_type(struct mtd_info *mtd,
 	 * options for chips which are not having an extended id.
 	 */
 	if (*maf_id != NAND_MFR_SAMSUNG && !type->pagesize)
-		chip->options &= ~NAND_SAMSUNG_LP_OPTIONS;
+		chip->options &= ~(NAND_SAMSUNG_LP_OPTIONS | NAND_CACHERD);
 
 	/*
 	 * Bad block marker is stored in the last page of each block
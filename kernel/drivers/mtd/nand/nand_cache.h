@@ -0,0 +1,16 @@
+#ifndef __NAND_CACHE_H__
+#define __NAND_CACHE_H__
+
+#include <linux/mtd/nand.h>
+
+/*
+ * Chip option: the chip has the cache read commands (31h/3Fh).
+ *
+ * Kept here rather than in <linux/mtd/nand.h> until it is needed outside
+ * drivers/mtd/nand. 0x8000 is the last bit of NAND_CHIPOPTIONS_MSK, so
+ * nand_get_flash_type() copies it from nand_flash_ids like the other
+ * chip options.
+ */
+#define NAND_CACHERD		0x00008000
+
+#endif /* __NAND_CACHE_H__ */
@@ -18,6 +18,9 @@
 #include <linux/sched.h>
 #include <linux/fs.h>
 #include <linux/pagemap.h>
+#include <linux/ktime.h>
+
+#include "nand_cache.h"
 
 /* Default simulator parameters values */
 #if !defined(CONFIG_NANDSIM_FIRST_ID_BYTE)  || \
@@ -84,6 +87,7 @@ static char *gravepages = NULL;
 static unsigned int rptwear = 0;
 static unsigned int overridesize = 0;
 static char *cache_file = NULL;
+static uint cache_ops = 1;
 
 module_param(first_id_byte,  uint, 0400);
 module_param(second_id_byte, uint, 0400);
@@ -107,6 +111,7 @@ module_param(gravepages,     charp, 0400);
 module_param(rptwear,        uint, 0400);
 module_param(overridesize,   uint, 0400);
 module_param(cache_file,     charp, 0400);
+module_param(cache_ops,      uint, 0400);
 
 MODULE_PARM_DESC(first_id_byte,  "The first byte returned by NAND Flash 'read ID' command (manufacturer ID)");
 MODULE_PARM_DESC(second_id_byte, "The second byte returned by NAND Flash 'read ID' command (chip ID)");
@@ -139,6 +144,7 @@ MODULE_PARM_DESC(overridesize,   "Specifies the NAND Flash size overriding the I
 				 "The size is specified in erase blocks and as the exponent of a power of two"
 				 " e.g. 5 means a size of 32 erase blocks");
 MODULE_PARM_DESC(cache_file,     "File to use to cache nand pages instead of memory");
+MODULE_PARM_DESC(cache_ops,      "Let the MTD layer use cache read and program if the chip ID allows them");
 
 /* The largest possible page size */
 #define NS_LARGEST_PAGE_SIZE	4096
@@ -158,6 +164,12 @@ MODULE_PARM_DESC(cache_file,     "File to use to cache nand pages instead of mem
 #define NS_INFO(args...) \
 	do { printk(KERN_INFO NS_OUTPUT_PREFIX " " args); } while(0)
 
+/* Cache read sequence commands */
+#ifndef NAND_CMD_READCACHESEQ
+#define NAND_CMD_READCACHESEQ	0x31
+#define NAND_CMD_READCACHEEND	0x3f
+#endif
+
 /* Busy-wait delay macros (microseconds, milliseconds) */
 #define NS_UDELAY(us) \
         do { if (do_delays) udelay(us); } while(0)
@@ -318,6 +330,15 @@ struct nandsim {
                 int wp;  /* write Protect */
         } lines;
 
+	/* Cache operations state */
+	struct {
+		int read;      /* a cache read sequence is in progress */
+		int prog;      /* the page program started is a cache program */
+		uint row;      /* the page in the cache register */
+		int busy;      /* the array works in the background ... */
+		ktime_t ready; /* ... until this time */
+	} cache;
+
 	/* Fields needed when using a cache file */
 	struct file *cfile; /* Open file */
 	unsigned char *pages_written; /* Which pages have been written */
@@ -367,6 +388,9 @@ static struct nandsim_operations {
 			       STATE_DATAOUT, STATE_READY}},
 };
 
+/* Output of the page moved to the cache register by a cache read command */
+static uint32_t cache_read_states[NS_OPER_STATES] = {STATE_DATAOUT, STATE_READY};
+
 struct weak_block {
 	struct list_head list;
 	unsigned int erase_block_no;
@@ -515,6 +539,9 @@ static int init_nandsim(struct mtd_info *mtd)
 	/* Force mtd to not do delays */
 	chip->chip_delay = 0;
 
+	if (!cache_ops)
+		chip->options &= ~(NAND_CACHEPRG | NAND_CACHERD);
+
 	/* Initialize the NAND flash parameters */
 	ns->busw = chip->options & NAND_BUSWIDTH_16 ? 16 : 8;
 	ns->geom.totsz    = mtd->size;
@@ -1445,6 +1472,30 @@ static int prog_page(struct nandsim *ns, int num)
 	return 0;
 }
 
+/*
+ * Cache operations let the array work in the background while the next page
+ * is transferred. Wait for it before it is used again.
+ */
+static void wait_array(struct nandsim *ns)
+{
+	s64 us;
+
+	if (!ns->cache.busy)
+		return;
+	ns->cache.busy = 0;
+	us = ktime_us_delta(ns->cache.ready, ktime_get());
+	if (us > 0)
+		NS_UDELAY(us);
+}
+
+static void set_array_busy(struct nandsim *ns, uint us)
+{
+	if (!do_delays)
+		return;
+	ns->cache.ready = ktime_add_us(ktime_get(), us);
+	ns->cache.busy = 1;
+}
+
 static int do_state_action(struct nandsim *ns, uint32_t action)
 {
 	int num;
@@ -1484,7 +1535,11 @@ static int do_state_action(struct nandsim *ns, uint32_t action)
 		else
 			NS_LOG("read OOB of page %d\n", ns->regs.row);
 
-		NS_UDELAY(access_delay);
+		/* Random data output from the cache register takes no access */
+		if (!ns->cache.read) {
+			wait_array(ns);
+			NS_UDELAY(access_delay);
+		}
 		NS_UDELAY(input_cycle * ns->geom.pgsz / 1000 / busdiv);
 
 		break;
@@ -1515,6 +1570,7 @@ static int do_state_action(struct nandsim *ns, uint32_t action)
 				ns->regs.row, NS_RAW_OFFSET(ns));
 		NS_LOG("erase sector %u\n", erase_block_no);
 
+		wait_array(ns);
 		erase_sector(ns);
 
 		NS_MDELAY(erase_delay);
@@ -1546,6 +1602,13 @@ static int do_state_action(struct nandsim *ns, uint32_t action)
 			return -1;
 		}
 
+		/*
+		 * The data came in while the array may still have been
+		 * programming the page before.
+		 */
+		NS_UDELAY(output_cycle * ns->geom.pgsz / 1000 / busdiv);
+		wait_array(ns);
+
 		if (prog_page(ns, num) == -1)
 			return -1;
 
@@ -1553,10 +1616,14 @@ static int do_state_action(struct nandsim *ns, uint32_t action)
 
 		NS_DBG("do_state_action: copy %d bytes from int buf to (%#x, %#x), raw off = %d\n",
 			num, ns->regs.row, ns->regs.column, NS_RAW_OFFSET(ns) + ns->regs.off);
-		NS_LOG("programm page %d\n", ns->regs.row);
+		NS_LOG("programm page %d%s\n", ns->regs.row,
+			ns->cache.prog ? " (cache)" : "");
 
-		NS_UDELAY(programm_delay);
-		NS_UDELAY(output_cycle * ns->geom.pgsz / 1000 / busdiv);
+		if (ns->cache.prog)
+			set_array_busy(ns, programm_delay);
+		else
+			NS_UDELAY(programm_delay);
+		ns->cache.prog = 0;
 
 		if (write_error(page_no)) {
 			NS_WARN("simulating write failure in page %u\n", page_no);
@@ -1738,6 +1805,51 @@ static void switch_state(struct nandsim *ns)
 	}
 }
 
+/*
+ * The first cache read command moves the page just read to the cache
+ * register and makes the array load the next one, each further command
+ * outputs the page loaded. The end command does not load another page.
+ */
+static void cache_read(struct nandsim *ns, u_char cmd)
+{
+	int busdiv = ns->busw == 8 ? 1 : 2;
+
+	if (!ns->cache.read) {
+		if (cmd != NAND_CMD_READCACHESEQ ||
+		    NS_STATE(ns->state) != STATE_DATAOUT || ns->regs.off) {
+			NS_ERR("cache_read: no page read to continue (%#x)\n", (uint)cmd);
+			switch_to_ready_state(ns, NS_STATUS_FAILED(ns));
+			return;
+		}
+		ns->cache.read = 1;
+		ns->cache.row = ns->regs.row;
+	} else {
+		if (ns->cache.row + 1 >= ns->geom.pgnum) {
+			NS_ERR("cache_read: no page after %u\n", ns->cache.row);
+			ns->cache.read = 0;
+			switch_to_ready_state(ns, NS_STATUS_FAILED(ns));
+			return;
+		}
+		wait_array(ns);
+		ns->cache.row += 1;
+	}
+
+	switch_to_ready_state(ns, NS_STATUS_OK(ns));
+	ns->op = &cache_read_states[0];
+	ns->state = ns->op[0];
+	ns->nxstate = ns->op[1];
+	ns->regs.row = ns->cache.row;
+	ns->regs.num = ns->geom.pgszoob;
+	read_page(ns, ns->regs.num);
+	NS_LOG("cache read page %d\n", ns->regs.row);
+
+	if (cmd == NAND_CMD_READCACHESEQ && ns->cache.row + 1 < ns->geom.pgnum)
+		set_array_busy(ns, access_delay);
+	else
+		ns->cache.read = 0;
+	NS_UDELAY(input_cycle * ns->geom.pgsz / 1000 / busdiv);
+}
+
 static u_char ns_nand_read_byte(struct mtd_info *mtd)
 {
         struct nandsim *ns = (struct nandsim *)((struct nand_chip *)mtd->priv)->priv;
@@ -1832,10 +1944,23 @@ static void ns_nand_write_byte(struct mtd_info *mtd, u_char byte)
 
 		if (byte == NAND_CMD_RESET) {
 			NS_LOG("reset chip\n");
+			ns->cache.read = ns->cache.prog = 0;
 			switch_to_ready_state(ns, NS_STATUS_OK(ns));
 			return;
 		}
 
+		if (byte == NAND_CMD_READCACHESEQ || byte == NAND_CMD_READCACHEEND) {
+			cache_read(ns, byte);
+			return;
+		}
+		if (byte != NAND_CMD_RNDOUT && byte != NAND_CMD_RNDOUTSTART)
+			ns->cache.read = 0;
+
+		/* A cache program is a page program the chip returns early from */
+		ns->cache.prog = byte == NAND_CMD_CACHEDPROG;
+		if (ns->cache.prog)
+			byte = NAND_CMD_PAGEPROG;
+
 		/* Check that the command byte is correct */
 		if (check_command(byte)) {
 			NS_ERR("write_byte: unknown command %#x\n", (uint)byte);
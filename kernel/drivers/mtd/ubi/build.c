@@ -12,6 +12,7 @@
 #include <linux/kthread.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/jiffies.h>
 #include "ubi.h"
 
 /* Maximum length of the 'mtd=' parameter */
@@ -660,6 +661,7 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 {
 	struct ubi_device *ubi;
 	int i, err, ref = 0;
+	unsigned long attach_time;
 
 	/*
 	 * Check if we already have the same MTD device attached.
@@ -747,11 +749,21 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 		goto out_free;
 #endif
 
+	err = ubi_cp_init(ubi);
+	if (err)
+		goto out_free;
+
+	err = ubi_debugfs_init_dev(ubi);
+	if (err)
+		goto out_free;
+
+	attach_time = jiffies;
 	err = attach_by_scanning(ubi);
 	if (err) {
 		dbg_err("failed to attach by scanning, error %d", err);
 		goto out_free;
 	}
+	attach_time = jiffies - attach_time;
 
 	if (ubi->autoresize_vol_id != -1) {
 		err = autoresize(ubi, ubi->autoresize_vol_id);
@@ -759,6 +771,13 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 			goto out_detach;
 	}
 
+	/* Scanned the whole device, so that the next attach does not have to */
+	if (!ubi->cp_active) {
+		err = ubi_wl_checkpoint(ubi);
+		if (err)
+			goto out_detach;
+	}
+
 	err = uif_init(ubi, &ref);
 	if (err)
 		goto out_detach;
@@ -787,6 +806,9 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 		ubi->beb_rsvd_pebs);
 	ubi_msg("max/mean erase counter: %d/%d", ubi->max_ec, ubi->mean_ec);
 	ubi_msg("image sequence number: %d", ubi->image_seq);
+	ubi_msg("attached by %s in %u ms",
+		ubi->cp_active ? "checkpoint" : "scanning",
+		jiffies_to_msecs(attach_time));
 
 	/*
 	 * The below lock makes sure we do not race with 'ubi_thread()' which
@@ -809,6 +831,8 @@ out_detach:
 	free_internal_volumes(ubi);
 	vfree(ubi->vtbl);
 out_free:
+	ubi_debugfs_exit_dev(ubi);
+	ubi_cp_close(ubi);
 	vfree(ubi->peb_buf1);
 	vfree(ubi->peb_buf2);
 #ifdef CONFIG_MTD_UBI_DEBUG_PARANOID
@@ -864,10 +888,19 @@ int ubi_detach_mtd_dev(int ubi_num, int anyway)
 	 */
 	get_device(&ubi->dev);
 
+	/*
+	 * Leave a checkpoint with a fresh pool behind. The thread is gone, so
+	 * the erasures this queues are just dropped.
+	 */
+	ubi->thread_enabled = 0;
+	ubi_wl_checkpoint(ubi);
+
 	uif_close(ubi);
 	ubi_wl_close(ubi);
 	free_internal_volumes(ubi);
 	vfree(ubi->vtbl);
+	ubi_cp_close(ubi);
+	ubi_debugfs_exit_dev(ubi);
 	put_mtd_device(ubi->mtd);
 	vfree(ubi->peb_buf1);
 	vfree(ubi->peb_buf2);
@@ -968,6 +1001,10 @@ static int __init ubi_init(void)
 	if (!ubi_wl_entry_slab)
 		goto out_dev_unreg;
 
+	err = ubi_debugfs_init();
+	if (err)
+		goto out_slab;
+
 	/* Attach MTD devices */
 	for (i = 0; i < mtd_devs; i++) {
 		struct mtd_dev_param *p = &mtd_dev_param[i];
@@ -1016,6 +1053,8 @@ out_detach:
 			ubi_detach_mtd_dev(ubi_devices[k]->ubi_num, 1);
 			mutex_unlock(&ubi_devices_mutex);
 		}
+	ubi_debugfs_exit();
+out_slab:
 	kmem_cache_destroy(ubi_wl_entry_slab);
 out_dev_unreg:
 	misc_deregister(&ubi_ctrl_cdev);
@@ -1039,6 +1078,7 @@ static void __exit ubi_exit(void)
 			ubi_detach_mtd_dev(ubi_devices[i]->ubi_num, 1);
 			mutex_unlock(&ubi_devices_mutex);
 		}
+	ubi_debugfs_exit();
 	kmem_cache_destroy(ubi_wl_entry_slab);
 	misc_deregister(&ubi_ctrl_cdev);
 	class_remove_file(ubi_class, &ubi_version);
@@ -0,0 +1,343 @@
+/*
+ * UBI checkpoint sub-system.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * A checkpoint is a snapshot of what scanning the whole device would find:
+ * the state and erase counter of every PEB and the LEB each used PEB holds.
+ * Attaching by a checkpoint reads it and scans only the PEBs it does not
+ * vouch for, which is a small pool free PEBs are handed out from after the
+ * checkpoint is written, instead of reading the headers of every PEB.
+ *
+ * The checkpoint stays valid for as long as the WL sub-system takes new PEBs
+ * from the pool only and does not erase PEBs the checkpoint says are used,
+ * see 'ubi_wl_checkpoint()', which writes a new one whenever the pool is
+ * used up and on detach.
+ */
+
+#include <linux/crc32.h>
+#include <linux/err.h>
+#include "ubi.h"
+
+/* Size of the pool of PEBs scanned on attach */
+#define CP_POOL_MIN 8
+#define CP_POOL_MAX 256
+
+static int cp_data_size(const struct ubi_device *ubi, int nr_vols)
+{
+	return ubi->cp_size * sizeof(__be32) +
+	       ubi->peb_count * sizeof(struct ubi_cp_peb) +
+	       nr_vols * sizeof(struct ubi_cp_vol);
+}
+
+static __be32 *cp_pnums(const struct ubi_device *ubi)
+{
+	return ubi->cp_buf + sizeof(struct ubi_cp_hdr);
+}
+
+struct ubi_cp_peb *ubi_cp_pebs(const struct ubi_device *ubi)
+{
+	return (struct ubi_cp_peb *)(cp_pnums(ubi) + ubi->cp_size);
+}
+
+static struct ubi_cp_vol *cp_vols(const struct ubi_device *ubi)
+{
+	return (struct ubi_cp_vol *)(ubi_cp_pebs(ubi) + ubi->peb_count);
+}
+
+struct ubi_cp_vol *ubi_cp_find_vol(const struct ubi_device *ubi, int vol_id)
+{
+	struct ubi_cp_hdr *hdr = ubi->cp_buf;
+	struct ubi_cp_vol *cv = cp_vols(ubi);
+	int i;
+
+	for (i = 0; i < be32_to_cpu(hdr->nr_vols); i++, cv++)
+		if (be32_to_cpu(cv->vol_id) == vol_id)
+			return cv;
+
+	return NULL;
+}
+
+struct ubi_cp_peb *ubi_cp_start(struct ubi_device *ubi)
+{
+	struct ubi_cp_peb *recs = ubi_cp_pebs(ubi);
+
+	memset(recs, 0, ubi->peb_count * sizeof(struct ubi_cp_peb));
+	return recs;
+}
+
+int ubi_cp_fill(struct ubi_device *ubi)
+{
+	int i, err, lnum, pnum, nr_vols = 0;
+	int bitmap_size = BITS_TO_LONGS(ubi->peb_count) * sizeof(long);
+	struct ubi_cp_hdr *hdr = ubi->cp_buf;
+	struct ubi_cp_peb *recs = ubi_cp_pebs(ubi);
+	struct ubi_cp_vol *cv = cp_vols(ubi);
+	struct ubi_wl_entry *e;
+	struct ubi_volume *vol;
+
+	memset(ubi->cp_used, 0, bitmap_size);
+	memset(ubi->cp_pool, 0, bitmap_size);
+	memset(cv, 0, (UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT) *
+		      sizeof(struct ubi_cp_vol));
+
+	spin_lock(&ubi->volumes_lock);
+	for (i = 0; i < ubi->vtbl_slots + UBI_INT_VOL_COUNT; i++) {
+		vol = ubi->volumes[i];
+		if (!vol)
+			continue;
+
+		cv->vol_id = cpu_to_be32(vol->vol_id);
+		cv->data_pad = cpu_to_be32(vol->data_pad);
+		if (vol->vol_type == UBI_STATIC_VOLUME) {
+			cv->vol_type = UBI_VID_STATIC;
+			cv->used_ebs = cpu_to_be32(vol->updating ?
+						   vol->upd_ebs :
+						   vol->used_ebs);
+			cv->last_data_size = cpu_to_be32(vol->last_eb_bytes);
+		} else
+			cv->vol_type = UBI_VID_DYNAMIC;
+		if (vol->vol_id == UBI_LAYOUT_VOLUME_ID)
+			cv->compat = UBI_LAYOUT_VOLUME_COMPAT;
+		cv += 1;
+		nr_vols += 1;
+
+		for (lnum = 0; lnum < vol->reserved_pebs; lnum++) {
+			pnum = vol->eba_tbl[lnum];
+			if (pnum < 0)
+				continue;
+
+			recs[pnum].state = UBI_CP_USED;
+			recs[pnum].vol_id = cpu_to_be32(vol->vol_id);
+			recs[pnum].lnum = cpu_to_be32(lnum);
+			set_bit(pnum, ubi->cp_used);
+		}
+	}
+	spin_unlock(&ubi->volumes_lock);
+
+	for (pnum = 0; pnum < ubi->peb_count; pnum++) {
+		e = ubi->lookuptbl[pnum];
+		if (e)
+			recs[pnum].ec = cpu_to_be32(e->ec);
+		else if (recs[pnum].state == UBI_CP_SCAN) {
+			err = ubi_io_is_bad(ubi, pnum);
+			if (err < 0)
+				return err;
+			if (err)
+				recs[pnum].state = UBI_CP_BAD;
+		}
+
+		if (recs[pnum].state == UBI_CP_SCAN)
+			set_bit(pnum, ubi->cp_pool);
+	}
+
+	memset(hdr, 0, sizeof(struct ubi_cp_hdr));
+	hdr->magic = cpu_to_be32(UBI_CP_HDR_MAGIC);
+	hdr->version = UBI_CP_VERSION;
+	hdr->peb_count = cpu_to_be32(ubi->peb_count);
+	hdr->image_seq = cpu_to_be32(ubi->image_seq);
+	hdr->nr_pebs = cpu_to_be32(ubi->cp_size);
+	hdr->nr_vols = cpu_to_be32(nr_vols);
+	hdr->data_size = cpu_to_be32(cp_data_size(ubi, nr_vols));
+	return 0;
+}
+
+int ubi_cp_write_pebs(struct ubi_device *ubi, struct ubi_wl_entry **pebs)
+{
+	int i, err = 0, len, size;
+	unsigned long long sqnum[UBI_CP_MAX_PEBS];
+	struct ubi_cp_hdr *hdr = ubi->cp_buf;
+	__be32 *pnums = cp_pnums(ubi);
+	struct ubi_vid_hdr *vid_hdr;
+	uint32_t crc;
+
+	vid_hdr = ubi_zalloc_vid_hdr(ubi, GFP_NOFS);
+	if (!vid_hdr)
+		return -ENOMEM;
+
+	/*
+	 * The anchor is written last and gets the highest sequence number, so
+	 * a checkpoint with an anchor is complete, and the newest anchor is
+	 * the one to use.
+	 */
+	for (i = ubi->cp_size - 1; i > 0; i--)
+		sqnum[i] = ubi_next_sqnum(ubi);
+	sqnum[0] = ubi_next_sqnum(ubi);
+
+	for (i = 0; i < ubi->cp_size; i++)
+		pnums[i] = cpu_to_be32(pebs[i]->pnum);
+
+	size = sizeof(struct ubi_cp_hdr) + be32_to_cpu(hdr->data_size);
+	crc = crc32(UBI_CRC32_INIT, pnums, size - sizeof(struct ubi_cp_hdr));
+	hdr->data_crc = cpu_to_be32(crc);
+	hdr->sqnum = cpu_to_be64(sqnum[0]);
+	crc = crc32(UBI_CRC32_INIT, hdr, UBI_CP_HDR_SIZE_CRC);
+	hdr->hdr_crc = cpu_to_be32(crc);
+
+	vid_hdr->vol_type = UBI_VID_DYNAMIC;
+	vid_hdr->vol_id = cpu_to_be32(UBI_CP_VOLUME_ID);
+	vid_hdr->compat = UBI_CP_VOLUME_COMPAT;
+
+	for (i = ubi->cp_size - 1; i >= 0; i--) {
+		len = size - i * ubi->leb_size;
+		if (len > ubi->leb_size)
+			len = ubi->leb_size;
+
+		vid_hdr->lnum = cpu_to_be32(i);
+		vid_hdr->sqnum = cpu_to_be64(sqnum[i]);
+		vid_hdr->data_size = cpu_to_be32(len > 0 ? len : 0);
+		err = ubi_io_write_vid_hdr(ubi, pebs[i]->pnum, vid_hdr);
+		if (err)
+			break;
+
+		if (len <= 0)
+			continue;
+
+		err = ubi_io_write_data(ubi, ubi->cp_buf + i * ubi->leb_size,
+					pebs[i]->pnum, 0,
+					ALIGN(len, ubi->min_io_size));
+		if (err)
+			break;
+	}
+
+	ubi_free_vid_hdr(ubi, vid_hdr);
+	return err;
+}
+
+struct ubi_cp_hdr *ubi_cp_read(struct ubi_device *ubi, int anchor,
+			       unsigned long long sqnum)
+{
+	int i, err, pnum, len, size, nr_vols;
+	struct ubi_cp_hdr *hdr = ubi->cp_buf;
+	__be32 *pnums = cp_pnums(ubi);
+	struct ubi_vid_hdr *vid_hdr;
+	uint32_t crc;
+
+	err = ubi_io_read_data(ubi, ubi->cp_buf, anchor, 0, ubi->leb_size);
+	if (err && err != UBI_IO_BITFLIPS) {
+		dbg_bld("cannot read checkpoint anchor PEB %d (%d)",
+			anchor, err);
+		return NULL;
+	}
+
+	crc = crc32(UBI_CRC32_INIT, hdr, UBI_CP_HDR_SIZE_CRC);
+	if (be32_to_cpu(hdr->magic) != UBI_CP_HDR_MAGIC ||
+	    be32_to_cpu(hdr->hdr_crc) != crc) {
+		dbg_bld("bad checkpoint header in PEB %d", anchor);
+		return NULL;
+	}
+
+	nr_vols = be32_to_cpu(hdr->nr_vols);
+	size = sizeof(struct ubi_cp_hdr) + be32_to_cpu(hdr->data_size);
+	if (hdr->version != UBI_CP_VERSION ||
+	    be64_to_cpu(hdr->sqnum) != sqnum ||
+	    be32_to_cpu(hdr->peb_count) != ubi->peb_count ||
+	    be32_to_cpu(hdr->nr_pebs) != ubi->cp_size ||
+	    nr_vols < 0 || nr_vols > UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT ||
+	    size != sizeof(struct ubi_cp_hdr) + cp_data_size(ubi, nr_vols) ||
+	    be32_to_cpu(pnums[0]) != anchor) {
+		dbg_bld("checkpoint in PEB %d does not fit this device",
+			anchor);
+		return NULL;
+	}
+
+	vid_hdr = ubi_zalloc_vid_hdr(ubi, GFP_KERNEL);
+	if (!vid_hdr)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 1; i < ubi->cp_size; i++) {
+		pnum = be32_to_cpu(pnums[i]);
+		if (pnum < 0 || pnum >= ubi->peb_count)
+			goto out_invalid;
+
+		err = ubi_io_read_vid_hdr(ubi, pnum, vid_hdr, 0);
+		if (err && err != UBI_IO_BITFLIPS)
+			goto out_invalid;
+
+		if (be32_to_cpu(vid_hdr->vol_id) != UBI_CP_VOLUME_ID ||
+		    be32_to_cpu(vid_hdr->lnum) != i ||
+		    be64_to_cpu(vid_hdr->sqnum) >= sqnum)
+			goto out_invalid;
+
+		len = size - i * ubi->leb_size;
+		if (len <= 0)
+			continue;
+		if (len > ubi->leb_size)
+			len = ubi->leb_size;
+
+		err = ubi_io_read_data(ubi, ubi->cp_buf + i * ubi->leb_size,
+				       pnum, 0, len);
+		if (err && err != UBI_IO_BITFLIPS)
+			goto out_invalid;
+	}
+
+	crc = crc32(UBI_CRC32_INIT, pnums, size - sizeof(struct ubi_cp_hdr));
+	if (be32_to_cpu(hdr->data_crc) != crc)
+		goto out_invalid;
+
+	ubi_free_vid_hdr(ubi, vid_hdr);
+	return hdr;
+
+out_invalid:
+	dbg_bld("checkpoint anchored in PEB %d is incomplete", anchor);
+	ubi_free_vid_hdr(ubi, vid_hdr);
+	return NULL;
+}
+
+int ubi_cp_init(struct ubi_device *ubi)
+{
+	int size;
+
+	size = sizeof(struct ubi_cp_hdr) + UBI_CP_MAX_PEBS * sizeof(__be32) +
+	       ubi->peb_count * sizeof(struct ubi_cp_peb) +
+	       (UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT) * sizeof(struct ubi_cp_vol);
+	ubi->cp_size = DIV_ROUND_UP(size, ubi->leb_size);
+
+	/*
+	 * The checkpoint PEBs and the ones reserved for the next checkpoint
+	 * should not eat a noticeable part of the device.
+	 */
+	if (ubi->cp_size > UBI_CP_MAX_PEBS ||
+	    ubi->cp_size * 16 > ubi->peb_count) {
+		ubi_warn("checkpoint would take %d of %d PEBs, do not use it",
+			 ubi->cp_size, ubi->peb_count);
+		ubi->cp_size = 0;
+		return 0;
+	}
+
+	ubi->cp_pool_size = clamp(ubi->peb_count / 20, CP_POOL_MIN,
+				  CP_POOL_MAX);
+
+	size = BITS_TO_LONGS(ubi->peb_count) * sizeof(long);
+	ubi->cp_used = kzalloc(size, GFP_KERNEL);
+	ubi->cp_pool = kzalloc(size, GFP_KERNEL);
+	ubi->cp_buf = vmalloc(ubi->cp_size * ubi->leb_size);
+	if (!ubi->cp_used || !ubi->cp_pool || !ubi->cp_buf)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void ubi_cp_close(struct ubi_device *ubi)
+{
+	kfree(ubi->cp_used);
+	kfree(ubi->cp_pool);
+	vfree(ubi->cp_buf);
+	ubi->cp_used = ubi->cp_pool = NULL;
+	ubi->cp_buf = NULL;
+	ubi->cp_size = 0;
+}
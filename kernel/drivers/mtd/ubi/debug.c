@@ -3,6 +3,9 @@
 
 #ifdef CONFIG_MTD_UBI_DEBUG
 
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
 #include "ubi.h"
 
 void ubi_dbg_dump_ec_hdr(const struct ubi_ec_hdr *ec_hdr)
@@ -168,4 +171,175 @@ out:
 	return;
 }
 
+void ubi_dbg_lat_add(struct ubi_dbg_lat *lat, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int i;
+
+	if (us < 0)
+		us = 0;
+	i = min_t(int, fls64(us), UBI_DBG_LAT_BUCKETS - 1);
+
+	spin_lock(&lat->lock);
+	lat->count += 1;
+	lat->total_us += us;
+	if (us > lat->max_us)
+		lat->max_us = min_t(s64, us, UINT_MAX);
+	lat->hist[i] += 1;
+	spin_unlock(&lat->lock);
+}
+
+static struct dentry *dfs_rootdir;
+
+static int dfs_lat_show(struct seq_file *m, void *v)
+{
+	struct ubi_dbg_lat *lat = m->private;
+	unsigned long hist[UBI_DBG_LAT_BUCKETS];
+	unsigned long long count, total;
+	unsigned int max;
+	int i;
+
+	spin_lock(&lat->lock);
+	count = lat->count;
+	total = lat->total_us;
+	max = lat->max_us;
+	memcpy(hist, lat->hist, sizeof(hist));
+	spin_unlock(&lat->lock);
+
+	seq_printf(m, "count:   %llu\n", count);
+	seq_printf(m, "mean us: %llu\n", count ? div64_u64(total, count) : 0);
+	seq_printf(m, "max us:  %u\n", max);
+	for (i = 0; i < UBI_DBG_LAT_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == UBI_DBG_LAT_BUCKETS - 1)
+			seq_printf(m, ">= %lu us: %lu\n", 1UL << (i - 1),
+				   hist[i]);
+		else
+			seq_printf(m, "< %lu us: %lu\n", 1UL << i, hist[i]);
+	}
+	return 0;
+}
+
+static int dfs_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dfs_lat_show, inode->i_private);
+}
+
+/* Any write resets the statistics */
+static ssize_t dfs_lat_write(struct file *file, const char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	struct ubi_dbg_lat *lat = ((struct seq_file *)file->private_data)->private;
+
+	spin_lock(&lat->lock);
+	lat->count = 0;
+	lat->total_us = 0;
+	lat->max_us = 0;
+	memset(lat->hist, 0, sizeof(lat->hist));
+	spin_unlock(&lat->lock);
+	return count;
+}
+
+static const struct file_operations dfs_lat_fops = {
+	.open    = dfs_lat_open,
+	.read    = seq_read,
+	.write   = dfs_lat_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+	.owner   = THIS_MODULE,
+};
+
+static int dfs_reserve_show(struct seq_file *m, void *v)
+{
+	struct ubi_device *ubi = m->private;
+
+	spin_lock(&ubi->wl_lock);
+	seq_printf(m, "free PEBs:       %d\n", ubi->free_count);
+	seq_printf(m, "low watermark:   %d\n", ubi->free_low);
+	seq_printf(m, "pending works:   %d\n", ubi->works_count);
+	seq_printf(m, "waiting writers: %d\n", ubi->writers_waiting);
+	spin_unlock(&ubi->wl_lock);
+	return 0;
+}
+
+static int dfs_reserve_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dfs_reserve_show, inode->i_private);
+}
+
+static const struct file_operations dfs_reserve_fops = {
+	.open    = dfs_reserve_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+	.owner   = THIS_MODULE,
+};
+
+int ubi_debugfs_init(void)
+{
+	dfs_rootdir = debugfs_create_dir(UBI_NAME_STR, NULL);
+	if (IS_ERR_OR_NULL(dfs_rootdir)) {
+		int err = dfs_rootdir ? PTR_ERR(dfs_rootdir) : -ENODEV;
+
+		ubi_err("cannot create \"%s\" debugfs directory, error %d",
+			UBI_NAME_STR, err);
+		dfs_rootdir = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
+void ubi_debugfs_exit(void)
+{
+	debugfs_remove_recursive(dfs_rootdir);
+}
+
+int ubi_debugfs_init_dev(struct ubi_device *ubi)
+{
+	char name[sizeof(UBI_NAME_STR) + 5];
+	struct dentry *dent;
+
+	spin_lock_init(&ubi->write_lat.lock);
+	spin_lock_init(&ubi->get_peb_lat.lock);
+
+	sprintf(name, UBI_NAME_STR "%d", ubi->ubi_num);
+	dent = debugfs_create_dir(name, dfs_rootdir);
+	if (IS_ERR_OR_NULL(dent))
+		goto out;
+	ubi->dbg_dir = dent;
+
+	dent = debugfs_create_file("write_latency", S_IRUSR | S_IWUSR,
+				   ubi->dbg_dir, &ubi->write_lat, &dfs_lat_fops);
+	if (IS_ERR_OR_NULL(dent))
+		goto out_remove;
+
+	dent = debugfs_create_file("get_peb_latency", S_IRUSR | S_IWUSR,
+				   ubi->dbg_dir, &ubi->get_peb_lat,
+				   &dfs_lat_fops);
+	if (IS_ERR_OR_NULL(dent))
+		goto out_remove;
+
+	dent = debugfs_create_file("erase_reserve", S_IRUSR, ubi->dbg_dir,
+				   ubi, &dfs_reserve_fops);
+	if (IS_ERR_OR_NULL(dent))
+		goto out_remove;
+
+	return 0;
+
+out_remove:
+	debugfs_remove_recursive(ubi->dbg_dir);
+	ubi->dbg_dir = NULL;
+out:
+	ubi_err("cannot create \"%s\" debugfs directory or files", name);
+	return dent ? PTR_ERR(dent) : -ENODEV;
+}
+
+void ubi_debugfs_exit_dev(struct ubi_device *ubi)
+{
+	debugfs_remove_recursive(ubi->dbg_dir);
+	ubi->dbg_dir = NULL;
+}
+
 #endif /* CONFIG_MTD_UBI_DEBUG */
@@ -3,6 +3,8 @@
 #ifndef __UBI_DEBUG_H__
 #define __UBI_DEBUG_H__
 
+#include <linux/ktime.h>
+
 #ifdef CONFIG_MTD_UBI_DEBUG
 #include <linux/random.h>
 
@@ -39,6 +41,25 @@ void ubi_dbg_dump_seb(const struct ubi_scan_leb *seb, int type);
 void ubi_dbg_dump_mkvol_req(const struct ubi_mkvol_req *req);
 void ubi_dbg_dump_flash(struct ubi_device *ubi, int pnum, int offset, int len);
 
+/* Bucket @i counts latencies of less than 2^@i microseconds */
+#define UBI_DBG_LAT_BUCKETS 20
+
+struct ubi_dbg_lat {
+	spinlock_t lock;
+	unsigned long long count;
+	unsigned long long total_us;
+	unsigned int max_us;
+	unsigned long hist[UBI_DBG_LAT_BUCKETS];
+};
+
+#define ubi_dbg_lat_start() ktime_get()
+void ubi_dbg_lat_add(struct ubi_dbg_lat *lat, ktime_t start);
+
+int ubi_debugfs_init(void);
+void ubi_debugfs_exit(void);
+int ubi_debugfs_init_dev(struct ubi_device *ubi);
+void ubi_debugfs_exit_dev(struct ubi_device *ubi);
+
 #ifdef CONFIG_MTD_UBI_DEBUG_MSG
 /* General debugging messages */
 #define dbg_gen(fmt, ...) dbg_msg(fmt, ##__VA_ARGS__)
@@ -138,6 +159,22 @@ static inline int ubi_dbg_is_erase_failure(void)
 #define ubi_dbg_dump_mkvol_req(req)      ({})
 #define ubi_dbg_dump_flash(ubi, pnum, offset, len) ({})
 
+struct ubi_dbg_lat { };
+
+static inline ktime_t ubi_dbg_lat_start(void)
+{
+	return ktime_set(0, 0);
+}
+
+static inline void ubi_dbg_lat_add(struct ubi_dbg_lat *lat, ktime_t start)
+{
+}
+
+#define ubi_debugfs_init()               0
+#define ubi_debugfs_exit()               ({})
+#define ubi_debugfs_init_dev(ubi)        0
+#define ubi_debugfs_exit_dev(ubi)        ({})
+
 #define UBI_IO_DEBUG               0
 #define DBG_DISABLE_BGT            0
 #define ubi_dbg_is_bitflip()       0
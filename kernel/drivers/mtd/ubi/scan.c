@@ -659,6 +659,31 @@ static int process_eb(struct ubi_device *ubi, struct ubi_scan_info *si,
 	}
 
 	vol_id = be32_to_cpu(vidh->vol_id);
+	if (vol_id == UBI_CP_VOLUME_ID) {
+		int lnum = be32_to_cpu(vidh->lnum);
+		unsigned long long sqnum = be64_to_cpu(vidh->sqnum);
+
+		/*
+		 * A checkpoint which is not the one we attach by. Its anchor
+		 * has to be gone before anything is written to the device,
+		 * or a later attach could take the stale snapshot for a valid
+		 * one.
+		 */
+		if (si->max_sqnum < sqnum)
+			si->max_sqnum = sqnum;
+		if (lnum == 0) {
+			dbg_bld("erase old checkpoint anchor PEB %d", pnum);
+			err = ubi_io_sync_erase(ubi, pnum, 0);
+			if (err < 0)
+				ubi_warn("cannot erase checkpoint anchor PEB "
+					 "%d, error %d", pnum, err);
+		}
+		err = add_to_list(si, pnum, ec, &si->erase);
+		if (err)
+			return err;
+		goto adjust_mean_ec;
+	}
+
 	if (vol_id > UBI_MAX_VOLUMES && vol_id != UBI_LAYOUT_VOLUME_ID) {
 		int lnum = be32_to_cpu(vidh->lnum);
 
@@ -715,17 +740,161 @@ adjust_mean_ec:
 	return 0;
 }
 
-struct ubi_scan_info *ubi_scan(struct ubi_device *ubi)
+#ifdef CONFIG_MTD_UBI_CHECKPOINT
+
+static int find_cp_anchor(struct ubi_device *ubi, unsigned long long *sqnum)
+{
+	int err, pnum, anchor = -ENOENT;
+
+	for (pnum = 0; pnum < ubi->peb_count && pnum < UBI_CP_MAX_START;
+	     pnum++) {
+		err = ubi_io_is_bad(ubi, pnum);
+		if (err < 0)
+			return err;
+		else if (err)
+			continue;
+
+		err = ubi_io_read_vid_hdr(ubi, pnum, vidh, 0);
+		if (err < 0)
+			return err;
+		else if (err && err != UBI_IO_BITFLIPS)
+			continue;
+
+		if (be32_to_cpu(vidh->vol_id) != UBI_CP_VOLUME_ID ||
+		    be32_to_cpu(vidh->lnum) != 0)
+			continue;
+
+		if (anchor < 0 || be64_to_cpu(vidh->sqnum) > *sqnum) {
+			anchor = pnum;
+			*sqnum = be64_to_cpu(vidh->sqnum);
+		}
+	}
+
+	return anchor;
+}
+
+static int add_cp_used(struct ubi_device *ubi, struct ubi_scan_info *si,
+		       int pnum, int ec, const struct ubi_cp_peb *rec,
+		       const struct ubi_cp_vol *cv)
+{
+	/*
+	 * Make up the VID header scanning would have read. The sequence
+	 * number is unknown, but anything written after the checkpoint has a
+	 * higher one, so zero makes every PEB from the pool win.
+	 */
+	memset(vidh, 0, UBI_VID_HDR_SIZE);
+	vidh->vol_type = cv->vol_type;
+	vidh->compat = cv->compat;
+	vidh->vol_id = rec->vol_id;
+	vidh->lnum = rec->lnum;
+	vidh->data_size = cv->last_data_size;
+	vidh->used_ebs = cv->used_ebs;
+	vidh->data_pad = cv->data_pad;
+
+	return ubi_scan_add_used(ubi, si, pnum, ec, vidh, 0);
+}
+
+static int scan_checkpoint(struct ubi_device *ubi, struct ubi_scan_info *si)
+{
+	int err, pnum, anchor, ec;
+	unsigned long long sqnum = 0;
+	struct ubi_cp_hdr *hdr;
+	struct ubi_cp_peb *rec;
+	struct ubi_cp_vol *cv = NULL;
+
+	if (!ubi->cp_size)
+		return 1;
+
+	anchor = find_cp_anchor(ubi, &sqnum);
+	if (anchor == -ENOENT) {
+		dbg_bld("no checkpoint found");
+		return 1;
+	} else if (anchor < 0)
+		return anchor;
+
+	hdr = ubi_cp_read(ubi, anchor, sqnum);
+	if (IS_ERR(hdr))
+		return PTR_ERR(hdr);
+	if (!hdr) {
+		ubi_warn("checkpoint in PEB %d is not valid", anchor);
+		return 1;
+	}
+
+	ubi->image_seq = be32_to_cpu(hdr->image_seq);
+	si->max_sqnum = sqnum;
+	si->is_empty = 0;
+
+	rec = ubi_cp_pebs(ubi);
+	for (pnum = 0; pnum < ubi->peb_count; pnum++, rec++) {
+		cond_resched();
+
+		err = ubi_io_is_bad(ubi, pnum);
+		if (err < 0)
+			return err;
+		else if (err) {
+			si->bad_peb_count += 1;
+			continue;
+		}
+
+		ec = be32_to_cpu(rec->ec);
+		switch (rec->state) {
+		case UBI_CP_FREE:
+			err = add_to_list(si, pnum, ec, &si->free);
+			break;
+		case UBI_CP_SELF:
+			/* Only erase it once it is superseded */
+			set_bit(pnum, ubi->cp_used);
+			/* fall through */
+		case UBI_CP_ERASE:
+			err = add_to_list(si, pnum, ec, &si->erase);
+			break;
+		case UBI_CP_USED:
+			if (!cv || cv->vol_id != rec->vol_id)
+				cv = ubi_cp_find_vol(ubi,
+						be32_to_cpu(rec->vol_id));
+			if (!cv) {
+				ubi_err("PEB %d of unknown volume %d in "
+					"checkpoint", pnum,
+					be32_to_cpu(rec->vol_id));
+				return -EINVAL;
+			}
+			set_bit(pnum, ubi->cp_used);
+			err = add_cp_used(ubi, si, pnum, ec, rec, cv);
+			break;
+		default:
+			set_bit(pnum, ubi->cp_pool);
+			err = process_eb(ubi, si, pnum);
+			if (err < 0)
+				return err;
+			continue;
+		}
+		if (err)
+			return err;
+
+		si->ec_sum += ec;
+		si->ec_count += 1;
+		if (ec > si->max_ec)
+			si->max_ec = ec;
+		if (ec < si->min_ec)
+			si->min_ec = ec;
+	}
+
+	ubi->cp_active = 1;
+	ubi->cp_anchor = anchor;
+	return 0;
+}
+
+#else
+#define scan_checkpoint(ubi, si) 1
+#endif /* CONFIG_MTD_UBI_CHECKPOINT */
+
+static struct ubi_scan_info *alloc_si(void)
 {
-	int err, pnum;
-	struct rb_node *rb1, *rb2;
-	struct ubi_scan_volume *sv;
-	struct ubi_scan_leb *seb;
 	struct ubi_scan_info *si;
 
 	si = kzalloc(sizeof(struct ubi_scan_info), GFP_KERNEL);
 	if (!si)
-		return ERR_PTR(-ENOMEM);
+		return NULL;
 
 	INIT_LIST_HEAD(&si->corr);
 	INIT_LIST_HEAD(&si->free);
@@ -733,6 +902,20 @@ struct ubi_scan_info *ubi_scan(struct ubi_device *ubi)
 	INIT_LIST_HEAD(&si->alien);
 	si->volumes = RB_ROOT;
 	si->is_empty = 1;
+	return si;
+}
+
+struct ubi_scan_info *ubi_scan(struct ubi_device *ubi)
+{
+	int err, pnum;
+	struct rb_node *rb1, *rb2;
+	struct ubi_scan_volume *sv;
+	struct ubi_scan_leb *seb;
+	struct ubi_scan_info *si;
+
+	si = alloc_si();
+	if (!si)
+		return ERR_PTR(-ENOMEM);
 
 	err = -ENOMEM;
 	ech = kzalloc(ubi->ec_hdr_alsize, GFP_KERNEL);
@@ -743,14 +926,33 @@ struct ubi_scan_info *ubi_scan(struct ubi_device *ubi)
 	if (!vidh)
 		goto out_ech;
 
-	for (pnum = 0; pnum < ubi->peb_count; pnum++) {
-		cond_resched();
+	/*
+	 * Attach by the checkpoint if there is a good one. If it turns out
+	 * not to match the flash (-EINVAL), forget what it said and scan.
+	 */
+	err = scan_checkpoint(ubi, si);
+	if (err == -EINVAL || err > 0) {
+		if (err < 0) {
+			ubi_warn("checkpoint is inconsistent, scan the device");
+			ubi_scan_destroy_si(si);
+			si = alloc_si();
+			if (!si) {
+				err = -ENOMEM;
+				goto out_vidh;
+			}
+			ubi->image_seq = 0;
+		}
 
-		dbg_gen("process PEB %d", pnum);
-		err = process_eb(ubi, si, pnum);
-		if (err < 0)
-			goto out_vidh;
-	}
+		for (pnum = 0; pnum < ubi->peb_count; pnum++) {
+			cond_resched();
+
+			dbg_gen("process PEB %d", pnum);
+			err = process_eb(ubi, si, pnum);
+			if (err < 0)
+				goto out_vidh;
+		}
+	} else if (err < 0)
+		goto out_vidh;
 
 	dbg_msg("scanning is finished");
 
@@ -797,9 +999,12 @@ struct ubi_scan_info *ubi_scan(struct ubi_device *ubi)
 		if (seb->ec == UBI_SCAN_UNKNOWN_EC)
 			seb->ec = si->mean_ec;
 
-	err = paranoid_check_si(ubi, si);
-	if (err)
-		goto out_vidh;
+	/* The checkpoint does not record sequence numbers to check against */
+	if (!ubi->cp_active) {
+		err = paranoid_check_si(ubi, si);
+		if (err)
+			goto out_vidh;
+	}
 
 	ubi_free_vid_hdr(ubi, vidh);
 	kfree(ech);
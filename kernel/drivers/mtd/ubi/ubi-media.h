@@ -89,6 +89,16 @@ struct ubi_vid_hdr {
 #define UBI_LAYOUT_VOLUME_NAME   "layout volume"
 #define UBI_LAYOUT_VOLUME_COMPAT UBI_COMPAT_REJECT
 
+/*
+ * The checkpoint volume holds a snapshot of what scanning would find, see
+ * checkpoint.c. It is not counted in %UBI_INT_VOL_COUNT as it is never
+ * opened as a volume, and it is "delete" compatible so that UBI versions
+ * which do not know it simply drop it.
+ */
+
+#define UBI_CP_VOLUME_ID     (UBI_INTERNAL_VOL_START + 1)
+#define UBI_CP_VOLUME_COMPAT UBI_COMPAT_DELETE
+
 /* The maximum number of volumes per one UBI device */
 #define UBI_MAX_VOLUMES 128
 
@@ -114,4 +124,72 @@ struct ubi_vtbl_record {
 	__be32  crc;
 } __attribute__ ((packed));
 
+/* Checkpoint header magic number (ASCII "UBIC") */
+#define UBI_CP_HDR_MAGIC 0x55424943
+
+/* Version of the checkpoint format */
+#define UBI_CP_VERSION 1
+
+/* The anchor of a checkpoint is always in one of these first PEBs */
+#define UBI_CP_MAX_START 64
+
+/* The highest number of PEBs a checkpoint may take */
+#define UBI_CP_MAX_PEBS 32
+
+/* Size of the checkpoint header without the ending CRC */
+#define UBI_CP_HDR_SIZE_CRC (sizeof(struct ubi_cp_hdr) - sizeof(__be32))
+
+/*
+ * State of a PEB in a checkpoint. PEBs in the %UBI_CP_SCAN state (the pool
+ * new data goes to, and anything the checkpoint does not account for) are
+ * scanned when attaching, the rest is taken as recorded.
+ */
+enum {
+	UBI_CP_SCAN = 0,
+	UBI_CP_FREE,
+	UBI_CP_USED,
+	UBI_CP_ERASE,
+	UBI_CP_BAD,
+	UBI_CP_SELF
+};
+
+/*
+ * The header starts the data of LEB 0 of the checkpoint (the anchor). It is
+ * followed by @nr_pebs PEB numbers the checkpoint is stored in (anchor
+ * first), one PEB record per PEB and @nr_vols volume records, @data_size
+ * bytes in all, which continue to LEB 1, 2 and so on.
+ */
+struct ubi_cp_hdr {
+	__be32  magic;
+	__u8    version;
+	__u8    padding1[3];
+	__be64  sqnum;
+	__be32  peb_count;
+	__be32  image_seq;
+	__be32  nr_pebs;
+	__be32  nr_vols;
+	__be32  data_size;
+	__be32  data_crc;
+	__u8    padding2[20];
+	__be32  hdr_crc;
+} __attribute__ ((packed));
+
+struct ubi_cp_vol {
+	__be32  vol_id;
+	__be32  used_ebs;
+	__be32  data_pad;
+	__be32  last_data_size;
+	__u8    vol_type;
+	__u8    compat;
+	__u8    padding[2];
+} __attribute__ ((packed));
+
+struct ubi_cp_peb {
+	__be32  ec;
+	__be32  vol_id;
+	__be32  lnum;
+	__u8    state;
+	__u8    padding[3];
+} __attribute__ ((packed));
+
 #endif /* !__UBI_MEDIA_H__ */
@@ -190,10 +190,27 @@ struct ubi_device {
 	int move_to_put;
 	struct list_head works;
 	int works_count;
+	int free_count;
+	int free_low;
+	int writers_waiting;
 	struct task_struct *bgt_thread;
 	int thread_enabled;
 	char bgt_name[sizeof(UBI_BGT_NAME_PATTERN)+2];
 
+	/* Checkpoint sub-system's stuff */
+	int cp_size;
+	int cp_pool_size;
+	int cp_active;
+	int cp_anchor;
+	unsigned long *cp_used;
+	unsigned long *cp_pool;
+	struct rb_root cp_free;
+	struct list_head cp_erase;
+	struct ubi_wl_entry *cp_pebs[UBI_CP_MAX_PEBS];
+	struct ubi_wl_entry *cp_resv[UBI_CP_MAX_PEBS];
+	struct rw_semaphore cp_sem;
+	void *cp_buf;
+
 	/* I/O sub-system's stuff */
 	long long flash_size;
 	int peb_count;
@@ -224,6 +241,11 @@ struct ubi_device {
 	void *dbg_peb_buf;
 	struct mutex dbg_buf_mutex;
 #endif
+#ifdef CONFIG_MTD_UBI_DEBUG
+	struct dentry *dbg_dir;
+#endif
+	struct ubi_dbg_lat write_lat;
+	struct ubi_dbg_lat get_peb_lat;
 };
 
 extern struct kmem_cache *ubi_wl_entry_slab;
@@ -280,6 +302,7 @@ int ubi_eba_atomic_leb_change(struct ubi_device *ubi, struct ubi_volume *vol,
 int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 		     struct ubi_vid_hdr *vid_hdr);
 int ubi_eba_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si);
+unsigned long long ubi_next_sqnum(struct ubi_device *ubi);
 
 /* wl.c */
 int ubi_wl_get_peb(struct ubi_device *ubi, int dtype);
@@ -290,6 +313,26 @@ int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si);
 void ubi_wl_close(struct ubi_device *ubi);
 int ubi_thread(void *u);
 
+#ifdef CONFIG_MTD_UBI_CHECKPOINT
+/* checkpoint.c */
+int ubi_cp_init(struct ubi_device *ubi);
+void ubi_cp_close(struct ubi_device *ubi);
+struct ubi_cp_peb *ubi_cp_pebs(const struct ubi_device *ubi);
+struct ubi_cp_vol *ubi_cp_find_vol(const struct ubi_device *ubi, int vol_id);
+struct ubi_cp_hdr *ubi_cp_read(struct ubi_device *ubi, int anchor,
+			       unsigned long long sqnum);
+struct ubi_cp_peb *ubi_cp_start(struct ubi_device *ubi);
+int ubi_cp_fill(struct ubi_device *ubi);
+int ubi_cp_write_pebs(struct ubi_device *ubi, struct ubi_wl_entry **pebs);
+
+/* wl.c */
+int ubi_wl_checkpoint(struct ubi_device *ubi);
+#else
+static inline int ubi_cp_init(struct ubi_device *ubi) { return 0; }
+static inline void ubi_cp_close(struct ubi_device *ubi) { }
+static inline int ubi_wl_checkpoint(struct ubi_device *ubi) { return 0; }
+#endif
+
 /* io.c */
 int ubi_io_read(const struct ubi_device *ubi, void *buf, int pnum, int offset,
 		int len);
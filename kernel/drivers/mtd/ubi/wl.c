@@ -16,6 +16,13 @@
 
 #define WL_MAX_FAILURES 32
 
+/*
+ * Bounds of the number of free PEBs below which erasures are done before
+ * wear-leveling works.
+ */
+#define WL_FREE_LOW_MIN 2
+#define WL_FREE_LOW_MAX 32
+
 struct ubi_work {
 	struct list_head list;
 	int (*func)(struct ubi_device *ubi, struct ubi_work *wrk, int cancel);
@@ -24,6 +31,9 @@ struct ubi_work {
 	int torture;
 };
 
+static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
+			int cancel);
+
 #ifdef CONFIG_MTD_UBI_DEBUG_PARANOID
 static int paranoid_check_ec(struct ubi_device *ubi, int pnum, int ec);
 static int paranoid_check_in_wl_tree(struct ubi_wl_entry *e,
@@ -85,6 +95,19 @@ static int do_work(struct ubi_device *ubi)
 	}
 
 	wrk = list_entry(ubi->works.next, struct ubi_work, list);
+	if (ubi->writers_waiting || ubi->free_count < ubi->free_low) {
+		struct ubi_work *wrk1;
+
+		/*
+		 * Free PEBs run short. Erasures produce them while a
+		 * wear-leveling move takes one, so erase first.
+		 */
+		list_for_each_entry(wrk1, &ubi->works, list)
+			if (wrk1->func == &erase_worker) {
+				wrk = wrk1;
+				break;
+			}
+	}
 	list_del(&wrk->list);
 	ubi->works_count -= 1;
 	ubi_assert(ubi->works_count >= 0);
@@ -108,7 +131,7 @@ static int produce_free_peb(struct ubi_device *ubi)
 	int err;
 
 	spin_lock(&ubi->wl_lock);
-	while (!ubi->free.rb_node) {
+	while (!ubi->free.rb_node && ubi->works_count) {
 		spin_unlock(&ubi->wl_lock);
 
 		dbg_wl("do one work synchronously");
@@ -193,22 +216,46 @@ int ubi_wl_get_peb(struct ubi_device *ubi, int dtype)
 {
 	int err, medium_ec;
 	struct ubi_wl_entry *e, *first, *last;
+	ktime_t start = ubi_dbg_lat_start();
 
 	ubi_assert(dtype == UBI_LONGTERM || dtype == UBI_SHORTTERM ||
 		   dtype == UBI_UNKNOWN);
 
 retry:
+	/* No PEBs may be given out while a checkpoint is being written */
+	down_read(&ubi->cp_sem);
 	spin_lock(&ubi->wl_lock);
 	if (!ubi->free.rb_node) {
+		if (ubi->cp_active && (ubi->cp_free.rb_node ||
+				       !list_empty(&ubi->cp_erase))) {
+			/*
+			 * The pool is used up, but there are free PEBs outside
+			 * it, or PEBs to erase which wait for a new checkpoint.
+			 * Write one, it refills the pool.
+			 */
+			spin_unlock(&ubi->wl_lock);
+			up_read(&ubi->cp_sem);
+			err = ubi_wl_checkpoint(ubi);
+			if (err)
+				return err;
+			goto retry;
+		}
+
 		if (ubi->works_count == 0) {
 			ubi_assert(list_empty(&ubi->works));
 			ubi_err("no free eraseblocks");
 			spin_unlock(&ubi->wl_lock);
+			up_read(&ubi->cp_sem);
 			return -ENOSPC;
 		}
+		ubi->writers_waiting += 1;
 		spin_unlock(&ubi->wl_lock);
+		up_read(&ubi->cp_sem);
 
 		err = produce_free_peb(ubi);
+		spin_lock(&ubi->wl_lock);
+		ubi->writers_waiting -= 1;
+		spin_unlock(&ubi->wl_lock);
 		if (err < 0)
 			return err;
 		goto retry;
@@ -261,9 +308,12 @@ retry:
 	 * be protected from being moved for some time.
 	 */
 	rb_erase(&e->u.rb, &ubi->free);
+	ubi->free_count -= 1;
 	dbg_wl("PEB %d EC %d", e->pnum, e->ec);
 	prot_queue_add(ubi, e);
 	spin_unlock(&ubi->wl_lock);
+	up_read(&ubi->cp_sem);
+	ubi_dbg_lat_add(&ubi->get_peb_lat, start);
 
 	err = ubi_dbg_check_all_ff(ubi, e->pnum, ubi->vid_hdr_aloffset,
 				   ubi->peb_size - ubi->vid_hdr_aloffset);
@@ -390,9 +440,6 @@ static void schedule_ubi_work(struct ubi_device *ubi, struct ubi_work *wrk)
 	spin_unlock(&ubi->wl_lock);
 }
 
-static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
-			int cancel);
-
 static int schedule_erase(struct ubi_device *ubi, struct ubi_wl_entry *e,
 			  int torture)
 {
@@ -451,6 +498,15 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 		goto out_cancel;
 	}
 
+	if (!ubi->scrub.rb_node && ubi->writers_waiting) {
+		/*
+		 * Somebody waits for a free PEB, do not take one away. The
+		 * next erasure triggers wear-leveling again.
+		 */
+		dbg_wl("cancel WL, %d writers wait", ubi->writers_waiting);
+		goto out_cancel;
+	}
+
 	if (!ubi->scrub.rb_node) {
 		/*
 		 * Now pick the least worn-out used physical eraseblock and a
@@ -481,6 +537,7 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 
 	paranoid_check_in_wl_tree(e2, &ubi->free);
 	rb_erase(&e2->u.rb, &ubi->free);
+	ubi->free_count -= 1;
 	ubi->move_from = e1;
 	ubi->move_to = e2;
 	spin_unlock(&ubi->wl_lock);
@@ -746,6 +803,18 @@ static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
 		return 0;
 	}
 
+	if (ubi->cp_active && test_bit(pnum, ubi->cp_used)) {
+		/*
+		 * The checkpoint on flash maps a LEB to this PEB. Erasing it
+		 * has to wait until a newer checkpoint is written.
+		 */
+		dbg_wl("PEB %d is in the checkpoint, defer erasure", pnum);
+		spin_lock(&ubi->wl_lock);
+		list_add_tail(&wl_wrk->list, &ubi->cp_erase);
+		spin_unlock(&ubi->wl_lock);
+		return 0;
+	}
+
 	dbg_wl("erase PEB %d EC %d", pnum, e->ec);
 
 	err = sync_erase(ubi, e, wl_wrk->torture);
@@ -753,8 +822,17 @@ static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
 		/* Fine, we've erased it successfully */
 		kfree(wl_wrk);
 
+		/*
+		 * Only PEBs the checkpoint has in the pool are scanned on
+		 * attach, so only they may be written to.
+		 */
 		spin_lock(&ubi->wl_lock);
-		wl_tree_add(e, &ubi->free);
+		if (ubi->cp_active && !test_bit(pnum, ubi->cp_pool))
+			wl_tree_add(e, &ubi->cp_free);
+		else {
+			wl_tree_add(e, &ubi->free);
+			ubi->free_count += 1;
+		}
 		spin_unlock(&ubi->wl_lock);
 
 		/*
@@ -770,7 +848,6 @@ static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
 
 	ubi_err("failed to erase PEB %d, error %d", pnum, err);
 	kfree(wl_wrk);
-	kmem_cache_free(ubi_wl_entry_slab, e);
 
 	if (err == -EINTR || err == -ENOMEM || err == -EAGAIN ||
 	    err == -EBUSY) {
@@ -783,7 +860,14 @@ static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
 			goto out_ro;
 		}
 		return err;
-	} else if (err != -EIO) {
+	}
+
+	spin_lock(&ubi->wl_lock);
+	ubi->lookuptbl[pnum] = NULL;
+	spin_unlock(&ubi->wl_lock);
+	kmem_cache_free(ubi_wl_entry_slab, e);
+
+	if (err != -EIO) {
 		/*
 		 * If this is not %-EIO, we have no idea what to do. Scheduling
 		 * this physical eraseblock for erasure again would cause
@@ -968,6 +1052,243 @@ retry:
 	return ensure_wear_leveling(ubi);
 }
 
+#ifdef CONFIG_MTD_UBI_CHECKPOINT
+
+static int cp_tree_move(struct rb_root *from, struct rb_root *to)
+{
+	int count = 0;
+	struct rb_node *rb;
+	struct ubi_wl_entry *e;
+
+	while ((rb = rb_first(from))) {
+		e = rb_entry(rb, struct ubi_wl_entry, u.rb);
+		rb_erase(rb, from);
+		wl_tree_add(e, to);
+		count += 1;
+	}
+	return count;
+}
+
+/*
+ * Take the PEBs the next checkpoint goes to out of @ubi->free. The anchor
+ * has to be one of the first %UBI_CP_MAX_START PEBs. Must be called with
+ * @ubi->wl_lock held.
+ */
+static int cp_reserve(struct ubi_device *ubi)
+{
+	int i;
+	struct rb_node *rb;
+	struct ubi_wl_entry *e;
+
+	if (!ubi->cp_resv[0]) {
+		ubi_rb_for_each_entry(rb, e, &ubi->free, u.rb)
+			if (e->pnum < UBI_CP_MAX_START)
+				break;
+		if (!e)
+			return -ENOSPC;
+		rb_erase(&e->u.rb, &ubi->free);
+		ubi->free_count -= 1;
+		ubi->cp_resv[0] = e;
+	}
+
+	for (i = 1; i < ubi->cp_size; i++) {
+		if (ubi->cp_resv[i])
+			continue;
+		rb = rb_first(&ubi->free);
+		if (!rb)
+			return -ENOSPC;
+		e = rb_entry(rb, struct ubi_wl_entry, u.rb);
+		rb_erase(rb, &ubi->free);
+		ubi->free_count -= 1;
+		ubi->cp_resv[i] = e;
+	}
+
+	return 0;
+}
+
+/* Queue the held back erasures the checkpoint no longer protects */
+static void cp_release_erasures(struct ubi_device *ubi)
+{
+	struct ubi_work *wrk, *tmp;
+
+	spin_lock(&ubi->wl_lock);
+	list_for_each_entry_safe(wrk, tmp, &ubi->cp_erase, list) {
+		if (ubi->cp_active && test_bit(wrk->e->pnum, ubi->cp_used))
+			continue;
+		list_move_tail(&wrk->list, &ubi->works);
+		ubi->works_count += 1;
+	}
+	if (ubi->thread_enabled)
+		wake_up_process(ubi->bgt_thread);
+	spin_unlock(&ubi->wl_lock);
+}
+
+/*
+ * Stop keeping the checkpoint on flash valid, e.g. because no new one can be
+ * written. Its anchor is erased first, so the next attach scans. Must be
+ * called with @ubi->cp_sem and @ubi->work_sem held for writing.
+ */
+static void cp_deactivate(struct ubi_device *ubi)
+{
+	int i, err;
+	struct ubi_wl_entry *e;
+
+	if (ubi->cp_active && !ubi->ro_mode) {
+		err = sync_erase(ubi, ubi->lookuptbl[ubi->cp_anchor], 0);
+		if (err) {
+			ubi_err("cannot erase checkpoint anchor PEB %d, "
+				"error %d", ubi->cp_anchor, err);
+			ubi_ro_mode(ubi);
+		}
+	}
+	ubi->cp_active = 0;
+
+	spin_lock(&ubi->wl_lock);
+	ubi->free_count += cp_tree_move(&ubi->cp_free, &ubi->free);
+	for (i = 0; i < ubi->cp_size; i++)
+		if (ubi->cp_resv[i]) {
+			wl_tree_add(ubi->cp_resv[i], &ubi->free);
+			ubi->free_count += 1;
+			ubi->cp_resv[i] = NULL;
+		}
+	spin_unlock(&ubi->wl_lock);
+	cp_release_erasures(ubi);
+
+	for (i = 0; i < ubi->cp_size; i++) {
+		e = ubi->cp_pebs[i];
+		if (!e)
+			continue;
+		ubi->cp_pebs[i] = NULL;
+		if (schedule_erase(ubi, e, 0)) {
+			kmem_cache_free(ubi_wl_entry_slab, e);
+			ubi_ro_mode(ubi);
+		}
+	}
+}
+
+int ubi_wl_checkpoint(struct ubi_device *ubi)
+{
+	int i, n, err, step, count, pool = 0;
+	struct ubi_wl_entry *e, *pebs[UBI_CP_MAX_PEBS], *old[UBI_CP_MAX_PEBS];
+	struct ubi_cp_peb *recs;
+	struct ubi_work *wrk;
+	struct rb_node *rb;
+
+	if (!ubi->cp_size || ubi->ro_mode)
+		return 0;
+
+	down_write(&ubi->cp_sem);
+	down_write(&ubi->work_sem);
+
+	/*
+	 * While a checkpoint is active the PEBs for the next one have been
+	 * taken from the pool, and if some are missing only pool PEBs will
+	 * do. Otherwise there is no valid checkpoint on flash to keep intact
+	 * and any free PEB is good.
+	 */
+	spin_lock(&ubi->wl_lock);
+	err = cp_reserve(ubi);
+	if (err) {
+		spin_unlock(&ubi->wl_lock);
+		goto out_deactivate;
+	}
+	memcpy(pebs, ubi->cp_resv, sizeof(pebs));
+	memset(ubi->cp_resv, 0, sizeof(ubi->cp_resv));
+
+	/*
+	 * The new checkpoint vouches for none of the free PEBs yet. Reserve
+	 * the ones for the next checkpoint, pick the pool, spread over the
+	 * range of erase counters, and set the rest aside.
+	 */
+	ubi->free_count += cp_tree_move(&ubi->cp_free, &ubi->free);
+	cp_reserve(ubi);
+	recs = ubi_cp_start(ubi);
+
+	count = ubi->free_count;
+	step = count / ubi->cp_pool_size ?: 1;
+
+	n = 0;
+	rb = rb_first(&ubi->free);
+	while (rb) {
+		e = rb_entry(rb, struct ubi_wl_entry, u.rb);
+		rb = rb_next(rb);
+		if (n++ % step == 0 && pool < ubi->cp_pool_size) {
+			pool += 1;
+			continue;
+		}
+		rb_erase(&e->u.rb, &ubi->free);
+		ubi->free_count -= 1;
+		wl_tree_add(e, &ubi->cp_free);
+		recs[e->pnum].state = UBI_CP_FREE;
+	}
+
+	list_for_each_entry(wrk, &ubi->works, list)
+		if (wrk->func == &erase_worker)
+			recs[wrk->e->pnum].state = UBI_CP_ERASE;
+	list_for_each_entry(wrk, &ubi->cp_erase, list)
+		recs[wrk->e->pnum].state = UBI_CP_ERASE;
+	for (i = 0; i < ubi->cp_size; i++) {
+		if (ubi->cp_pebs[i])
+			recs[ubi->cp_pebs[i]->pnum].state = UBI_CP_ERASE;
+		recs[pebs[i]->pnum].state = UBI_CP_SELF;
+		recs[pebs[i]->pnum].lnum = cpu_to_be32(i);
+	}
+	spin_unlock(&ubi->wl_lock);
+
+	/*
+	 * Workers are stopped and no PEBs are given out, but LEBs may still be
+	 * unmapped meanwhile. A PEB the EBA table maps is recorded as used, so
+	 * its erasure is held back even if it was already queued.
+	 */
+	err = ubi_cp_fill(ubi);
+	if (err)
+		goto out_resv;
+
+	err = ubi_cp_write_pebs(ubi, pebs);
+	if (err)
+		goto out_resv;
+
+	ubi->cp_active = 1;
+	ubi->cp_anchor = pebs[0]->pnum;
+	memcpy(old, ubi->cp_pebs, sizeof(old));
+	memcpy(ubi->cp_pebs, pebs, sizeof(pebs));
+	cp_release_erasures(ubi);
+	up_write(&ubi->work_sem);
+	up_write(&ubi->cp_sem);
+
+	dbg_wl("checkpoint written, anchor PEB %d, pool of %d PEBs",
+	       ubi->cp_anchor, pool);
+
+	for (i = 0; i < ubi->cp_size; i++) {
+		if (!old[i])
+			continue;
+		err = schedule_erase(ubi, old[i], 0);
+		if (err) {
+			kmem_cache_free(ubi_wl_entry_slab, old[i]);
+			ubi_ro_mode(ubi);
+			return err;
+		}
+	}
+	return 0;
+
+out_resv:
+	/* The PEBs may be written to partly by now */
+	for (i = 0; i < ubi->cp_size; i++)
+		if (schedule_erase(ubi, pebs[i], 1)) {
+			kmem_cache_free(ubi_wl_entry_slab, pebs[i]);
+			ubi_ro_mode(ubi);
+		}
+out_deactivate:
+	ubi_warn("cannot write checkpoint, error %d, next attach will scan",
+		 err);
+	cp_deactivate(ubi);
+	up_write(&ubi->work_sem);
+	up_write(&ubi->cp_sem);
+	return ubi->ro_mode ? -EROFS : 0;
+}
+
+#endif /* CONFIG_MTD_UBI_CHECKPOINT */
+
 int ubi_wl_flush(struct ubi_device *ubi)
 {
 	int err;
@@ -977,6 +1298,18 @@ int ubi_wl_flush(struct ubi_device *ubi)
 	 * the number of currently pending works.
 	 */
 	dbg_wl("flush (%d pending works)", ubi->works_count);
+
+	/*
+	 * Callers rely on unmapped LEBs being gone from the flash once this
+	 * returns, also after an unclean reboot. Erasures the checkpoint
+	 * holds back only go once a newer checkpoint no longer maps them.
+	 */
+	if (ubi->cp_active && !list_empty(&ubi->cp_erase)) {
+		err = ubi_wl_checkpoint(ubi);
+		if (err)
+			return err;
+	}
+
 	while (ubi->works_count) {
 		err = do_work(ubi);
 		if (err)
@@ -1095,6 +1428,14 @@ static void cancel_pending(struct ubi_device *ubi)
 		ubi->works_count -= 1;
 		ubi_assert(ubi->works_count >= 0);
 	}
+
+	while (!list_empty(&ubi->cp_erase)) {
+		struct ubi_work *wrk;
+
+		wrk = list_entry(ubi->cp_erase.next, struct ubi_work, list);
+		list_del(&wrk->list);
+		wrk->func(ubi, wrk, 1);
+	}
 }
 
 int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
@@ -1106,11 +1447,14 @@ int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
 	struct ubi_wl_entry *e;
 
 	ubi->used = ubi->erroneous = ubi->free = ubi->scrub = RB_ROOT;
+	ubi->cp_free = RB_ROOT;
 	spin_lock_init(&ubi->wl_lock);
 	mutex_init(&ubi->move_mutex);
 	init_rwsem(&ubi->work_sem);
+	init_rwsem(&ubi->cp_sem);
 	ubi->max_ec = si->max_ec;
 	INIT_LIST_HEAD(&ubi->works);
+	INIT_LIST_HEAD(&ubi->cp_erase);
 
 	sprintf(ubi->bgt_name, UBI_BGT_NAME_PATTERN, ubi->ubi_num);
 
@@ -1149,7 +1493,12 @@ int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
 		e->pnum = seb->pnum;
 		e->ec = seb->ec;
 		ubi_assert(e->ec >= 0);
-		wl_tree_add(e, &ubi->free);
+		if (ubi->cp_active && !test_bit(e->pnum, ubi->cp_pool))
+			wl_tree_add(e, &ubi->cp_free);
+		else {
+			wl_tree_add(e, &ubi->free);
+			ubi->free_count += 1;
+		}
 		ubi->lookuptbl[e->pnum] = e;
 	}
 
@@ -1200,6 +1549,33 @@ int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
 	ubi->avail_pebs -= WL_RESERVED_PEBS;
 	ubi->rsvd_pebs += WL_RESERVED_PEBS;
 
+#ifdef CONFIG_MTD_UBI_CHECKPOINT
+	/* The current checkpoint and the PEBs for the next one */
+	if (ubi->cp_size && ubi->avail_pebs < 2 * ubi->cp_size) {
+		ubi_warn("no PEBs for the checkpoint (%d, need %d)",
+			 ubi->avail_pebs, 2 * ubi->cp_size);
+		cp_deactivate(ubi);
+		ubi->cp_size = 0;
+	} else if (ubi->cp_size) {
+		ubi->avail_pebs -= 2 * ubi->cp_size;
+		ubi->rsvd_pebs += 2 * ubi->cp_size;
+		if (ubi->cp_active) {
+			spin_lock(&ubi->wl_lock);
+			cp_reserve(ubi);
+			spin_unlock(&ubi->wl_lock);
+		}
+	}
+#endif
+
+	/*
+	 * Below this many free PEBs erasures go first. A checkpoint restricts
+	 * writes to its pool, so stay well below the pool size then.
+	 */
+	ubi->free_low = clamp(ubi->good_peb_count / 64, WL_FREE_LOW_MIN,
+			      WL_FREE_LOW_MAX);
+	if (ubi->cp_size)
+		ubi->free_low = min(ubi->free_low, ubi->cp_pool_size / 2);
+
 	/* Schedule wear-leveling if needed */
 	err = ensure_wear_leveling(ubi);
 	if (err)
@@ -1211,6 +1587,7 @@ out_free:
 	cancel_pending(ubi);
 	tree_destroy(&ubi->used);
 	tree_destroy(&ubi->free);
+	tree_destroy(&ubi->cp_free);
 	tree_destroy(&ubi->scrub);
 	kfree(ubi->lookuptbl);
 	return err;
@@ -1231,12 +1608,21 @@ static void protection_queue_destroy(struct ubi_device *ubi)
 
 void ubi_wl_close(struct ubi_device *ubi)
 {
+	int i;
+
 	dbg_wl("close the WL sub-system");
 	cancel_pending(ubi);
 	protection_queue_destroy(ubi);
+	for (i = 0; i < UBI_CP_MAX_PEBS; i++) {
+		if (ubi->cp_pebs[i])
+			kmem_cache_free(ubi_wl_entry_slab, ubi->cp_pebs[i]);
+		if (ubi->cp_resv[i])
+			kmem_cache_free(ubi_wl_entry_slab, ubi->cp_resv[i]);
+	}
 	tree_destroy(&ubi->used);
 	tree_destroy(&ubi->erroneous);
 	tree_destroy(&ubi->free);
+	tree_destroy(&ubi->cp_free);
 	tree_destroy(&ubi->scrub);
 	kfree(ubi->lookuptbl);
 }
@@ -0,0 +1,43 @@
+/*
+ *  linux/include/linux/mmc/async.h
+ *
+ *  Non-blocking request submission for the MMC core.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef LINUX_MMC_ASYNC_H
+#define LINUX_MMC_ASYNC_H
+
+#include <linux/completion.h>
+#include <linux/mmc/host.h>
+
+/*
+ * A host whose caps include MMC_CAP_PRE_POST_REQ has its host->ops
+ * embedded in a struct mmc_host_async_ops, and so can be asked to do
+ * the slow part of setting up a request (mapping it for DMA, say)
+ * before it is started, and to undo it after it is done, while the
+ * bus is busy with another request.
+ *
+ * pre_req() is called with is_first_req set when nothing is running
+ * on the host, so that there is nothing to gain from doing the work
+ * early.  post_req() gets the error the request completed with.
+ */
+#define MMC_CAP_PRE_POST_REQ	(1 << 30)
+
+struct mmc_host_async_ops {
+	struct mmc_host_ops	ops;
+	void	(*pre_req)(struct mmc_host *host, struct mmc_request *req,
+			   bool is_first_req);
+	void	(*post_req)(struct mmc_host *host, struct mmc_request *req,
+			    int err);
+};
+
+extern void mmc_pre_req(struct mmc_host *, struct mmc_request *, bool);
+extern void mmc_post_req(struct mmc_host *, struct mmc_request *, int);
+extern void mmc_start_req(struct mmc_host *, struct mmc_request *,
+			  struct completion *);
+extern void mmc_wait_for_req_done(struct mmc_request *);
+
+#endif
@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+# Throughput of a dm-crypt mapping over a backend that costs nothing,
+# so that the numbers reflect dm-crypt itself.
+#
+# usage: dm-crypt.sh [zero|ram] [size-MB] [cipher]
+#
+#   zero  - dm-zero backend (writes are discarded, reads return zeroes)
+#   ram   - brd ramdisk backend (needs the brd module)
+#
+# Runs sequential O_DIRECT writes and reads with one and with one dd per
+# online CPU.
+
+backend=${1:-zero}
+size_mb=${2:-1024}
+cipher=${3:-aes-cbc-essiv:sha256}
+name=blockbench_crypt
+ncpu=$(grep -c ^processor /proc/cpuinfo)
+sectors=$((size_mb * 2048))
+
+die() {
+	echo "$*" >&2
+	cleanup
+	exit 1
+}
+
+cleanup() {
+	dmsetup remove $name 2>/dev/null
+	dmsetup remove ${name}_zero 2>/dev/null
+	[ "$backend" = ram ] && rmmod brd 2>/dev/null
+}
+
+case $backend in
+zero)
+	echo "0 $sectors zero" | dmsetup create ${name}_zero || die "dm-zero setup failed"
+	dev=/dev/mapper/${name}_zero
+	;;
+ram)
+	modprobe brd rd_nr=1 rd_size=$((size_mb * 1024)) || die "brd load failed"
+	dev=/dev/ram0
+	;;
+*)
+	echo "usage: $0 [zero|ram] [size-MB] [cipher]" >&2
+	exit 1
+	;;
+esac
+
+key=$(od -An -tx1 -N32 /dev/urandom | tr -d ' \n')
+echo "0 $sectors crypt $cipher $key 0 $dev 0" | dmsetup create $name ||
+	die "dm-crypt setup failed"
+crypt=/dev/mapper/$name
+
+# run <label> <jobs> <dd args...>
+run() {
+	label=$1
+	jobs=$2
+	shift 2
+	per=$((size_mb / jobs))
+	start=$(date +%s.%N)
+	i=0
+	while [ $i -lt $jobs ]; do
+		dd "$@" bs=1M count=$per seek=$((i * per)) skip=$((i * per)) \
+			2>/dev/null &
+		i=$((i + 1))
+	done
+	wait
+	end=$(date +%s.%N)
+	echo "$label jobs=$jobs: $(echo "$size_mb / ($end - $start)" | bc) MB/s"
+}
+
+for jobs in 1 $ncpu; do
+	run write $jobs if=/dev/zero of=$crypt oflag=direct conv=notrunc
+	run read $jobs if=$crypt of=/dev/null iflag=direct
+done
+
+cleanup
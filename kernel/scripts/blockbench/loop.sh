@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# Compare a loop device in the default (page cache) mode against direct
+# I/O mode, over the same backing file.
+#
+# usage: loop.sh <backing-dir> [size-MB] [runtime-s]
+#
+# Needs fio.  For each mode the backing file is bound afresh and fio
+# runs sequential and random, read and write jobs against the loop
+# device with O_DIRECT, at queue depth 1 and 32.  Caches are dropped
+# between runs so that reads really reach the backing file.
+
+dir=$1
+size_mb=${2:-1024}
+runtime=${3:-30}
+param=/sys/module/loop/parameters/direct_io
+
+if [ -z "$dir" ]; then
+	echo "usage: $0 <backing-dir> [size-MB] [runtime-s]" >&2
+	exit 1
+fi
+
+command -v fio >/dev/null || { echo "fio not found" >&2; exit 1; }
+modprobe loop
+[ -w $param ] || { echo "loop has no direct_io parameter" >&2; exit 1; }
+
+img=$dir/blockbench_loop.img
+dev=
+old=$(cat $param)
+
+cleanup() {
+	[ -n "$dev" ] && losetup -d $dev 2>/dev/null
+	echo $old > $param
+	rm -f $img
+}
+
+die() {
+	echo "$*" >&2
+	cleanup
+	exit 1
+}
+
+# Fully allocated, so that direct mode never has to fall back
+dd if=/dev/zero of=$img bs=1M count=$size_mb conv=fsync 2>/dev/null ||
+	die "cannot create $img"
+
+# run <mode> <rw> <bs> <iodepth>
+run() {
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+	bw=$(fio --name=loop --filename=$dev --direct=1 --ioengine=libaio \
+		--rw=$2 --bs=$3 --iodepth=$4 --runtime=$runtime --time_based \
+		--size=${size_mb}m --norandommap --group_reporting \
+		--minimal 2>/dev/null |
+		awk -F';' '{ print $7 + $48 }')
+	echo "$1 $2 bs=$3 qd=$4: $((bw / 1024)) MB/s"
+}
+
+for mode in buffered direct; do
+	[ $mode = direct ] && echo 1 > $param || echo 0 > $param
+	dev=$(losetup -f --show $img) || die "losetup failed"
+
+	for qd in 1 32; do
+		run $mode read 1M $qd
+		run $mode write 1M $qd
+		run $mode randread 4k $qd
+		run $mode randwrite 4k $qd
+	done
+
+	losetup -d $dev
+	dev=
+done
+
+cleanup
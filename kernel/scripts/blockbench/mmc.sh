@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Measure how much mmc_block gains from packing contiguous small writes,
+# through the mmcblk device itself.
+#
+# usage: mmc.sh <mmcblk-device> [size-MB] [runtime-s]
+#
+# Needs fio.  WHATEVER IS ON THE DEVICE IS OVERWRITTEN.  Merging in the
+# block layer is turned off, so that sequential 4k O_DIRECT writes reach
+# mmc_block as separate requests.  At queue depth 1 there is never more
+# than one to issue, at higher depths the queued ones get packed.
+
+dev=$1
+size_mb=${2:-64}
+runtime=${3:-30}
+
+if [ ! -b "$dev" ]; then
+	echo "usage: $0 <mmcblk-device> [size-MB] [runtime-s]" >&2
+	exit 1
+fi
+
+command -v fio >/dev/null || { echo "fio not found" >&2; exit 1; }
+
+nomerges=/sys/block/$(basename $dev)/queue/nomerges
+[ -w $nomerges ] || { echo "no $nomerges" >&2; exit 1; }
+old=$(cat $nomerges)
+trap 'echo $old > $nomerges' EXIT
+echo 2 > $nomerges
+
+# run <bs> <iodepth>
+run() {
+	bw=$(fio --name=mmc --filename=$dev --direct=1 --ioengine=libaio \
+		--rw=write --bs=$1 --iodepth=$2 --runtime=$runtime \
+		--time_based --size=${size_mb}m --group_reporting \
+		--minimal 2>/dev/null |
+		awk -F';' '{ print $48 }')
+	echo "write bs=$1 qd=$2: $bw KB/s"
+}
+
+for qd in 1 4 16 32; do
+	run 4k $qd
+done
+run 64k 1
@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# Throughput of nbd over loopback with one and with several connections
+# per device.
+#
+# usage: nbd.sh <backing-file-dir> [size-MB] [runtime-s] [max-conns]
+#
+# Needs nbd-server, an nbd-client that knows -C (connections) and fio.
+# The export is a file on the given directory; the server and client
+# talk over 127.0.0.1.
+
+dir=$1
+size_mb=${2:-1024}
+runtime=${3:-30}
+max_conns=${4:-$(grep -c ^processor /proc/cpuinfo)}
+port=10809
+dev=/dev/nbd0
+
+if [ -z "$dir" ]; then
+	echo "usage: $0 <backing-file-dir> [size-MB] [runtime-s] [max-conns]" >&2
+	exit 1
+fi
+
+for tool in nbd-server nbd-client fio; do
+	command -v $tool >/dev/null || { echo "$tool not found" >&2; exit 1; }
+done
+
+img=$dir/blockbench_nbd.img
+conf=$dir/blockbench_nbd.conf
+server=
+
+cleanup() {
+	nbd-client -d $dev 2>/dev/null
+	[ -n "$server" ] && kill $server 2>/dev/null
+	rm -f $img $conf
+}
+
+die() {
+	echo "$*" >&2
+	cleanup
+	exit 1
+}
+
+modprobe nbd || die "nbd load failed"
+dd if=/dev/zero of=$img bs=1M count=$size_mb conv=fsync 2>/dev/null ||
+	die "cannot create $img"
+
+cat > $conf <<EOC
+[generic]
+	port = $port
+	listenaddr = 127.0.0.1
+[blockbench]
+	exportname = $img
+EOC
+nbd-server -C $conf -d &
+server=$!
+sleep 1
+
+# run <conns> <rw> <bs> <iodepth>
+run() {
+	bw=$(fio --name=nbd --filename=$dev --direct=1 --ioengine=libaio \
+		--rw=$2 --bs=$3 --iodepth=$4 --numjobs=$1 --runtime=$runtime \
+		--time_based --size=${size_mb}m --norandommap \
+		--group_reporting --minimal 2>/dev/null |
+		awk -F';' '{ print $7 + $48 }')
+	echo "conns=$1 $2 bs=$3 qd=$4: $((bw / 1024)) MB/s"
+}
+
+conns=1
+while [ $conns -le $max_conns ]; do
+	nbd-client -N blockbench -C $conns 127.0.0.1 $port $dev ||
+		die "nbd-client failed"
+
+	run $conns read 1M 16
+	run $conns write 1M 16
+	run $conns randread 4k 32
+	run $conns randwrite 4k 32
+	cat /sys/block/nbd0/connections
+
+	nbd-client -d $dev
+	conns=$((conns * 2))
+done
+
+cleanup